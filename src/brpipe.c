@@ -0,0 +1,407 @@
+/* brpipe.c
+ * Brotli pipe-pipe routines
+ *
+ * Ziproxy - the HTTP acceleration proxy
+ * This code is under the following conditions:
+ *
+ * ---------------------------------------------------------------------
+ * Copyright (c)2005-2014 Daniel Mealha Cabrita
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111 USA
+ * ---------------------------------------------------------------------
+ */
+
+/* those routines mirror the ones in gzpipe.c, but for Brotli (RFC 7932) */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef BROTLI
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <brotli/encode.h>
+#include <brotli/decode.h>
+
+#include "brpipe.h"
+#include "cfgfile.h"
+#include "log.h"
+#include "tosmarking.h"
+#include "globaldefs.h"
+
+#define BUFSIZE 16384
+
+/* state of the body being read from source */
+typedef struct {
+	int de_chunk;
+	int pending_chunk_len;
+	int first_chunk;
+	int finished;
+} t_brpipe_source;
+
+static void brpipe_source_init (t_brpipe_source *src_state, int de_chunk)
+{
+	src_state->de_chunk = de_chunk;
+	src_state->pending_chunk_len = 0;
+	src_state->first_chunk = 1;
+	src_state->finished = 0;
+}
+
+/* reads up to BUFSIZE bytes of the body into buf, de-chunking it if requested.
+ * src_state->finished is set once the end of the body is reached.
+ * returns: the number of bytes read */
+static size_t brpipe_read (t_brpipe_source *src_state, FILE *source, unsigned char *buf)
+{
+	int to_read_len = BUFSIZE;
+	size_t read_len;
+
+	if (src_state->de_chunk) {
+		if (src_state->pending_chunk_len == 0) {
+			// discards chunk end CRLF
+			if (src_state->first_chunk == 0) {
+				fgetc (source);
+				fgetc (source);
+			} else {
+				src_state->first_chunk = 0;
+			}
+
+			if ((fscanf (source, "%x", &(src_state->pending_chunk_len)) != 1) || (src_state->pending_chunk_len <= 0)) {
+				// last chunk, the rest of source will be discarded
+				src_state->finished = 1;
+				return (0);
+			} else {
+				int prevchar = '\0';
+				int curchar = '\0';
+
+				// Eat any chunk-extension(RFC2616) up to CRLF.
+				while (! ((prevchar == '\r') && (curchar == '\n'))) {
+					prevchar = curchar;
+					if ((curchar = fgetc (source)) == EOF) {
+						src_state->finished = 1;
+						return (0);
+					}
+				}
+			}
+		}
+
+		if (src_state->pending_chunk_len > BUFSIZE)
+			to_read_len = BUFSIZE;
+		else
+			to_read_len = src_state->pending_chunk_len;
+		src_state->pending_chunk_len -= to_read_len;
+	}
+
+	read_len = fread (buf, 1, to_read_len, source);
+	if (feof (source) || ferror (source))
+		src_state->finished = 1;
+
+	return (read_len);
+}
+
+/* Compress from file source to file dest until EOF on source
+   (or until the last chunk, if de_chunk).
+   returns BRPIPE_OK on success, BRPIPE_MEM_ERROR if memory could not be
+   allocated for processing, or BRPIPE_ERRNO if there is an error
+   reading or writing the files. */
+int brotli_stream_stream (FILE *source, FILE *dest, int quality, ZP_DATASIZE_TYPE *inlen, ZP_DATASIZE_TYPE *outlen, int de_chunk)
+{
+	BrotliEncoderState *enc;
+	BrotliEncoderOperation op;
+	t_brpipe_source src_state;
+	unsigned char in [BUFSIZE];
+	unsigned char out [BUFSIZE];
+	const uint8_t *next_in;
+	uint8_t *next_out;
+	size_t avail_in, avail_out;
+	size_t have, last_write_bytes;
+
+	*inlen = 0;
+	*outlen = 0;
+
+	if ((enc = BrotliEncoderCreateInstance (NULL, NULL, NULL)) == NULL)
+		return (BRPIPE_MEM_ERROR);
+	BrotliEncoderSetParameter (enc, BROTLI_PARAM_QUALITY, quality);
+
+	brpipe_source_init (&src_state, de_chunk);
+
+	/* compress until end of file */
+	do {
+		avail_in = brpipe_read (&src_state, source, in);
+		*inlen += avail_in;
+
+		/* update access log stats */
+		access_log_def_inlen(*inlen);
+
+		if (ferror(source)) {
+			BrotliEncoderDestroyInstance (enc);
+			debug_log_puts ("stream brotli: IO error (source). Aborting.");
+			return (BRPIPE_ERRNO);
+		}
+		op = src_state.finished ? BROTLI_OPERATION_FINISH : BROTLI_OPERATION_PROCESS;
+		next_in = in;
+
+		/* run the encoder until all input is consumed and there's no pending output,
+		   finish compression if all of source has been read in */
+		do {
+			avail_out = BUFSIZE;
+			next_out = out;
+			if (! BrotliEncoderCompressStream (enc, op, &avail_in, &next_in, &avail_out, &next_out, NULL)) {
+				BrotliEncoderDestroyInstance (enc);
+				debug_log_puts ("stream brotli: Encoder error. Aborting.");
+				return (BRPIPE_MEM_ERROR);
+			}
+			have = BUFSIZE - avail_out;
+			tosmarking_add_check_bytecount (have);	/* update TOS if necessary */
+			if ((last_write_bytes = fwrite(out, 1, have, dest)) != have || ferror(dest)) {
+				BrotliEncoderDestroyInstance (enc);
+				*outlen += last_write_bytes;
+				debug_log_puts ("stream brotli: IO error (dest). Aborting.");
+				return (BRPIPE_ERRNO);
+			}
+			*outlen += last_write_bytes;
+
+			/* update access log stats */
+			access_log_def_outlen(*outlen);
+
+		} while ((avail_in != 0) || BrotliEncoderHasMoreOutput (enc) || ((op == BROTLI_OPERATION_FINISH) && (! BrotliEncoderIsFinished (enc))));
+
+		// If we are sending a big file down a slow line, we
+		// need to reset the alarm once a while.
+		if (ConnTimeout)
+			alarm(ConnTimeout);
+
+		/* done when last data in file processed */
+	} while (op != BROTLI_OPERATION_FINISH);
+
+	/* clean up and return */
+	BrotliEncoderDestroyInstance (enc);
+	return (BRPIPE_OK);
+}
+
+/* Decompress from file source to file dest until stream ends or EOF.
+   returns BRPIPE_OK on success, BRPIPE_MEM_ERROR if memory could not be
+   allocated for processing, BRPIPE_DATA_ERROR if the Brotli data is
+   invalid or incomplete, or BRPIPE_ERRNO if there is an error reading
+   or writing the files (or the decompression ratio is exceeded). */
+int unbrotli_stream_stream (FILE *source, FILE *dest, ZP_DATASIZE_TYPE *inlen, ZP_DATASIZE_TYPE *outlen, int de_chunk, int max_ratio, ZP_DATASIZE_TYPE min_eval)
+{
+	BrotliDecoderState *dec;
+	BrotliDecoderResult result = BROTLI_DECODER_RESULT_NEEDS_MORE_INPUT;
+	t_brpipe_source src_state;
+	unsigned char in [BUFSIZE];
+	unsigned char out [BUFSIZE];
+	const uint8_t *next_in;
+	uint8_t *next_out;
+	size_t avail_in, avail_out;
+	size_t have, last_write_bytes;
+
+	*inlen = 0;
+	*outlen = 0;
+
+	if ((dec = BrotliDecoderCreateInstance (NULL, NULL, NULL)) == NULL)
+		return (BRPIPE_MEM_ERROR);
+
+	brpipe_source_init (&src_state, de_chunk);
+
+	/* decompress until Brotli stream ends or end of file */
+	do {
+		avail_in = brpipe_read (&src_state, source, in);
+		*inlen += avail_in;
+
+		/* update access log stats */
+		access_log_def_inlen(*inlen);
+
+		if (ferror(source)) {
+			BrotliDecoderDestroyInstance (dec);
+			debug_log_puts ("stream unbrotli: IO error (source). Aborting.");
+			return (BRPIPE_ERRNO);
+		}
+		if (avail_in == 0)
+			break;
+		next_in = in;
+
+		/* run the decoder until it asks for more input (or finishes) */
+		do {
+			avail_out = BUFSIZE;
+			next_out = out;
+			result = BrotliDecoderDecompressStream (dec, &avail_in, &next_in, &avail_out, &next_out, NULL);
+			if (result == BROTLI_DECODER_RESULT_ERROR) {
+				BrotliDecoderDestroyInstance (dec);
+				return (BRPIPE_DATA_ERROR);
+			}
+			have = BUFSIZE - avail_out;
+			tosmarking_add_check_bytecount (have);	/* update TOS if necessary */
+			if ((last_write_bytes = fwrite(out, 1, have, dest)) != have || ferror(dest)) {
+				*outlen += last_write_bytes;
+				BrotliDecoderDestroyInstance (dec);
+				debug_log_puts ("stream unbrotli: IO error (dest). Aborting.");
+				return (BRPIPE_ERRNO);
+			}
+			*outlen += last_write_bytes;
+
+			/* update access log stats */
+			access_log_def_outlen(*outlen);
+
+			/* evaluate whether decompression rate is exceeded */
+			if ((max_ratio != 0) && (*outlen >= min_eval)) {
+				if (((*inlen * max_ratio) / 100) < *outlen) {
+					/* ratio is exceeded, abort decompression and streaming */
+					access_log_set_flags (LOG_AC_FLAG_LLCOMP_TOO_EXPANSIVE);
+					BrotliDecoderDestroyInstance (dec);
+					debug_log_puts ("stream unbrotli: Decompression ratio exceeded. Aborting.");
+					return (BRPIPE_ERRNO);
+				}
+			}
+
+		} while (result == BROTLI_DECODER_RESULT_NEEDS_MORE_OUTPUT);
+
+		// If we are sending a big file down a slow line, we
+		// need to reset the alarm once a while.
+		if (ConnTimeout)
+			alarm(ConnTimeout);
+
+		/* done when the decoder says it's done */
+	} while ((result != BROTLI_DECODER_RESULT_SUCCESS) && (! src_state.finished));
+
+	/* clean up and return */
+	BrotliDecoderDestroyInstance (dec);
+	return (result == BROTLI_DECODER_RESULT_SUCCESS ? BRPIPE_OK : BRPIPE_DATA_ERROR);
+}
+
+/* Compress inlen bytes from source to file dest.
+   returns: same as brotli_stream_stream() */
+int brotli_memory_stream (const char *source, FILE *dest, int quality, ZP_DATASIZE_TYPE inlen, ZP_DATASIZE_TYPE *outlen)
+{
+	BrotliEncoderState *enc;
+	unsigned char out [BUFSIZE];
+	const uint8_t *next_in;
+	uint8_t *next_out;
+	size_t avail_in, avail_out;
+	size_t have, last_write_bytes;
+
+	*outlen = 0;
+
+	if ((enc = BrotliEncoderCreateInstance (NULL, NULL, NULL)) == NULL)
+		return (BRPIPE_MEM_ERROR);
+	BrotliEncoderSetParameter (enc, BROTLI_PARAM_QUALITY, quality);
+	/* whole data is known, let the encoder tune itself for it */
+	BrotliEncoderSetParameter (enc, BROTLI_PARAM_SIZE_HINT, (inlen < (1 << 30)) ? inlen : (1 << 30));
+
+	avail_in = inlen;
+	next_in = (const uint8_t *) source;
+
+	/* run the encoder until it's finished */
+	do {
+		avail_out = BUFSIZE;
+		next_out = out;
+		if (! BrotliEncoderCompressStream (enc, BROTLI_OPERATION_FINISH, &avail_in, &next_in, &avail_out, &next_out, NULL)) {
+			BrotliEncoderDestroyInstance (enc);
+			return (BRPIPE_MEM_ERROR);
+		}
+		have = BUFSIZE - avail_out;
+		tosmarking_add_check_bytecount (have);	/* update TOS if necessary */
+		if ((last_write_bytes = fwrite(out, 1, have, dest)) != have || ferror(dest)) {
+			BrotliEncoderDestroyInstance (enc);
+			*outlen += last_write_bytes;
+			return (BRPIPE_ERRNO);
+		}
+		*outlen += last_write_bytes;
+
+		/* update access log stats */
+		access_log_def_outlen(*outlen);
+
+		// If we are sending a big file down a slow line, we
+		// need to reset the alarm once a while.
+		if (ConnTimeout)
+			alarm(ConnTimeout);
+
+	} while (! BrotliEncoderIsFinished (enc));
+
+	/* clean up and return */
+	BrotliEncoderDestroyInstance (enc);
+	return (BRPIPE_OK);
+}
+
+/* Decompress inlen bytes from source into a newly-allocated *dest.
+ * *dest is allocated with one extra byte, so htmlopt may add its '\0'.
+ * max_growth (in %) is the maximum allowable uncompressed size relative
+ * 	to inlen, if exceeded the decompressor will stop
+ * 	if max_growth==0 then there will be no limit (other than memory)
+ * returns: BRPIPE_OK (*dest and *outlen are defined) or an error
+ * 	(in this case, *dest is unchanged) */
+int unbrotli_memory_memory (const char *source, ZP_DATASIZE_TYPE inlen, char **dest, ZP_DATASIZE_TYPE *outlen, int max_growth)
+{
+	BrotliDecoderState *dec;
+	BrotliDecoderResult result;
+	ZP_DATASIZE_TYPE max_outlen;
+	ZP_DATASIZE_TYPE buf_len;
+	char *buf, *new_buf;
+	const uint8_t *next_in;
+	uint8_t *next_out;
+	size_t avail_in, avail_out;
+
+	max_outlen = (inlen * max_growth) / 100;
+
+	/* initial guess, grown as needed */
+	buf_len = (inlen * 4) + BUFSIZE;
+	if ((buf = malloc (buf_len + 1)) == NULL)
+		return (BRPIPE_MEM_ERROR);
+	if ((dec = BrotliDecoderCreateInstance (NULL, NULL, NULL)) == NULL) {
+		free (buf);
+		return (BRPIPE_MEM_ERROR);
+	}
+
+	avail_in = inlen;
+	next_in = (const uint8_t *) source;
+	avail_out = buf_len;
+	next_out = (uint8_t *) buf;
+
+	while ((result = BrotliDecoderDecompressStream (dec, &avail_in, &next_in, &avail_out, &next_out, NULL)) == BROTLI_DECODER_RESULT_NEEDS_MORE_OUTPUT) {
+		if ((max_growth != 0) && ((buf_len - avail_out) > max_outlen)) {
+			BrotliDecoderDestroyInstance (dec);
+			free (buf);
+			return (BRPIPE_RATIO_EXCEEDED);
+		}
+
+		if ((new_buf = realloc (buf, (buf_len * 2) + 1)) == NULL) {
+			BrotliDecoderDestroyInstance (dec);
+			free (buf);
+			return (BRPIPE_MEM_ERROR);
+		}
+		next_out = (uint8_t *) (new_buf + (buf_len - avail_out));
+		avail_out += buf_len;
+		buf_len *= 2;
+		buf = new_buf;
+	}
+	BrotliDecoderDestroyInstance (dec);
+
+	if (result != BROTLI_DECODER_RESULT_SUCCESS) {
+		free (buf);
+		return (BRPIPE_DATA_ERROR);
+	}
+	if ((max_growth != 0) && ((buf_len - avail_out) > max_outlen)) {
+		free (buf);
+		return (BRPIPE_RATIO_EXCEEDED);
+	}
+
+	*outlen = buf_len - avail_out;
+	*dest = buf;
+	return (BRPIPE_OK);
+}
+
+#endif
+
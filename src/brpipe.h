@@ -0,0 +1,47 @@
+/* brpipe.h
+ * Brotli pipe-pipe routines
+ *
+ * Ziproxy - the HTTP acceleration proxy
+ * This code is under the following conditions:
+ *
+ * ---------------------------------------------------------------------
+ * Copyright (c)2005-2014 Daniel Mealha Cabrita
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111 USA
+ * ---------------------------------------------------------------------
+ */
+
+//To stop multiple inclusions.
+#ifndef SRC_BRPIPE_H
+#define SRC_BRPIPE_H
+
+#include <stdio.h>
+
+#include "globaldefs.h"
+
+/* return codes */
+#define BRPIPE_OK		0
+#define BRPIPE_ERRNO		1	/* IO error (source or dest) */
+#define BRPIPE_MEM_ERROR	2
+#define BRPIPE_DATA_ERROR	3	/* broken or truncated Brotli data */
+#define BRPIPE_RATIO_EXCEEDED	4	/* decompressed data exceeds the given max ratio */
+
+int brotli_stream_stream (FILE *source, FILE *dest, int quality, ZP_DATASIZE_TYPE *inlen, ZP_DATASIZE_TYPE *outlen, int de_chunk);
+int unbrotli_stream_stream (FILE *source, FILE *dest, ZP_DATASIZE_TYPE *inlen, ZP_DATASIZE_TYPE *outlen, int de_chunk, int max_ratio, ZP_DATASIZE_TYPE min_eval);
+int brotli_memory_stream (const char *source, FILE *dest, int quality, ZP_DATASIZE_TYPE inlen, ZP_DATASIZE_TYPE *outlen);
+int unbrotli_memory_memory (const char *source, ZP_DATASIZE_TYPE inlen, char **dest, ZP_DATASIZE_TYPE *outlen, int max_growth);
+
+#endif //SRC_BRPIPE_H
+
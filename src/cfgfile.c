@@ -76,12 +76,29 @@
 #include "simplelist.h"
 #include "cttables.h"
 #include "auth.h"
+#include "imginline.h"
+#include "preemptdns.h"
+#include "prefetch.h"
 #include "log.h"
 
 
-t_qp_bool DoGzip, UseContentLength, AllowLookCh, ProcessJPG, ProcessPNG, ProcessGIF, PreemptNameRes, PreemptNameResBC, TransparentProxy, ConventionalProxy, ProcessHTML, ProcessCSS, ProcessJS, ProcessHTML_CSS, ProcessHTML_JS, ProcessHTML_tags, ProcessHTML_text, ProcessHTML_PRE, ProcessHTML_NoComments, ProcessHTML_TEXTAREA, AllowMethodCONNECT, OverrideAcceptEncoding, DecompressIncomingGzipData, WA_MSIE_FriendlyErrMsgs, InterceptCrashes, TOSMarking, TOSMarkAsDiffCTAlsoXST, URLReplaceDataCTListAlsoXST, LosslessCompressCTAlsoXST, ConvertToGrayscale;
+t_qp_bool DoGzip, UseContentLength, AllowLookCh, ProcessJPG, ProcessPNG, ProcessGIF, PreemptNameRes, PreemptNameResBC, TransparentProxy, ConventionalProxy, ProcessHTML, ProcessCSS, ProcessJS, ProcessHTML_CSS, ProcessHTML_JS, ProcessHTML_tags, ProcessHTML_text, ProcessHTML_PRE, ProcessHTML_NoComments, ProcessHTML_TEXTAREA, ProcessHTML_OptionalTags, ProcessHTML_UnquoteAttrs, ProcessHTML_BooleanAttrs, ProcessHTML_DefaultTypes, ProcessHTML_BlockSpaces, ProcessTextStreaming, AllowMethodCONNECT, OverrideAcceptEncoding, DecompressIncomingGzipData, WA_MSIE_FriendlyErrMsgs, InterceptCrashes, TOSMarking, TOSMarkAsDiffCTAlsoXST, URLReplaceDataCTListAlsoXST, LosslessCompressCTAlsoXST, ConvertToGrayscale;
 
 int Port, NextPort, ConnTimeout, MaxSize, PreemptNameResMax, MaxUncompressedGzipRatio, MinUncompressedGzipStreamEval, MaxUncompressedImageRatio;
+int PreemptNameResThreads, PreemptNameResEntries, PreemptNameResTTL;
+int MinifiedTextThreshold;
+t_qp_bool InlineImages;
+int InlineImagesMax, InlineImagesMaxSize, InlineImagesPageBudget;
+t_qp_bool InlineCSS;
+int InlineCSSMaxSize, InlineCSSPageBudget, InlineCSSCacheTTL;
+char *InlineCSSCacheDir;
+t_qp_bool ImageResize;
+float ImageResizeDPR;
+int ImageResizeEntries, ImageResizeTTL;
+t_qp_bool LazyLoad;
+int LazyLoadEager;
+char *tmpLazyLoadExList;
+t_st_strtable *LazyLoadExList;
 int ZiproxyTimeout; // deprecated
 int ImageQuality[4];
 int AlphaRemovalMinAvgOpacity;
@@ -119,6 +136,33 @@ int TOSMarkAsDiffSizeBT;
 
 int MaxActiveUserConnections;
 
+int NegativeCacheEntries;
+int NegativeCacheTTL;
+int NegativeCacheLearnSamples;
+int NegativeCacheLearnRatio;
+
+int CoalesceRequests;
+int CoalesceTimeout;
+char *CoalesceTempDir;
+t_qp_bool Prefetch;
+int PrefetchMax, PrefetchParallel, PrefetchBudget, PrefetchTTL;
+int MuxLinkListenPort;
+int MuxLinkConnections;
+int MuxLinkNextPort;
+int MuxLinkWindow;
+t_qp_bool DeltaEncodeHTML;
+t_qp_bool AnnounceDeltaCapability;
+char *DeltaCacheDir;
+int DeltaCacheVersions;
+int DeltaMinSaving;
+int GzipLevel;
+t_qp_bool GzipAdaptiveLevel;
+int GzipAdaptiveLoadHigh;
+int GzipParallelThreads;
+int GzipParallelMinSize;
+t_qp_bool GzipReoptimize;
+int GzipReoptimizeMinSaving;
+
 char *PIDFile;
 char *cli_PIDFile;
 
@@ -133,6 +177,19 @@ char *AuthPasswdFile;
 char *AuthSASLConfPath;
 #endif
 
+#ifdef BROTLI
+t_qp_bool DoBrotli, DecompressIncomingBrotliData;
+int BrotliQualityStream, BrotliQualityMemory;
+#endif
+
+#ifdef ZSTD
+t_qp_bool DoZstd;
+int ZstdLevelStream, ZstdLevelMemory, ZstdStreamFlushInterval;
+t_qp_bool SharedDictCompress, AnnounceSharedDictCapability;
+char *SharedDictDir;
+int SharedDictSize, SharedDictTrainSamples, SharedDictTrainInterval;
+#endif
+
 #ifdef JP2K
 t_qp_bool ProcessJP2, ForceOutputNoJP2, ProcessToJP2, AnnounceJP2Capability, JP2OutRequiresExpCap;
 int JP2Colorspace_cfg;
@@ -250,6 +307,9 @@ int ReadCfgFile(char * cfg_file)
 	ConnTimeout = 90;
 	MaxSize = 1048576;
 	PreemptNameResMax = 50;
+	PreemptNameResThreads = 8;
+	PreemptNameResEntries = 1024;
+	PreemptNameResTTL = 60;
 	MaxUncompressedGzipRatio = 2000;
 	MinUncompressedGzipStreamEval = 10000000;
 	MaxUncompressedImageRatio = 500;
@@ -258,6 +318,26 @@ int ReadCfgFile(char * cfg_file)
 	ProcessHTML = ProcessCSS = ProcessJS = QP_FALSE;
 	WA_MSIE_FriendlyErrMsgs = QP_TRUE;
 	ProcessHTML_CSS = ProcessHTML_JS = ProcessHTML_tags = ProcessHTML_text = ProcessHTML_PRE = ProcessHTML_NoComments = ProcessHTML_TEXTAREA = QP_TRUE;
+	ProcessHTML_OptionalTags = ProcessHTML_UnquoteAttrs = ProcessHTML_BooleanAttrs = ProcessHTML_DefaultTypes = ProcessHTML_BlockSpaces = QP_FALSE;
+	ProcessTextStreaming = QP_FALSE;
+	MinifiedTextThreshold = 2;
+	InlineImages = QP_FALSE;
+	InlineImagesMax = 16;
+	InlineImagesMaxSize = 2048;
+	InlineImagesPageBudget = 16384;
+	InlineCSS = QP_FALSE;
+	InlineCSSMaxSize = 8192;
+	InlineCSSPageBudget = 32768;
+	InlineCSSCacheDir = NULL;
+	InlineCSSCacheTTL = 300;
+	ImageResize = QP_FALSE;
+	ImageResizeDPR = 2.0;
+	ImageResizeEntries = 4096;
+	ImageResizeTTL = 600;
+	LazyLoad = QP_FALSE;
+	LazyLoadEager = 3;
+	tmpLazyLoadExList = NULL;
+	LazyLoadExList = NULL;
 	AllowLookCh = PreemptNameResBC = TransparentProxy = QP_FALSE;
 	ConvertToGrayscale = QP_FALSE;
 	ConventionalProxy = QP_TRUE;
@@ -299,6 +379,34 @@ int ReadCfgFile(char * cfg_file)
 	tos_maskasdiff_ct = NULL;
 	TOSMarkAsDiffCTAlsoXST = QP_TRUE;
 	MaxActiveUserConnections = 0;
+	NegativeCacheEntries = 0;
+	NegativeCacheTTL = 3600;
+	NegativeCacheLearnSamples = 0;
+	NegativeCacheLearnRatio = 90;
+	CoalesceRequests = 0;
+	CoalesceTimeout = 30;
+	CoalesceTempDir = "/tmp";
+	Prefetch = QP_FALSE;
+	PrefetchMax = 8;
+	PrefetchParallel = 4;
+	PrefetchBudget = 1048576;
+	PrefetchTTL = 30;
+	MuxLinkListenPort = 0;
+	MuxLinkConnections = 0;
+	MuxLinkNextPort = 0;
+	MuxLinkWindow = 262144;
+	DeltaEncodeHTML = QP_FALSE;
+	AnnounceDeltaCapability = QP_FALSE;
+	DeltaCacheDir = NULL;
+	DeltaCacheVersions = 4;
+	DeltaMinSaving = 20;
+	GzipLevel = 9;
+	GzipAdaptiveLevel = QP_FALSE;
+	GzipAdaptiveLoadHigh = 100;
+	GzipParallelThreads = 0;
+	GzipParallelMinSize = 1048576;
+	GzipReoptimize = QP_FALSE;
+	GzipReoptimizeMinSaving = 10;
 	PIDFile = cli_PIDFile;		/* defaults to CLI parameter, if specified */
 	RunAsUser = cli_RunAsUser;	/* defaults to CLI parameter, if specified */
 	RunAsGroup = cli_RunAsGroup;	/* defaults to CLI parameter, if specified */
@@ -308,6 +416,24 @@ int ReadCfgFile(char * cfg_file)
 #ifdef SASL
 	AuthSASLConfPath = NULL;
 #endif
+#ifdef BROTLI
+	DoBrotli = QP_FALSE;
+	BrotliQualityStream = 5;
+	BrotliQualityMemory = 9;
+	DecompressIncomingBrotliData = QP_TRUE;
+#endif
+#ifdef ZSTD
+	DoZstd = QP_FALSE;
+	ZstdLevelStream = 3;
+	ZstdLevelMemory = 9;
+	ZstdStreamFlushInterval = 65536;
+	SharedDictCompress = QP_FALSE;
+	AnnounceSharedDictCapability = QP_FALSE;
+	SharedDictDir = NULL;
+	SharedDictSize = 65536;
+	SharedDictTrainSamples = 500;
+	SharedDictTrainInterval = 86400;
+#endif
 #ifdef JP2K
 	ProcessJP2 = QP_FALSE;
 	ForceOutputNoJP2 = QP_FALSE;
@@ -335,6 +461,13 @@ int ReadCfgFile(char * cfg_file)
 	qp_getconf_int (conf_handler, "ConnTimeout", &ConnTimeout, QP_FLAG_NONE);
 	qp_getconf_int (conf_handler, "ZiproxyTimeout", &ZiproxyTimeout, QP_FLAG_NONE); // deprecated
 	qp_getconf_bool (conf_handler, "Gzip", &DoGzip, QP_FLAG_NONE);
+	qp_getconf_int (conf_handler, "GzipLevel", &GzipLevel, QP_FLAG_NONE);
+	qp_getconf_bool (conf_handler, "GzipAdaptiveLevel", &GzipAdaptiveLevel, QP_FLAG_NONE);
+	qp_getconf_int (conf_handler, "GzipAdaptiveLoadHigh", &GzipAdaptiveLoadHigh, QP_FLAG_NONE);
+	qp_getconf_int (conf_handler, "GzipParallelThreads", &GzipParallelThreads, QP_FLAG_NONE);
+	qp_getconf_int (conf_handler, "GzipParallelMinSize", &GzipParallelMinSize, QP_FLAG_NONE);
+	qp_getconf_bool (conf_handler, "GzipReoptimize", &GzipReoptimize, QP_FLAG_NONE);
+	qp_getconf_int (conf_handler, "GzipReoptimizeMinSaving", &GzipReoptimizeMinSaving, QP_FLAG_NONE);
 	qp_getconf_array_str (conf_handler, "Compressible", 0, NULL, QP_FLAG_NONE);	// deprecated
 	qp_getconf_array_str (conf_handler, "LosslessCompressCT", 0, NULL, QP_FLAG_NONE);
 	qp_getconf_bool (conf_handler, "LosslessCompressCTAlsoXST", &LosslessCompressCTAlsoXST, QP_FLAG_NONE);
@@ -351,6 +484,9 @@ int ReadCfgFile(char * cfg_file)
 	qp_getconf_bool (conf_handler, "PreemptNameRes", &PreemptNameRes, QP_FLAG_NONE);
 	qp_getconf_int (conf_handler, "PreemptNameResMax", &PreemptNameResMax, QP_FLAG_NONE);
 	qp_getconf_bool (conf_handler, "PreemptNameResBC", &PreemptNameResBC, QP_FLAG_NONE);
+	qp_getconf_int (conf_handler, "PreemptNameResThreads", &PreemptNameResThreads, QP_FLAG_NONE);
+	qp_getconf_int (conf_handler, "PreemptNameResEntries", &PreemptNameResEntries, QP_FLAG_NONE);
+	qp_getconf_int (conf_handler, "PreemptNameResTTL", &PreemptNameResTTL, QP_FLAG_NONE);
 	qp_getconf_bool (conf_handler, "TransparentProxy", &TransparentProxy, QP_FLAG_NONE);
 	qp_getconf_bool (conf_handler, "ConventionalProxy", &ConventionalProxy, QP_FLAG_NONE);
 	qp_getconf_str (conf_handler, "CustomError400", &CustomError400, QP_FLAG_NONE);
@@ -373,6 +509,29 @@ int ReadCfgFile(char * cfg_file)
 	qp_getconf_bool (conf_handler, "ProcessHTML_PRE", &ProcessHTML_PRE, QP_FLAG_NONE);
 	qp_getconf_bool (conf_handler, "ProcessHTML_NoComments", &ProcessHTML_NoComments, QP_FLAG_NONE);
 	qp_getconf_bool (conf_handler, "ProcessHTML_TEXTAREA", &ProcessHTML_TEXTAREA, QP_FLAG_NONE);
+	qp_getconf_bool (conf_handler, "ProcessHTML_OptionalTags", &ProcessHTML_OptionalTags, QP_FLAG_NONE);
+	qp_getconf_bool (conf_handler, "ProcessHTML_UnquoteAttrs", &ProcessHTML_UnquoteAttrs, QP_FLAG_NONE);
+	qp_getconf_bool (conf_handler, "ProcessHTML_BooleanAttrs", &ProcessHTML_BooleanAttrs, QP_FLAG_NONE);
+	qp_getconf_bool (conf_handler, "ProcessHTML_DefaultTypes", &ProcessHTML_DefaultTypes, QP_FLAG_NONE);
+	qp_getconf_bool (conf_handler, "ProcessHTML_BlockSpaces", &ProcessHTML_BlockSpaces, QP_FLAG_NONE);
+	qp_getconf_bool (conf_handler, "ProcessTextStreaming", &ProcessTextStreaming, QP_FLAG_NONE);
+	qp_getconf_int (conf_handler, "MinifiedTextThreshold", &MinifiedTextThreshold, QP_FLAG_NONE);
+	qp_getconf_bool (conf_handler, "InlineImages", &InlineImages, QP_FLAG_NONE);
+	qp_getconf_int (conf_handler, "InlineImagesMax", &InlineImagesMax, QP_FLAG_NONE);
+	qp_getconf_int (conf_handler, "InlineImagesMaxSize", &InlineImagesMaxSize, QP_FLAG_NONE);
+	qp_getconf_int (conf_handler, "InlineImagesPageBudget", &InlineImagesPageBudget, QP_FLAG_NONE);
+	qp_getconf_bool (conf_handler, "InlineCSS", &InlineCSS, QP_FLAG_NONE);
+	qp_getconf_int (conf_handler, "InlineCSSMaxSize", &InlineCSSMaxSize, QP_FLAG_NONE);
+	qp_getconf_int (conf_handler, "InlineCSSPageBudget", &InlineCSSPageBudget, QP_FLAG_NONE);
+	qp_getconf_str (conf_handler, "InlineCSSCacheDir", &InlineCSSCacheDir, QP_FLAG_NONE);
+	qp_getconf_int (conf_handler, "InlineCSSCacheTTL", &InlineCSSCacheTTL, QP_FLAG_NONE);
+	qp_getconf_bool (conf_handler, "ImageResize", &ImageResize, QP_FLAG_NONE);
+	qp_getconf_float (conf_handler, "ImageResizeDPR", &ImageResizeDPR, QP_FLAG_NONE);
+	qp_getconf_int (conf_handler, "ImageResizeEntries", &ImageResizeEntries, QP_FLAG_NONE);
+	qp_getconf_int (conf_handler, "ImageResizeTTL", &ImageResizeTTL, QP_FLAG_NONE);
+	qp_getconf_bool (conf_handler, "LazyLoad", &LazyLoad, QP_FLAG_NONE);
+	qp_getconf_int (conf_handler, "LazyLoadEager", &LazyLoadEager, QP_FLAG_NONE);
+	qp_getconf_str (conf_handler, "LazyLoadExList", &tmpLazyLoadExList, QP_FLAG_NONE);
 	qp_getconf_bool (conf_handler, "AllowMethodCONNECT", &AllowMethodCONNECT, QP_FLAG_NONE);
 	qp_getconf_bool (conf_handler, "OverrideAcceptEncoding", &OverrideAcceptEncoding, QP_FLAG_NONE);
 	qp_getconf_int (conf_handler, "MaxUncompressedGzipRatio", &MaxUncompressedGzipRatio, QP_FLAG_NONE);
@@ -401,6 +560,27 @@ int ReadCfgFile(char * cfg_file)
 	qp_getconf_bool (conf_handler, "TOSMarkAsDiffCTAlsoXST", &TOSMarkAsDiffCTAlsoXST, QP_FLAG_NONE);
 	qp_getconf_int (conf_handler, "TOSMarkAsDiffSizeBT", &TOSMarkAsDiffSizeBT, QP_FLAG_NONE);
 	qp_getconf_int (conf_handler, "MaxActiveUserConnections", &MaxActiveUserConnections, QP_FLAG_NONE);
+	qp_getconf_int (conf_handler, "NegativeCacheEntries", &NegativeCacheEntries, QP_FLAG_NONE);
+	qp_getconf_int (conf_handler, "NegativeCacheTTL", &NegativeCacheTTL, QP_FLAG_NONE);
+	qp_getconf_int (conf_handler, "NegativeCacheLearnSamples", &NegativeCacheLearnSamples, QP_FLAG_NONE);
+	qp_getconf_int (conf_handler, "NegativeCacheLearnRatio", &NegativeCacheLearnRatio, QP_FLAG_NONE);
+	qp_getconf_int (conf_handler, "CoalesceRequests", &CoalesceRequests, QP_FLAG_NONE);
+	qp_getconf_int (conf_handler, "CoalesceTimeout", &CoalesceTimeout, QP_FLAG_NONE);
+	qp_getconf_str (conf_handler, "CoalesceTempDir", &CoalesceTempDir, QP_FLAG_NONE);
+	qp_getconf_bool (conf_handler, "Prefetch", &Prefetch, QP_FLAG_NONE);
+	qp_getconf_int (conf_handler, "PrefetchMax", &PrefetchMax, QP_FLAG_NONE);
+	qp_getconf_int (conf_handler, "PrefetchParallel", &PrefetchParallel, QP_FLAG_NONE);
+	qp_getconf_int (conf_handler, "PrefetchBudget", &PrefetchBudget, QP_FLAG_NONE);
+	qp_getconf_int (conf_handler, "PrefetchTTL", &PrefetchTTL, QP_FLAG_NONE);
+	qp_getconf_int (conf_handler, "MuxLinkListenPort", &MuxLinkListenPort, QP_FLAG_NONE);
+	qp_getconf_int (conf_handler, "MuxLinkConnections", &MuxLinkConnections, QP_FLAG_NONE);
+	qp_getconf_int (conf_handler, "MuxLinkNextPort", &MuxLinkNextPort, QP_FLAG_NONE);
+	qp_getconf_int (conf_handler, "MuxLinkWindow", &MuxLinkWindow, QP_FLAG_NONE);
+	qp_getconf_bool (conf_handler, "DeltaEncodeHTML", &DeltaEncodeHTML, QP_FLAG_NONE);
+	qp_getconf_bool (conf_handler, "AnnounceDeltaCapability", &AnnounceDeltaCapability, QP_FLAG_NONE);
+	qp_getconf_str (conf_handler, "DeltaCacheDir", &DeltaCacheDir, QP_FLAG_NONE);
+	qp_getconf_int (conf_handler, "DeltaCacheVersions", &DeltaCacheVersions, QP_FLAG_NONE);
+	qp_getconf_int (conf_handler, "DeltaMinSaving", &DeltaMinSaving, QP_FLAG_NONE);
 	qp_getconf_str (conf_handler, "PIDFile", &PIDFile, QP_FLAG_NONE);
 	qp_getconf_str (conf_handler, "RunAsUser", &RunAsUser, QP_FLAG_NONE);
 	qp_getconf_str (conf_handler, "RunAsGroup", &RunAsGroup, QP_FLAG_NONE);
@@ -442,6 +622,40 @@ int ReadCfgFile(char * cfg_file)
 	qp_set_parameter_status (conf_handler, QP_PARM_STATUS_NOT_SUPPORTED, "JP2CSamplingRGBA");
 	qp_set_parameter_status (conf_handler, QP_PARM_STATUS_NOT_SUPPORTED, "JP2CSamplingYUVA");
 #endif
+#ifdef BROTLI
+	qp_getconf_bool (conf_handler, "Brotli", &DoBrotli, QP_FLAG_NONE);
+	qp_getconf_int (conf_handler, "BrotliQualityStream", &BrotliQualityStream, QP_FLAG_NONE);
+	qp_getconf_int (conf_handler, "BrotliQualityMemory", &BrotliQualityMemory, QP_FLAG_NONE);
+	qp_getconf_bool (conf_handler, "DecompressIncomingBrotliData", &DecompressIncomingBrotliData, QP_FLAG_NONE);
+#else
+	qp_set_parameter_status (conf_handler, QP_PARM_STATUS_NOT_SUPPORTED, "Brotli");
+	qp_set_parameter_status (conf_handler, QP_PARM_STATUS_NOT_SUPPORTED, "BrotliQualityStream");
+	qp_set_parameter_status (conf_handler, QP_PARM_STATUS_NOT_SUPPORTED, "BrotliQualityMemory");
+	qp_set_parameter_status (conf_handler, QP_PARM_STATUS_NOT_SUPPORTED, "DecompressIncomingBrotliData");
+#endif
+#ifdef ZSTD
+	qp_getconf_bool (conf_handler, "Zstd", &DoZstd, QP_FLAG_NONE);
+	qp_getconf_int (conf_handler, "ZstdLevelStream", &ZstdLevelStream, QP_FLAG_NONE);
+	qp_getconf_int (conf_handler, "ZstdLevelMemory", &ZstdLevelMemory, QP_FLAG_NONE);
+	qp_getconf_int (conf_handler, "ZstdStreamFlushInterval", &ZstdStreamFlushInterval, QP_FLAG_NONE);
+	qp_getconf_bool (conf_handler, "SharedDictCompress", &SharedDictCompress, QP_FLAG_NONE);
+	qp_getconf_bool (conf_handler, "AnnounceSharedDictCapability", &AnnounceSharedDictCapability, QP_FLAG_NONE);
+	qp_getconf_str (conf_handler, "SharedDictDir", &SharedDictDir, QP_FLAG_NONE);
+	qp_getconf_int (conf_handler, "SharedDictSize", &SharedDictSize, QP_FLAG_NONE);
+	qp_getconf_int (conf_handler, "SharedDictTrainSamples", &SharedDictTrainSamples, QP_FLAG_NONE);
+	qp_getconf_int (conf_handler, "SharedDictTrainInterval", &SharedDictTrainInterval, QP_FLAG_NONE);
+#else
+	qp_set_parameter_status (conf_handler, QP_PARM_STATUS_NOT_SUPPORTED, "Zstd");
+	qp_set_parameter_status (conf_handler, QP_PARM_STATUS_NOT_SUPPORTED, "ZstdLevelStream");
+	qp_set_parameter_status (conf_handler, QP_PARM_STATUS_NOT_SUPPORTED, "ZstdLevelMemory");
+	qp_set_parameter_status (conf_handler, QP_PARM_STATUS_NOT_SUPPORTED, "ZstdStreamFlushInterval");
+	qp_set_parameter_status (conf_handler, QP_PARM_STATUS_NOT_SUPPORTED, "SharedDictCompress");
+	qp_set_parameter_status (conf_handler, QP_PARM_STATUS_NOT_SUPPORTED, "AnnounceSharedDictCapability");
+	qp_set_parameter_status (conf_handler, QP_PARM_STATUS_NOT_SUPPORTED, "SharedDictDir");
+	qp_set_parameter_status (conf_handler, QP_PARM_STATUS_NOT_SUPPORTED, "SharedDictSize");
+	qp_set_parameter_status (conf_handler, QP_PARM_STATUS_NOT_SUPPORTED, "SharedDictTrainSamples");
+	qp_set_parameter_status (conf_handler, QP_PARM_STATUS_NOT_SUPPORTED, "SharedDictTrainInterval");
+#endif
 #ifdef EN_NAMESERVERS
 	qp_getconf_array_str (conf_handler, "Nameservers", 0, NULL, QP_FLAG_NONE);
 #else
@@ -624,6 +838,199 @@ int ReadCfgFile(char * cfg_file)
 	if (check_int_minimum ("MaxActiveUserConnections", MaxActiveUserConnections, 0))
 		return (1);
 
+	if (check_int_ranges ("PreemptNameResThreads", PreemptNameResThreads, 1, PREEMPTDNS_MAX_THREADS))
+		return (1);
+
+	if (check_int_ranges ("PreemptNameResEntries", PreemptNameResEntries, 1, 16777216))
+		return (1);
+
+	if (check_int_minimum ("PreemptNameResTTL", PreemptNameResTTL, 1))
+		return (1);
+
+	if (check_int_ranges ("MinifiedTextThreshold", MinifiedTextThreshold, 0, 100))
+		return (1);
+
+	if (check_int_ranges ("InlineImagesMax", InlineImagesMax, 1, IMGINLINE_MAX_IMAGES))
+		return (1);
+
+	if (check_int_ranges ("InlineImagesMaxSize", InlineImagesMaxSize, 1, 1048576))
+		return (1);
+
+	if (check_int_minimum ("InlineImagesPageBudget", InlineImagesPageBudget, 0))
+		return (1);
+
+	if (check_int_ranges ("InlineCSSMaxSize", InlineCSSMaxSize, 1, 1048576))
+		return (1);
+
+	if (check_int_minimum ("InlineCSSPageBudget", InlineCSSPageBudget, 0))
+		return (1);
+
+	if (check_int_minimum ("InlineCSSCacheTTL", InlineCSSCacheTTL, 1))
+		return (1);
+
+	if ((InlineCSSCacheDir != NULL) && check_directory ("InlineCSSCacheDir", InlineCSSCacheDir))
+		return (1);
+
+	if ((ImageResizeDPR < 1.0) || (ImageResizeDPR > 4.0)) {
+		error_log_printf (LOGMT_FATALERROR, LOGSS_CONFIG,
+			"Out of range value for ImageResizeDPR (Acceptable: 1.0 to 4.0)\n");
+		return (1);
+	}
+
+	if (check_int_ranges ("ImageResizeEntries", ImageResizeEntries, 1, 16777216))
+		return (1);
+
+	if (check_int_minimum ("ImageResizeTTL", ImageResizeTTL, 1))
+		return (1);
+
+	if (check_int_minimum ("LazyLoadEager", LazyLoadEager, 0))
+		return (1);
+
+	if (check_int_ranges ("NegativeCacheEntries", NegativeCacheEntries, 0, 16777216))
+		return (1);
+
+	if (check_int_minimum ("NegativeCacheTTL", NegativeCacheTTL, 1))
+		return (1);
+
+	if (check_int_minimum ("NegativeCacheLearnSamples", NegativeCacheLearnSamples, 0))
+		return (1);
+
+	if (check_int_ranges ("NegativeCacheLearnRatio", NegativeCacheLearnRatio, 1, 100))
+		return (1);
+
+	if (check_int_ranges ("CoalesceRequests", CoalesceRequests, 0, 65536))
+		return (1);
+
+	if (check_int_minimum ("CoalesceTimeout", CoalesceTimeout, 1))
+		return (1);
+
+	if (CoalesceRequests > 0) {
+		if (check_directory ("CoalesceTempDir", CoalesceTempDir))
+			return (1);
+	}
+
+	if (check_int_ranges ("PrefetchMax", PrefetchMax, 1, PREFETCH_MAX_URLS))
+		return (1);
+
+	if (check_int_ranges ("PrefetchParallel", PrefetchParallel, 1, PREFETCH_MAX_URLS))
+		return (1);
+
+	if (check_int_minimum ("PrefetchBudget", PrefetchBudget, 1))
+		return (1);
+
+	if (check_int_minimum ("PrefetchTTL", PrefetchTTL, 1))
+		return (1);
+
+	if (Prefetch && ((CoalesceRequests == 0) || (! ConventionalProxy))) {
+		error_log_puts (LOGMT_FATALERROR, LOGSS_CONFIG,
+			"Prefetch requires CoalesceRequests and ConventionalProxy.");
+		return (1);
+	}
+
+	if (check_int_ranges ("MuxLinkListenPort", MuxLinkListenPort, 0, 65535))
+		return (1);
+
+	if (check_int_ranges ("MuxLinkConnections", MuxLinkConnections, 0, 16))
+		return (1);
+
+	if (check_int_ranges ("MuxLinkNextPort", MuxLinkNextPort, 0, 65535))
+		return (1);
+
+	if (check_int_ranges ("MuxLinkWindow", MuxLinkWindow, 65536, 16777216))
+		return (1);
+
+	if (MuxLinkConnections > 0) {
+		if ((NextProxy == NULL) || (MuxLinkNextPort == 0)) {
+			error_log_puts (LOGMT_FATALERROR, LOGSS_CONFIG,
+				"MuxLinkConnections requires both NextProxy and MuxLinkNextPort to be defined.");
+			return (1);
+		}
+		if (MuxLinkListenPort != 0) {
+			error_log_puts (LOGMT_FATALERROR, LOGSS_CONFIG,
+				"MuxLinkConnections and MuxLinkListenPort cannot be used at the same time.");
+			return (1);
+		}
+	}
+
+	if (check_int_ranges ("DeltaCacheVersions", DeltaCacheVersions, 1, 64))
+		return (1);
+
+	if (check_int_ranges ("DeltaMinSaving", DeltaMinSaving, 0, 100))
+		return (1);
+
+	if (DeltaEncodeHTML || AnnounceDeltaCapability) {
+		if (DeltaEncodeHTML && AnnounceDeltaCapability) {
+			error_log_puts (LOGMT_FATALERROR, LOGSS_CONFIG,
+				"DeltaEncodeHTML and AnnounceDeltaCapability cannot be enabled at the same time.");
+			return (1);
+		}
+		if (DeltaCacheDir == NULL) {
+			error_log_puts (LOGMT_FATALERROR, LOGSS_CONFIG,
+				"DeltaCacheDir must be defined when using delta encoding.");
+			return (1);
+		}
+		if (check_directory ("DeltaCacheDir", DeltaCacheDir))
+			return (1);
+	}
+
+	if (check_int_ranges ("GzipLevel", GzipLevel, 1, 9))
+		return (1);
+
+	if (check_int_minimum ("GzipAdaptiveLoadHigh", GzipAdaptiveLoadHigh, 1))
+		return (1);
+
+	if (check_int_ranges ("GzipParallelThreads", GzipParallelThreads, 0, 64))
+		return (1);
+
+	if (check_int_minimum ("GzipParallelMinSize", GzipParallelMinSize, 0))
+		return (1);
+
+	if (check_int_ranges ("GzipReoptimizeMinSaving", GzipReoptimizeMinSaving, 0, 100))
+		return (1);
+
+#ifdef BROTLI
+	if (check_int_ranges ("BrotliQualityStream", BrotliQualityStream, 0, 11))
+		return (1);
+
+	if (check_int_ranges ("BrotliQualityMemory", BrotliQualityMemory, 0, 11))
+		return (1);
+#endif
+
+#ifdef ZSTD
+	if (check_int_ranges ("ZstdLevelStream", ZstdLevelStream, 1, 19))
+		return (1);
+
+	if (check_int_ranges ("ZstdLevelMemory", ZstdLevelMemory, 1, 19))
+		return (1);
+
+	if (check_int_minimum ("ZstdStreamFlushInterval", ZstdStreamFlushInterval, 0))
+		return (1);
+
+	if (check_int_ranges ("SharedDictSize", SharedDictSize, 1024, 1048576))
+		return (1);
+
+	if (check_int_ranges ("SharedDictTrainSamples", SharedDictTrainSamples, 10, 100000))
+		return (1);
+
+	if (check_int_minimum ("SharedDictTrainInterval", SharedDictTrainInterval, 0))
+		return (1);
+
+	if (SharedDictCompress || AnnounceSharedDictCapability) {
+		if (SharedDictCompress && AnnounceSharedDictCapability) {
+			error_log_puts (LOGMT_FATALERROR, LOGSS_CONFIG,
+				"SharedDictCompress and AnnounceSharedDictCapability cannot be enabled at the same time.");
+			return (1);
+		}
+		if (SharedDictDir == NULL) {
+			error_log_puts (LOGMT_FATALERROR, LOGSS_CONFIG,
+				"SharedDictDir must be defined when using shared dictionaries.");
+			return (1);
+		}
+		if (check_directory ("SharedDictDir", SharedDictDir))
+			return (1);
+	}
+#endif
+
 	if (check_int_ranges ("AlphaRemovalMinAvgOpacity", AlphaRemovalMinAvgOpacity, 0, 1000000))
 		return (1);
 
@@ -648,6 +1055,14 @@ int ReadCfgFile(char * cfg_file)
 		}
 	}
 
+	if (tmpLazyLoadExList != NULL) {
+		if ((LazyLoadExList = slist_create (tmpLazyLoadExList)) == NULL) {
+			error_log_puts (LOGMT_FATALERROR, LOGSS_CONFIG,
+				"Problem while processing LazyLoadExList.");
+			return (1);
+		}
+	}
+
 	if (tmpBindOutgoingExAddr != NULL) {
 		BindOutgoingExAddr = calloc (1, sizeof (in_addr_t));
 		*BindOutgoingExAddr = inet_addr (tmpBindOutgoingExAddr);
@@ -68,6 +68,20 @@
 #define MAX_RESTRICTOUTPORTCONNECT_LEN 16
 
 extern int Port, NextPort, ConnTimeout, MaxSize, PreemptNameResMax, MaxUncompressedGzipRatio, MinUncompressedGzipStreamEval, MaxUncompressedImageRatio;
+extern int PreemptNameResThreads, PreemptNameResEntries, PreemptNameResTTL;
+extern int MinifiedTextThreshold;
+extern t_qp_bool InlineImages;
+extern int InlineImagesMax, InlineImagesMaxSize, InlineImagesPageBudget;
+extern t_qp_bool InlineCSS;
+extern int InlineCSSMaxSize, InlineCSSPageBudget, InlineCSSCacheTTL;
+extern char *InlineCSSCacheDir;
+extern t_qp_bool ImageResize;
+extern float ImageResizeDPR;
+extern int ImageResizeEntries, ImageResizeTTL;
+extern t_qp_bool LazyLoad;
+extern int LazyLoadEager;
+extern char *tmpLazyLoadExList;
+extern t_st_strtable *LazyLoadExList;
 
 extern int ImageQuality[4];
 extern int AlphaRemovalMinAvgOpacity;
@@ -77,7 +91,7 @@ extern int RestrictOutPortCONNECT [MAX_RESTRICTOUTPORTCONNECT_LEN];
 extern int RestrictOutPortHTTP_len;
 extern int RestrictOutPortCONNECT_len;
 
-extern t_qp_bool DoGzip, UseContentLength, AllowLookCh, ProcessJPG, ProcessPNG, ProcessGIF, PreemptNameRes, PreemptNameResBC, TransparentProxy, ConventionalProxy, ProcessHTML, ProcessCSS, ProcessJS, ProcessHTML_CSS, ProcessHTML_JS, ProcessHTML_tags, ProcessHTML_text, ProcessHTML_PRE, ProcessHTML_NoComments, ProcessHTML_TEXTAREA, AllowMethodCONNECT, OverrideAcceptEncoding, DecompressIncomingGzipData, WA_MSIE_FriendlyErrMsgs, InterceptCrashes, TOSMarking, TOSMarkAsDiffCTAlsoXST, URLReplaceDataCTListAlsoXST, LosslessCompressCTAlsoXST, ConvertToGrayscale;
+extern t_qp_bool DoGzip, UseContentLength, AllowLookCh, ProcessJPG, ProcessPNG, ProcessGIF, PreemptNameRes, PreemptNameResBC, TransparentProxy, ConventionalProxy, ProcessHTML, ProcessCSS, ProcessJS, ProcessHTML_CSS, ProcessHTML_JS, ProcessHTML_tags, ProcessHTML_text, ProcessHTML_PRE, ProcessHTML_NoComments, ProcessHTML_TEXTAREA, ProcessHTML_OptionalTags, ProcessHTML_UnquoteAttrs, ProcessHTML_BooleanAttrs, ProcessHTML_DefaultTypes, ProcessHTML_BlockSpaces, ProcessTextStreaming, AllowMethodCONNECT, OverrideAcceptEncoding, DecompressIncomingGzipData, WA_MSIE_FriendlyErrMsgs, InterceptCrashes, TOSMarking, TOSMarkAsDiffCTAlsoXST, URLReplaceDataCTListAlsoXST, LosslessCompressCTAlsoXST, ConvertToGrayscale;
 
 extern char *ServHost, *ServUrl, *OnlyFrom, *NextProxy;
 extern char *LosslessCompressCT;
@@ -103,6 +117,31 @@ extern int TOSFlagsDiff;
 extern char *TOSMarkAsDiffURL;
 extern int TOSMarkAsDiffSizeBT;
 extern int MaxActiveUserConnections;
+extern int NegativeCacheEntries;
+extern int NegativeCacheTTL;
+extern int NegativeCacheLearnSamples;
+extern int NegativeCacheLearnRatio;
+extern int CoalesceRequests;
+extern int CoalesceTimeout;
+extern char *CoalesceTempDir;
+extern t_qp_bool Prefetch;
+extern int PrefetchMax, PrefetchParallel, PrefetchBudget, PrefetchTTL;
+extern int MuxLinkListenPort;
+extern int MuxLinkConnections;
+extern int MuxLinkNextPort;
+extern int MuxLinkWindow;
+extern t_qp_bool DeltaEncodeHTML;
+extern t_qp_bool AnnounceDeltaCapability;
+extern char *DeltaCacheDir;
+extern int DeltaCacheVersions;
+extern int DeltaMinSaving;
+extern int GzipLevel;
+extern t_qp_bool GzipAdaptiveLevel;
+extern int GzipAdaptiveLoadHigh;
+extern int GzipParallelThreads;
+extern int GzipParallelMinSize;
+extern t_qp_bool GzipReoptimize;
+extern int GzipReoptimizeMinSaving;
 extern char *PIDFile;
 extern char *cli_PIDFile;
 
@@ -128,6 +167,19 @@ extern char *AuthPasswdFile;
 extern char *AuthSASLConfPath;
 #endif
 
+#ifdef BROTLI
+extern t_qp_bool DoBrotli, DecompressIncomingBrotliData;
+extern int BrotliQualityStream, BrotliQualityMemory;
+#endif
+
+#ifdef ZSTD
+extern t_qp_bool DoZstd;
+extern int ZstdLevelStream, ZstdLevelMemory, ZstdStreamFlushInterval;
+extern t_qp_bool SharedDictCompress, AnnounceSharedDictCapability;
+extern char *SharedDictDir;
+extern int SharedDictSize, SharedDictTrainSamples, SharedDictTrainInterval;
+#endif
+
 #ifdef JP2K
 extern int JP2ImageQuality[4];
 extern t_qp_bool ProcessJP2, ForceOutputNoJP2, ProcessToJP2, AnnounceJP2Capability, JP2OutRequiresExpCap;
@@ -0,0 +1,531 @@
+/* coalesce.c
+ * Request coalescing (collapsed forwarding) of concurrent identical requests.
+ *
+ * Ziproxy - the HTTP acceleration proxy
+ * This code is under the following conditions:
+ *
+ * ---------------------------------------------------------------------
+ * Copyright (c)2005-2014 Daniel Mealha Cabrita
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111 USA
+ * ---------------------------------------------------------------------
+ */
+
+/*
+ * The first request for a given URL (and client capabilities) becomes
+ * the leader: it fetches and processes the data as usual, while also
+ * spooling the response sent to its client to a temporary file.
+ * Identical requests arriving meanwhile (followers) do not contact the
+ * remote server, they wait for the leader and send the spooled response
+ * instead.
+ *
+ * If the leader gives up (response not shareable, data streamed instead of
+ * processed, process died etc), or takes longer than the timeout, followers
+ * fall back to fetching the data themselves.
+ *
+ * Only the response which is loaded into memory and processed is shared,
+ * since that's where the costly part (image recompression etc) is.
+ *
+ * A leader may also keep its result for a while after it's done (see
+ * coalesce_keep_result()), for the identical requests expected to come
+ * later (see prefetch.c). Those are served just like the followers.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "globaldefs.h"
+#include "coalesce.h"
+#include "http.h"
+#include "cfgfile.h"
+#include "log.h"
+#include "misc.h"
+#include "session.h"
+#include "delta.h"
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+#define COALESCE_POLL_USEC 20000	/* interval for followers to check the leader's progress */
+#define COALESCE_SPOOL_NAME_LEN 1024
+#define COALESCE_BUFSIZE 16384
+
+#define t_coalesce_state enum enum_coalesce_state
+enum enum_coalesce_state {CO_FREE = 0, CO_LEADING, CO_DONE, CO_FAILED};
+
+typedef struct {
+	unsigned long long int key;
+	t_coalesce_state state;
+	pid_t leader_pid;
+	unsigned int generation;	/* makes the spool filename unique */
+	int waiting;			/* followers still waiting for the result */
+	ZP_DATASIZE_TYPE inlen;		/* for followers' access log */
+	ZP_DATASIZE_TYPE outlen;
+	time_t kept_until;		/* CO_DONE kept after the followers are gone, until then */
+} t_coalesce_entry;
+
+typedef struct {
+	pthread_mutex_t lock;
+	unsigned long int served;
+	unsigned long int fallbacks;
+} t_coalesce_shared;
+
+/* shared among all processes */
+static t_coalesce_shared *coalesce = NULL;
+static t_coalesce_entry *coalesce_entry;
+
+static int coalesce_entries;
+static int coalesce_timeout;
+static const char *coalesce_tmpdir;
+static pid_t coalesce_daemon_pid;
+
+/* set if this process is the leader */
+static t_coalesce_entry *lead_entry = NULL;
+static unsigned int lead_generation;
+static FILE *lead_spool = NULL;
+static char lead_spool_name [COALESCE_SPOOL_NAME_LEN];
+static int lead_keep_ttl = 0;
+
+static void coalesce_spool_name (char *out_name, const t_coalesce_entry *entry, const unsigned int generation)
+{
+	snprintf (out_name, COALESCE_SPOOL_NAME_LEN, "%s/ziproxy_coalesce.%d.%d.%u", coalesce_tmpdir, (int) coalesce_daemon_pid, (int) (entry - coalesce_entry), generation);
+}
+
+/* returns: != 0 if the process which was the leader is not there anymore */
+static int coalesce_leader_is_gone (const t_coalesce_entry *entry)
+{
+	return ((kill (entry->leader_pid, 0) != 0) && (errno == ESRCH));
+}
+
+/* must be invoked with the lock held */
+static void coalesce_release_entry (t_coalesce_entry *entry)
+{
+	char spool_name [COALESCE_SPOOL_NAME_LEN];
+
+	/* the spool may be left behind by a leader which died */
+	coalesce_spool_name (spool_name, entry, entry->generation);
+	unlink (spool_name);
+
+	entry->state = CO_FREE;
+	entry->key = 0;
+	entry->kept_until = 0;
+}
+
+/* must be invoked by the daemon before forking, in order to share the table.
+ * if not invoked, request coalescing remains disabled.
+ * in_entries: max different requests being coalesced at once (0: disabled)
+ * in_timeout: max seconds a follower waits for the leader
+ * in_tmpdir: where to store the spooled responses
+ * returns: 0 - ok, != 0 - unable to allocate shared memory (remains disabled) */
+int coalesce_init (const int in_entries, const int in_timeout, const char *in_tmpdir)
+{
+	pthread_mutexattr_t lock_attr;
+	size_t shared_size;
+	void *shared;
+
+	if (in_entries <= 0)
+		return (0);
+
+	shared_size = sizeof (t_coalesce_shared) + (sizeof (t_coalesce_entry) * in_entries);
+	if ((shared = mmap (NULL, shared_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+		return (1);
+
+	/* anonymous mappings are zero-filled, all entries start as CO_FREE */
+	pthread_mutexattr_init (&lock_attr);
+	if (pthread_mutexattr_setpshared (&lock_attr, PTHREAD_PROCESS_SHARED) != 0) {
+		munmap (shared, shared_size);
+		return (2);
+	}
+	pthread_mutex_init (&(((t_coalesce_shared *) shared)->lock), &lock_attr);
+	pthread_mutexattr_destroy (&lock_attr);
+
+	coalesce = (t_coalesce_shared *) shared;
+	coalesce_entry = (t_coalesce_entry *) (coalesce + 1);
+
+	coalesce_entries = in_entries;
+	coalesce_timeout = in_timeout;
+	coalesce_tmpdir = in_tmpdir;
+	coalesce_daemon_pid = getpid ();
+
+	return (0);
+}
+
+/* sends the spooled response to the client
+ * returns: 0 - ok, != 0 - unable to read the spool */
+static int coalesce_follower_send (const int spool_fd, const ZP_DATASIZE_TYPE in_inlen, const ZP_DATASIZE_TYPE in_outlen)
+{
+	char buf [COALESCE_BUFSIZE];
+	FILE *spool;
+	size_t block_len;
+
+	if ((spool = fdopen (spool_fd, "r")) == NULL) {
+		close (spool_fd);
+		return (1);
+	}
+
+	while ((block_len = fread (buf, 1, COALESCE_BUFSIZE, spool)) > 0) {
+		if (fwrite (buf, 1, block_len, sess_wclient) != block_len)
+			break;
+		if (ConnTimeout)
+			alarm (ConnTimeout);
+	}
+	fflush (sess_wclient);
+	fclose (spool);
+
+	access_log_set_flags (LOG_AC_FLAG_COALESCED);
+	access_log_def_inlen (in_inlen);
+	access_log_def_outlen (in_outlen);
+	access_log_dump_entry ();
+
+	return (0);
+}
+
+/* waits for the leader of the entry, then sends its result to the client
+ * returns: COALESCE_SERVED or COALESCE_INDEPENDENT (result unavailable, fetch it normally) */
+static int coalesce_follow (t_coalesce_entry *entry, const unsigned long long int key, const unsigned int generation)
+{
+	char spool_name [COALESCE_SPOOL_NAME_LEN];
+	time_t deadline;
+	ZP_DATASIZE_TYPE inlen, outlen;
+	int spool_fd = -1;
+	int result_ready = 0;
+
+	deadline = time (NULL) + coalesce_timeout;
+	coalesce_spool_name (spool_name, entry, generation);
+
+	while (1) {
+		pthread_mutex_lock (&(coalesce->lock));
+
+		/* entries are not reused while followers are waiting, but let's be paranoid */
+		if ((entry->key != key) || (entry->generation != generation)) {
+			pthread_mutex_unlock (&(coalesce->lock));
+			break;
+		}
+
+		if (entry->state == CO_DONE) {
+			/* open it now, it may be unlinked as soon as we release the entry */
+			if ((spool_fd = open (spool_name, O_RDONLY)) >= 0)
+				result_ready = 1;
+			inlen = entry->inlen;
+			outlen = entry->outlen;
+		}
+
+		if ((result_ready) || (entry->state != CO_LEADING) || (coalesce_leader_is_gone (entry)) || (time (NULL) >= deadline)) {
+			if (! result_ready)
+				coalesce->fallbacks++;
+			else
+				coalesce->served++;
+
+			/* last one to leave cleans up (unless the leader is still working on it) */
+			entry->waiting--;
+			if ((entry->waiting == 0) && ((entry->state != CO_LEADING) || (coalesce_leader_is_gone (entry))) && (entry->kept_until <= time (NULL)))
+				coalesce_release_entry (entry);
+			pthread_mutex_unlock (&(coalesce->lock));
+			break;
+		}
+
+		pthread_mutex_unlock (&(coalesce->lock));
+
+		if (ConnTimeout)
+			alarm (ConnTimeout);
+		usleep (COALESCE_POLL_USEC);
+	}
+
+	debug_log_printf ("Coalesce: Served so far: %lu, fallbacks so far: %lu (including this one).\n", coalesce->served, coalesce->fallbacks);
+
+	if (! result_ready) {
+		debug_log_puts ("Coalesce: Result of identical request unavailable. Fetching it independently.");
+		return (COALESCE_INDEPENDENT);
+	}
+
+	/* the spool may be unlinked by now, but it's still open */
+	debug_log_puts ("Coalesce: Sending result of identical request.");
+	if (coalesce_follower_send (spool_fd, inlen, outlen) != 0) {
+		debug_log_puts ("Coalesce: Unable to read result of identical request. Fetching it independently.");
+		return (COALESCE_INDEPENDENT);
+	}
+
+	return (COALESCE_SERVED);
+}
+
+/* returns !=0 if the response to this request does not depend on who's asking.
+ * also used by other modules, to know whether data may be shared with other clients */
+int coalesce_request_is_shareable (const http_headers *chdr)
+{
+	if ((strcasecmp (chdr->method, "GET") != 0) || (chdr->content_length > 0) || (chdr->url == NULL))
+		return (0);
+	if ((find_header ("Range:", chdr) != NULL) || (find_header ("If-Range:", chdr) != NULL) \
+		|| (find_header ("Authorization:", chdr) != NULL) || (find_header ("Cookie:", chdr) != NULL))
+		return (0);
+	return (1);
+}
+
+/* returns !=0 if the response (headers) may be shared with other clients */
+int coalesce_response_is_shareable (const http_headers *shdr)
+{
+	const char *header_data;
+
+	if (shdr->status != 200)
+		return (0);
+
+	if (find_header ("Set-Cookie:", shdr) != NULL)
+		return (0);
+
+	if ((header_data = find_header ("Cache-Control:", shdr)) != NULL) {
+		char *cache_control;
+		int not_shareable;
+
+		cache_control = strdup (header_data);
+		misc_convert_str_tolower (cache_control, cache_control);
+		not_shareable = (strstr (cache_control, "private") != NULL) || (strstr (cache_control, "no-store") != NULL);
+		free (cache_control);
+
+		if (not_shareable)
+			return (0);
+	}
+
+	/* we only account for client's gzip support */
+	if ((header_data = find_header ("Vary:", shdr)) != NULL) {
+		while ((*header_data == ' ') || (*header_data == '\t'))
+			header_data++;
+		if (strncasecmp (header_data, "Accept-Encoding", 15) != 0)
+			return (0);
+	}
+
+	return (1);
+}
+
+/* invoked when the client request is known, before contacting the remote server.
+ * if an identical request is in progress, waits for it and sends its result
+ * to the client instead.
+ * returns: COALESCE_INDEPENDENT, COALESCE_LEADER or COALESCE_SERVED */
+int coalesce_begin (const http_headers *chdr)
+{
+	char variant [64];
+	t_coalesce_entry *entry;
+	t_coalesce_entry *free_entry = NULL;
+	unsigned long long int key;
+	unsigned int generation;
+	time_t now;
+	int i;
+
+	if (coalesce == NULL)
+		return (COALESCE_INDEPENDENT);
+
+	if (! coalesce_request_is_shareable (chdr))
+		return (COALESCE_INDEPENDENT);
+	/* paired Ziproxy expecting differences from the version it holds */
+	if (find_header (DELTA_BASE_HEADER ":", chdr) != NULL)
+		return (COALESCE_INDEPENDENT);
+
+	/* the result also depends on the client capabilities */
+	snprintf (variant, sizeof (variant), "%d %d %d %d", (chdr->flags & H_WILLGZIP) != 0, (chdr->flags & H_WILLBROTLI) != 0, (chdr->flags & H_WILLZSTD) != 0, chdr->client_explicity_accepts_jp2);
+	key = misc_hash_str (misc_hash_str (misc_hash_str (MISC_HASH_INIT, chdr->url), "\n"), variant);
+	if (chdr->x_ziproxy_flags != NULL)
+		key = misc_hash_str (misc_hash_str (key, "\n"), chdr->x_ziproxy_flags);	/* paired Ziproxy, may be shared-dictionary encoded */
+	if (key == 0)
+		key = 1;
+
+	now = time (NULL);
+	pthread_mutex_lock (&(coalesce->lock));
+
+	for (i = 0; i < coalesce_entries; i++) {
+		entry = &coalesce_entry [i];
+
+		/* leaders which died without telling, and not being waited by anyone */
+		if ((entry->state == CO_LEADING) && (entry->waiting == 0) && (coalesce_leader_is_gone (entry)))
+			coalesce_release_entry (entry);
+
+		/* kept results which expired */
+		if ((entry->state == CO_DONE) && (entry->waiting == 0) && (entry->kept_until <= now))
+			coalesce_release_entry (entry);
+
+		if ((entry->state == CO_FREE) && (free_entry == NULL))
+			free_entry = entry;
+
+		if ((entry->key == key) && ((entry->state == CO_LEADING) || (entry->state == CO_DONE))) {
+			entry->waiting++;
+			generation = entry->generation;
+			pthread_mutex_unlock (&(coalesce->lock));
+
+			debug_log_puts ("Coalesce: Identical request in progress. Waiting for its result.");
+			return (coalesce_follow (entry, key, generation));
+		}
+	}
+
+	/* nobody's doing it, we're the leader (if there's room) */
+	if (free_entry != NULL) {
+		free_entry->key = key;
+		free_entry->state = CO_LEADING;
+		free_entry->leader_pid = getpid ();
+		free_entry->waiting = 0;
+		free_entry->generation++;
+		lead_entry = free_entry;
+		lead_generation = free_entry->generation;
+	}
+
+	pthread_mutex_unlock (&(coalesce->lock));
+
+	if (lead_entry == NULL)
+		return (COALESCE_INDEPENDENT);
+
+	/* whatever happens (errors, timeout etc), followers must not wait forever */
+	atexit (coalesce_leader_abort);
+
+	return (COALESCE_LEADER);
+}
+
+/* invoked by the leader once the response headers are known.
+ * gives up leadership if the response is not meant to be shared. */
+void coalesce_leader_check_response (const http_headers *shdr)
+{
+	const char *header_data;
+
+	if (lead_entry == NULL)
+		return;
+
+	if (! coalesce_response_is_shareable (shdr)) {
+		coalesce_leader_abort ();
+		return;
+	}
+
+	if ((header_data = find_header ("Cache-Control:", shdr)) != NULL) {
+		char *cache_control;
+
+		cache_control = strdup (header_data);
+		misc_convert_str_tolower (cache_control, cache_control);
+
+		/* to be revalidated every time, thus not to be kept for later */
+		if ((strstr (cache_control, "no-cache") != NULL) || (strstr (cache_control, "max-age=0") != NULL))
+			lead_keep_ttl = 0;
+		free (cache_control);
+	}
+}
+
+/* invoked by the leader just before sending the response to the client.
+ * returns: the stream where the response should be written into instead
+ *          (to be sent with coalesce_leader_publish() afterwards),
+ *          or NULL if the response won't be shared */
+FILE *coalesce_leader_spool (void)
+{
+	int spool_fd;
+
+	if (lead_entry == NULL)
+		return (NULL);
+
+	coalesce_spool_name (lead_spool_name, lead_entry, lead_generation);
+	if ((spool_fd = open (lead_spool_name, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR)) < 0) {
+		debug_log_printf ("Coalesce: Unable to create spool file: %s\n", lead_spool_name);
+		coalesce_leader_abort ();
+		return (NULL);
+	}
+	if ((lead_spool = fdopen (spool_fd, "w+")) == NULL) {
+		close (spool_fd);
+		unlink (lead_spool_name);
+		coalesce_leader_abort ();
+		return (NULL);
+	}
+
+	return (lead_spool);
+}
+
+/* invoked by the leader once the response is wholly written into the spool.
+ * makes it available to the followers and sends it to the client. */
+void coalesce_leader_publish (FILE *spool, FILE *to, const ZP_DATASIZE_TYPE in_inlen, const ZP_DATASIZE_TYPE in_outlen)
+{
+	char buf [COALESCE_BUFSIZE];
+	size_t block_len;
+
+	fflush (spool);
+	if (ferror (spool)) {
+		debug_log_puts ("Coalesce: Error while writing spool file.");
+		/* we still have to send something to our client, fallback to that spool anyway */
+	} else {
+		pthread_mutex_lock (&(coalesce->lock));
+		if ((lead_entry->key != 0) && (lead_entry->generation == lead_generation) && (lead_entry->state == CO_LEADING)) {
+			lead_entry->inlen = in_inlen;
+			lead_entry->outlen = in_outlen;
+			if ((lead_entry->waiting > 0) || (lead_keep_ttl > 0)) {
+				if (lead_entry->waiting > 0)
+					debug_log_printf ("Coalesce: Sharing result with %d identical request(s).\n", lead_entry->waiting);
+				lead_entry->state = CO_DONE;
+				if (lead_keep_ttl > 0) {
+					debug_log_printf ("Coalesce: Result kept for %d seconds.\n", lead_keep_ttl);
+					lead_entry->kept_until = time (NULL) + lead_keep_ttl;
+				}
+				lead_spool_name [0] = '\0';	/* unlinked by the last follower, or once expired */
+			} else {
+				coalesce_release_entry (lead_entry);
+			}
+		}
+		pthread_mutex_unlock (&(coalesce->lock));
+		lead_entry = NULL;
+	}
+
+	rewind (spool);
+	while ((block_len = fread (buf, 1, COALESCE_BUFSIZE, spool)) > 0) {
+		if (fwrite (buf, 1, block_len, to) != block_len)
+			break;
+		if (ConnTimeout)
+			alarm (ConnTimeout);
+	}
+	fflush (to);
+
+	coalesce_leader_abort ();
+}
+
+/* invoked by the leader (if it is) before fetching the data:
+ * the result is to be kept for 'ttl' seconds for identical requests coming
+ * later, if cacheable (see prefetch.c) */
+void coalesce_keep_result (const int ttl)
+{
+	if (lead_entry != NULL)
+		lead_keep_ttl = ttl;
+}
+
+/* gives up leadership (if leader), followers will fetch the data themselves */
+void coalesce_leader_abort (void)
+{
+	if (lead_entry != NULL) {
+		pthread_mutex_lock (&(coalesce->lock));
+		if ((lead_entry->generation == lead_generation) && (lead_entry->state == CO_LEADING)) {
+			if (lead_entry->waiting > 0)
+				lead_entry->state = CO_FAILED;
+			else
+				coalesce_release_entry (lead_entry);
+		}
+		pthread_mutex_unlock (&(coalesce->lock));
+		lead_entry = NULL;
+	}
+
+	if (lead_spool != NULL) {
+		fclose (lead_spool);
+		lead_spool = NULL;
+		if (lead_spool_name [0] != '\0')
+			unlink (lead_spool_name);
+	}
+}
+
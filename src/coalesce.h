@@ -0,0 +1,51 @@
+/* coalesce.h
+ * Request coalescing (collapsed forwarding) of concurrent identical requests.
+ *
+ * Ziproxy - the HTTP acceleration proxy
+ * This code is under the following conditions:
+ *
+ * ---------------------------------------------------------------------
+ * Copyright (c)2005-2014 Daniel Mealha Cabrita
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111 USA
+ * ---------------------------------------------------------------------
+ */
+
+// To stop multiple inclusions.
+#ifndef SRC_COALESCE_H
+#define SRC_COALESCE_H
+
+#include <stdio.h>
+
+#include "globaldefs.h"
+#include "http.h"
+
+/* coalesce_begin() return codes */
+#define COALESCE_INDEPENDENT	0	/* fetch and process it normally */
+#define COALESCE_LEADER		1	/* fetch and process it normally, the result may be shared */
+#define COALESCE_SERVED		2	/* the result of an identical request was sent to the client */
+
+extern int coalesce_init (const int in_entries, const int in_timeout, const char *in_tmpdir);
+extern int coalesce_request_is_shareable (const http_headers *chdr);
+extern int coalesce_response_is_shareable (const http_headers *shdr);
+extern int coalesce_begin (const http_headers *chdr);
+extern void coalesce_keep_result (const int ttl);
+extern void coalesce_leader_check_response (const http_headers *shdr);
+extern FILE *coalesce_leader_spool (void);
+extern void coalesce_leader_publish (FILE *spool, FILE *to, const ZP_DATASIZE_TYPE in_inlen, const ZP_DATASIZE_TYPE in_outlen);
+extern void coalesce_leader_abort (void);
+
+#endif //SRC_COALESCE_H
+
@@ -0,0 +1,991 @@
+/* cssinline.c
+ * Flattening of CSS @import chains and inlining of small external stylesheets.
+ *
+ * Ziproxy - the HTTP acceleration proxy
+ * This code is under the following conditions:
+ *
+ * ---------------------------------------------------------------------
+ * Copyright (c)2005-2014 Daniel Mealha Cabrita
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111 USA
+ * ---------------------------------------------------------------------
+ */
+
+/*
+ * Stylesheets block rendering, and @import chains make it worse: each
+ * level is only discovered once the previous one arrives. When InlineCSS
+ * is enabled:
+ *
+ * - in HTML pages optimized in memory, <link rel="stylesheet" href="...">
+ *   elements are replaced by <style> elements with the (minified) sheet,
+ *   and @import rules in <style> elements by the imported sheets.
+ * - in stylesheets optimized in memory, @import rules are replaced by the
+ *   imported sheets.
+ *
+ * Imported sheets are wrapped in "@media <query>{...}" if the @import has
+ * a media query, and their url(...) references are rewritten so they
+ * still point to the same resources from their new location.
+ * Only sheets from the page's own site are fetched (see subres.c), up to
+ * CSSINLINE_MAX_SHEETS per page and CSSINLINE_MAX_DEPTH levels of @import,
+ * each one up to InlineCSSMaxSize bytes. Fetched sheets may be kept in
+ * InlineCSSCacheDir for InlineCSSCacheTTL seconds.
+ *
+ * A <link> or a set of @import rules is replaced only if everything it
+ * (indirectly) imports could be fetched and flattened, and as long as the
+ * page does not grow by more than InlineCSSPageBudget. Sheets which cannot
+ * be moved safely are left alone: non-ASCII (the charset could change),
+ * @namespace, image-set(), escapes in URLs, @import with layer() or
+ * supports(), or "</style" (when inlined into HTML).
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <ctype.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "cssinline.h"
+#include "subres.h"
+#include "htmlopt.h"
+#include "cfgfile.h"
+#include "log.h"
+#include "misc.h"
+#include "globaldefs.h"
+
+#define CSSINLINE_MAX_SHEETS	16	/* distinct sheets fetched per page */
+#define CSSINLINE_MAX_DEPTH	4	/* levels of @import (a <link> counts as one) */
+#define CSSINLINE_MAX_IMPORTS	64
+#define CSSINLINE_MAX_ROOTS	32	/* <link> and <style> elements considered per page */
+#define CSSINLINE_PATH_LEN	1024
+#define CSSINLINE_ACCEPT	"text/css,*/*;q=0.1"
+
+/* sheet states */
+#define CSSINLINE_NEW		0	/* not fetched yet */
+#define CSSINLINE_PARSED	1
+#define CSSINLINE_FAILED	2
+#define CSSINLINE_BUSY		3	/* being flattened (found again: @import loop) */
+#define CSSINLINE_DONE		4	/* flattened */
+
+/* elements whose contents are not markup */
+static const char *cssinline_raw_elements [] = { "script", "textarea", "title", "xmp", "noscript", NULL };
+
+typedef struct {
+	char *data;
+	int len;
+	int size;
+} cssinline_buf;
+
+typedef struct {
+	int sheet;			/* index in sheets[] */
+	const char *media;		/* media query (within the importing text), or NULL */
+	int media_len;
+} cssinline_import;
+
+typedef struct {
+	t_subres fetch;
+	int from_cache;
+	int depth;
+	int state;
+	int first_import, imports_len;	/* in imports[] */
+	char *body;			/* what follows the @import rules: minified, URLs rewritten */
+	int body_len;
+	char *flat;			/* imported sheets followed by body */
+	int flat_len;
+} cssinline_sheet;
+
+typedef struct {
+	int start, end;			/* the part of the text to be replaced */
+	int is_link;			/* <link> (replaced by <style>), otherwise @import rules */
+	const char *media;		/* <link media="..."> (as is), or NULL */
+	int media_len;
+	int first_import, imports_len;	/* in imports[] */
+	char *replacement;		/* or NULL if not replaced */
+	int replacement_len;
+} cssinline_root;
+
+typedef struct {
+	const char *src;
+	int len;
+	int is_html;
+	char base [SUBRES_URL_LEN];
+	int has_base_element;
+	const http_headers *chdr;
+	cssinline_sheet sheets [CSSINLINE_MAX_SHEETS];
+	int sheets_len;
+	cssinline_import imports [CSSINLINE_MAX_IMPORTS];
+	int imports_len;
+	cssinline_root roots [CSSINLINE_MAX_ROOTS];
+	int roots_len;
+} cssinline_ctx;
+
+static void cssinline_buf_init (cssinline_buf *buf, int size)
+{
+	buf->data = malloc (size);
+	buf->len = 0;
+	buf->size = size;
+}
+
+static void cssinline_buf_append (cssinline_buf *buf, const char *data, int len)
+{
+	char *new_data;
+	int new_size;
+
+	if (buf->data == NULL)
+		return;	/* out of memory earlier */
+
+	if (buf->len + len > buf->size) {
+		new_size = buf->size * 2;
+		while (new_size < buf->len + len)
+			new_size *= 2;
+		if ((new_data = realloc (buf->data, new_size)) == NULL) {
+			free (buf->data);
+			buf->data = NULL;
+			return;
+		}
+		buf->data = new_data;
+		buf->size = new_size;
+	}
+	memcpy (buf->data + buf->len, data, len);
+	buf->len += len;
+}
+
+static void cssinline_buf_puts (cssinline_buf *buf, const char *str)
+{
+	cssinline_buf_append (buf, str, strlen (str));
+}
+
+/* ### CACHE ### */
+
+/* entries are InlineCSSCacheDir/<URL hash>, containing the URL, '\n' and the sheet */
+static void cssinline_cache_path (char *path, const char *url)
+{
+	snprintf (path, CSSINLINE_PATH_LEN, "%s/%016llx", InlineCSSCacheDir, misc_hash_str (MISC_HASH_INIT, url));
+}
+
+/* returns: ==0 sheet loaded from the cache into fetch->data, !=0 not cached (or expired) */
+static int cssinline_cache_load (t_subres *fetch)
+{
+	char path [CSSINLINE_PATH_LEN];
+	struct stat st;
+	FILE *file;
+	char *data;
+	int url_len = strlen (fetch->url);
+	int file_len;
+
+	if (InlineCSSCacheDir == NULL)
+		return (1);
+	cssinline_cache_path (path, fetch->url);
+	if ((stat (path, &st) != 0) || (st.st_mtime + InlineCSSCacheTTL < time (NULL)) || \
+		(st.st_size <= url_len + 1) || (st.st_size > url_len + 1 + fetch->max_size))
+		return (1);
+	if ((file = fopen (path, "rb")) == NULL)
+		return (1);
+	if ((data = malloc (st.st_size + 1)) == NULL) {
+		fclose (file);
+		return (1);
+	}
+	file_len = fread (data, 1, st.st_size, file);
+	fclose (file);
+
+	/* incomplete, or another URL with the same hash */
+	if ((file_len != st.st_size) || (memcmp (data, fetch->url, url_len) != 0) || (data [url_len] != '\n')) {
+		free (data);
+		return (1);
+	}
+	fetch->data_len = file_len - (url_len + 1);
+	memmove (data, data + url_len + 1, fetch->data_len);
+	fetch->data = data;
+	strcpy (fetch->content_type, "text/css");
+	return (0);
+}
+
+static void cssinline_cache_store (const t_subres *fetch)
+{
+	char path [CSSINLINE_PATH_LEN];
+	char tmp_path [CSSINLINE_PATH_LEN];
+	FILE *file;
+
+	if ((InlineCSSCacheDir == NULL) || fetch->no_store)
+		return;
+	cssinline_cache_path (path, fetch->url);
+	snprintf (tmp_path, sizeof (tmp_path), "%s/.%d.tmp", InlineCSSCacheDir, (int) getpid ());
+	if ((file = fopen (tmp_path, "wb")) == NULL)
+		return;
+	if ((fprintf (file, "%s\n", fetch->url) < 0) | (fwrite (fetch->data, 1, fetch->data_len, file) != fetch->data_len) | (fclose (file) != 0) || (rename (tmp_path, path) != 0))
+		unlink (tmp_path);
+}
+
+/* ### STYLESHEETS ### */
+
+/* skips whitespace, comments and "<!--", "-->" (allowed between rules).
+ * returns: the new position */
+static int cssinline_skip_blank (const char *src, const int len, int pos)
+{
+	while (pos < len) {
+		if (isspace (src [pos])) {
+			pos++;
+		} else if (subres_match (src, len, pos, "/*")) {
+			pos = subres_find (src, len, pos + 2, "*/") + 2;
+		} else if (subres_match (src, len, pos, "<!--")) {
+			pos += 4;
+		} else if (subres_match (src, len, pos, "-->")) {
+			pos += 3;
+		} else {
+			break;
+		}
+	}
+	return ((pos < len) ? pos : len);
+}
+
+/* returns: index in ctx->sheets of the sheet at 'url' (added if new), or <0 if not to be fetched */
+static int cssinline_add_sheet (cssinline_ctx *ctx, const char *url, int depth)
+{
+	cssinline_sheet *sheet;
+	int i;
+
+	for (i = 0; i < ctx->sheets_len; i++) {
+		if (strcmp (ctx->sheets [i].fetch.url, url) == 0)
+			return (i);
+	}
+	if (ctx->sheets_len >= CSSINLINE_MAX_SHEETS)
+		return (-1);
+	sheet = &(ctx->sheets [ctx->sheets_len]);
+	if (subres_prepare (&(sheet->fetch), url, ctx->chdr, CSSINLINE_ACCEPT, InlineCSSMaxSize))
+		return (-1);
+	sheet->depth = depth;
+	sheet->state = CSSINLINE_NEW;
+	return (ctx->sheets_len++);
+}
+
+/* parses the @import rules at the start of the sheet in src[0..len), 'depth' levels deep,
+ * whose URLs are relative to 'base'. Those are appended to ctx->imports.
+ * *head: start of the first @import (or of the rules, if none)
+ * *body: start of the rules following the @import rules
+ * returns: ==0 ok, !=0 the @import rules cannot be flattened (nothing appended then) */
+static int cssinline_parse_imports (cssinline_ctx *ctx, const char *src, const int len, const char *base, const int depth, int *first_import, int *imports_len, int *head, int *body)
+{
+	char value [SUBRES_URL_LEN];
+	char url [SUBRES_URL_LEN];
+	cssinline_import *import;
+	int saved_sheets_len = ctx->sheets_len;
+	int pos = 0, value_start, value_end, media_start, media_end;
+	char quote;
+
+	*first_import = ctx->imports_len;
+	*imports_len = 0;
+	*head = -1;
+
+	while ((pos = cssinline_skip_blank (src, len, pos)) < len) {
+		if (subres_match (src, len, pos, "@charset")) {
+			if ((pos = subres_find (src, len, pos, ";")) >= len)
+				break;
+			pos++;
+			continue;
+		}
+		if (! subres_match (src, len, pos, "@import"))
+			break;
+		if (*head < 0)
+			*head = pos;
+
+		/* url(...) or string */
+		pos = cssinline_skip_blank (src, len, pos + 7);
+		if (subres_match (src, len, pos, "url(")) {
+			pos = cssinline_skip_blank (src, len, pos + 4);
+			if ((pos < len) && ((src [pos] == '"') || (src [pos] == '\''))) {
+				quote = src [pos++];
+				value_start = pos;
+				while ((pos < len) && (src [pos] != quote))
+					pos++;
+				value_end = pos++;
+				pos = cssinline_skip_blank (src, len, pos);
+			} else {
+				value_start = pos;
+				while ((pos < len) && (src [pos] != ')') && (! isspace (src [pos])))
+					pos++;
+				value_end = pos;
+				pos = cssinline_skip_blank (src, len, pos);
+			}
+			if ((pos >= len) || (src [pos] != ')'))
+				goto error;
+			pos++;
+		} else if ((pos < len) && ((src [pos] == '"') || (src [pos] == '\''))) {
+			quote = src [pos++];
+			value_start = pos;
+			while ((pos < len) && (src [pos] != quote))
+				pos++;
+			value_end = pos++;
+		} else {
+			goto error;
+		}
+
+		/* media query, up to ';' */
+		media_start = cssinline_skip_blank (src, len, pos);
+		if ((pos = subres_find (src, len, pos, ";")) >= len)
+			goto error;
+		for (media_end = pos; (media_end > media_start) && isspace (src [media_end - 1]); media_end--);
+		pos++;
+		if ((memchr (src + media_start, '{', media_end - media_start) != NULL) || \
+			subres_match (src, media_end, media_start, "layer") || (subres_find (src, media_end, media_start, "supports(") < media_end))
+			goto error;
+
+		if ((value_end - value_start >= SUBRES_URL_LEN) || (memchr (src + value_start, '\\', value_end - value_start) != NULL))
+			goto error;
+		memcpy (value, src + value_start, value_end - value_start);
+		value [value_end - value_start] = '\0';
+		if ((depth >= CSSINLINE_MAX_DEPTH) || (ctx->imports_len >= CSSINLINE_MAX_IMPORTS) || subres_resolve (base, value, url, sizeof (url)))
+			goto error;
+
+		import = &(ctx->imports [ctx->imports_len]);
+		if ((import->sheet = cssinline_add_sheet (ctx, url, depth + 1)) < 0)
+			goto error;
+		import->media = (media_end > media_start) ? src + media_start : NULL;
+		import->media_len = media_end - media_start;
+		ctx->imports_len++;
+		(*imports_len)++;
+	}
+
+	*body = pos;
+	if (*head < 0)
+		*head = pos;
+	return (0);
+
+error:
+	/* the sheets added here are referenced by nobody else */
+	ctx->sheets_len = saved_sheets_len;
+	ctx->imports_len = *first_import;
+	*imports_len = 0;
+	return (1);
+}
+
+/* returns: length of the scheme and authority ("http://host:port") of 'url' */
+static int cssinline_authority_len (const char *url)
+{
+	return (7 + strcspn (url + 7, "/?#"));
+}
+
+/* appends src[0..len) to 'buf', with the relative url(...) references
+ * (relative to 'sheet_url') rewritten to point to the same resources from ctx->base.
+ * returns: ==0 ok, !=0 some reference could not be rewritten */
+static int cssinline_rewrite_urls (cssinline_ctx *ctx, const char *sheet_url, const char *src, const int len, cssinline_buf *buf)
+{
+	char value [SUBRES_URL_LEN];
+	char url [SUBRES_URL_LEN];
+	int pos = 0, copied = 0;
+	int url_start, value_start, value_end, scheme_len, authority_len;
+	char quote;
+
+	while ((pos = subres_find (src, len, pos, "url(")) < len) {
+		/* not part of some other identifier */
+		if ((pos > 0) && (isalnum (src [pos - 1]) || (src [pos - 1] == '-') || (src [pos - 1] == '_'))) {
+			pos += 4;
+			continue;
+		}
+		url_start = pos;
+		pos = cssinline_skip_blank (src, len, pos + 4);
+		if ((pos < len) && ((src [pos] == '"') || (src [pos] == '\''))) {
+			quote = src [pos++];
+			value_start = pos;
+			while ((pos < len) && (src [pos] != quote))
+				pos++;
+			value_end = pos++;
+		} else {
+			value_start = pos;
+			while ((pos < len) && (src [pos] != ')'))
+				pos++;
+			value_end = pos;
+		}
+		pos = cssinline_skip_blank (src, len, pos);
+		if ((pos >= len) || (src [pos] != ')'))
+			return (1);
+		pos++;
+
+		/* nothing to rewrite in those */
+		if ((value_end == value_start) || subres_match (src, value_end, value_start, "data:") || (src [value_start] == '#'))
+			continue;
+		scheme_len = strspn (src + value_start, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789+-.");
+		if ((scheme_len > 0) && (scheme_len < value_end - value_start) && (src [value_start + scheme_len] == ':'))
+			continue;
+
+		if (value_end - value_start >= SUBRES_URL_LEN)
+			return (1);
+		memcpy (value, src + value_start, value_end - value_start);
+		value [value_end - value_start] = '\0';
+		if ((strpbrk (value, "\\\"'() \t\r\n\f") != NULL) || subres_resolve (sheet_url, value, url, sizeof (url)) || (strpbrk (url, "\\\"'() \t\r\n\f") != NULL))
+			return (1);
+
+		cssinline_buf_append (buf, src + copied, url_start - copied);
+		cssinline_buf_puts (buf, "url(");
+		authority_len = cssinline_authority_len (url);
+		if ((authority_len == cssinline_authority_len (ctx->base)) && (strncasecmp (url, ctx->base, authority_len) == 0) && (url [authority_len] == '/'))
+			cssinline_buf_puts (buf, url + authority_len);
+		else
+			cssinline_buf_puts (buf, url);
+		cssinline_buf_puts (buf, ")");
+		copied = pos;
+	}
+	cssinline_buf_append (buf, src + copied, len - copied);
+	return (0);
+}
+
+/* returns: ==0 if the fetched sheet may be moved elsewhere */
+static int cssinline_check_sheet (cssinline_ctx *ctx, const t_subres *fetch)
+{
+	const char *data = fetch->data;
+	int i;
+
+	if (strcasecmp (fetch->content_type, "text/css") != 0)
+		return (1);
+	for (i = 0; i < fetch->data_len; i++) {
+		if ((data [i] == '\0') || (((unsigned char) data [i]) >= 0x80))
+			return (1);
+	}
+	if ((subres_find (data, fetch->data_len, 0, "@namespace") < fetch->data_len) || (subres_find (data, fetch->data_len, 0, "image-set(") < fetch->data_len))
+		return (1);
+	if (ctx->is_html && (subres_find (data, fetch->data_len, 0, "</style") < fetch->data_len))
+		return (1);
+	return (0);
+}
+
+/* checks, minifies and parses a fetched sheet.
+ * returns: ==0 ok, !=0 not usable */
+static int cssinline_parse_sheet (cssinline_ctx *ctx, cssinline_sheet *sheet)
+{
+	t_subres *fetch = &(sheet->fetch);
+	cssinline_buf buf;
+	int head, body;
+
+	if (fetch->data == NULL) {
+		debug_log_printf ("InlineCSS: %s not fetched (error, timeout or too big).\n", fetch->url);
+		return (1);
+	}
+	if (cssinline_check_sheet (ctx, fetch)) {
+		debug_log_printf ("InlineCSS: %s cannot be inlined.\n", fetch->url);
+		return (1);
+	}
+	if (! sheet->from_cache)
+		cssinline_cache_store (fetch);
+
+	/* fetch->data has room for the extra '\0' from htmlopt */
+	fetch->data_len = hopt_pack_css ((unsigned char *) fetch->data, fetch->data_len, (unsigned char *) fetch->data);
+
+	/* @charset is dropped (the sheet is ASCII) */
+	if (cssinline_parse_imports (ctx, fetch->data, fetch->data_len, fetch->url, sheet->depth, &(sheet->first_import), &(sheet->imports_len), &head, &body))
+		return (1);
+
+	cssinline_buf_init (&buf, fetch->data_len - body + 64);
+	if (cssinline_rewrite_urls (ctx, fetch->url, fetch->data + body, fetch->data_len - body, &buf) || (buf.data == NULL)) {
+		if (buf.data != NULL)
+			free (buf.data);
+		return (1);
+	}
+	sheet->body = buf.data;
+	sheet->body_len = buf.len;
+	return (0);
+}
+
+/* fetches the sheets (and the sheets imported by those, and so on) */
+static void cssinline_fetch_sheets (cssinline_ctx *ctx)
+{
+	t_subres *fetches [CSSINLINE_MAX_SHEETS];
+	int round [CSSINLINE_MAX_SHEETS];
+	int fetches_len, round_len, i;
+	cssinline_sheet *sheet;
+
+	/* one level of @import at a time, each level in parallel */
+	do {
+		fetches_len = round_len = 0;
+		for (i = 0; i < ctx->sheets_len; i++) {
+			sheet = &(ctx->sheets [i]);
+			if (sheet->state != CSSINLINE_NEW)
+				continue;
+			round [round_len++] = i;
+			if (cssinline_cache_load (&(sheet->fetch)) == 0)
+				sheet->from_cache = 1;
+			else
+				fetches [fetches_len++] = &(sheet->fetch);
+		}
+		subres_fetch_all (fetches, fetches_len);
+
+		for (i = 0; i < round_len; i++) {
+			sheet = &(ctx->sheets [round [i]]);
+			sheet->state = cssinline_parse_sheet (ctx, sheet) ? CSSINLINE_FAILED : CSSINLINE_PARSED;
+		}
+	} while (round_len > 0);
+	debug_log_difftime ("InlineCSS: fetching");
+}
+
+/* ### FLATTENING ### */
+
+static int cssinline_flatten_sheet (cssinline_ctx *ctx, int index);
+
+/* appends the imported sheets (flattened) to 'buf'.
+ * returns: ==0 ok, !=0 some could not be flattened */
+static int cssinline_flatten_imports (cssinline_ctx *ctx, const int first_import, const int imports_len, cssinline_buf *buf)
+{
+	cssinline_import *import;
+	cssinline_sheet *sheet;
+	int i;
+
+	for (i = first_import; i < first_import + imports_len; i++) {
+		import = &(ctx->imports [i]);
+		if (cssinline_flatten_sheet (ctx, import->sheet))
+			return (1);
+		sheet = &(ctx->sheets [import->sheet]);
+
+		if (import->media != NULL) {
+			cssinline_buf_puts (buf, "@media ");
+			cssinline_buf_append (buf, import->media, import->media_len);
+			cssinline_buf_puts (buf, "{");
+		}
+		cssinline_buf_append (buf, sheet->flat, sheet->flat_len);
+		if (import->media != NULL)
+			cssinline_buf_puts (buf, "}");
+	}
+	return (0);
+}
+
+/* builds sheet->flat.
+ * returns: ==0 ok, !=0 the sheet cannot be flattened */
+static int cssinline_flatten_sheet (cssinline_ctx *ctx, int index)
+{
+	cssinline_sheet *sheet = &(ctx->sheets [index]);
+	cssinline_buf buf;
+
+	switch (sheet->state) {
+	case CSSINLINE_DONE:
+		return (0);
+	case CSSINLINE_PARSED:
+		break;
+	case CSSINLINE_BUSY:
+		debug_log_printf ("InlineCSS: @import loop at %s.\n", sheet->fetch.url);
+		return (1);
+	default:
+		return (1);
+	}
+
+	sheet->state = CSSINLINE_BUSY;
+	cssinline_buf_init (&buf, sheet->body_len + 64);
+	if (cssinline_flatten_imports (ctx, sheet->first_import, sheet->imports_len, &buf) == 0)
+		cssinline_buf_append (&buf, sheet->body, sheet->body_len);
+	else if (buf.data != NULL) {
+		free (buf.data);
+		buf.data = NULL;
+	}
+	if (buf.data == NULL) {
+		sheet->state = CSSINLINE_FAILED;
+		return (1);
+	}
+	sheet->flat = buf.data;
+	sheet->flat_len = buf.len;
+	sheet->state = CSSINLINE_DONE;
+	return (0);
+}
+
+/* ### PAGE SCANNING ### */
+
+/* records a <link rel="stylesheet"> at src[start..end) */
+static void cssinline_add_link (cssinline_ctx *ctx, const int start, const int end, const int href_start, const int href_end, const int media_start, const int media_end)
+{
+	const char *src = ctx->src;
+	char value [SUBRES_URL_LEN];
+	char url [SUBRES_URL_LEN];
+	cssinline_root *root;
+	int value_len = 0, pos, sheet;
+
+	if ((ctx->roots_len >= CSSINLINE_MAX_ROOTS) || (ctx->imports_len >= CSSINLINE_MAX_IMPORTS) || (href_end - href_start >= SUBRES_URL_LEN))
+		return;
+	if ((media_start >= 0) && (memchr (src + media_start, '"', media_end - media_start) != NULL))
+		return;
+
+	/* only &amp; is expected there */
+	for (pos = href_start; pos < href_end; pos++) {
+		if (src [pos] == '&') {
+			if (! subres_match (src, href_end, pos, "&amp;"))
+				return;
+			pos += 4;
+		} else if (isspace (src [pos]) || (src [pos] == '"') || (src [pos] == '\'') || (src [pos] == '<') || (src [pos] == '>')) {
+			return;
+		}
+		value [value_len++] = src [pos];
+	}
+	value [value_len] = '\0';
+
+	if (subres_resolve (ctx->base, value, url, sizeof (url)) || ((sheet = cssinline_add_sheet (ctx, url, 1)) < 0))
+		return;
+
+	root = &(ctx->roots [ctx->roots_len++]);
+	root->start = start;
+	root->end = end;
+	root->is_link = 1;
+	root->media = (media_start >= 0) ? src + media_start : NULL;
+	root->media_len = media_end - media_start;
+	root->first_import = ctx->imports_len;
+	root->imports_len = 1;
+	ctx->imports [ctx->imports_len].sheet = sheet;
+	ctx->imports [ctx->imports_len].media = NULL;
+	ctx->imports_len++;
+}
+
+/* records the @import rules of the <style> element with contents at src[start..end) */
+static void cssinline_add_style (cssinline_ctx *ctx, const int start, const int end)
+{
+	cssinline_root *root;
+	int first_import, imports_len, head, body;
+
+	if (ctx->roots_len >= CSSINLINE_MAX_ROOTS)
+		return;
+	if (cssinline_parse_imports (ctx, ctx->src + start, end - start, ctx->base, 0, &first_import, &imports_len, &head, &body) || (imports_len == 0))
+		return;
+
+	root = &(ctx->roots [ctx->roots_len++]);
+	root->start = start + head;
+	root->end = start + body;
+	root->is_link = 0;
+	root->media = NULL;
+	root->first_import = first_import;
+	root->imports_len = imports_len;
+}
+
+/* returns: !=0 if the attribute at src[start..start+len) is 'name' */
+static int cssinline_is_attr (const char *src, const int start, const int len, const char *name)
+{
+	return ((len == strlen (name)) && (strncasecmp (src + start, name, len) == 0));
+}
+
+/* processes the tag at src[pos] ('<').
+ * returns: position after the tag (or after the element, for raw elements) */
+static int cssinline_scan_tag (cssinline_ctx *ctx, int pos)
+{
+	const char *src = ctx->src;
+	const int len = ctx->len;
+	const int tag_start = pos;
+	int name_start, name_len;
+	int attr_start, attr_len;
+	int value_start, value_end, has_value;
+	int is_link, is_style, is_base;
+	int is_stylesheet = 0, is_css = 1, is_excluded = 0;
+	int href_start = -1, href_end = -1, media_start = -1, media_end = -1;
+	char end_tag [16];
+	int i;
+
+	name_start = ++pos;
+	while ((pos < len) && (isalnum (src [pos]) || (src [pos] == '-') || (src [pos] == ':')))
+		pos++;
+	if ((name_len = pos - name_start) == 0)
+		return (pos);
+
+	is_link = cssinline_is_attr (src, name_start, name_len, "link");
+	is_style = cssinline_is_attr (src, name_start, name_len, "style");
+	is_base = cssinline_is_attr (src, name_start, name_len, "base");
+
+	/* attributes */
+	while (pos < len) {
+		while ((pos < len) && (isspace (src [pos]) || (src [pos] == '/')))
+			pos++;
+		if ((pos >= len) || (src [pos] == '>'))
+			break;
+
+		attr_start = pos;
+		while ((pos < len) && (! isspace (src [pos])) && (src [pos] != '=') && (src [pos] != '>') && (src [pos] != '/'))
+			pos++;
+		attr_len = pos - attr_start;
+		if (attr_len == 0)
+			pos++;	/* stray '=' */
+		while ((pos < len) && isspace (src [pos]))
+			pos++;
+
+		has_value = 0;
+		value_start = value_end = pos;
+		if ((pos < len) && (src [pos] == '=') && (attr_len > 0)) {
+			pos++;
+			while ((pos < len) && isspace (src [pos]))
+				pos++;
+			if ((pos < len) && ((src [pos] == '"') || (src [pos] == '\''))) {
+				char quote = src [pos++];
+
+				value_start = pos;
+				while ((pos < len) && (src [pos] != quote))
+					pos++;
+				value_end = pos;
+				if (pos < len)
+					pos++;
+			} else {
+				value_start = pos;
+				while ((pos < len) && (! isspace (src [pos])) && (src [pos] != '>'))
+					pos++;
+				value_end = pos;
+			}
+			has_value = (value_end < len);
+		}
+
+		/* those change how (or whether) the sheet applies */
+		if (is_link && (cssinline_is_attr (src, attr_start, attr_len, "integrity") || cssinline_is_attr (src, attr_start, attr_len, "disabled") || \
+			cssinline_is_attr (src, attr_start, attr_len, "title") || cssinline_is_attr (src, attr_start, attr_len, "onload")))
+			is_excluded = 1;
+		if (! has_value)
+			continue;
+
+		if (is_link && cssinline_is_attr (src, attr_start, attr_len, "rel")) {
+			is_stylesheet = cssinline_is_attr (src, value_start, value_end - value_start, "stylesheet");
+		} else if (is_link && cssinline_is_attr (src, attr_start, attr_len, "href")) {
+			href_start = value_start;
+			href_end = value_end;
+		} else if (is_link && cssinline_is_attr (src, attr_start, attr_len, "media")) {
+			media_start = value_start;
+			media_end = value_end;
+		} else if ((is_link || is_style) && cssinline_is_attr (src, attr_start, attr_len, "type")) {
+			is_css = cssinline_is_attr (src, value_start, value_end - value_start, "text/css");
+		} else if (is_base && cssinline_is_attr (src, attr_start, attr_len, "href") && (! ctx->has_base_element)) {
+			char href [SUBRES_URL_LEN];
+			char base [SUBRES_URL_LEN];
+
+			/* only the first one counts, and only if resolvable */
+			ctx->has_base_element = 1;
+			if ((value_end - value_start < SUBRES_URL_LEN) && (memchr (src + value_start, '&', value_end - value_start) == NULL)) {
+				memcpy (href, src + value_start, value_end - value_start);
+				href [value_end - value_start] = '\0';
+				if (subres_resolve (ctx->base, href, base, sizeof (base)) == 0)
+					strcpy (ctx->base, base);
+			}
+		}
+	}
+	if (pos < len)
+		pos++;
+
+	if (is_link && is_stylesheet && is_css && (! is_excluded) && (href_start >= 0) && (pos <= len) && (src [pos - 1] == '>'))
+		cssinline_add_link (ctx, tag_start, pos, href_start, href_end, media_start, media_end);
+
+	/* element contents */
+	if (is_style) {
+		int end = subres_find (src, len, pos, "</style");
+
+		if (is_css && (end < len))
+			cssinline_add_style (ctx, pos, end);
+		return (end);
+	}
+	for (i = 0; cssinline_raw_elements [i] != NULL; i++) {
+		if (cssinline_is_attr (src, name_start, name_len, cssinline_raw_elements [i])) {
+			snprintf (end_tag, sizeof (end_tag), "</%s", cssinline_raw_elements [i]);
+			return (subres_find (src, len, pos, end_tag));
+		}
+	}
+	return (pos);
+}
+
+/* records the <link> and <style> elements of the page */
+static void cssinline_scan (cssinline_ctx *ctx)
+{
+	const char *src = ctx->src;
+	const char *found;
+	int pos = 0;
+
+	while ((pos < ctx->len) && (ctx->roots_len < CSSINLINE_MAX_ROOTS)) {
+		if ((found = memchr (src + pos, '<', ctx->len - pos)) == NULL)
+			break;
+		pos = found - src;
+
+		if (subres_match (src, ctx->len, pos, "<!--"))
+			pos = subres_find (src, ctx->len, pos + 4, "-->");
+		else
+			pos = cssinline_scan_tag (ctx, pos);
+	}
+}
+
+/* ### INLINING ### */
+
+/* builds the replacements, in order, while within InlineCSSPageBudget.
+ * returns: number of replacements */
+static int cssinline_build (cssinline_ctx *ctx)
+{
+	cssinline_root *root;
+	cssinline_buf buf;
+	int budget = InlineCSSPageBudget;
+	int replaced = 0, cost, i;
+
+	for (i = 0; i < ctx->roots_len; i++) {
+		root = &(ctx->roots [i]);
+		cssinline_buf_init (&buf, 1024);
+		if (root->is_link) {
+			cssinline_buf_puts (&buf, "<style");
+			if (root->media != NULL) {
+				cssinline_buf_puts (&buf, " media=\"");
+				cssinline_buf_append (&buf, root->media, root->media_len);
+				cssinline_buf_puts (&buf, "\"");
+			}
+			cssinline_buf_puts (&buf, ">");
+		}
+		if (cssinline_flatten_imports (ctx, root->first_import, root->imports_len, &buf) || (buf.data == NULL)) {
+			if (buf.data != NULL)
+				free (buf.data);
+			continue;
+		}
+		if (root->is_link)
+			cssinline_buf_puts (&buf, "</style>");
+		if (buf.data == NULL)
+			continue;
+
+		cost = buf.len - (root->end - root->start);
+		if (cost > budget) {
+			debug_log_printf ("InlineCSS: %s exceeds the page budget.\n", root->is_link ? ctx->sheets [ctx->imports [root->first_import].sheet].fetch.url : "@import");
+			free (buf.data);
+			continue;
+		}
+		if (cost > 0)
+			budget -= cost;
+		root->replacement = buf.data;
+		root->replacement_len = buf.len;
+		replaced++;
+	}
+	return (replaced);
+}
+
+/* replaces the parts of *inoutbuf with their replacements (in a new buffer) */
+static void cssinline_apply (cssinline_ctx *ctx, char **inoutbuf, ZP_DATASIZE_TYPE *inoutlen)
+{
+	cssinline_root *root;
+	char *outbuf, *out;
+	ZP_DATASIZE_TYPE outlen = ctx->len;
+	int pos = 0, i;
+
+	for (i = 0; i < ctx->roots_len; i++) {
+		root = &(ctx->roots [i]);
+		if (root->replacement != NULL)
+			outlen += root->replacement_len - (root->end - root->start);
+	}
+	/* one extra byte, for htmlopt */
+	if ((outbuf = malloc (outlen + 1)) == NULL)
+		return;
+
+	out = outbuf;
+	for (i = 0; i < ctx->roots_len; i++) {
+		root = &(ctx->roots [i]);
+		if (root->replacement == NULL)
+			continue;
+		memcpy (out, ctx->src + pos, root->start - pos);
+		out += root->start - pos;
+		memcpy (out, root->replacement, root->replacement_len);
+		out += root->replacement_len;
+		pos = root->end;
+	}
+	memcpy (out, ctx->src + pos, ctx->len - pos);
+
+	free (*inoutbuf);
+	*inoutbuf = outbuf;
+	*inoutlen = outlen;
+}
+
+static void cssinline_free (cssinline_ctx *ctx)
+{
+	int i;
+
+	for (i = 0; i < ctx->sheets_len; i++) {
+		if (ctx->sheets [i].fetch.data != NULL)
+			free (ctx->sheets [i].fetch.data);
+		if (ctx->sheets [i].body != NULL)
+			free (ctx->sheets [i].body);
+		if (ctx->sheets [i].flat != NULL)
+			free (ctx->sheets [i].flat);
+	}
+	for (i = 0; i < ctx->roots_len; i++) {
+		if (ctx->roots [i].replacement != NULL)
+			free (ctx->roots [i].replacement);
+	}
+	free (ctx);
+}
+
+/* returns: new context for the text in *inoutbuf, or NULL if not to be processed */
+static cssinline_ctx *cssinline_new (http_headers *chdr, char *inbuf, ZP_DATASIZE_TYPE inlen, int is_html)
+{
+	cssinline_ctx *ctx;
+
+	if ((chdr->url == NULL) || (strncmp (chdr->url, "http://", 7) != 0) || (strlen (chdr->url) >= SUBRES_URL_LEN) || (inlen > INT_MAX))
+		return (NULL);
+	if ((ctx = calloc (1, sizeof (cssinline_ctx))) == NULL)
+		return (NULL);
+	ctx->src = inbuf;
+	ctx->len = inlen;
+	ctx->is_html = is_html;
+	ctx->chdr = chdr;
+	strcpy (ctx->base, chdr->url);
+	return (ctx);
+}
+
+/* processes the roots found in the text */
+static int cssinline_process (cssinline_ctx *ctx, char **inoutbuf, ZP_DATASIZE_TYPE *inoutlen)
+{
+	int replaced;
+
+	cssinline_fetch_sheets (ctx);
+	if ((replaced = cssinline_build (ctx)) > 0)
+		cssinline_apply (ctx, inoutbuf, inoutlen);
+	debug_log_printf ("InlineCSS: %d of %d stylesheet references replaced (%d sheets fetched).\n", replaced, ctx->roots_len, ctx->sheets_len);
+	return (replaced);
+}
+
+/* inlines the small stylesheets linked by the HTML page in *inoutbuf,
+ * and flattens the @import rules of its <style> elements.
+ * *inoutbuf may be replaced by a new (malloc()'ed) buffer, the old one is free()'d then.
+ * returns: number of <link> and <style> elements modified */
+int cssinline_html (http_headers *chdr, char **inoutbuf, ZP_DATASIZE_TYPE *inoutlen)
+{
+	cssinline_ctx *ctx;
+	int replaced = 0;
+
+	/* style-src may not allow inline styles (or only the ones matching a hash) */
+	if (subres_html_has_csp (*inoutbuf, *inoutlen)) {
+		debug_log_puts ("InlineCSS: page has a Content-Security-Policy, not inlining.");
+		return (0);
+	}
+	if ((ctx = cssinline_new (chdr, *inoutbuf, *inoutlen, 1)) == NULL)
+		return (0);
+	cssinline_scan (ctx);
+	if (ctx->roots_len > 0)
+		replaced = cssinline_process (ctx, inoutbuf, inoutlen);
+	cssinline_free (ctx);
+	return (replaced);
+}
+
+/* flattens the @import rules of the stylesheet in *inoutbuf.
+ * *inoutbuf may be replaced by a new (malloc()'ed) buffer, the old one is free()'d then.
+ * returns: !=0 if modified */
+int cssinline_css (http_headers *chdr, char **inoutbuf, ZP_DATASIZE_TYPE *inoutlen)
+{
+	cssinline_ctx *ctx;
+	cssinline_root *root;
+	int first_import, imports_len, head, body;
+	int replaced = 0;
+
+	if ((ctx = cssinline_new (chdr, *inoutbuf, *inoutlen, 0)) == NULL)
+		return (0);
+	if ((cssinline_parse_imports (ctx, ctx->src, ctx->len, ctx->base, 0, &first_import, &imports_len, &head, &body) == 0) && (imports_len > 0)) {
+		root = &(ctx->roots [ctx->roots_len++]);
+		root->start = head;
+		root->end = body;
+		root->first_import = first_import;
+		root->imports_len = imports_len;
+		replaced = cssinline_process (ctx, inoutbuf, inoutlen);
+	}
+	cssinline_free (ctx);
+	return (replaced);
+}
+
@@ -0,0 +1,37 @@
+/* cssinline.h
+ * Flattening of CSS @import chains and inlining of small external stylesheets.
+ *
+ * Ziproxy - the HTTP acceleration proxy
+ * This code is under the following conditions:
+ *
+ * ---------------------------------------------------------------------
+ * Copyright (c)2005-2014 Daniel Mealha Cabrita
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111 USA
+ * ---------------------------------------------------------------------
+ */
+
+// To stop multiple inclusions.
+#ifndef SRC_CSSINLINE_H
+#define SRC_CSSINLINE_H
+
+#include "globaldefs.h"
+#include "http.h"
+
+extern int cssinline_html (http_headers *chdr, char **inoutbuf, ZP_DATASIZE_TYPE *inoutlen);
+extern int cssinline_css (http_headers *chdr, char **inoutbuf, ZP_DATASIZE_TYPE *inoutlen);
+
+#endif //SRC_CSSINLINE_H
+
@@ -0,0 +1,625 @@
+/* dcpipe.c
+ * deflate and compress (LZW) decoding pipe-pipe routines
+ *
+ * Ziproxy - the HTTP acceleration proxy
+ * This code is under the following conditions:
+ *
+ * ---------------------------------------------------------------------
+ * Copyright (c)2005-2014 Daniel Mealha Cabrita
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111 USA
+ * ---------------------------------------------------------------------
+ */
+
+/* those routines mirror the decoding ones in gzpipe.c and brpipe.c,
+ * for the two remaining content-codings of RFC 2616:
+ * - "deflate": zlib-wrapped deflate (RFC 1950) as specified, although a number
+ *   of servers send raw deflate (RFC 1951) instead. Both are accepted.
+ * - "compress": LZW, as produced by UNIX compress (same decoding as gzip's unlzw) */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "dcpipe.h"
+#include "cfgfile.h"
+#include "log.h"
+#include "tosmarking.h"
+#include "globaldefs.h"
+
+#define BUFSIZE 16384
+
+/* compress (LZW) parameters */
+#define LZW_MAGIC_1	0x1f
+#define LZW_MAGIC_2	0x9d
+#define LZW_BIT_MASK	0x1f	/* maxbits, in the flags byte */
+#define LZW_RESERVED	0x60
+#define LZW_BLOCK_MODE	0x80
+#define LZW_INIT_BITS	9
+#define LZW_MAX_BITS	16
+#define LZW_CLEAR	256	/* (block mode only) */
+#define LZW_FIRST	257	/* first free entry (block mode) */
+
+#define DCPIPE_DEFLATE	0
+#define DCPIPE_LZW	1
+
+/* state of the body being read from source */
+typedef struct {
+	int de_chunk;
+	int pending_chunk_len;
+	int first_chunk;
+	int finished;
+} t_dcpipe_source;
+
+/* where the decoded data goes: either a stream or a (growing) memory buffer */
+typedef struct {
+	FILE *dest;		/* NULL: write to buf */
+	char *buf;
+	ZP_DATASIZE_TYPE buf_len;
+	ZP_DATASIZE_TYPE max_outlen;	/* memory only, 0: no limit */
+	ZP_DATASIZE_TYPE *inlen;
+	ZP_DATASIZE_TYPE *outlen;
+	int max_ratio;			/* stream only */
+	ZP_DATASIZE_TYPE min_eval;	/* stream only */
+} t_dcpipe_sink;
+
+typedef struct {
+	unsigned short prefix [1 << LZW_MAX_BITS];
+	unsigned char suffix [1 << LZW_MAX_BITS];
+	unsigned char stack [1 << LZW_MAX_BITS];
+	int head_len;
+	int maxbits;
+	int block_mode;
+	long maxmaxcode;
+	int n_bits;
+	long maxcode;
+	long free_ent;
+	long oldcode;
+	int finchar;
+	unsigned long bitbuf;
+	int bitcnt;
+	long skip_bits;
+	int ncodes;	/* codes read since the last code width change */
+} t_lzw;
+
+typedef struct {
+	int method;
+	int finished;	/* end of encoded data was reached */
+
+	/* deflate */
+	z_stream strm;
+	int strm_ready;
+	unsigned char head [2];
+	int head_len;
+
+	/* LZW */
+	t_lzw *lzw;
+} t_dcpipe_dec;
+
+static void dcpipe_source_init (t_dcpipe_source *src_state, int de_chunk)
+{
+	src_state->de_chunk = de_chunk;
+	src_state->pending_chunk_len = 0;
+	src_state->first_chunk = 1;
+	src_state->finished = 0;
+}
+
+/* reads up to BUFSIZE bytes of the body into buf, de-chunking it if requested.
+ * src_state->finished is set once the end of the body is reached.
+ * returns: the number of bytes read */
+static size_t dcpipe_read (t_dcpipe_source *src_state, FILE *source, unsigned char *buf)
+{
+	int to_read_len = BUFSIZE;
+	size_t read_len;
+
+	if (src_state->de_chunk) {
+		if (src_state->pending_chunk_len == 0) {
+			// discards chunk end CRLF
+			if (src_state->first_chunk == 0) {
+				fgetc (source);
+				fgetc (source);
+			} else {
+				src_state->first_chunk = 0;
+			}
+
+			if ((fscanf (source, "%x", &(src_state->pending_chunk_len)) != 1) || (src_state->pending_chunk_len <= 0)) {
+				// last chunk, the rest of source will be discarded
+				src_state->finished = 1;
+				return (0);
+			} else {
+				int prevchar = '\0';
+				int curchar = '\0';
+
+				// Eat any chunk-extension(RFC2616) up to CRLF.
+				while (! ((prevchar == '\r') && (curchar == '\n'))) {
+					prevchar = curchar;
+					if ((curchar = fgetc (source)) == EOF) {
+						src_state->finished = 1;
+						return (0);
+					}
+				}
+			}
+		}
+
+		if (src_state->pending_chunk_len > BUFSIZE)
+			to_read_len = BUFSIZE;
+		else
+			to_read_len = src_state->pending_chunk_len;
+		src_state->pending_chunk_len -= to_read_len;
+	}
+
+	read_len = fread (buf, 1, to_read_len, source);
+	if (feof (source) || ferror (source))
+		src_state->finished = 1;
+
+	return (read_len);
+}
+
+static int dcpipe_sink_write (t_dcpipe_sink *sink, const unsigned char *data, size_t len)
+{
+	size_t last_write_bytes;
+
+	if (len == 0)
+		return (DCPIPE_OK);
+
+	/* memory */
+	if (sink->dest == NULL) {
+		if ((sink->max_outlen != 0) && ((*(sink->outlen) + len) > sink->max_outlen))
+			return (DCPIPE_RATIO_EXCEEDED);
+
+		if ((*(sink->outlen) + len) > sink->buf_len) {
+			ZP_DATASIZE_TYPE new_len = sink->buf_len * 2;
+			char *new_buf;
+
+			while (new_len < (*(sink->outlen) + len))
+				new_len *= 2;
+			if ((new_buf = realloc (sink->buf, new_len + 1)) == NULL)
+				return (DCPIPE_MEM_ERROR);
+			sink->buf = new_buf;
+			sink->buf_len = new_len;
+		}
+		memcpy (sink->buf + *(sink->outlen), data, len);
+		*(sink->outlen) += len;
+		return (DCPIPE_OK);
+	}
+
+	/* stream */
+	tosmarking_add_check_bytecount (len);	/* update TOS if necessary */
+	if ((last_write_bytes = fwrite (data, 1, len, sink->dest)) != len || ferror (sink->dest)) {
+		*(sink->outlen) += last_write_bytes;
+		debug_log_puts ("stream dcpipe: IO error (dest). Aborting.");
+		return (DCPIPE_ERRNO);
+	}
+	*(sink->outlen) += last_write_bytes;
+
+	/* update access log stats */
+	access_log_def_outlen(*(sink->outlen));
+
+	/* evaluate whether decompression rate is exceeded */
+	if ((sink->max_ratio != 0) && (*(sink->outlen) >= sink->min_eval)) {
+		if (((*(sink->inlen) * sink->max_ratio) / 100) < *(sink->outlen)) {
+			/* ratio is exceeded, abort decompression and streaming */
+			access_log_set_flags (LOG_AC_FLAG_LLCOMP_TOO_EXPANSIVE);
+			debug_log_puts ("stream dcpipe: Decompression ratio exceeded. Aborting.");
+			return (DCPIPE_RATIO_EXCEEDED);
+		}
+	}
+
+	return (DCPIPE_OK);
+}
+
+/* whether the two first bytes are a valid zlib header (RFC 1950) */
+static int is_zlib_header (const unsigned char *head)
+{
+	return (((head [0] & 0x0f) == Z_DEFLATED) && ((head [0] >> 4) <= 7) && ((((head [0] << 8) | head [1]) % 31) == 0));
+}
+
+static int dc_inflate_run (t_dcpipe_dec *dec, const unsigned char *in, size_t len, t_dcpipe_sink *sink)
+{
+	unsigned char out [BUFSIZE];
+	int ret, sink_ret;
+
+	dec->strm.next_in = (unsigned char *) in;
+	dec->strm.avail_in = len;
+
+	/* run inflate() on input until output buffer not full */
+	do {
+		dec->strm.avail_out = BUFSIZE;
+		dec->strm.next_out = out;
+		ret = inflate (&(dec->strm), Z_NO_FLUSH);
+		switch (ret) {
+		case Z_NEED_DICT:
+		case Z_DATA_ERROR:
+		case Z_STREAM_ERROR:
+			return (DCPIPE_DATA_ERROR);
+		case Z_MEM_ERROR:
+			return (DCPIPE_MEM_ERROR);
+		}
+		if ((sink_ret = dcpipe_sink_write (sink, out, BUFSIZE - dec->strm.avail_out)) != DCPIPE_OK)
+			return (sink_ret);
+		if (ret == Z_STREAM_END) {
+			/* anything after that is ignored */
+			dec->finished = 1;
+			break;
+		}
+	} while (dec->strm.avail_out == 0);
+
+	return (DCPIPE_OK);
+}
+
+static int dc_inflate_feed (t_dcpipe_dec *dec, const unsigned char *in, size_t len, t_dcpipe_sink *sink)
+{
+	int ret;
+
+	if (! dec->strm_ready) {
+		/* two bytes are needed to tell zlib-wrapped from raw deflate */
+		while ((dec->head_len < 2) && (len > 0)) {
+			dec->head [dec->head_len++] = *(in++);
+			len--;
+		}
+		if (dec->head_len < 2)
+			return (DCPIPE_OK);
+
+		dec->strm.zalloc = Z_NULL;
+		dec->strm.zfree = Z_NULL;
+		dec->strm.opaque = Z_NULL;
+		dec->strm.avail_in = 0;
+		dec->strm.next_in = Z_NULL;
+		if (is_zlib_header (dec->head)) {
+			ret = inflateInit2 (&(dec->strm), MAX_WBITS);
+		} else {
+			debug_log_puts ("dcpipe: deflate data has no zlib header, decoding as raw deflate.");
+			ret = inflateInit2 (&(dec->strm), -MAX_WBITS);
+		}
+		if (ret != Z_OK)
+			return (DCPIPE_MEM_ERROR);
+		dec->strm_ready = 1;
+
+		if ((ret = dc_inflate_run (dec, dec->head, 2, sink)) != DCPIPE_OK)
+			return (ret);
+	}
+
+	if ((len == 0) || dec->finished)
+		return (DCPIPE_OK);
+	return (dc_inflate_run (dec, in, len, sink));
+}
+
+/* drops the codes left in the current group of 8 codes
+ * (compress writes codes in groups of n_bits bytes, and starts a new group
+ * whenever the code width changes) */
+static void lzw_align (t_lzw *z)
+{
+	long skip = ((8 - (z->ncodes & 7)) & 7) * (long) z->n_bits;
+
+	z->ncodes = 0;
+	if (skip <= z->bitcnt) {
+		z->bitbuf >>= skip;
+		z->bitcnt -= skip;
+	} else {
+		z->skip_bits = skip - z->bitcnt;
+		z->bitbuf = 0;
+		z->bitcnt = 0;
+	}
+}
+
+static int lzw_feed (t_lzw *z, const unsigned char *in, size_t len, t_dcpipe_sink *sink)
+{
+	unsigned char out [BUFSIZE];
+	size_t outpos = 0;
+	unsigned char *sp;
+	long code, incode;
+	int ret;
+
+	while (len > 0) {
+		/* header: magic + flags */
+		if (z->head_len < 3) {
+			switch (z->head_len++) {
+			case 0:
+				if (*in != LZW_MAGIC_1)
+					return (DCPIPE_DATA_ERROR);
+				break;
+			case 1:
+				if (*in != LZW_MAGIC_2)
+					return (DCPIPE_DATA_ERROR);
+				break;
+			case 2:
+				z->maxbits = *in & LZW_BIT_MASK;
+				z->block_mode = (*in & LZW_BLOCK_MODE) != 0;
+				if ((*in & LZW_RESERVED) || (z->maxbits < LZW_INIT_BITS) || (z->maxbits > LZW_MAX_BITS))
+					return (DCPIPE_DATA_ERROR);
+				z->maxmaxcode = 1L << z->maxbits;
+				z->n_bits = LZW_INIT_BITS;
+				z->maxcode = (1L << LZW_INIT_BITS) - 1;
+				z->free_ent = z->block_mode ? LZW_FIRST : 256;
+				z->oldcode = -1;
+				z->finchar = 0;
+				z->bitbuf = 0;
+				z->bitcnt = 0;
+				z->skip_bits = 0;
+				z->ncodes = 0;
+				break;
+			}
+			in++;
+			len--;
+			continue;
+		}
+
+		if (z->skip_bits >= 8) {
+			z->skip_bits -= 8;
+			in++;
+			len--;
+			continue;
+		}
+		z->bitbuf |= (unsigned long) *(in++) << z->bitcnt;
+		z->bitcnt += 8;
+		len--;
+		if (z->skip_bits) {
+			z->bitbuf >>= z->skip_bits;
+			z->bitcnt -= z->skip_bits;
+			z->skip_bits = 0;
+		}
+
+		for (;;) {
+			if (z->free_ent > z->maxcode) {
+				lzw_align (z);
+				z->n_bits++;
+				z->maxcode = (z->n_bits == z->maxbits) ? z->maxmaxcode : (1L << z->n_bits) - 1;
+				continue;
+			}
+			if (z->bitcnt < z->n_bits)
+				break;
+
+			code = z->bitbuf & ((1L << z->n_bits) - 1);
+			z->bitbuf >>= z->n_bits;
+			z->bitcnt -= z->n_bits;
+			z->ncodes++;
+
+			if (z->oldcode == -1) {
+				if (code >= 256)
+					return (DCPIPE_DATA_ERROR);
+				z->finchar = z->oldcode = code;
+				out [outpos++] = code;
+				if (outpos == BUFSIZE) {
+					if ((ret = dcpipe_sink_write (sink, out, outpos)) != DCPIPE_OK)
+						return (ret);
+					outpos = 0;
+				}
+				continue;
+			}
+
+			if ((code == LZW_CLEAR) && z->block_mode) {
+				lzw_align (z);
+				z->free_ent = LZW_FIRST - 1;
+				z->n_bits = LZW_INIT_BITS;
+				z->maxcode = (1L << LZW_INIT_BITS) - 1;
+				continue;
+			}
+
+			/* the string is built backwards into the stack */
+			incode = code;
+			sp = z->stack + sizeof (z->stack);
+			if (code >= z->free_ent) {
+				/* KwKwK case */
+				if (code > z->free_ent)
+					return (DCPIPE_DATA_ERROR);
+				*(--sp) = z->finchar;
+				code = z->oldcode;
+			}
+			while (code >= 256) {
+				if (sp == z->stack)
+					return (DCPIPE_DATA_ERROR);
+				*(--sp) = z->suffix [code];
+				code = z->prefix [code];
+			}
+			if (sp == z->stack)
+				return (DCPIPE_DATA_ERROR);
+			*(--sp) = z->finchar = code;
+
+			while (sp < (z->stack + sizeof (z->stack))) {
+				size_t n = (z->stack + sizeof (z->stack)) - sp;
+
+				if (n > (BUFSIZE - outpos))
+					n = BUFSIZE - outpos;
+				memcpy (out + outpos, sp, n);
+				outpos += n;
+				sp += n;
+				if (outpos == BUFSIZE) {
+					if ((ret = dcpipe_sink_write (sink, out, outpos)) != DCPIPE_OK)
+						return (ret);
+					outpos = 0;
+				}
+			}
+
+			/* new entry */
+			if (z->free_ent < z->maxmaxcode) {
+				z->prefix [z->free_ent] = z->oldcode;
+				z->suffix [z->free_ent] = z->finchar;
+				z->free_ent++;
+			}
+			z->oldcode = incode;
+		}
+	}
+
+	return (dcpipe_sink_write (sink, out, outpos));
+}
+
+static int dcpipe_dec_init (t_dcpipe_dec *dec, int method)
+{
+	memset (dec, 0, sizeof (t_dcpipe_dec));
+	dec->method = method;
+	if (method == DCPIPE_LZW) {
+		if ((dec->lzw = malloc (sizeof (t_lzw))) == NULL)
+			return (DCPIPE_MEM_ERROR);
+		dec->lzw->head_len = 0;
+	}
+	return (DCPIPE_OK);
+}
+
+static void dcpipe_dec_end (t_dcpipe_dec *dec)
+{
+	if (dec->strm_ready)
+		(void)inflateEnd (&(dec->strm));
+	if (dec->lzw != NULL)
+		free (dec->lzw);
+}
+
+static int dcpipe_dec_feed (t_dcpipe_dec *dec, const unsigned char *in, size_t len, t_dcpipe_sink *sink)
+{
+	if (dec->method == DCPIPE_LZW)
+		return (lzw_feed (dec->lzw, in, len, sink));
+	return (dc_inflate_feed (dec, in, len, sink));
+}
+
+/* whether the data received so far is complete (or no data at all) */
+static int dcpipe_dec_complete (const t_dcpipe_dec *dec)
+{
+	if (dec->method == DCPIPE_LZW)
+		/* LZW has no end marker, a truncated body cannot be detected */
+		return ((dec->lzw->head_len == 0) || (dec->lzw->head_len == 3));
+	return (dec->finished || (dec->head_len == 0));
+}
+
+/* Decompress from file source to file dest until stream ends or EOF.
+   returns DCPIPE_OK on success, DCPIPE_MEM_ERROR if memory could not be
+   allocated for processing, DCPIPE_DATA_ERROR if the data is invalid
+   or incomplete, DCPIPE_RATIO_EXCEEDED if the decompression ratio is
+   exceeded or DCPIPE_ERRNO if there is an error reading or writing the files. */
+static int dcpipe_stream_stream (int method, FILE *source, FILE *dest, ZP_DATASIZE_TYPE *inlen, ZP_DATASIZE_TYPE *outlen, int de_chunk, int max_ratio, ZP_DATASIZE_TYPE min_eval)
+{
+	t_dcpipe_dec dec;
+	t_dcpipe_source src_state;
+	t_dcpipe_sink sink;
+	unsigned char in [BUFSIZE];
+	size_t avail_in;
+	int ret;
+
+	*inlen = 0;
+	*outlen = 0;
+
+	if ((ret = dcpipe_dec_init (&dec, method)) != DCPIPE_OK)
+		return (ret);
+	dcpipe_source_init (&src_state, de_chunk);
+	memset (&sink, 0, sizeof (t_dcpipe_sink));
+	sink.dest = dest;
+	sink.inlen = inlen;
+	sink.outlen = outlen;
+	sink.max_ratio = max_ratio;
+	sink.min_eval = min_eval;
+
+	/* decompress until the encoded data ends or end of file */
+	do {
+		avail_in = dcpipe_read (&src_state, source, in);
+		*inlen += avail_in;
+
+		/* update access log stats */
+		access_log_def_inlen(*inlen);
+
+		if (ferror(source)) {
+			dcpipe_dec_end (&dec);
+			debug_log_puts ("stream dcpipe: IO error (source). Aborting.");
+			return (DCPIPE_ERRNO);
+		}
+		if (avail_in == 0)
+			break;
+
+		if ((ret = dcpipe_dec_feed (&dec, in, avail_in, &sink)) != DCPIPE_OK) {
+			dcpipe_dec_end (&dec);
+			return (ret);
+		}
+
+		// If we are sending a big file down a slow line, we
+		// need to reset the alarm once a while.
+		if (ConnTimeout)
+			alarm(ConnTimeout);
+
+	} while ((! dec.finished) && (! src_state.finished));
+
+	/* clean up and return */
+	ret = dcpipe_dec_complete (&dec) ? DCPIPE_OK : DCPIPE_DATA_ERROR;
+	dcpipe_dec_end (&dec);
+	return (ret);
+}
+
+/* Decompress inlen bytes from source into a newly-allocated *dest.
+ * *dest is allocated with one extra byte, so htmlopt may add its '\0'.
+ * max_growth (in %) is the maximum allowable uncompressed size relative
+ * 	to inlen, if exceeded the decompressor will stop
+ * 	if max_growth==0 then there will be no limit (other than memory)
+ * returns: DCPIPE_OK (*dest and *outlen are defined) or an error
+ * 	(in this case, *dest is unchanged) */
+static int dcpipe_memory_memory (int method, const char *source, ZP_DATASIZE_TYPE inlen, char **dest, ZP_DATASIZE_TYPE *outlen, int max_growth)
+{
+	t_dcpipe_dec dec;
+	t_dcpipe_sink sink;
+	ZP_DATASIZE_TYPE pos = 0;
+	ZP_DATASIZE_TYPE new_outlen = 0;
+	size_t len;
+	int ret;
+
+	if ((ret = dcpipe_dec_init (&dec, method)) != DCPIPE_OK)
+		return (ret);
+	memset (&sink, 0, sizeof (t_dcpipe_sink));
+	sink.outlen = &new_outlen;
+	sink.max_outlen = (inlen * max_growth) / 100;
+
+	/* initial guess, grown as needed */
+	sink.buf_len = (inlen * 4) + BUFSIZE;
+	if ((sink.buf = malloc (sink.buf_len + 1)) == NULL) {
+		dcpipe_dec_end (&dec);
+		return (DCPIPE_MEM_ERROR);
+	}
+
+	while ((pos < inlen) && (! dec.finished)) {
+		len = ((inlen - pos) > BUFSIZE) ? BUFSIZE : (inlen - pos);
+		if ((ret = dcpipe_dec_feed (&dec, (const unsigned char *) source + pos, len, &sink)) != DCPIPE_OK)
+			break;
+		pos += len;
+	}
+	if ((ret == DCPIPE_OK) && (! dcpipe_dec_complete (&dec)))
+		ret = DCPIPE_DATA_ERROR;
+	dcpipe_dec_end (&dec);
+
+	if (ret != DCPIPE_OK) {
+		free (sink.buf);
+		return (ret);
+	}
+
+	*dest = sink.buf;
+	*outlen = new_outlen;
+	return (DCPIPE_OK);
+}
+
+int undeflate_stream_stream (FILE *source, FILE *dest, ZP_DATASIZE_TYPE *inlen, ZP_DATASIZE_TYPE *outlen, int de_chunk, int max_ratio, ZP_DATASIZE_TYPE min_eval)
+{
+	return (dcpipe_stream_stream (DCPIPE_DEFLATE, source, dest, inlen, outlen, de_chunk, max_ratio, min_eval));
+}
+
+int undeflate_memory_memory (const char *source, ZP_DATASIZE_TYPE inlen, char **dest, ZP_DATASIZE_TYPE *outlen, int max_growth)
+{
+	return (dcpipe_memory_memory (DCPIPE_DEFLATE, source, inlen, dest, outlen, max_growth));
+}
+
+int unlzw_stream_stream (FILE *source, FILE *dest, ZP_DATASIZE_TYPE *inlen, ZP_DATASIZE_TYPE *outlen, int de_chunk, int max_ratio, ZP_DATASIZE_TYPE min_eval)
+{
+	return (dcpipe_stream_stream (DCPIPE_LZW, source, dest, inlen, outlen, de_chunk, max_ratio, min_eval));
+}
+
+int unlzw_memory_memory (const char *source, ZP_DATASIZE_TYPE inlen, char **dest, ZP_DATASIZE_TYPE *outlen, int max_growth)
+{
+	return (dcpipe_memory_memory (DCPIPE_LZW, source, inlen, dest, outlen, max_growth));
+}
+
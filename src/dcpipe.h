@@ -0,0 +1,51 @@
+/* dcpipe.h
+ * deflate and compress (LZW) decoding pipe-pipe routines
+ *
+ * Ziproxy - the HTTP acceleration proxy
+ * This code is under the following conditions:
+ *
+ * ---------------------------------------------------------------------
+ * Copyright (c)2005-2014 Daniel Mealha Cabrita
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111 USA
+ * ---------------------------------------------------------------------
+ */
+
+//To stop multiple inclusions.
+#ifndef SRC_DCPIPE_H
+#define SRC_DCPIPE_H
+
+#include <stdio.h>
+
+#include "globaldefs.h"
+
+/* return codes */
+#define DCPIPE_OK		0
+#define DCPIPE_ERRNO		1	/* IO error (source or dest) */
+#define DCPIPE_MEM_ERROR	2
+#define DCPIPE_DATA_ERROR	3	/* broken or truncated data */
+#define DCPIPE_RATIO_EXCEEDED	4	/* decompressed data exceeds the given max ratio */
+
+/* "deflate" content-coding, either zlib-wrapped (RFC 1950, as specified)
+ * or raw deflate (RFC 1951, as sent by some servers) - autodetected */
+int undeflate_stream_stream (FILE *source, FILE *dest, ZP_DATASIZE_TYPE *inlen, ZP_DATASIZE_TYPE *outlen, int de_chunk, int max_ratio, ZP_DATASIZE_TYPE min_eval);
+int undeflate_memory_memory (const char *source, ZP_DATASIZE_TYPE inlen, char **dest, ZP_DATASIZE_TYPE *outlen, int max_growth);
+
+/* "compress" content-coding (LZW, as produced by UNIX compress) */
+int unlzw_stream_stream (FILE *source, FILE *dest, ZP_DATASIZE_TYPE *inlen, ZP_DATASIZE_TYPE *outlen, int de_chunk, int max_ratio, ZP_DATASIZE_TYPE min_eval);
+int unlzw_memory_memory (const char *source, ZP_DATASIZE_TYPE inlen, char **dest, ZP_DATASIZE_TYPE *outlen, int max_growth);
+
+#endif //SRC_DCPIPE_H
+
@@ -0,0 +1,622 @@
+/* delta.c
+ * Delta encoding (RFC 3229-like) of HTML pages between paired Ziproxies
+ *
+ * Ziproxy - the HTTP acceleration proxy
+ * This code is under the following conditions:
+ *
+ * ---------------------------------------------------------------------
+ * Copyright (c)2005-2014 Daniel Mealha Cabrita
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111 USA
+ * ---------------------------------------------------------------------
+ */
+
+/*
+ * Pages like news portals are fetched again and again, and change
+ * only slightly between fetches. When two Ziproxies are chained:
+ *
+ * - the near one (AnnounceDeltaCapability) keeps the last version of
+ *   each page it received and tells the far one which version it holds
+ *   (DELTA_BASE_HEADER), along with DELTA_FLAG in X-Ziproxy-Flags.
+ * - the far one (DeltaEncodeHTML) keeps the last DeltaCacheVersions
+ *   versions of each page it sent (after optimization), tagging the
+ *   response with its version (DELTA_VERSION_HEADER). If it still has
+ *   the version held by the near one, and the differences are small
+ *   enough, it sends those instead: "226 IM Used", "IM: DELTA_IM" and
+ *   "Delta-Base: <version>", as in RFC 3229.
+ * - the near one rebuilds the page before further processing, so the
+ *   clients receive the usual "200 OK" response.
+ *
+ * Otherwise the full page is sent, as usual.
+ *
+ * Versions are stored as DeltaCacheDir/<URL hash>/<version>, where
+ * version is a hash of the contents.
+ *
+ * Differences format: "ZPD1", base length and page length (varints),
+ * adler32 of base and page (4 bytes each, big-endian), followed by:
+ *   0x00 <length> <bytes>	add bytes
+ *   0x01 <offset> <length>	copy from base
+ * (offsets and lengths as LEB128 varints)
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <utime.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "delta.h"
+#include "http.h"
+#include "coalesce.h"
+#include "cfgfile.h"
+#include "log.h"
+#include "misc.h"
+
+#define DELTA_MAGIC		"ZPD1"
+#define DELTA_MAGIC_LEN		4
+#define DELTA_BLOCK		16	/* minimum match length */
+#define DELTA_ID_LEN		16	/* hex chars of a version id */
+#define DELTA_PATH_LEN		1024
+#define DELTA_MAX_PAGE		(64 * 1024 * 1024)	/* sanity limit for rebuilt pages */
+
+#define DELTA_OP_ADD		0
+#define DELTA_OP_COPY		1
+
+typedef struct {
+	unsigned char *data;
+	size_t len;
+	size_t size;
+} t_delta_buf;
+
+/* (far end) version held by the near Ziproxy (empty: none) */
+static char requested_base_id [DELTA_ID_LEN + 1] = "";
+
+/* (near end) version announced to the far Ziproxy */
+static char announced_base_id [DELTA_ID_LEN + 1] = "";
+static char *announced_base = NULL;
+static size_t announced_base_len = 0;
+
+static unsigned long long delta_hash_data (const unsigned char *data, size_t len)
+{
+	unsigned long long hash = MISC_HASH_INIT;
+
+	while (len--) {
+		hash ^= *(data++);
+		hash *= 1099511628211ULL;
+	}
+	return (hash);
+}
+
+static void delta_version_id (char *id, const char *data, size_t len)
+{
+	snprintf (id, DELTA_ID_LEN + 1, "%016llx", delta_hash_data ((const unsigned char *) data, len));
+}
+
+static void delta_url_dir (char *path, const char *url)
+{
+	snprintf (path, DELTA_PATH_LEN, "%s/%016llx", DeltaCacheDir, misc_hash_str (MISC_HASH_INIT, url));
+}
+
+/* whether 'name' looks like a version id (and not a temporary file etc) */
+static int delta_is_id (const char *name)
+{
+	int i;
+
+	for (i = 0; i < DELTA_ID_LEN; i++) {
+		if (! (((name [i] >= '0') && (name [i] <= '9')) || ((name [i] >= 'a') && (name [i] <= 'f'))))
+			return (0);
+	}
+	return (name [DELTA_ID_LEN] == '\0');
+}
+
+/* reads a whole file into a newly-allocated buffer (with one extra byte).
+ * returns: the buffer (*len defined) or NULL if error */
+static char *delta_read_file (const char *path, size_t *len)
+{
+	FILE *file;
+	struct stat st;
+	char *buf;
+
+	if ((stat (path, &st) != 0) || (st.st_size > DELTA_MAX_PAGE))
+		return (NULL);
+	if ((file = fopen (path, "rb")) == NULL)
+		return (NULL);
+	if ((buf = malloc (st.st_size + 1)) == NULL) {
+		fclose (file);
+		return (NULL);
+	}
+	*len = fread (buf, 1, st.st_size, file);
+	fclose (file);
+	return (buf);
+}
+
+/* stores version 'id' of the page, keeping at most 'max_versions' of it
+ * (the least recently sent ones are removed) */
+static void delta_store (const char *url, const char *id, const char *data, size_t len, int max_versions)
+{
+	char dir [DELTA_PATH_LEN];
+	char path [DELTA_PATH_LEN + 258];
+	char tmp_path [DELTA_PATH_LEN + 258];
+	char oldest_path [DELTA_PATH_LEN + 258];
+	time_t oldest_time;
+	struct stat st;
+	struct dirent *entry;
+	DIR *dir_handle;
+	FILE *file;
+	int versions;
+
+	delta_url_dir (dir, url);
+	mkdir (dir, 0700);
+
+	snprintf (path, sizeof (path), "%s/%s", dir, id);
+	if (stat (path, &st) == 0) {
+		/* already stored, mark it as recently sent */
+		utime (path, NULL);
+	} else {
+		snprintf (tmp_path, sizeof (tmp_path), "%s/.%d.tmp", dir, (int) getpid ());
+		if ((file = fopen (tmp_path, "wb")) == NULL)
+			return;
+		if ((fwrite (data, 1, len, file) != len) | (fclose (file) != 0) || (rename (tmp_path, path) != 0)) {
+			unlink (tmp_path);
+			return;
+		}
+	}
+
+	/* remove the excess versions, oldest first */
+	do {
+		if ((dir_handle = opendir (dir)) == NULL)
+			return;
+		versions = 0;
+		oldest_time = 0;
+		while ((entry = readdir (dir_handle)) != NULL) {
+			if (! delta_is_id (entry->d_name))
+				continue;
+			snprintf (path, sizeof (path), "%s/%s", dir, entry->d_name);
+			if (stat (path, &st) != 0)
+				continue;
+			versions++;
+			if ((strcmp (entry->d_name, id) != 0) && ((oldest_time == 0) || (st.st_mtime < oldest_time))) {
+				oldest_time = st.st_mtime;
+				strcpy (oldest_path, path);
+			}
+		}
+		closedir (dir_handle);
+
+		if ((versions > max_versions) && (oldest_time != 0))
+			unlink (oldest_path);
+	} while ((versions - 1 > max_versions) && (oldest_time != 0));
+}
+
+/* (near end) loads the version of the page we hold, if any */
+static void delta_load_latest (const char *url)
+{
+	char dir [DELTA_PATH_LEN];
+	char path [DELTA_PATH_LEN + 258];
+	struct dirent *entry;
+	DIR *dir_handle;
+
+	delta_url_dir (dir, url);
+	if ((dir_handle = opendir (dir)) == NULL)
+		return;
+	while ((entry = readdir (dir_handle)) != NULL) {
+		if (! delta_is_id (entry->d_name))
+			continue;
+		snprintf (path, sizeof (path), "%s/%s", dir, entry->d_name);
+		if ((announced_base = delta_read_file (path, &announced_base_len)) != NULL) {
+			strcpy (announced_base_id, entry->d_name);
+			break;
+		}
+	}
+	closedir (dir_handle);
+}
+
+static void delta_buf_append (t_delta_buf *buf, const void *data, size_t len)
+{
+	unsigned char *new_data;
+	size_t new_size;
+
+	if (buf->data == NULL)
+		return;	/* out of memory earlier */
+
+	if (buf->len + len > buf->size) {
+		new_size = buf->size * 2;
+		while (new_size < buf->len + len)
+			new_size *= 2;
+		if ((new_data = realloc (buf->data, new_size)) == NULL) {
+			free (buf->data);
+			buf->data = NULL;
+			return;
+		}
+		buf->data = new_data;
+		buf->size = new_size;
+	}
+	memcpy (buf->data + buf->len, data, len);
+	buf->len += len;
+}
+
+static void delta_put_varint (t_delta_buf *buf, unsigned long value)
+{
+	unsigned char bytes [10];
+	int len = 0;
+
+	do {
+		bytes [len] = value & 0x7f;
+		value >>= 7;
+		if (value != 0)
+			bytes [len] |= 0x80;
+		len++;
+	} while (value != 0);
+	delta_buf_append (buf, bytes, len);
+}
+
+static void delta_put_u32 (t_delta_buf *buf, unsigned long value)
+{
+	unsigned char bytes [4];
+
+	bytes [0] = (value >> 24) & 0xff;
+	bytes [1] = (value >> 16) & 0xff;
+	bytes [2] = (value >> 8) & 0xff;
+	bytes [3] = value & 0xff;
+	delta_buf_append (buf, bytes, 4);
+}
+
+/* returns: ==0 ok, !=0 out of data */
+static int delta_get_varint (const unsigned char **pos, const unsigned char *end, unsigned long *value)
+{
+	int shift = 0;
+
+	*value = 0;
+	while (*pos < end) {
+		*value |= (unsigned long) (**pos & 0x7f) << shift;
+		if ((*((*pos)++) & 0x80) == 0)
+			return (0);
+		if ((shift += 7) > 56)
+			return (1);
+	}
+	return (1);
+}
+
+static unsigned long delta_get_u32 (const unsigned char *pos)
+{
+	return (((unsigned long) pos [0] << 24) | (pos [1] << 16) | (pos [2] << 8) | pos [3]);
+}
+
+static void delta_put_add (t_delta_buf *buf, const unsigned char *data, size_t len)
+{
+	if (len == 0)
+		return;
+	delta_put_varint (buf, DELTA_OP_ADD);
+	delta_put_varint (buf, len);
+	delta_buf_append (buf, data, len);
+}
+
+static unsigned int delta_block_hash (const unsigned char *data, unsigned int mask)
+{
+	return (delta_hash_data (data, DELTA_BLOCK) & mask);
+}
+
+/* computes the differences to rebuild 'target' from 'base'.
+ * returns: newly-allocated buffer (*outlen defined) or NULL if out of memory */
+static unsigned char *delta_compute (const unsigned char *base, size_t base_len, const unsigned char *target, size_t target_len, size_t *outlen)
+{
+	t_delta_buf out;
+	long *table;
+	unsigned int table_size = 1024;
+	unsigned int mask;
+	size_t pos, add_start, match_len, i;
+	long cand;
+
+	out.size = (target_len / 8) + 64;
+	out.len = 0;
+	if ((out.data = malloc (out.size)) == NULL)
+		return (NULL);
+
+	/* index of the base, one entry per block */
+	while (table_size < (base_len / DELTA_BLOCK) * 2)
+		table_size *= 2;
+	mask = table_size - 1;
+	if ((table = malloc (table_size * sizeof (long))) == NULL) {
+		free (out.data);
+		return (NULL);
+	}
+	for (i = 0; i < table_size; i++)
+		table [i] = -1;
+	for (i = 0; i + DELTA_BLOCK <= base_len; i += DELTA_BLOCK)
+		table [delta_block_hash (base + i, mask)] = i;
+
+	delta_buf_append (&out, DELTA_MAGIC, DELTA_MAGIC_LEN);
+	delta_put_varint (&out, base_len);
+	delta_put_varint (&out, target_len);
+	delta_put_u32 (&out, adler32 (adler32 (0L, Z_NULL, 0), base, base_len));
+	delta_put_u32 (&out, adler32 (adler32 (0L, Z_NULL, 0), target, target_len));
+
+	pos = add_start = 0;
+	while (pos + DELTA_BLOCK <= target_len) {
+		cand = table [delta_block_hash (target + pos, mask)];
+		if ((cand < 0) || (memcmp (base + cand, target + pos, DELTA_BLOCK) != 0)) {
+			pos++;
+			continue;
+		}
+
+		/* extend the match in both directions */
+		while ((pos > add_start) && (cand > 0) && (base [cand - 1] == target [pos - 1])) {
+			pos--;
+			cand--;
+		}
+		match_len = DELTA_BLOCK;
+		while ((pos + match_len < target_len) && (cand + match_len < base_len) && (base [cand + match_len] == target [pos + match_len]))
+			match_len++;
+
+		delta_put_add (&out, target + add_start, pos - add_start);
+		delta_put_varint (&out, DELTA_OP_COPY);
+		delta_put_varint (&out, cand);
+		delta_put_varint (&out, match_len);
+
+		pos += match_len;
+		add_start = pos;
+	}
+	delta_put_add (&out, target + add_start, target_len - add_start);
+
+	free (table);
+	*outlen = out.len;
+	return (out.data);
+}
+
+/* rebuilds the page from 'base' and the differences.
+ * returns: newly-allocated buffer with one extra byte (*outlen defined), or NULL if error */
+static char *delta_apply (const char *base, size_t base_len, const unsigned char *delta, size_t delta_len, size_t *outlen)
+{
+	const unsigned char *pos = delta + DELTA_MAGIC_LEN;
+	const unsigned char *end = delta + delta_len;
+	unsigned long in_base_len, target_len, op, offset, len;
+	unsigned long base_adler, target_adler;
+	unsigned char *target;
+	size_t target_pos = 0;
+
+	if ((delta_len < DELTA_MAGIC_LEN) || (memcmp (delta, DELTA_MAGIC, DELTA_MAGIC_LEN) != 0))
+		return (NULL);
+	if (delta_get_varint (&pos, end, &in_base_len) || delta_get_varint (&pos, end, &target_len) || (end - pos < 8))
+		return (NULL);
+	base_adler = delta_get_u32 (pos);
+	target_adler = delta_get_u32 (pos + 4);
+	pos += 8;
+
+	if ((in_base_len != base_len) || (target_len > DELTA_MAX_PAGE))
+		return (NULL);
+	if (adler32 (adler32 (0L, Z_NULL, 0), (const unsigned char *) base, base_len) != base_adler)
+		return (NULL);
+	if ((target = malloc (target_len + 1)) == NULL)
+		return (NULL);
+
+	while (pos < end) {
+		if (delta_get_varint (&pos, end, &op))
+			break;
+		if (op == DELTA_OP_ADD) {
+			if (delta_get_varint (&pos, end, &len) || (len > (unsigned long) (end - pos)) || (len > target_len - target_pos))
+				break;
+			memcpy (target + target_pos, pos, len);
+			pos += len;
+		} else if (op == DELTA_OP_COPY) {
+			if (delta_get_varint (&pos, end, &offset) || delta_get_varint (&pos, end, &len) \
+				|| (offset > base_len) || (len > base_len - offset) || (len > target_len - target_pos))
+				break;
+			memcpy (target + target_pos, base + offset, len);
+		} else {
+			break;
+		}
+		target_pos += len;
+	}
+
+	if ((pos != end) || (target_pos != target_len) || (adler32 (adler32 (0L, Z_NULL, 0), target, target_len) != target_adler)) {
+		free (target);
+		return (NULL);
+	}
+	*outlen = target_len;
+	return ((char *) target);
+}
+
+/* replaces the status line (keeping the protocol version) */
+static void delta_set_status (http_headers *shdr, int status, const char *reason)
+{
+	char line [64];
+	int proto_len;
+
+	proto_len = strcspn (shdr->hdr [0], " ");
+	if (proto_len > 16)
+		proto_len = 16;
+	snprintf (line, sizeof (line), "%.*s %d %s", proto_len, shdr->hdr [0], status, reason);
+	/* not freed, shdr->proto points there */
+	shdr->hdr [0] = strdup (line);
+	shdr->status = status;
+}
+
+/* whether the request comes from a Ziproxy announcing delta capability */
+int delta_client_is_paired (const char *x_ziproxy_flags)
+{
+	if (x_ziproxy_flags == NULL)
+		return (0);
+	return (strstr (x_ziproxy_flags, DELTA_FLAG) != NULL);
+}
+
+/* (near end) appends the delta capability to the X-Ziproxy-Flags value */
+void delta_announce (char *flags, int flags_size)
+{
+	int len = strlen (flags);
+
+	if (! AnnounceDeltaCapability)
+		return;
+	snprintf (flags + len, flags_size - len, "%s%s", (len > 0) ? ", " : "", DELTA_FLAG);
+}
+
+/* far end: takes note of the version held by the near Ziproxy.
+ * near end: announces the version we hold (if any).
+ * DELTA_BASE_HEADER is never forwarded as received. */
+void delta_prepare_request (http_headers *chdr)
+{
+	const char *value;
+	char new_header [64];
+	int i = 0;
+
+	if (DeltaEncodeHTML) {
+		requested_base_id [0] = '\0';
+		if ((value = find_header (DELTA_BASE_HEADER ":", chdr)) != NULL) {
+			while (*value == ' ')
+				value++;
+			while ((i < DELTA_ID_LEN) && (value [i] != '\0')) {
+				requested_base_id [i] = value [i];
+				i++;
+			}
+			requested_base_id [i] = '\0';
+			if (! delta_is_id (requested_base_id))
+				requested_base_id [0] = '\0';
+		}
+		remove_header_str (chdr, DELTA_BASE_HEADER ":");
+	} else if (AnnounceDeltaCapability) {
+		remove_header_str (chdr, DELTA_BASE_HEADER ":");
+		if ((strcasecmp (chdr->method, "GET") == 0) && (chdr->url != NULL) && (find_header ("Range:", chdr) == NULL)) {
+			delta_load_latest (chdr->url);
+			if (announced_base != NULL) {
+				snprintf (new_header, sizeof (new_header), "%s: %s", DELTA_BASE_HEADER, announced_base_id);
+				add_header (chdr, new_header);
+			}
+		}
+	}
+}
+
+/* (near end) whether the response carries differences instead of the page */
+int delta_is_encoded_response (const http_headers *shdr)
+{
+	const char *im;
+
+	if ((shdr->status != 226) || ((im = find_header ("IM:", shdr)) == NULL))
+		return (0);
+	return (strstr (im, DELTA_IM) != NULL);
+}
+
+/* (far end) stores the page about to be sent to the paired Ziproxy and
+ * replaces it with the differences from the version it holds, if worth.
+ * *inoutbuf must be a malloc'ed buffer, it may be replaced. */
+void delta_encode_response (const http_headers *chdr, http_headers *shdr, char **inoutbuf, ZP_DATASIZE_TYPE *inoutlen)
+{
+	char version_id [DELTA_ID_LEN + 1];
+	char dir [DELTA_PATH_LEN];
+	char path [DELTA_PATH_LEN + 258];
+	char new_header [64];
+	char *base, *new_buf;
+	unsigned char *delta;
+	size_t base_len, delta_len;
+
+	delta_version_id (version_id, *inoutbuf, *inoutlen);
+	delta_store (chdr->url, version_id, *inoutbuf, *inoutlen, DeltaCacheVersions);
+	snprintf (new_header, sizeof (new_header), "%s: %s", DELTA_VERSION_HEADER, version_id);
+	add_header (shdr, new_header);
+
+	if (requested_base_id [0] == '\0')
+		return;
+
+	delta_url_dir (dir, chdr->url);
+	snprintf (path, sizeof (path), "%s/%s", dir, requested_base_id);
+	if ((base = delta_read_file (path, &base_len)) == NULL) {
+		debug_log_printf ("Delta: base version %s no longer available, sending full page.\n", requested_base_id);
+		return;
+	}
+	delta = delta_compute ((unsigned char *) base, base_len, (unsigned char *) *inoutbuf, *inoutlen, &delta_len);
+	free (base);
+	if (delta == NULL)
+		return;
+
+	if (delta_len > ((*inoutlen / 100) * (100 - DeltaMinSaving))) {
+		debug_log_printf ("Delta: differences not worth (%lu of %"ZP_DATASIZE_STR" bytes), sending full page.\n", (unsigned long) delta_len, *inoutlen);
+		free (delta);
+		return;
+	}
+	if ((new_buf = realloc (delta, delta_len + 1)) == NULL) {
+		free (delta);
+		return;
+	}
+
+	debug_log_printf ("Delta: sending differences from version %s (%lu of %"ZP_DATASIZE_STR" bytes).\n", requested_base_id, (unsigned long) delta_len, *inoutlen);
+	free (*inoutbuf);
+	*inoutbuf = new_buf;
+	*inoutlen = delta_len;
+
+	delta_set_status (shdr, 226, "IM Used");
+	add_header (shdr, "IM: " DELTA_IM);
+	snprintf (new_header, sizeof (new_header), "Delta-Base: %s", requested_base_id);
+	add_header (shdr, new_header);
+}
+
+/* (near end) rebuilds the page if differences were sent,
+ * and stores the page as the version we hold (if tagged by the far Ziproxy).
+ * *inoutbuf must be a malloc'ed buffer, it may be replaced.
+ * returns: DELTA_OK, DELTA_NOT_APPLIED (full page) or DELTA_ERROR */
+int delta_decode_response (const http_headers *chdr, http_headers *shdr, char **inoutbuf, ZP_DATASIZE_TYPE *inoutlen)
+{
+	char version_id [DELTA_ID_LEN + 1];
+	char dir [DELTA_PATH_LEN];
+	char path [DELTA_PATH_LEN + 258];
+	const char *value;
+	char *page;
+	size_t page_len;
+	int ret = DELTA_NOT_APPLIED;
+
+	if (delta_is_encoded_response (shdr)) {
+		if (((value = find_header ("Delta-Base:", shdr)) == NULL) || (announced_base == NULL))
+			return (DELTA_ERROR);
+		while (*value == ' ')
+			value++;
+		if (strncmp (value, announced_base_id, DELTA_ID_LEN) != 0)
+			return (DELTA_ERROR);
+
+		if ((page = delta_apply (announced_base, announced_base_len, (unsigned char *) *inoutbuf, *inoutlen, &page_len)) == NULL) {
+			/* the version we hold is broken, don't use it again */
+			delta_url_dir (dir, chdr->url);
+			snprintf (path, sizeof (path), "%s/%s", dir, announced_base_id);
+			unlink (path);
+			return (DELTA_ERROR);
+		}
+
+		debug_log_printf ("Delta: page rebuilt from version %s (%"ZP_DATASIZE_STR" -> %lu bytes).\n", announced_base_id, *inoutlen, (unsigned long) page_len);
+		free (*inoutbuf);
+		*inoutbuf = page;
+		*inoutlen = page_len;
+
+		delta_set_status (shdr, 200, "OK");
+		remove_header_str (shdr, "IM:");
+		remove_header_str (shdr, "Delta-Base:");
+		ret = DELTA_OK;
+	}
+
+	if ((value = find_header (DELTA_VERSION_HEADER ":", shdr)) != NULL) {
+		while (*value == ' ')
+			value++;
+		delta_version_id (version_id, *inoutbuf, *inoutlen);
+		/* used as base for other users' requests, thus only shareable pages */
+		if ((strncmp (value, version_id, DELTA_ID_LEN) == 0) && coalesce_request_is_shareable (chdr) && coalesce_response_is_shareable (shdr))
+			delta_store (chdr->url, version_id, *inoutbuf, *inoutlen, 1);
+		remove_header_str (shdr, DELTA_VERSION_HEADER ":");
+	}
+
+	return (ret);
+}
+
@@ -0,0 +1,57 @@
+/* delta.h
+ * Delta encoding (RFC 3229-like) of HTML pages between paired Ziproxies
+ *
+ * Ziproxy - the HTTP acceleration proxy
+ * This code is under the following conditions:
+ *
+ * ---------------------------------------------------------------------
+ * Copyright (c)2005-2014 Daniel Mealha Cabrita
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111 USA
+ * ---------------------------------------------------------------------
+ */
+
+#include "http.h"
+
+//To stop multiple inclusions.
+#ifndef SRC_DELTA_H
+#define SRC_DELTA_H
+
+/* X-Ziproxy-Flags token announcing the capability */
+#define DELTA_FLAG		"delta"
+
+/* instance-manipulation (RFC 3229 "IM:" header) used for the differences */
+#define DELTA_IM		"x-ziproxy-delta"
+
+/* request header: version held by the near Ziproxy */
+#define DELTA_BASE_HEADER	"X-Ziproxy-Delta-Base"
+
+/* response header: version of the (full) page, to be used as base later */
+#define DELTA_VERSION_HEADER	"X-Ziproxy-Delta-Version"
+
+/* delta_decode_response() return codes */
+#define DELTA_OK		0
+#define DELTA_NOT_APPLIED	1	/* full body, nothing to be done */
+#define DELTA_ERROR		2	/* differences could not be applied */
+
+extern int delta_client_is_paired (const char *x_ziproxy_flags);
+extern void delta_announce (char *flags, int flags_size);
+extern void delta_prepare_request (http_headers *chdr);
+extern int delta_is_encoded_response (const http_headers *shdr);
+extern void delta_encode_response (const http_headers *chdr, http_headers *shdr, char **inoutbuf, ZP_DATASIZE_TYPE *inoutlen);
+extern int delta_decode_response (const http_headers *chdr, http_headers *shdr, char **inoutbuf, ZP_DATASIZE_TYPE *inoutlen);
+
+#endif //SRC_DELTA_H
+
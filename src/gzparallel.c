@@ -0,0 +1,262 @@
+/* gzparallel.c
+ * multi-threaded gzip compression
+ *
+ * Ziproxy - the HTTP acceleration proxy
+ * This code is under the following conditions:
+ *
+ * ---------------------------------------------------------------------
+ * Copyright (c)2005-2014 Daniel Mealha Cabrita
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111 USA
+ * ---------------------------------------------------------------------
+ */
+
+/* the input is split into blocks which are deflated by a pool of threads,
+ * each block primed with the last 32KB of the previous one (so the compression
+ * ratio is nearly the same as the serial one).
+ * every block but the last ends with a sync flush (byte-aligned, non-final),
+ * so their concatenation is a single valid deflate stream.
+ * the blocks are sent in order as soon as they are ready. */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#include "gzparallel.h"
+#include "cfgfile.h"
+#include "log.h"
+#include "tosmarking.h"
+#include "globaldefs.h"
+
+#define GZPARALLEL_BLOCK_LEN (128 * 1024)
+#define GZPARALLEL_DICT_LEN 32768
+#define GZPARALLEL_MAX_THREADS 64
+
+typedef struct {
+	const unsigned char *data;
+	unsigned int len;
+	int is_last;
+	unsigned char *out;
+	unsigned int out_len;
+	uLong crc;
+	int status;	/* Z_OK or error */
+	int done;
+} t_gzparallel_block;
+
+typedef struct {
+	const unsigned char *source;
+	int level;
+	int strategy;
+	t_gzparallel_block *blocks;
+	int blocks_total;
+	int next_block;	/* next block to be picked by a thread */
+	int abort;	/* !=0: stop picking new blocks */
+	pthread_mutex_t mutex;
+	pthread_cond_t block_done;
+} t_gzparallel_job;
+
+/* deflates one block (raw deflate, to be concatenated with the others) */
+static void gzparallel_deflate_block (t_gzparallel_job *job, t_gzparallel_block *block)
+{
+	z_stream strm;
+	unsigned int bound;
+	int ret;
+
+	block->crc = crc32 (crc32 (0L, Z_NULL, 0), block->data, block->len);
+
+	strm.zalloc = Z_NULL;
+	strm.zfree = Z_NULL;
+	strm.opaque = Z_NULL;
+	if ((block->status = deflateInit2 (&strm, job->level, Z_DEFLATED, -15, 8, job->strategy)) != Z_OK)
+		return;
+
+	/* prime with the end of the previous block */
+	if (block->data != job->source) {
+		if (block->data - job->source >= GZPARALLEL_DICT_LEN)
+			deflateSetDictionary (&strm, block->data - GZPARALLEL_DICT_LEN, GZPARALLEL_DICT_LEN);
+		else
+			deflateSetDictionary (&strm, job->source, block->data - job->source);
+	}
+
+	/* room for the sync flush marker aswell */
+	bound = deflateBound (&strm, block->len) + 16;
+	if ((block->out = malloc (bound)) == NULL) {
+		(void)deflateEnd (&strm);
+		block->status = Z_MEM_ERROR;
+		return;
+	}
+
+	strm.next_in = (unsigned char *) block->data;
+	strm.avail_in = block->len;
+	strm.next_out = block->out;
+	strm.avail_out = bound;
+	ret = deflate (&strm, block->is_last ? Z_FINISH : Z_SYNC_FLUSH);
+	block->out_len = bound - strm.avail_out;
+
+	if ((block->is_last && (ret != Z_STREAM_END)) || ((! block->is_last) && ((ret != Z_OK) || (strm.avail_in != 0) || (strm.avail_out == 0))))
+		block->status = Z_BUF_ERROR;
+	(void)deflateEnd (&strm);
+}
+
+static void *gzparallel_thread (void *given_job)
+{
+	t_gzparallel_job *job = (t_gzparallel_job *) given_job;
+	t_gzparallel_block *block;
+	int block_n;
+
+	while (1) {
+		pthread_mutex_lock (&job->mutex);
+		if (job->abort || (job->next_block >= job->blocks_total)) {
+			pthread_mutex_unlock (&job->mutex);
+			break;
+		}
+		block_n = job->next_block++;
+		pthread_mutex_unlock (&job->mutex);
+
+		block = &(job->blocks [block_n]);
+		gzparallel_deflate_block (job, block);
+
+		pthread_mutex_lock (&job->mutex);
+		block->done = 1;
+		pthread_cond_broadcast (&job->block_done);
+		pthread_mutex_unlock (&job->mutex);
+	}
+
+	return (NULL);
+}
+
+/* Compress inlen bytes from source to file dest (gzip format), using
+   up to 'threads' threads.
+   returns: same as gzip_memory_stream() */
+int gzparallel_memory_stream (const char *source, FILE *dest, int level, int strategy, int threads, ZP_DATASIZE_TYPE inlen, ZP_DATASIZE_TYPE *outlen)
+{
+	t_gzparallel_job job;
+	t_gzparallel_block *block;
+	pthread_t tids [GZPARALLEL_MAX_THREADS];
+	int threads_running = 0;
+	unsigned char gzip_header[] = {0x1f, 0x8b, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff};
+	unsigned char gzip_footer[8];
+	uLong crc;
+	unsigned int last_write_bytes;
+	int ret = Z_OK;
+	int i;
+
+	*outlen = 0;
+
+	job.source = (const unsigned char *) source;
+	job.level = level;
+	job.strategy = strategy;
+	job.blocks_total = (inlen + GZPARALLEL_BLOCK_LEN - 1) / GZPARALLEL_BLOCK_LEN;
+	job.next_block = 0;
+	job.abort = 0;
+	if (job.blocks_total < 1)
+		job.blocks_total = 1;
+	if ((job.blocks = calloc (job.blocks_total, sizeof (t_gzparallel_block))) == NULL)
+		return (Z_MEM_ERROR);
+	for (i = 0; i < job.blocks_total; i++) {
+		block = &(job.blocks [i]);
+		block->data = job.source + ((ZP_DATASIZE_TYPE) i * GZPARALLEL_BLOCK_LEN);
+		block->len = (i == (job.blocks_total - 1)) ? inlen - ((ZP_DATASIZE_TYPE) i * GZPARALLEL_BLOCK_LEN) : GZPARALLEL_BLOCK_LEN;
+		block->is_last = (i == (job.blocks_total - 1));
+		block->status = Z_OK;
+	}
+	pthread_mutex_init (&job.mutex, NULL);
+	pthread_cond_init (&job.block_done, NULL);
+
+	/* launch threads */
+	if (threads > job.blocks_total)
+		threads = job.blocks_total;
+	if (threads > GZPARALLEL_MAX_THREADS)
+		threads = GZPARALLEL_MAX_THREADS;
+	while (threads_running < threads) {
+		if (pthread_create (&tids [threads_running], NULL, gzparallel_thread, &job) != 0)
+			break;
+		threads_running++;
+	}
+	debug_log_printf ("Parallel gzip: %d blocks, %d threads\n", job.blocks_total, threads_running);
+
+	/* no threads at all, do it ourselves */
+	if (threads_running == 0)
+		gzparallel_thread (&job);
+
+	/* new block started, send gzip header */
+	*outlen += fwrite (&gzip_header, 1, 10, dest); // gzip header
+	crc = crc32 (0L, Z_NULL, 0);
+
+	/* send blocks in order, as they're ready */
+	for (i = 0; (i < job.blocks_total) && (ret == Z_OK); i++) {
+		block = &(job.blocks [i]);
+
+		pthread_mutex_lock (&job.mutex);
+		while (block->done == 0)
+			pthread_cond_wait (&job.block_done, &job.mutex);
+		pthread_mutex_unlock (&job.mutex);
+
+		if ((ret = block->status) != Z_OK)
+			break;
+
+		crc = crc32_combine (crc, block->crc, block->len);
+		tosmarking_add_check_bytecount (block->out_len);	/* update TOS if necessary */
+		if ((last_write_bytes = fwrite(block->out, 1, block->out_len, dest)) != block->out_len || ferror(dest))
+			ret = Z_ERRNO;
+		*outlen += last_write_bytes;
+
+		/* update access log stats */
+		access_log_def_outlen(*outlen);
+
+		// If we are sending a big file down a slow line, we
+		// need to reset the alarm once a while.
+		if (ConnTimeout)
+			alarm(ConnTimeout);
+	}
+
+	/* stop (in case of error) and wait for threads to finish */
+	pthread_mutex_lock (&job.mutex);
+	job.abort = 1;
+	pthread_mutex_unlock (&job.mutex);
+	for (i = 0; i < threads_running; i++)
+		pthread_join (tids [i], NULL);
+
+	if (ret == Z_OK) {
+		/* block end, send gzip footer */
+		gzip_footer[0] = crc & 0xff;
+		gzip_footer[1] = (crc >> 8) & 0xff;
+		gzip_footer[2] = (crc >> 16) & 0xff;
+		gzip_footer[3] = (crc >> 24) & 0xff;
+		gzip_footer[4] = inlen & 0xff;
+		gzip_footer[5] = (inlen >> 8) & 0xff;
+		gzip_footer[6] = (inlen >> 16) & 0xff;
+		gzip_footer[7] = (inlen >> 24) & 0xff;
+		*outlen += fwrite(&gzip_footer, 1, 8, dest); // gzip footer
+	}
+
+	/* clean up and return */
+	for (i = 0; i < job.blocks_total; i++) {
+		if (job.blocks [i].out != NULL)
+			free (job.blocks [i].out);
+	}
+	free (job.blocks);
+	pthread_mutex_destroy (&job.mutex);
+	pthread_cond_destroy (&job.block_done);
+	return (ret);
+}
+
@@ -0,0 +1,37 @@
+/* gzparallel.h
+ * multi-threaded gzip compression
+ *
+ * Ziproxy - the HTTP acceleration proxy
+ * This code is under the following conditions:
+ *
+ * ---------------------------------------------------------------------
+ * Copyright (c)2005-2014 Daniel Mealha Cabrita
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111 USA
+ * ---------------------------------------------------------------------
+ */
+
+//To stop multiple inclusions.
+#ifndef SRC_GZPARALLEL_H
+#define SRC_GZPARALLEL_H
+
+#include <stdio.h>
+
+#include "globaldefs.h"
+
+int gzparallel_memory_stream (const char *source, FILE *dest, int level, int strategy, int threads, ZP_DATASIZE_TYPE inlen, ZP_DATASIZE_TYPE *outlen);
+
+#endif //SRC_GZPARALLEL_H
+
@@ -34,6 +34,9 @@
 #include <zlib.h>
 
 #include "gzpipe.h"
+#include "gzpolicy.h"
+#include "gzparallel.h"
+#include "ldgzip.h"
 #include "cfgfile.h"
 #include "log.h"
 #include "tosmarking.h"
@@ -54,7 +57,9 @@
    allocated for processing, Z_STREAM_ERROR if an invalid compression
    level is supplied, Z_VERSION_ERROR if the version of zlib.h and the
    version of the library linked do not match, or Z_ERRNO if there is
-   an error reading or writing the files. */
+   an error reading or writing the files.
+   If level is GZPOLICY_LEVEL_ADAPTIVE, level and strategy are decided
+   by gzpolicy_select() after reading the first data. */
 int gzip_stream_stream (FILE *source, FILE *dest, int level, ZP_DATASIZE_TYPE *inlen, ZP_DATASIZE_TYPE *outlen, int de_chunk)
 {
 	int ret, flush;
@@ -69,9 +74,17 @@ int gzip_stream_stream (FILE *source, FILE *dest, int level, ZP_DATASIZE_TYPE *i
 	int pending_chunk_len = 0;
 	int to_read_len = BUFSIZE;
 	int first_chunk = 1;
+	int adaptive = 0;
+	int strategy;
 
 	*inlen = 0;
 	*outlen = 0;
+
+	/* level to be decided once the first data is read */
+	if (level == GZPOLICY_LEVEL_ADAPTIVE) {
+		adaptive = 1;
+		level = Z_DEFAULT_COMPRESSION;
+	}
 	
 	/* allocate deflate state */
 	strm.zalloc = Z_NULL;
@@ -136,6 +149,13 @@ int gzip_stream_stream (FILE *source, FILE *dest, int level, ZP_DATASIZE_TYPE *i
 		flush = feof(source) ? Z_FINISH : Z_NO_FLUSH;
 		strm.next_in = in;
 
+		/* nothing compressed yet, parameters may be changed freely */
+		if (adaptive) {
+			adaptive = 0;
+			gzpolicy_select (in, strm.avail_in, &level, &strategy);
+			deflateParams (&strm, level, strategy);
+		}
+
 		/* run deflate() on input until output buffer not full, finish
 		   compression if all of source has been read in */
 		do {
@@ -320,6 +340,7 @@ int gunzip_stream_stream (FILE *source, FILE *dest, ZP_DATASIZE_TYPE *inlen, ZP_
 	return ret == Z_STREAM_END ? Z_OK : Z_DATA_ERROR;
 }
 
+/* same as gzip_stream_stream(), but from memory */
 int gzip_memory_stream (const char *source, FILE *dest, int level, ZP_DATASIZE_TYPE inlen, ZP_DATASIZE_TYPE *outlen)
 {
 	int ret;
@@ -330,15 +351,38 @@ int gzip_memory_stream (const char *source, FILE *dest, int level, ZP_DATASIZE_T
 	unsigned char gzip_footer[8];
 	uLong crc;
 	unsigned int last_write_bytes; // 'last_read_bytes' is 'strm.avail_in', so no need for a new variable
+	int strategy = Z_DEFAULT_STRATEGY;
 	
 	*outlen = 0;
+
+	if (level == GZPOLICY_LEVEL_ADAPTIVE)
+		gzpolicy_select ((const unsigned char *) source, (inlen > GZPOLICY_PROBE_LEN) ? GZPOLICY_PROBE_LEN : inlen, &level, &strategy);
+
+	/* big bodies are split among multiple threads */
+	if ((GzipParallelThreads > 1) && (inlen >= GzipParallelMinSize))
+		return (gzparallel_memory_stream (source, dest, level, strategy, GzipParallelThreads, inlen, outlen));
+
+#ifdef LIBDEFLATE
+	/* whole data is known, use the (faster) one-shot compressor
+	   (it has no strategy setting, though) */
+	if (strategy == Z_DEFAULT_STRATEGY) {
+		switch (ldgzip_memory_stream (source, dest, level, inlen, outlen)) {
+		case LDGZIP_OK:
+			return (Z_OK);
+		case LDGZIP_ERRNO:
+			return (Z_ERRNO);
+		default:
+			return (Z_MEM_ERROR);
+		}
+	}
+#endif
 	
 	/* allocate deflate state */
 	strm.zalloc = Z_NULL;
 	strm.zfree = Z_NULL;
 	strm.opaque = Z_NULL;
 	// ret = deflateInit(&strm, level);
-	ret = deflateInit2 (&strm, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+	ret = deflateInit2 (&strm, level, Z_DEFLATED, -15, 8, strategy);
 	if (ret != Z_OK)
 		return (ret);
 
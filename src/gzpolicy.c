@@ -0,0 +1,156 @@
+/* gzpolicy.c
+ * gzip compression level/strategy selection
+ *
+ * Ziproxy - the HTTP acceleration proxy
+ * This code is under the following conditions:
+ *
+ * ---------------------------------------------------------------------
+ * Copyright (c)2005-2014 Daniel Mealha Cabrita
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111 USA
+ * ---------------------------------------------------------------------
+ */
+
+/* picks the deflate level and strategy for the current response,
+ * according to its content-type, size, how compressible the first bytes are
+ * and how loaded the machine currently is.
+ * the level never goes above GzipLevel. */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <math.h>
+#include <zlib.h>
+
+#include "gzpolicy.h"
+#include "cfgfile.h"
+#include "log.h"
+#include "globaldefs.h"
+
+/* bodies bigger than that are not compressed with levels above GZPOLICY_BIG_BODY_LEVEL,
+ * (CPU cost grows faster than the gain, at that point) */
+#define GZPOLICY_BIG_BODY_LEN (1024 * 1024)
+#define GZPOLICY_BIG_BODY_LEVEL 6
+
+/* level used when the machine is loaded (half of GzipAdaptiveLoadHigh) */
+#define GZPOLICY_LOADED_LEVEL 5
+
+/* probes smaller than that are not evaluated (not meaningful) */
+#define GZPOLICY_PROBE_MIN_LEN 256
+
+/* entropy (in 1/100 bits per byte) from which data is considered
+ * practically incompressible */
+#define GZPOLICY_ENTROPY_HIGH 750
+
+/* current response */
+static const char *gzpolicy_content_type = NULL;
+static ZP_DATASIZE_TYPE gzpolicy_body_len = -1;
+
+/* defines the response to be compressed next.
+ * body_len may be -1 if unknown. */
+void gzpolicy_set_response (const char *content_type, ZP_DATASIZE_TYPE body_len)
+{
+	gzpolicy_content_type = content_type;
+	gzpolicy_body_len = body_len;
+}
+
+/* returns: Shannon entropy of data, in 1/100 bits per byte (0..800) */
+static int gzpolicy_entropy (const unsigned char *data, int data_len)
+{
+	int count [256];
+	double entropy = 0.0;
+	double freq;
+	int i;
+
+	memset (count, 0, sizeof (count));
+	for (i = 0; i < data_len; i++)
+		count [data [i]]++;
+
+	for (i = 0; i < 256; i++) {
+		if (count [i] != 0) {
+			freq = (double) count [i] / data_len;
+			entropy -= freq * log (freq);
+		}
+	}
+
+	return ((int) ((entropy / log (2.0)) * 100.0));
+}
+
+/* returns: 1-minute load average, in % per CPU (or -1, if unavailable) */
+static int gzpolicy_load (void)
+{
+	double loadavg;
+	long cpus;
+
+	if (getloadavg (&loadavg, 1) != 1)
+		return (-1);
+	if ((cpus = sysconf (_SC_NPROCESSORS_ONLN)) < 1)
+		cpus = 1;
+
+	return ((int) ((loadavg * 100.0) / cpus));
+}
+
+/* decides the deflate level and strategy for the current response.
+ * probe: the first bytes of the body (up to GZPOLICY_PROBE_LEN bytes are evaluated) */
+void gzpolicy_select (const unsigned char *probe, int probe_len, int *level, int *strategy)
+{
+	int entropy = -1;
+	int load = -1;
+
+	*level = GzipLevel;
+	*strategy = Z_DEFAULT_STRATEGY;
+
+	if (! GzipAdaptiveLevel)
+		return;
+
+	/* content-type: raw pictures/audio are better served by other strategies */
+	if (gzpolicy_content_type != NULL) {
+		if ((strncasecmp (gzpolicy_content_type, "image/", 6) == 0) && (strncasecmp (gzpolicy_content_type, "image/svg", 9) != 0))
+			*strategy = Z_RLE;
+		else if (strncasecmp (gzpolicy_content_type, "audio/", 6) == 0)
+			*strategy = Z_FILTERED;
+	}
+
+	/* compressibility: there's little to gain from (almost) random data */
+	if (probe_len > GZPOLICY_PROBE_LEN)
+		probe_len = GZPOLICY_PROBE_LEN;
+	if (probe_len >= GZPOLICY_PROBE_MIN_LEN) {
+		entropy = gzpolicy_entropy (probe, probe_len);
+		if (entropy >= GZPOLICY_ENTROPY_HIGH)
+			*level = Z_BEST_SPEED;
+	}
+
+	/* body size */
+	if ((gzpolicy_body_len > GZPOLICY_BIG_BODY_LEN) && (*level > GZPOLICY_BIG_BODY_LEVEL))
+		*level = GZPOLICY_BIG_BODY_LEVEL;
+
+	/* current load */
+	if ((load = gzpolicy_load ()) >= 0) {
+		if (load >= GzipAdaptiveLoadHigh)
+			*level = Z_BEST_SPEED;
+		else if ((load >= (GzipAdaptiveLoadHigh / 2)) && (*level > GZPOLICY_LOADED_LEVEL))
+			*level = GZPOLICY_LOADED_LEVEL;
+	}
+
+	debug_log_printf ("Gzip adaptive: level %d, strategy %d (entropy: %d, size: %"ZP_DATASIZE_STR", load: %d%%)\n",
+		*level, *strategy, entropy, gzpolicy_body_len, load);
+	access_log_define_gzip_level (*level);
+}
+
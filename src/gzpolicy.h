@@ -0,0 +1,43 @@
+/* gzpolicy.h
+ * gzip compression level/strategy selection
+ *
+ * Ziproxy - the HTTP acceleration proxy
+ * This code is under the following conditions:
+ *
+ * ---------------------------------------------------------------------
+ * Copyright (c)2005-2014 Daniel Mealha Cabrita
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111 USA
+ * ---------------------------------------------------------------------
+ */
+
+//To stop multiple inclusions.
+#ifndef SRC_GZPOLICY_H
+#define SRC_GZPOLICY_H
+
+#include "globaldefs.h"
+
+/* to be passed as 'level' to gzip_*_stream(),
+ * the actual level will be decided by gzpolicy_select() */
+#define GZPOLICY_LEVEL_ADAPTIVE -2
+
+/* amount of data (from the beginning of the body) used to evaluate compressibility */
+#define GZPOLICY_PROBE_LEN 4096
+
+void gzpolicy_set_response (const char *content_type, ZP_DATASIZE_TYPE body_len);
+void gzpolicy_select (const unsigned char *probe, int probe_len, int *level, int *strategy);
+
+#endif //SRC_GZPOLICY_H
+
@@ -0,0 +1,407 @@
+/* gzreopt.c
+ * gzip-to-gzip re-optimization (stream-to-stream)
+ *
+ * Ziproxy - the HTTP acceleration proxy
+ * This code is under the following conditions:
+ *
+ * ---------------------------------------------------------------------
+ * Copyright (c)2005-2014 Daniel Mealha Cabrita
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111 USA
+ * ---------------------------------------------------------------------
+ */
+
+/* gzipped data from the remote server is usually streamed unmodified,
+ * since recompressing it is mostly useless and adds latency.
+ * but some servers use low compression levels: here the first
+ * GZREOPT_PROBE_LEN bytes are decompressed and recompressed, and only if
+ * that saves enough the whole body is transcoded, otherwise the original
+ * data is sent. */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "gzreopt.h"
+#include "cfgfile.h"
+#include "log.h"
+#include "tosmarking.h"
+#include "globaldefs.h"
+
+#define BUFSIZE 16384
+#define GZREOPT_PROBE_LEN 65536
+
+/* state of the body being read from source */
+typedef struct {
+	int de_chunk;
+	int pending_chunk_len;
+	int first_chunk;
+	int finished;
+} t_gzreopt_source;
+
+/* where the recompressed data goes: dest or (if dest == NULL) a memory buffer */
+typedef struct {
+	FILE *dest;
+	ZP_DATASIZE_TYPE *outlen;
+	unsigned char *buf;
+	size_t buf_len;
+	size_t buf_size;
+} t_gzreopt_sink;
+
+/* decompression -> recompression state */
+typedef struct {
+	z_stream istrm;
+	z_stream ostrm;
+	uLong crc;
+	ZP_DATASIZE_TYPE raw_len;	/* decompressed bytes */
+	ZP_DATASIZE_TYPE gz_len;	/* compressed bytes fed (from remote) */
+	int member_ended;	/* !=0 if the current gzip member is over */
+	int max_ratio;
+	ZP_DATASIZE_TYPE min_eval;
+} t_gzreopt_state;
+
+static void gzreopt_source_init (t_gzreopt_source *src_state, int de_chunk)
+{
+	src_state->de_chunk = de_chunk;
+	src_state->pending_chunk_len = 0;
+	src_state->first_chunk = 1;
+	src_state->finished = 0;
+}
+
+/* reads up to max_len (<= BUFSIZE) bytes of the body into buf, de-chunking it if requested.
+ * src_state->finished is set once the end of the body is reached.
+ * returns: the number of bytes read */
+static size_t gzreopt_read (t_gzreopt_source *src_state, FILE *source, unsigned char *buf, int max_len)
+{
+	int to_read_len = max_len;
+	size_t read_len;
+
+	if (src_state->de_chunk) {
+		if (src_state->pending_chunk_len == 0) {
+			// discards chunk end CRLF
+			if (src_state->first_chunk == 0) {
+				fgetc (source);
+				fgetc (source);
+			} else {
+				src_state->first_chunk = 0;
+			}
+
+			if ((fscanf (source, "%x", &(src_state->pending_chunk_len)) != 1) || (src_state->pending_chunk_len <= 0)) {
+				// last chunk, the rest of source will be discarded
+				src_state->finished = 1;
+				return (0);
+			} else {
+				int prevchar = '\0';
+				int curchar = '\0';
+
+				// Eat any chunk-extension(RFC2616) up to CRLF.
+				while (! ((prevchar == '\r') && (curchar == '\n'))) {
+					prevchar = curchar;
+					if ((curchar = fgetc (source)) == EOF) {
+						src_state->finished = 1;
+						return (0);
+					}
+				}
+			}
+		}
+
+		if (src_state->pending_chunk_len < to_read_len)
+			to_read_len = src_state->pending_chunk_len;
+		src_state->pending_chunk_len -= to_read_len;
+	}
+
+	read_len = fread (buf, 1, to_read_len, source);
+	if (feof (source) || ferror (source))
+		src_state->finished = 1;
+
+	return (read_len);
+}
+
+static int gzreopt_sink_write (t_gzreopt_sink *sink, const unsigned char *data, size_t len)
+{
+	size_t last_write_bytes;
+	unsigned char *new_buf;
+
+	if (len == 0)
+		return (Z_OK);
+
+	if (sink->dest == NULL) {
+		if ((sink->buf_len + len) > sink->buf_size) {
+			if ((new_buf = realloc (sink->buf, (sink->buf_len + len) * 2)) == NULL)
+				return (Z_MEM_ERROR);
+			sink->buf = new_buf;
+			sink->buf_size = (sink->buf_len + len) * 2;
+		}
+		memcpy (sink->buf + sink->buf_len, data, len);
+		sink->buf_len += len;
+		return (Z_OK);
+	}
+
+	tosmarking_add_check_bytecount (len);	/* update TOS if necessary */
+	last_write_bytes = fwrite (data, 1, len, sink->dest);
+	*(sink->outlen) += last_write_bytes;
+
+	/* update access log stats */
+	access_log_def_outlen(*(sink->outlen));
+
+	if ((last_write_bytes != len) || ferror (sink->dest))
+		return (Z_ERRNO);
+	return (Z_OK);
+}
+
+/* runs deflate() with 'flush' on the pending input, sending the output to sink */
+static int gzreopt_deflate (t_gzreopt_state *state, int flush, t_gzreopt_sink *sink)
+{
+	unsigned char out [BUFSIZE];
+	int ret;
+
+	do {
+		state->ostrm.avail_out = BUFSIZE;
+		state->ostrm.next_out = out;
+		ret = deflate (&(state->ostrm), flush);
+		if (ret == Z_STREAM_ERROR)
+			return (Z_STREAM_ERROR);
+		if ((ret = gzreopt_sink_write (sink, out, BUFSIZE - state->ostrm.avail_out)) != Z_OK)
+			return (ret);
+	} while (state->ostrm.avail_out == 0);
+
+	return (Z_OK);
+}
+
+/* decompresses len bytes of gzip data and recompresses them into sink.
+ * returns: Z_OK, Z_DATA_ERROR (broken data, or decompression ratio exceeded)
+ * 	or other Z_* errors */
+static int gzreopt_recompress (t_gzreopt_state *state, const unsigned char *data, size_t len, t_gzreopt_sink *sink)
+{
+	unsigned char mid [BUFSIZE];
+	size_t have;
+	int iret, ret;
+
+	state->istrm.next_in = (unsigned char *) data;
+	state->istrm.avail_in = len;
+	state->gz_len += len;
+
+	while (state->istrm.avail_in > 0) {
+		/* multiple gzip members, anything else after the end is ignored (as gunzip does) */
+		if (state->member_ended) {
+			if ((state->istrm.avail_in >= 2) && (state->istrm.next_in [0] == 0x1f) && (state->istrm.next_in [1] == 0x8b)) {
+				inflateReset (&(state->istrm));
+				state->member_ended = 0;
+			} else {
+				state->istrm.avail_in = 0;
+				break;
+			}
+		}
+
+		state->istrm.avail_out = BUFSIZE;
+		state->istrm.next_out = mid;
+		iret = inflate (&(state->istrm), Z_NO_FLUSH);
+		switch (iret) {
+		case Z_NEED_DICT:
+		case Z_DATA_ERROR:
+		case Z_STREAM_ERROR:
+			return (Z_DATA_ERROR);
+		case Z_MEM_ERROR:
+			return (Z_MEM_ERROR);
+		case Z_STREAM_END:
+			state->member_ended = 1;
+			break;
+		}
+		have = BUFSIZE - state->istrm.avail_out;
+		state->crc = crc32 (state->crc, mid, have);
+		state->raw_len += have;
+
+		/* evaluate whether decompression rate is exceeded */
+		if ((state->max_ratio != 0) && (state->raw_len >= state->min_eval)) {
+			if (((state->gz_len * state->max_ratio) / 100) < state->raw_len) {
+				access_log_set_flags (LOG_AC_FLAG_LLCOMP_TOO_EXPANSIVE);
+				debug_log_puts ("stream gzip reoptimization: Decompression ratio exceeded. Aborting.");
+				return (Z_DATA_ERROR);
+			}
+		}
+
+		state->ostrm.next_in = mid;
+		state->ostrm.avail_in = have;
+		if ((ret = gzreopt_deflate (state, Z_NO_FLUSH, sink)) != Z_OK)
+			return (ret);
+
+		/* no progress possible (truncated data) */
+		if ((have == 0) && (iret == Z_BUF_ERROR))
+			break;
+	}
+
+	return (Z_OK);
+}
+
+/* copies the rest of the body (raw) from source to dest */
+static int gzreopt_forward (t_gzreopt_source *src_state, FILE *source, FILE *dest, ZP_DATASIZE_TYPE *inlen, ZP_DATASIZE_TYPE *outlen)
+{
+	t_gzreopt_sink sink = {dest, outlen, NULL, 0, 0};
+	unsigned char in [BUFSIZE];
+	size_t in_len;
+	int ret;
+
+	while (! src_state->finished) {
+		in_len = gzreopt_read (src_state, source, in, BUFSIZE);
+		*inlen += in_len;
+		access_log_def_inlen(*inlen);
+		if ((ret = gzreopt_sink_write (&sink, in, in_len)) != Z_OK)
+			return (ret);
+
+		// If we are sending a big file down a slow line, we
+		// need to reset the alarm once a while.
+		if (ConnTimeout)
+			alarm(ConnTimeout);
+	}
+
+	return (ferror (source) ? Z_ERRNO : Z_OK);
+}
+
+/* Stream gzip data from source to dest, recompressing it with 'level' if
+   the first GZREOPT_PROBE_LEN bytes show a saving of at least min_saving (%).
+   Otherwise (or if the data can't be decompressed) the original data is sent.
+   inlen is the (compressed) data read from source, outlen the data sent to dest.
+   returns Z_OK on success, Z_DATA_ERROR if the data was broken
+   after transcoding had started (or the decompression ratio was exceeded),
+   Z_MEM_ERROR if memory could not be allocated for processing,
+   or Z_ERRNO if there is an error reading or writing the files. */
+int gzreopt_stream_stream (FILE *source, FILE *dest, int level, int min_saving, ZP_DATASIZE_TYPE *inlen, ZP_DATASIZE_TYPE *outlen, int de_chunk, int max_ratio, ZP_DATASIZE_TYPE min_eval)
+{
+	t_gzreopt_source src_state;
+	t_gzreopt_state state;
+	t_gzreopt_sink mem_sink = {NULL, NULL, NULL, 0, 0};
+	t_gzreopt_sink dest_sink = {dest, outlen, NULL, 0, 0};
+	unsigned char gzip_header[] = {0x1f, 0x8b, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff};
+	unsigned char gzip_footer[8];
+	unsigned char *probe;
+	unsigned char in [BUFSIZE];
+	size_t probe_len = 0;
+	size_t in_len;
+	ZP_DATASIZE_TYPE projected_len;
+	int saving = 0;
+	int ret;
+
+	*inlen = 0;
+	*outlen = 0;
+
+	if ((probe = malloc (GZREOPT_PROBE_LEN)) == NULL)
+		return (Z_MEM_ERROR);
+
+	gzreopt_source_init (&src_state, de_chunk);
+
+	/* collect the first data */
+	while ((probe_len < GZREOPT_PROBE_LEN) && (! src_state.finished)) {
+		in_len = GZREOPT_PROBE_LEN - probe_len;
+		probe_len += gzreopt_read (&src_state, source, probe + probe_len, (in_len > BUFSIZE) ? BUFSIZE : in_len);
+	}
+	*inlen = probe_len;
+	access_log_def_inlen(*inlen);
+
+	memset (&state, 0, sizeof (state));
+	state.crc = crc32 (0L, Z_NULL, 0);
+	state.max_ratio = max_ratio;
+	state.min_eval = min_eval;
+	if (inflateInit2 (&(state.istrm), 15 + 16) != Z_OK) {
+		free (probe);
+		return (Z_MEM_ERROR);
+	}
+	if (deflateInit2 (&(state.ostrm), level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		(void)inflateEnd (&(state.istrm));
+		free (probe);
+		return (Z_MEM_ERROR);
+	}
+
+	/* how would it look like, recompressed? */
+	ret = gzreopt_recompress (&state, probe, probe_len, &mem_sink);
+	if (ret == Z_OK)
+		ret = gzreopt_deflate (&state, (src_state.finished && state.member_ended) ? Z_FINISH : Z_SYNC_FLUSH, &mem_sink);
+	if ((ret == Z_OK) && (probe_len > 0)) {
+		projected_len = sizeof (gzip_header) + mem_sink.buf_len + sizeof (gzip_footer);
+		saving = ((((ZP_DATASIZE_TYPE) probe_len) - projected_len) * 100) / (ZP_DATASIZE_TYPE) probe_len;
+		debug_log_printf ("Gzip reoptimization: %d bytes -> %"ZP_DATASIZE_STR" bytes (%d%% saving, required: %d%%)\n",
+			(int) probe_len, projected_len, saving, min_saving);
+	}
+
+	/* not worth (or not possible), send the original data */
+	if ((ret != Z_OK) || (saving < min_saving)) {
+		(void)inflateEnd (&(state.istrm));
+		(void)deflateEnd (&(state.ostrm));
+		if (mem_sink.buf != NULL)
+			free (mem_sink.buf);
+
+		if (ret == Z_DATA_ERROR)
+			debug_log_puts ("Gzip reoptimization: unable to decompress data. Forwarding unmodified data.");
+		if ((ret = gzreopt_sink_write (&dest_sink, probe, probe_len)) == Z_OK)
+			ret = gzreopt_forward (&src_state, source, dest, inlen, outlen);
+		free (probe);
+		return (ret);
+	}
+	free (probe);
+
+	/* it's worth, send what was recompressed so far and go on */
+	ret = gzreopt_sink_write (&dest_sink, gzip_header, sizeof (gzip_header));
+	if (ret == Z_OK)
+		ret = gzreopt_sink_write (&dest_sink, mem_sink.buf, mem_sink.buf_len);
+	free (mem_sink.buf);
+
+	while ((ret == Z_OK) && (! src_state.finished)) {
+		in_len = gzreopt_read (&src_state, source, in, BUFSIZE);
+		*inlen += in_len;
+		access_log_def_inlen(*inlen);
+
+		if (ferror(source)) {
+			debug_log_puts ("stream gzip reoptimization: IO error (source). Aborting.");
+			ret = Z_ERRNO;
+			break;
+		}
+		ret = gzreopt_recompress (&state, in, in_len, &dest_sink);
+
+		// If we are sending a big file down a slow line, we
+		// need to reset the alarm once a while.
+		if (ConnTimeout)
+			alarm(ConnTimeout);
+	}
+
+	/* the data must end properly, otherwise the client gets broken data */
+	if ((ret == Z_OK) && (! state.member_ended))
+		ret = Z_DATA_ERROR;
+
+	/* finish stream, send gzip footer */
+	if (ret == Z_OK) {
+		if ((ret = gzreopt_deflate (&state, Z_FINISH, &dest_sink)) == Z_OK) {
+			gzip_footer[0] = state.crc & 0xff;
+			gzip_footer[1] = (state.crc >> 8) & 0xff;
+			gzip_footer[2] = (state.crc >> 16) & 0xff;
+			gzip_footer[3] = (state.crc >> 24) & 0xff;
+			gzip_footer[4] = state.raw_len & 0xff;
+			gzip_footer[5] = (state.raw_len >> 8) & 0xff;
+			gzip_footer[6] = (state.raw_len >> 16) & 0xff;
+			gzip_footer[7] = (state.raw_len >> 24) & 0xff;
+			ret = gzreopt_sink_write (&dest_sink, gzip_footer, sizeof (gzip_footer));
+		}
+	}
+
+	/* clean up and return */
+	(void)inflateEnd (&(state.istrm));
+	(void)deflateEnd (&(state.ostrm));
+	return (ret);
+}
+
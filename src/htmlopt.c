@@ -24,10 +24,54 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "htmlopt.h"
 #include "fstring.h"
 
+/* vectorized scanning, if the compiler targets a CPU with such instructions
+ * (SSE2 is always present on x86_64, AVX2 requires -mavx2 or similar).
+ * not with AddressSanitizer, which reports the (harmless) aligned reads past '\0' */
+#if defined(__SANITIZE_ADDRESS__)
+#define SCAN_NO_SIMD
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define SCAN_NO_SIMD
+#endif
+#endif
+
+#if defined(SCAN_NO_SIMD)
+/* scalar code only */
+#elif defined(__AVX2__)
+#include <immintrin.h>
+#define SCAN_SIMD
+#define SCAN_VLEN		32
+#define SCAN_VEC		__m256i
+#define SCAN_LOAD(p)		_mm256_load_si256 ((const __m256i *) (p))
+#define SCAN_LOADU(p)		_mm256_loadu_si256 ((const __m256i *) (p))
+#define SCAN_SET1(c)		_mm256_set1_epi8 ((char) (c))
+#define SCAN_EQ(a,b)		_mm256_cmpeq_epi8 ((a), (b))
+#define SCAN_OR(a,b)		_mm256_or_si256 ((a), (b))
+#define SCAN_MINU(a,b)		_mm256_min_epu8 ((a), (b))
+#define SCAN_SUB(a,b)		_mm256_sub_epi8 ((a), (b))
+#define SCAN_MASK(a)		((unsigned int) _mm256_movemask_epi8 (a))
+#define SCAN_FULLMASK		0xffffffffU
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define SCAN_SIMD
+#define SCAN_VLEN		16
+#define SCAN_VEC		__m128i
+#define SCAN_LOAD(p)		_mm_load_si128 ((const __m128i *) (p))
+#define SCAN_LOADU(p)		_mm_loadu_si128 ((const __m128i *) (p))
+#define SCAN_SET1(c)		_mm_set1_epi8 ((char) (c))
+#define SCAN_EQ(a,b)		_mm_cmpeq_epi8 ((a), (b))
+#define SCAN_OR(a,b)		_mm_or_si128 ((a), (b))
+#define SCAN_MINU(a,b)		_mm_min_epu8 ((a), (b))
+#define SCAN_SUB(a,b)		_mm_sub_epi8 ((a), (b))
+#define SCAN_MASK(a)		((unsigned int) _mm_movemask_epi8 (a))
+#define SCAN_FULLMASK		0xffffU
+#endif
+
 enum chunk_type {CT_HTML_TAG_OTHER,
 		CT_HTML_TEXT,
 		CT_HTML_PRE_TEXT,
@@ -46,6 +90,22 @@ typedef struct {
 	enum chunk_type	c_type;
 } chunk_info;
 
+/* end tag and/or spaces held (not outputted yet), since those may be dropped depending on what comes next */
+#define HTML_PENDING_MAX	32
+
+/* html optimizer state, kept between chunks */
+typedef struct {
+	int	allow_empty_html_text;	/* does not allow more than 1 empty text-chunk after another */
+	int	prev_el;	/* HTML_EL_* of the last element (tag) outputted or held */
+	int	p_open;	/* !=0: within "<p>", with nothing but inline elements after it */
+	int	no_quirks;	/* !=0: "<!DOCTYPE html>" seen (in quirks mode "<table>" does not close "<p>") */
+	int	pending_tag;	/* held end tag: index into html_optional_end [] */
+	int	pending_tag_len;
+	int	pending_space_len;
+	unsigned char	pending [HTML_PENDING_MAX];	/* pending_tag_len chars of the end tag, followed by pending_space_len chars of spaces */
+	int	lazy_seen;	/* "<img>" and "<iframe>" so far (HOPT_LAZY_LOAD) */
+} html_state;
+
 
 /* ### DEBUG ROUTINES */
 
@@ -61,6 +121,132 @@ void debug_dump_chunk_data (const char *chunkdata, int chunksize, const char *la
 
 /* END OF ### DEBUG ROUTINES */
 
+/* ### SCANNING ROUTINES */
+
+/* the NUL-terminated scans below read whole aligned blocks (which never cross a memory page),
+ * thus they may read (and ignore) a few bytes past the terminating '\0' */
+
+/* returns: pointer to the first occurrence of chr or '\0', whichever comes first */
+const unsigned char *scan_chr_or_nul (const unsigned char *src, const unsigned char chr)
+{
+#ifdef SCAN_SIMD
+	const unsigned char	*block = src - ((unsigned long) src % SCAN_VLEN);
+	SCAN_VEC	vchr = SCAN_SET1 (chr);
+	SCAN_VEC	vnul = SCAN_SET1 ('\0');
+	SCAN_VEC	data;
+	unsigned int	found;
+
+	data = SCAN_LOAD (block);
+	found = SCAN_MASK (SCAN_OR (SCAN_EQ (data, vchr), SCAN_EQ (data, vnul))) >> (src - block);
+	if (found)
+		return (src + __builtin_ctz (found));
+	for (;;) {
+		block += SCAN_VLEN;
+		data = SCAN_LOAD (block);
+		found = SCAN_MASK (SCAN_OR (SCAN_EQ (data, vchr), SCAN_EQ (data, vnul)));
+		if (found)
+			return (block + __builtin_ctz (found));
+	}
+#else
+	while ((*src != chr) && (*src != '\0'))
+		src++;
+	return (src);
+#endif
+}
+
+#ifdef SCAN_SIMD
+/* returns: bitmask of the positions in data matching '\0' or any of vset */
+static unsigned int scan_set_mask (SCAN_VEC data, const SCAN_VEC *vset, int setlen)
+{
+	SCAN_VEC	match = SCAN_EQ (data, SCAN_SET1 ('\0'));
+
+	while (setlen--)
+		match = SCAN_OR (match, SCAN_EQ (data, vset [setlen]));
+
+	return (SCAN_MASK (match));
+}
+#endif
+
+/* set: chars to be searched ('\0'-terminated string, up to 8 chars)
+ * returns: pointer to the first occurrence of any char from set, or '\0', whichever comes first */
+const unsigned char *scan_set_or_nul (const unsigned char *src, const unsigned char *set)
+{
+#ifdef SCAN_SIMD
+	const unsigned char	*block = src - ((unsigned long) src % SCAN_VLEN);
+	SCAN_VEC	vset [8];
+	unsigned int	found;
+	int		setlen = 0;
+
+	while ((setlen < 8) && (set [setlen] != '\0')) {
+		vset [setlen] = SCAN_SET1 (set [setlen]);
+		setlen++;
+	}
+
+	found = scan_set_mask (SCAN_LOAD (block), vset, setlen) >> (src - block);
+	if (found)
+		return (src + __builtin_ctz (found));
+	for (;;) {
+		block += SCAN_VLEN;
+		found = scan_set_mask (SCAN_LOAD (block), vset, setlen);
+		if (found)
+			return (block + __builtin_ctz (found));
+	}
+#else
+	return (src + strcspn ((const char *) src, (const char *) set));
+#endif
+}
+
+/* returns: how many of the first srclen chars are neither '\0', chr1 nor chr2 */
+int scan_2chr_span (const unsigned char *src, int srclen, const unsigned char chr1, const unsigned char chr2)
+{
+	int	spanlen = 0;
+#ifdef SCAN_SIMD
+	SCAN_VEC	vset [2];
+	unsigned int	found;
+
+	vset [0] = SCAN_SET1 (chr1);
+	vset [1] = SCAN_SET1 (chr2);
+	while ((srclen - spanlen) >= SCAN_VLEN) {
+		if ((found = scan_set_mask (SCAN_LOADU (src + spanlen), vset, 2)) != 0)
+			return (spanlen + __builtin_ctz (found));
+		spanlen += SCAN_VLEN;
+	}
+#endif
+	while ((spanlen < srclen) && (src [spanlen] != '\0') && (src [spanlen] != chr1) && (src [spanlen] != chr2))
+		spanlen++;
+
+	return (spanlen);
+}
+
+/* returns: how many of the first srclen chars are spaces (<= ' ') if want_space != 0,
+ * 	or non-spaces (> ' ') otherwise */
+int scan_space_span (const unsigned char *src, int srclen, int want_space)
+{
+	int	spanlen = 0;
+#ifdef SCAN_SIMD
+	SCAN_VEC	vspace = SCAN_SET1 (' ');
+	SCAN_VEC	data;
+	unsigned int	spaces;
+
+	while ((srclen - spanlen) >= SCAN_VLEN) {
+		data = SCAN_LOADU (src + spanlen);
+		/* (x <= ' ') <=> (min (x, ' ') == x) */
+		spaces = SCAN_MASK (SCAN_EQ (SCAN_MINU (data, vspace), data));
+		if (! want_space)
+			spaces = (~spaces) & SCAN_FULLMASK;
+		if (spaces != SCAN_FULLMASK)
+			return (spanlen + __builtin_ctz (~spaces));
+		spanlen += SCAN_VLEN;
+	}
+#endif
+	while ((spanlen < srclen) && ((src [spanlen] <= ' ') == (want_space != 0)))
+		spanlen++;
+
+	return (spanlen);
+}
+
+/* END OF ### SCANNING ROUTINES */
+
 /* similar to strcpy(), except is allows overlapping strings */
 /* NOTE: this is not truly overlapping, only if src >= dst */
 void strcpy_overlapping (const unsigned char *src, char *dst)
@@ -74,140 +260,863 @@ void strcpy_overlapping (const unsigned char *src, char *dst)
 /* NOTE: this is not truly overlapping, only if src >= dst */
 void strncpy_overlapping (const unsigned char *src, char *dst, int srclen)
 {
-	while (srclen--)
-		*(dst++) = *(src++);
+	memmove (dst, src, srclen);
 }
 
 
 /* ### STYLE OPTIMIZATION ROUTINES */
 
-/* returns:
- *   0 = non_concatenable (a-z, A-Z, 0-9, '_', '.', '#', '%')
- *  !0 = ok,concatenable (other) */
-int style_concatenable (const unsigned char *given_char)
+/* style text is parsed into items: the text up to '{', ';' or '}'
+ * (outside strings, comments, parentheses and brackets), or one of those chars alone.
+ * each item is minified according to what it is (selector, at-rule, declaration)
+ * and to the kind of block it's in, which allows structural optimizations:
+ * empty rules are removed, the last ';' of a block is dropped,
+ * adjacent rules with the same selector are merged, numbers and colors are shortened.
+ * items are minified while their end is searched for, as what they're most likely to be,
+ * and minified again (from the source, which is left intact) if that turns out wrong. */
+
+/* kind of block (CSS_CTX_*, possibly OR'ed with CSS_CTXF_*) */
+#define CSS_CTX_RULES		0	/* rules: top level, @media, @supports etc */
+#define CSS_CTX_KEYFRAMES	1	/* keyframe rules: @keyframes */
+#define CSS_CTX_DECLS		2	/* declarations (maybe nested rules too): rules, @font-face, @page etc */
+#define CSS_CTX_MASK		3
+#define CSS_CTXF_MERGEABLE	4	/* plain rule within CSS_CTX_RULES */
+#define CSS_CTXF_NESTED		8	/* contains another block */
+
+/* blocks nested deeper than that are minified as declarations (no structural changes) */
+#define CSS_MAX_DEPTH		32
+
+/* rules with longer selectors are not merged */
+#define CSS_MAX_SELECTOR	256
+
+/* how to minify an item */
+#define CSS_MODE_SELECTOR	0
+#define CSS_MODE_PRELUDE	1	/* at-rules, property names and anything not recognized */
+#define CSS_MODE_VALUE		2	/* declaration values */
+
+/* declaration value optimizations */
+#define CSS_VAL_SHORTEN		1	/* numbers and colors */
+#define CSS_VAL_ZERO_UNITS	2	/* "0px" -> "0" */
+
+/* char classes */
+#define CSS_CC_BLANK		1
+#define CSS_CC_NAME		2	/* may be part of an identifier */
+#define CSS_CC_PLAIN		4	/* neither blank nor any of CSS_SPECIAL_CHARS */
+#define CSS_CC_DIGIT		8
+#define CSS_CC_HEX		16
+#define CSS_CC_END		32	/* may end an item */
+
+/* chars which delimit items, strings, comments, escapes and blocks */
+#define CSS_SPECIAL_CHARS	"{};\"'/()[]\\"
+
+/* style optimizer state, kept between calls when streaming */
+typedef struct {
+	int		depth;	/* blocks currently open */
+	unsigned char	ctx [CSS_MAX_DEPTH];	/* kind of each open block, ctx [0] is the top level */
+	int		pending_semicolon;	/* a declaration ended with ';', not outputted yet */
+	int		prev_closed;	/* !=0 if the last char outputted is the '}' of a rule with 'selector' */
+	int		selector_len;
+	unsigned char	selector [CSS_MAX_SELECTOR];
+} css_state;
+
+static unsigned char	css_cc [256];
+static int		css_cc_ready = 0;
+#ifdef SCAN_SIMD
+static SCAN_VEC		css_special_vec [sizeof (CSS_SPECIAL_CHARS) - 1];
+#endif
+
+static void css_cc_init (void)
 {
-	int	concatenable = 0;
-	
-	switch (*given_char) {
-	case ':':
-	case ';':
-	case ',':
-//	case '.':
-//	case '#':
-	case '{':
-	case '}':
-		concatenable = 1;
+	int	c;
+
+	for (c = 0; c < 256; c++) {
+		css_cc [c] = 0;
+		if (c <= ' ')
+			css_cc [c] |= CSS_CC_BLANK;
+		else if (strchr (CSS_SPECIAL_CHARS, c) == NULL)
+			css_cc [c] |= CSS_CC_PLAIN;
+		if (((c >= 'a') && (c <= 'z')) || ((c >= 'A') && (c <= 'Z')) || ((c >= '0') && (c <= '9')) || (c == '-') || (c == '_') || (c == '\\') || (c >= 0x80))
+			css_cc [c] |= CSS_CC_NAME;
+		if ((c == '{') || (c == ';') || (c == '}'))
+			css_cc [c] |= CSS_CC_END;
+		if ((c >= '0') && (c <= '9'))
+			css_cc [c] |= CSS_CC_DIGIT | CSS_CC_HEX;
+		if (((c >= 'a') && (c <= 'f')) || ((c >= 'A') && (c <= 'F')))
+			css_cc [c] |= CSS_CC_HEX;
 	}
+#ifdef SCAN_SIMD
+	for (c = 0; c < sizeof (CSS_SPECIAL_CHARS) - 1; c++)
+		css_special_vec [c] = SCAN_SET1 (CSS_SPECIAL_CHARS [c]);
+#endif
+	css_cc_ready = 1;
+}
 
-	return (concatenable);
+/* returns: how many of the first srclen chars are CSS_CC_PLAIN */
+static int css_plain_span (const unsigned char *src, int srclen)
+{
+	int	spanlen = 0;
+#ifdef SCAN_SIMD
+	SCAN_VEC	vspace = SCAN_SET1 (' ');
+	SCAN_VEC	data, match;
+	unsigned int	found;
+	int	i;
+
+	while ((srclen - spanlen) >= SCAN_VLEN) {
+		data = SCAN_LOADU (src + spanlen);
+		/* (x <= ' ') <=> (min (x, ' ') == x) */
+		match = SCAN_EQ (SCAN_MINU (data, vspace), data);
+		for (i = 0; i < sizeof (CSS_SPECIAL_CHARS) - 1; i++)
+			match = SCAN_OR (match, SCAN_EQ (data, css_special_vec [i]));
+		if ((found = SCAN_MASK (match)) != 0)
+			return (spanlen + __builtin_ctz (found));
+		spanlen += SCAN_VLEN;
+	}
+#endif
+	while ((spanlen < srclen) && (css_cc [src [spanlen]] & CSS_CC_PLAIN))
+		spanlen++;
+
+	return (spanlen);
 }
 
-/* src: source style text
- * dst: destination of compressed text
+/* returns: how many of the first srclen chars are CSS_CC_NAME, except '\\' */
+static int css_name_span (const unsigned char *src, int srclen)
+{
+	int	spanlen = 0;
+#ifdef SCAN_SIMD
+	SCAN_VEC	data, t, name;
+	unsigned int	found;
+
+	while ((srclen - spanlen) >= SCAN_VLEN) {
+		data = SCAN_LOADU (src + spanlen);
+		/* letters: ((x | 0x20) - 'a') <= 25, digits: (x - '0') <= 9 (unsigned, see scan_space_span()) */
+		t = SCAN_SUB (SCAN_OR (data, SCAN_SET1 (0x20)), SCAN_SET1 ('a'));
+		name = SCAN_EQ (SCAN_MINU (t, SCAN_SET1 (25)), t);
+		t = SCAN_SUB (data, SCAN_SET1 ('0'));
+		name = SCAN_OR (name, SCAN_EQ (SCAN_MINU (t, SCAN_SET1 (9)), t));
+		name = SCAN_OR (name, SCAN_OR (SCAN_EQ (data, SCAN_SET1 ('-')), SCAN_EQ (data, SCAN_SET1 ('_'))));
+		/* anything >= 0x80 */
+		found = (~SCAN_MASK (name)) & (~SCAN_MASK (data)) & SCAN_FULLMASK;
+		if (found)
+			return (spanlen + __builtin_ctz (found));
+		spanlen += SCAN_VLEN;
+	}
+#endif
+	while ((spanlen < srclen) && (css_cc [src [spanlen]] & CSS_CC_NAME) && (src [spanlen] != '\\'))
+		spanlen++;
+
+	return (spanlen);
+}
+
+/* returns: !=0 if src (srclen chars) begins with 'name' (lowercase), non-case sensitive */
+static int css_name_begins (const unsigned char *src, int srclen, const char *name)
+{
+	while (*name != '\0') {
+		if ((srclen-- <= 0) || (lowercase_table [*(src++)] != (unsigned char) *name))
+			return (0);
+		name++;
+	}
+	return (1);
+}
+
+/* returns: !=0 if src (srclen chars) is 'name' (lowercase), non-case sensitive */
+static int css_name_is (const unsigned char *src, int srclen, const char *name)
+{
+	return ((srclen == (int) strlen (name)) && css_name_begins (src, srclen, name));
+}
+
+/* returns: pointer to 'name' past its vendor prefix (such as "-webkit-"), if any */
+static const unsigned char *css_skip_vendor_prefix (const unsigned char *name, const unsigned char *end)
+{
+	const unsigned char	*pos;
+
+	if ((name < end) && (*name == '-')) {
+		for (pos = name + 1; (pos < end) && (*pos != '-') && (css_cc [*pos] & CSS_CC_NAME); pos++);
+		if ((pos < end) && (*pos == '-'))
+			return (pos + 1);
+	}
+	return (name);
+}
+
+/* src: points to the beginning of a comment
+ * returns: pointer just past its end, or NULL if it does not end before 'end' */
+static const unsigned char *css_skip_comment (const unsigned char *src, const unsigned char *end)
+{
+	src += 2;
+	while ((src < end) && ((src = memchr (src, '*', end - src)) != NULL)) {
+		if ((src + 1 < end) && (*(src + 1) == '/'))
+			return (src + 2);
+		src++;
+	}
+	return (NULL);
+}
+
+/* src: points to the opening quote
+ * returns: pointer just past the string (a line break ends it too, as in browsers) */
+static const unsigned char *css_skip_string (const unsigned char *src, const unsigned char *end)
+{
+	unsigned char	quote_char = *(src++);
+#ifdef SCAN_SIMD
+	SCAN_VEC	vset [3];
+	unsigned int	found;
+
+	vset [0] = SCAN_SET1 (quote_char);
+	vset [1] = SCAN_SET1 ('\\');
+	vset [2] = SCAN_SET1 ('\n');
+#endif
+
+	while (src < end) {
+#ifdef SCAN_SIMD
+		/* skips blocks of chars which are none of those below (nor '\0') */
+		if (end - src >= SCAN_VLEN) {
+			if ((found = scan_set_mask (SCAN_LOADU (src), vset, 3)) == 0) {
+				src += SCAN_VLEN;
+				continue;
+			}
+			src += __builtin_ctz (found);
+		}
+#endif
+		if (*src == '\\') {
+			/* escaped line break (maybe CR+LF) */
+			src += ((src + 2 < end) && (src [1] == '\r') && (src [2] == '\n')) ? 3 : 2;
+		} else if (*src == quote_char) {
+			return (src + 1);
+		} else if (*src == '\n') {
+			return (src);
+		} else {
+			src++;
+		}
+	}
+	return (end);
+}
+
+/* src: points to '(' (just after "url")
+ * returns: pointer just past the end of url(...) if that's an unquoted url
+ * 	(which may contain chars such as ';' and '/', and is kept as is), or NULL otherwise */
+static const unsigned char *css_skip_unquoted_url (const unsigned char *src, const unsigned char *end)
+{
+	src++;
+	while ((src < end) && (css_cc [*src] & CSS_CC_BLANK))
+		src++;
+	if ((src < end) && ((*src == '"') || (*src == '\'')))
+		return (NULL);
+
+	while (src < end) {
+		if (*src == '\\')
+			src += 2;
+		else if (*(src++) == ')')
+			return (src);
+	}
+	return (end);
+}
+
+/* returns: !=0 if the chars just before src (after start) are the function name "url" */
+static int css_is_url_function (const unsigned char *start, const unsigned char *src)
+{
+	if ((src - start < 3) || (! css_name_is (src - 3, 3, "url")))
+		return (0);
+	return ((src - start == 3) || (! (css_cc [*(src - 4)] & CSS_CC_NAME)));
+}
+
+/* skips spaces and comments
+ * complete: set to 0 if there's an unterminated comment (end is returned, then)
+ * returns: pointer to the first char which is neither */
+static const unsigned char *css_skip_blanks (const unsigned char *src, const unsigned char *end, int *complete)
+{
+	*complete = 1;
+	while (src < end) {
+		if (css_cc [*src] & CSS_CC_BLANK) {
+			src++;
+		} else if ((*src == '/') && (src + 1 < end) && (*(src + 1) == '*')) {
+			if ((src = css_skip_comment (src, end)) == NULL) {
+				*complete = 0;
+				return (end);
+			}
+		} else {
+			break;
+		}
+	}
+	return (src);
+}
+
+/* returns: !=0 if a space is required between chars 'prev' and 'next' (when there's any) */
+static int css_space_required (unsigned char prev, unsigned char next, int mode)
+{
+	switch (mode) {
+	case CSS_MODE_SELECTOR:
+		/* not ':' '.' '[' etc, a space before those is a descendant combinator */
+		switch (prev) {
+		case ',': case '>': case '+': case '~': case '(':
+			return (0);
+		}
+		switch (next) {
+		case ',': case '>': case '+': case '~': case ')':
+			return (0);
+		}
+		break;
+	case CSS_MODE_PRELUDE:
+		/* not before '(' either, "and (" must not become a function */
+		switch (prev) {
+		case ',': case ':': case ';': case '(':
+			return (0);
+		}
+		switch (next) {
+		case ',': case ':': case ';': case ')':
+			return (0);
+		}
+		break;
+	case CSS_MODE_VALUE:
+		/* not around '+', '-' nor '*' (calc() requires spaces there) */
+		switch (prev) {
+		case ',': case '/': case '(': case '!':
+			return (0);
+		}
+		switch (next) {
+		case ',': case '/': case ')': case '!':
+			return (0);
+		}
+		break;
+	}
+	return (1);
+}
+
+/* writes the separation between the previous and the next (*src) chars to be outputted
+ * dst: where the previous chars were outputted (dstlen chars), or will be outputted
+ * space, comment: !=0 if spaces/comments were found between those chars
+ * returns: chars outputted */
+static int css_separate (const unsigned char *src, unsigned char *dst, int dstlen, int space, int comment, int mode)
+{
+	if (dstlen == 0)
+		return (0);
+
+	if (space) {
+		if (css_space_required (*(dst - 1), *src, mode)) {
+			*dst = ' ';
+			return (1);
+		}
+	} else if (comment && (css_cc [*(dst - 1)] & CSS_CC_NAME) && (css_cc [*src] & CSS_CC_NAME)) {
+		/* a comment separates tokens too, keep an empty one so those won't be joined */
+		memcpy (dst, "/**/", 4);
+		return (4);
+	}
+	return (0);
+}
+
+/* minifies an item (selector, at-rule etc. but not a declaration value) into dst
+ * (which must not overlap src)
+ * item_end: returns pointer to the char ending the item ('{', ';' or '}'), or 'end' if there's none
+ * returns: chars outputted */
+static int css_minify_item (const unsigned char *src, const unsigned char *end, unsigned char *dst, int mode, const unsigned char **item_end)
+{
+	const unsigned char	*next;
+	unsigned char	*wpos = dst;
+	int	space = 0;
+	int	comment = 0;
+	int	depth = 0;	/* parentheses and brackets */
+	int	cc, len;
+
+	while (src < end) {
+		cc = css_cc [*src];
+		if (cc & CSS_CC_BLANK) {
+			space = 1;
+			src++;
+			continue;
+		}
+		if ((*src == '/') && (src + 1 < end) && (*(src + 1) == '*')) {
+			next = css_skip_comment (src, end);
+			src = (next != NULL) ? next : end;
+			comment = 1;
+			continue;
+		}
+		if ((cc & CSS_CC_END) && (depth == 0))
+			break;
+
+		if (space || comment) {
+			wpos += css_separate (src, wpos, wpos - dst, space, comment, mode);
+			space = 0;
+			comment = 0;
+		}
+
+		if (cc & CSS_CC_PLAIN) {
+			len = css_plain_span (src, end - src);
+			memcpy (wpos, src, len);
+			wpos += len;
+			src += len;
+			continue;
+		}
+
+		if ((*src == '"') || (*src == '\'')) {
+			next = css_skip_string (src, end);
+		} else if (*src == '\\') {
+			next = (src + 2 < end) ? src + 2 : end;
+		} else if ((*src == '(') && css_is_url_function (dst, wpos) && ((next = css_skip_unquoted_url (src, end)) != NULL)) {
+			/* unquoted url, as is */
+		} else {
+			if ((*src == '(') || (*src == '['))
+				depth++;
+			else if (((*src == ')') || (*src == ']')) && depth)
+				depth--;
+			*(wpos++) = *(src++);
+			continue;
+		}
+		memcpy (wpos, src, next - src);
+		wpos += next - src;
+		src = next;
+	}
+
+	*item_end = src;
+	return (wpos - dst);
+}
+
+/* returns: !=0 if unit (unitlen chars) is an unit of length */
+static int css_is_length_unit (const unsigned char *unit, int unitlen)
+{
+	static const char	*length_units [] = {"px", "em", "rem", "ex", "ch", "vw", "vh", "vmin", "vmax", "cm", "mm", "q", "in", "pt", "pc", NULL};
+	int	i;
+
+	if ((unitlen < 1) || (unitlen > 4))
+		return (0);
+	for (i = 0; length_units [i] != NULL; i++) {
+		if (css_name_is (unit, unitlen, length_units [i]))
+			return (1);
+	}
+	return (0);
+}
+
+/* returns: !=0 if a number starts at src */
+static int css_is_number (const unsigned char *src, const unsigned char *end)
+{
+	if ((*src == '+') || (*src == '-'))
+		src++;
+	if ((src < end) && (*src == '.'))
+		src++;
+	return ((src < end) && (css_cc [*src] & CSS_CC_DIGIT));
+}
+
+/* copies the (few) chars from src up to src_end into dst
+ * returns: pointer just past the chars copied into dst */
+static unsigned char *css_copy_short (unsigned char *dst, const unsigned char *src, const unsigned char *src_end)
+{
+	while (src < src_end)
+		*(dst++) = *(src++);
+	return (dst);
+}
+
+/* outputs the number (including its unit) at src, shortened if possible
+ * src: points to the number, which ends at num_end
+ * returns: chars outputted */
+static int css_minify_number (const unsigned char *src, const unsigned char *num_end, unsigned char *dst, int flags, int depth)
+{
+	const unsigned char	*rpos = src;
+	const unsigned char	*int_start, *int_end, *frac_start, *frac_end;
+	unsigned char	*wpos = dst;
+	int	is_zero = 1;
+	int	int_is_zero;
+
+	if ((*rpos == '+') || (*rpos == '-'))
+		rpos++;
+	int_start = rpos;
+	while ((rpos < num_end) && (css_cc [*rpos] & CSS_CC_DIGIT)) {
+		if (*(rpos++) != '0')
+			is_zero = 0;
+	}
+	int_end = rpos;
+	int_is_zero = is_zero;
+	frac_start = frac_end = rpos;
+	if ((rpos < num_end) && (*rpos == '.')) {
+		frac_start = ++rpos;
+		while ((rpos < num_end) && (css_cc [*rpos] & CSS_CC_DIGIT)) {
+			if (*(rpos++) != '0')
+				is_zero = 0;
+		}
+		frac_end = rpos;
+		/* trailing zeros are useless */
+		while ((frac_end > frac_start) && (*(frac_end - 1) == '0'))
+			frac_end--;
+	}
+	/* rpos: the unit, if any */
+
+	if ((! (flags & CSS_VAL_SHORTEN)) || ((rpos < num_end) && ((*rpos | 0x20) == 'e') && (rpos + 1 < num_end) && (css_cc [*(rpos + 1)] & CSS_CC_DIGIT))) {
+		/* not allowed, or with exponent (leave that as is) */
+		return (css_copy_short (wpos, src, num_end) - dst);
+	}
+
+	if (is_zero) {
+		*(wpos++) = '0';
+		/* "0px" -> "0", but not within functions (such as calc()) */
+		if ((flags & CSS_VAL_ZERO_UNITS) && (depth == 0) && css_is_length_unit (rpos, num_end - rpos))
+			return (1);
+	} else if (frac_start == int_end) {
+		/* integer, as is */
+		wpos = css_copy_short (wpos, src, int_end);
+	} else {
+		/* "0.50" -> ".5", "1.0" -> "1" */
+		if (src != int_start)
+			*(wpos++) = *src;
+		if (! int_is_zero) {
+			wpos = css_copy_short (wpos, int_start, int_end);
+		}
+		if (frac_end > frac_start) {
+			*(wpos++) = '.';
+			wpos = css_copy_short (wpos, frac_start, frac_end);
+		}
+	}
+	wpos = css_copy_short (wpos, rpos, num_end);
+
+	return (wpos - dst);
+}
+
+/* minifies a declaration value into dst (which must not overlap src)
+ * flags: CSS_VAL_*
+ * item_end: same as in css_minify_item()
+ * returns: chars outputted */
+static int css_minify_value (const unsigned char *src, const unsigned char *end, unsigned char *dst, int flags, const unsigned char **item_end)
+{
+	const unsigned char	*next;
+	unsigned char	*wpos = dst;
+	int	space = 0;
+	int	comment = 0;
+	int	depth = 0;	/* parentheses and brackets */
+	int	cc, len;
+
+	while (src < end) {
+		cc = css_cc [*src];
+		if (! (cc & CSS_CC_PLAIN)) {
+			if (cc & CSS_CC_BLANK) {
+				space = 1;
+				src++;
+				continue;
+			}
+			if ((*src == '/') && (src + 1 < end) && (*(src + 1) == '*')) {
+				next = css_skip_comment (src, end);
+				src = (next != NULL) ? next : end;
+				comment = 1;
+				continue;
+			}
+			if ((cc & CSS_CC_END) && (depth == 0))
+				break;
+		}
+
+		if (space || comment) {
+			wpos += css_separate (src, wpos, wpos - dst, space, comment, CSS_MODE_VALUE);
+			space = 0;
+			comment = 0;
+		}
+
+		if ((cc & CSS_CC_DIGIT) || (((*src == '.') || (*src == '+') || (*src == '-')) && css_is_number (src, end))) {
+			/* number, maybe followed by an unit */
+			next = ((*src == '+') || (*src == '-')) ? src + 1 : src;
+			while ((next < end) && (css_cc [*next] & CSS_CC_DIGIT))
+				next++;
+			if ((next + 1 < end) && (*next == '.') && (css_cc [*(next + 1)] & CSS_CC_DIGIT)) {
+				next++;
+				while ((next < end) && (css_cc [*next] & CSS_CC_DIGIT))
+					next++;
+			}
+			if ((next < end) && (*next == '%')) {
+				next++;
+			} else {
+				while ((next < end) && (css_cc [*next] & CSS_CC_NAME))
+					next += (*next == '\\') ? 2 : 1;
+				if (next > end)
+					next = end;
+			}
+			wpos += css_minify_number (src, next, wpos, flags, depth);
+			src = next;
+		} else if (cc & CSS_CC_NAME) {
+			/* identifier, function name */
+			for (;;) {
+				len = css_name_span (src, end - src);
+				wpos = css_copy_short (wpos, src, src + len);
+				src += len;
+				if ((src >= end) || (*src != '\\'))
+					break;
+				/* escaped char */
+				*(wpos++) = *(src++);
+				if (src < end)
+					*(wpos++) = *(src++);
+			}
+			if ((src < end) && (*src == '(') && css_is_url_function (dst, wpos) && ((next = css_skip_unquoted_url (src, end)) != NULL)) {
+				/* unquoted url, as is */
+				memcpy (wpos, src, next - src);
+				wpos += next - src;
+				src = next;
+			}
+		} else if (*src == '#') {
+			/* color (or something else) */
+			next = src + 1;
+			while ((next < end) && (css_cc [*next] & CSS_CC_NAME))
+				next += (*next == '\\') ? 2 : 1;
+			if (next > end)
+				next = end;
+			len = next - src - 1;
+			if ((flags & CSS_VAL_SHORTEN) && ((len == 6) || (len == 8)) && \
+				(css_cc [src [1]] & css_cc [src [2]] & css_cc [src [3]] & css_cc [src [4]] & css_cc [src [5]] & css_cc [src [6]] & CSS_CC_HEX) && \
+				(src [1] == src [2]) && (src [3] == src [4]) && (src [5] == src [6]) && \
+				((len == 6) || ((css_cc [src [7]] & css_cc [src [8]] & CSS_CC_HEX) && (src [7] == src [8])))) {
+				/* "#aabbcc" -> "#abc" */
+				*(wpos++) = '#';
+				*(wpos++) = src [1];
+				*(wpos++) = src [3];
+				*(wpos++) = src [5];
+				if (len == 8)
+					*(wpos++) = src [7];
+			} else {
+				wpos = css_copy_short (wpos, src, next);
+			}
+			src = next;
+		} else if ((*src == '"') || (*src == '\'')) {
+			next = css_skip_string (src, end);
+			memcpy (wpos, src, next - src);
+			wpos += next - src;
+			src = next;
+		} else {
+			if ((*src == '(') || (*src == '['))
+				depth++;
+			else if (((*src == ')') || (*src == ']')) && depth)
+				depth--;
+			*(wpos++) = *(src++);
+		}
+	}
+
+	*item_end = src;
+	return (wpos - dst);
+}
+
+/* returns: value optimizations (CSS_VAL_*) allowed for property 'name' (namelen chars) */
+static int css_value_flags (const unsigned char *name, int namelen)
+{
+	const unsigned char	*name_end = name + namelen;
+
+	/* custom properties are used as written, unicode ranges are not numbers */
+	if (((namelen >= 2) && (name [0] == '-') && (name [1] == '-')) || css_name_is (name, namelen, "unicode-range"))
+		return (0);
+
+	/* MSIE filters ("filter", "-ms-filter") require long colors,
+	 * flexbox implementations may require units for flex-basis ("flex", "flex-basis", "-webkit-box-flex" etc) */
+	name = css_skip_vendor_prefix (name, name_end);
+	namelen = name_end - name;
+	if ((namelen >= 6) && css_name_is (name_end - 6, 6, "filter"))
+		return (0);
+	if ((namelen >= 4) && (css_name_begins (name, namelen, "flex") || css_name_is (name_end - 4, 4, "flex")))
+		return (CSS_VAL_SHORTEN);
+	return (CSS_VAL_SHORTEN | CSS_VAL_ZERO_UNITS);
+}
+
+/* minifies a declaration (or anything else found among them) into dst (which must not overlap src)
+ * item_end: same as in css_minify_item()
+ * returns: chars outputted */
+static int css_minify_declaration (const unsigned char *src, const unsigned char *end, unsigned char *dst, const unsigned char **item_end)
+{
+	const unsigned char	*colon = src;
+	int	len;
+
+	/* "name:", anything else is minified as is */
+	len = css_name_span (src, end - src);
+	dst = css_copy_short (dst, src, src + len);
+	colon += len;
+	while ((colon < end) && (css_cc [*colon] & CSS_CC_BLANK))
+		colon++;
+	if ((len == 0) || (colon >= end) || (*colon != ':'))
+		return (css_minify_item (src, end, dst - len, CSS_MODE_PRELUDE, item_end));
+
+	*dst = ':';
+	return (len + 1 + css_minify_value (colon + 1, end, dst + 1, css_value_flags (src, len), item_end));
+}
+
+/* returns: kind of block opened by the at-rule at src (CSS_CTX_*) */
+static int css_at_rule_ctx (const unsigned char *src, const unsigned char *end)
+{
+	const unsigned char	*name = src + 1;
+	const unsigned char	*name_end;
+
+	/* such as "@-webkit-keyframes" */
+	name = css_skip_vendor_prefix (name, end);
+	for (name_end = name; (name_end < end) && (css_cc [*name_end] & CSS_CC_NAME); name_end++);
+
+	if (css_name_is (name, name_end - name, "keyframes"))
+		return (CSS_CTX_KEYFRAMES);
+	if (css_name_is (name, name_end - name, "media") || css_name_is (name, name_end - name, "supports") || \
+		css_name_is (name, name_end - name, "document") || css_name_is (name, name_end - name, "layer") || \
+		css_name_is (name, name_end - name, "container") || css_name_is (name, name_end - name, "scope"))
+		return (CSS_CTX_RULES);
+	return (CSS_CTX_DECLS);
+}
+
+/* state: optimizer state, all zeros before the first call
+ * src: source style text
+ * dst: destination of compressed text (must not overlap src)
  * srclen: size of src text
+ * dst_history: chars already outputted just before dst (0 if none), those may be modified
+ * stop_margin: if != 0, more text is yet to come: stops before an element reaching
+ * 	the last stop_margin chars of src (which will be processed in a later call)
+ * srcused: if != NULL, returns the chars of src processed
  * returns: chars outputted into dst */
-int compress_style_chunk (const unsigned char *src, int srclen, unsigned char *dst)
+int compress_style_text (css_state *state, const unsigned char *src, int srclen, unsigned char *dst, int dst_history, int stop_margin, int *srcused)
 {
 	const unsigned char	*rpos = src;
-	unsigned char		*wpos = dst;
-	int		count;
-	int		dstlen = 0;
-	unsigned char	previous_char = '\0';
-	unsigned char	previous_char2 = '\0'; /* 1 char before previous_char */
-	unsigned char	quote_char;
-	int		break_loop;
+	const unsigned char	*end = src + srclen;
+	const unsigned char	*item_end, *next;
+	unsigned char	*wpos = dst;
+	unsigned char	*item;
+	const unsigned char	*selector = state->selector;	/* selector of the last rule (saved into state when returning) */
+	int	complete;
+	int	ctx, new_ctx;
+	int	declaration;
+	int	len;
+
+	if (! css_cc_ready)
+		css_cc_init ();
+
+	while (rpos < end) {
+		if ((css_cc [*rpos] & CSS_CC_BLANK) || (*rpos == '/')) {
+			next = css_skip_blanks (rpos, end, &complete);
+			if (stop_margin && (! complete))
+				break;
+			rpos = next;
+		}
+		if ((rpos >= end) || (stop_margin && (end - rpos <= stop_margin)))
+			break;
 
-	count = srclen;
-	while (count) {
-		if (*rpos <= ' ') { /* space */
-			if (previous_char != ' ') {
-				*(wpos++) = ' ';
-				dstlen++;
-			}
+		ctx = (state->depth < CSS_MAX_DEPTH) ? state->ctx [state->depth] : CSS_CTX_DECLS;
+
+		/* end of block */
+		if (*rpos == '}') {
+			if (state->depth > 0)
+				state->depth--;
+			state->prev_closed = (ctx & CSS_CTXF_MERGEABLE) && (! (ctx & CSS_CTXF_NESTED)) && (state->selector_len > 0);
+			state->pending_semicolon = 0;
+			*(wpos++) = '}';
 			rpos++;
-			count--;
-		} else if (*rpos == '/') { /* perhaps "[double slash]" or "[slash]*" ? */
-			if (count >= 2) {
-				if (*(rpos + 1) == '*') {
-					/* skip comment */
-					rpos += 2;
-					count -= 2;
-
-					while ((count >= 2) && ((*rpos != '*') || (*(rpos + 1) != '/'))) {
-						rpos++;
-						count--;
-					}
+			continue;
+		}
 
-					/* skip remaining trailing *[slash], if existant */
-					if (count) {
-						rpos++;
-						count--;
-					}
-					if (count) {
-						rpos++;
-						count--;
-					}			
-				} else { /* "/" followed by something else, write that */
-					*(wpos++) = *(rpos++);
-					dstlen++;
-					count--;
-				}
-			} else { /* "/" followed by something else, write that */
-				*(wpos++) = *(rpos++);
-				dstlen++;
-				count--;
-			}		
-		} else if ((*rpos == '"') || (*rpos == '\'')) { /* quoted text, skip escaped quotes */
-			if (previous_char == ' ') {	/* no need for a space preceding quoted text, remove that */
-				wpos--;
-				dstlen--;
+		/* HTML comment delimiters (may be used in <style>), kept as they are */
+		if ((state->depth == 0) && ((*rpos == '<') || (*rpos == '-'))) {
+			len = 0;
+			if ((end - rpos >= 4) && (! memcmp (rpos, "<!--", 4)))
+				len = 4;
+			else if ((end - rpos >= 3) && (! memcmp (rpos, "-->", 3)))
+				len = 3;
+			if (len) {
+				memcpy (wpos, rpos, len);
+				wpos += len;
+				rpos += len;
+				state->prev_closed = 0;
+				continue;
 			}
-			quote_char = *(rpos++);
-			*(wpos++) = quote_char;
-			dstlen++;
-			count--;
-			break_loop = 0;
-			while ((count) && (! break_loop)) {
-				if (*rpos == '\\') {	/* escape char preceded by '\' (avoids closing quote when "\"" appears) */
-					*(wpos++) = *(rpos++);
-					if (count > 1) {
-						*(wpos++) = *(rpos++);
-						dstlen++;
-						count--;
-					}
-				} else if (*rpos == quote_char) {
-					*(wpos++) = *(rpos++);
-					break_loop = 1;
-				} else {
-					*(wpos++) = *(rpos++);
+		}
+
+		/* minified as a declaration within blocks of those, as a selector (or at-rule) elsewhere,
+		 * after the pending ';' (there's none outside blocks of declarations) */
+		item = wpos + state->pending_semicolon;
+		declaration = ((ctx & CSS_CTX_MASK) == CSS_CTX_DECLS) && (*rpos != '@');
+		if (declaration)
+			len = css_minify_declaration (rpos, end, item, &item_end);
+		else
+			len = css_minify_item (rpos, end, item, (*rpos == '@') ? CSS_MODE_PRELUDE : CSS_MODE_SELECTOR, &item_end);
+		if (stop_margin && (end - item_end <= stop_margin))
+			break;
+
+		/* beginning of block */
+		if ((item_end < end) && (*item_end == '{')) {
+			next = css_skip_blanks (item_end + 1, end, &complete);
+			if (stop_margin && ((! complete) || (end - next <= stop_margin)))
+				break;
+
+			if (*rpos == '@') {
+				new_ctx = css_at_rule_ctx (rpos, item_end);
+			} else if ((ctx & CSS_CTX_MASK) == CSS_CTX_RULES) {
+				/* empty rule, discard it */
+				if ((next < end) && (*next == '}')) {
+					rpos = next + 1;
+					continue;
 				}
-				dstlen++;
-				count--;
+				new_ctx = CSS_CTX_DECLS | CSS_CTXF_MERGEABLE;
+			} else {
+				new_ctx = CSS_CTX_DECLS;
 			}
-		} else { /* other char (a-z 0-9 etc) */
-			if (previous_char == ' ') {
-				if (style_concatenable (&previous_char2) || style_concatenable (rpos)) {
-					previous_char = previous_char2;
-					previous_char2 = '\0';
-					wpos--;
-					dstlen--;
+
+			/* a nested rule, not a declaration */
+			if (declaration)
+				len = css_minify_item (rpos, item_end, item, CSS_MODE_SELECTOR, &next);
+
+			if (state->pending_semicolon) {
+				*(wpos++) = ';';
+				state->pending_semicolon = 0;
+			}
+			if (state->depth < CSS_MAX_DEPTH)
+				state->ctx [state->depth] |= CSS_CTXF_NESTED;
+
+			if ((new_ctx & CSS_CTXF_MERGEABLE) && state->prev_closed && (len == state->selector_len) && \
+				((item - dst) + dst_history >= 1) && (*(item - 1) == '}') && (! memcmp (item, selector, len))) {
+				/* same selector as the previous rule, merge both "a{x}a{y}" -> "a{x;y}" */
+				*(item - 1) = ';';
+			} else {
+				if (new_ctx & CSS_CTXF_MERGEABLE) {
+					state->selector_len = (len <= CSS_MAX_SELECTOR) ? len : 0;
+					selector = item;
 				}
+				wpos += len;
+				*(wpos++) = '{';
 			}
-			*(wpos++) = *(rpos++);
-			dstlen++;
-			count--;
-		}	
+			state->prev_closed = 0;
+			state->depth++;
+			if (state->depth < CSS_MAX_DEPTH)
+				state->ctx [state->depth] = new_ctx;
+			rpos = item_end + 1;
+			continue;
+		}
 
-		if (dstlen)
-			previous_char = *(wpos - 1);
-		else
-			previous_char = '\0';
-		if (dstlen >= 2)
-			previous_char2 = *(wpos - 2);
-		else
-			previous_char2 = '\0';
+		/* declaration, at-rule without block (or something else): up to ';', '}' or end of text */
+		if ((ctx & CSS_CTX_MASK) == CSS_CTX_DECLS) {
+			/* the last ';' of a block is useless, output that only if more declarations come */
+			if (rpos != item_end) {
+				if (state->pending_semicolon)
+					*(wpos++) = ';';
+				wpos += len;
+				state->pending_semicolon = (item_end < end) && (*item_end == ';');
+			}
+		} else {
+			/* not a selector */
+			if (*rpos != '@')
+				len = css_minify_item (rpos, item_end, item, CSS_MODE_PRELUDE, &next);
+			wpos += len;
+			if ((item_end < end) && (*item_end == ';'))
+				*(wpos++) = ';';
+		}
+		state->prev_closed = 0;
+		rpos = ((item_end < end) && (*item_end == ';')) ? item_end + 1 : item_end;
 	}
 
+	if (selector != state->selector)
+		memcpy (state->selector, selector, state->selector_len);
+
+	if (srcused != NULL)
+		*srcused = rpos - src;
+	return (wpos - dst);
+}
+
+/* src: source style text
+ * dst: destination of compressed text (may be src, or before it)
+ * srclen: size of src text
+ * returns: chars outputted into dst */
+int compress_style_chunk (const unsigned char *src, int srclen, unsigned char *dst)
+{
+	css_state	state;
+	unsigned char	*src_copy;
+	int	dstlen;
+
+	/* the source must be left intact while optimizing */
+	if ((src_copy = malloc (srclen)) == NULL) {
+		memmove (dst, src, srclen);
+		return (srclen);
+	}
+	memcpy (src_copy, src, srclen);
+
+	memset (&state, 0, sizeof (css_state));
+	dstlen = compress_style_text (&state, src_copy, srclen, dst, 0, 0, NULL);
+	free (src_copy);
+
 	return (dstlen);
 }
 
@@ -216,294 +1125,543 @@ int compress_style_chunk (const unsigned char *src, int srclen, unsigned char *d
 
 /* ### JAVASCRIPT OPTIMIZATION ROUTINES */
 
-/* locate substr occurence in str which is a // (javascript) comment
- * will search until '\n' or end of str (srclen), whichever reaches first
- * srclen is the length of str string, substrlen (...) of substr string
- * returns !=0 found at least once, ==0 not found */
-int is_str_present_in_ss_comment (const unsigned char *src, int srclen, const unsigned char *substr, int substrlen)
+/* javascript code is split into tokens (names, numbers, strings, template pieces,
+ * regular expressions, punctuators), which are outputted unmodified.
+ * spaces and comments between tokens are dropped, except for a single space
+ * where the tokens would merge otherwise, and a line break where automatic
+ * semicolon insertion may depend on it.
+ * whether '/' is a division or begins a regular expression is decided by the previous token.
+ * HTML-like comments ("<!--", "-->") and the "//<![CDATA[" like markers of inline scripts are kept,
+ * as are multi-line comments beginning with '!' (license) or '@' (conditional compilation). */
+
+/* what may follow the last token (JS_PREV_*, OR'ed) */
+#define JS_PREV_EXPR		1	/* may end an expression: a line break after it may end the statement */
+#define JS_PREV_DIVISION	2	/* '/' after it is a division, not a regular expression */
+#define JS_PREV_RESTRICTED	4	/* a line break after it always ends the statement (return, break etc) */
+#define JS_PREV_CONTROL		8	/* if, for, with: the parenthesis after it is followed by a statement */
+#define JS_PREV_WHILE		16	/* while: same, except it may end a do-while too */
+#define JS_PREV_NOCONT		32	/* '}' or "++"/"--": not every operator may continue the expression after it */
+#define JS_PREV_NUMBER		64
+#define JS_PREV_REGEX		128	/* a name right after it would be taken as flags */
+#define JS_PREV_NEWLINE		256	/* a line break must follow (single-line comment kept) */
+
+/* kind of token */
+#define JS_TOK_NAME		0	/* identifiers, keywords, private names */
+#define JS_TOK_NUMBER		1
+#define JS_TOK_STRING		2	/* strings and regular expressions */
+#define JS_TOK_TEMPLATE		3	/* template literal, or its beginning up to "${" */
+#define JS_TOK_TEMPLATE_CONT	4	/* remainder of a template literal, after "${...}" */
+#define JS_TOK_PUNCT		5
+#define JS_TOK_COMMENT		6	/* multi-line comment to be kept */
+#define JS_TOK_LINE		7	/* single-line comment to be kept (maybe only partially) */
+
+/* kind of each open parenthesis/brace */
+#define JS_NEST_PAREN		0
+#define JS_NEST_CONTROL		1	/* after if, for, with */
+#define JS_NEST_WHILE		2
+#define JS_NEST_BLOCK		3
+#define JS_NEST_TEMPLATE	4	/* "${" within a template literal */
+
+/* code nested deeper than that is passed through unmodified */
+#define JS_MAX_NEST		64
+
+/* char classes */
+#define JS_CC_BLANK		1
+#define JS_CC_WORD		2	/* may be part of a name or number */
+#define JS_CC_DIGIT		4
+
+/* javascript optimizer state, kept between calls when streaming */
+typedef struct {
+	int		prev;		/* JS_PREV_* of the last token outputted */
+	unsigned char	prev_char;	/* last char outputted, '\0' if none yet */
+	int		mid_line;	/* !=0 if the last token outputted is not followed by a line break yet */
+	int		depth;
+	unsigned char	nest [JS_MAX_NEST];	/* JS_NEST_* */
+	int		passthrough;	/* !=0: nested too deep, the remaining code is dumped unmodified */
+} js_state;
+
+static unsigned char	js_cc [256];
+static int		js_cc_ready = 0;
+
+static void js_cc_init (void)
 {
-	srclen = srclen - substrlen + 1;
-	while (srclen--) {
-		if (*src == '\n')
-			return (0);
-		if (! WHICH_STRNCMP (src++, substr, substrlen))
+	int	c;
+
+	for (c = 0; c < 256; c++) {
+		js_cc [c] = 0;
+		if (c <= ' ')
+			js_cc [c] |= JS_CC_BLANK;
+		/* non-ASCII chars are taken as part of names (even the few which are spaces or line breaks),
+		 * so those are kept as they are */
+		if (((c >= 'a') && (c <= 'z')) || ((c >= 'A') && (c <= 'Z')) || ((c >= '0') && (c <= '9')) || (c == '_') || (c == '$') || (c == '\\') || (c >= 0x80))
+			js_cc [c] |= JS_CC_WORD;
+		if ((c >= '0') && (c <= '9'))
+			js_cc [c] |= JS_CC_DIGIT;
+	}
+	js_cc_ready = 1;
+}
+
+/* src: points just past the first char of a name
+ * returns: pointer just past the name */
+static const unsigned char *js_skip_name (const unsigned char *src, const unsigned char *end)
+{
+	while (src < end) {
+		while ((src < end) && (js_cc [*src] & JS_CC_WORD) && (*src != '\\'))
+			src++;
+		if ((src >= end) || (*src != '\\'))
+			break;
+
+		/* \uXXXX or \u{X...} */
+		src += 2;
+		if ((src < end) && (*(src - 1) == 'u') && (*src == '{')) {
+			while ((src < end) && (*(src++) != '}'));
+		}
+	}
+	return (src > end ? end : src);
+}
+
+/* src: points to the beginning of a number
+ * returns: pointer just past the number */
+static const unsigned char *js_skip_number (const unsigned char *src, const unsigned char *end)
+{
+	int	decimal = 1;
+	int	dot = 0;
+
+	if ((end - src > 2) && (*src == '0') && (((src [1] | 0x20) == 'x') || ((src [1] | 0x20) == 'o') || ((src [1] | 0x20) == 'b'))) {
+		decimal = 0;
+		src += 2;
+	}
+	while (src < end) {
+		if ((*src == '.') && decimal && (! dot)) {
+			dot = 1;
+			src++;
+		} else if (((*src | 0x20) == 'e') && decimal && (src + 1 < end) && ((src [1] == '+') || (src [1] == '-'))) {
+			src += 2;
+		} else if ((js_cc [*src] & JS_CC_WORD) && (*src != '\\')) {
+			src++;
+		} else {
+			break;
+		}
+	}
+	return (src);
+}
+
+/* src: points just past the opening '`' (or the '}' closing a "${")
+ * subst: returns !=0 if it ends with "${", ==0 if with '`' (or the end of src)
+ * returns: pointer just past the template text */
+static const unsigned char *js_skip_template (const unsigned char *src, const unsigned char *end, int *subst)
+{
+	*subst = 0;
+	while (src < end) {
+		if (*src == '\\') {
+			src += 2;
+		} else if (*src == '`') {
+			return (src + 1);
+		} else if ((*src == '$') && (src + 1 < end) && (src [1] == '{')) {
+			*subst = 1;
+			return (src + 2);
+		} else {
+			src++;
+		}
+	}
+	return (end);
+}
+
+/* src: points to the opening '/'
+ * returns: pointer just past the regular expression (including its flags),
+ * 	or NULL if not terminated within the line */
+static const unsigned char *js_skip_regex (const unsigned char *src, const unsigned char *end)
+{
+	int	in_class = 0;
+
+	src++;
+	while (src < end) {
+		if ((*src == '\n') || (*src == '\r')) {
+			return (NULL);
+		} else if (*src == '\\') {
+			if ((src + 1 < end) && ((src [1] == '\n') || (src [1] == '\r')))
+				return (NULL);
+			src += 2;
+			continue;
+		} else if (*src == '[') {
+			in_class = 1;
+		} else if (*src == ']') {
+			in_class = 0;
+		} else if ((*src == '/') && (! in_class)) {
+			return (js_skip_name (src + 1, end));
+		}
+		src++;
+	}
+	return (end);
+}
+
+/* src: points to the beginning of a single-line comment
+ * returns: pointer to the line break ending it (or end) */
+static const unsigned char *js_skip_line (const unsigned char *src, const unsigned char *end)
+{
+	const unsigned char	*line_end = src;
+	const unsigned char	*ls;
+
+	while (line_end < end) {
+		line_end += scan_2chr_span (line_end, end - line_end, '\n', '\r');
+		if ((line_end >= end) || (*line_end != '\0'))
+			break;
+		line_end++;
+	}
+	if (line_end > end)
+		line_end = end;
+
+	/* U+2028 and U+2029 (UTF-8) end lines too */
+	for (ls = src; (ls = memchr (ls, 0xe2, line_end - ls)) != NULL; ls++) {
+		if ((ls + 2 < line_end) && (ls [1] == 0x80) && ((ls [2] == 0xa8) || (ls [2] == 0xa9)))
+			return (ls);
+	}
+	return (line_end);
+}
+
+/* returns: !=0 if str is present within src..end */
+static int js_is_str_present (const unsigned char *src, const unsigned char *end, const char *str, int len)
+{
+	for (end -= len - 1; src < end; src++) {
+		if ((*src == (unsigned char) *str) && (! memcmp (src, str, len)))
 			return (1);
 	}
 	return (0);
 }
 
-/* returns:
- *   0 = non_concatenable (a-z, A-Z, 0-9, '_', '.', '#', '%')
- *  !0 = ok,concatenable (other) */
-int javascript_concatenable (const unsigned char *given_char)
+/* src: points to the beginning of a single-line comment ("//", "<!--", "-->" or "#!")
+ * keptlen: returns the size of what's returned
+ * returns: what's to be kept of the comment, or NULL if nothing */
+static const unsigned char *js_kept_comment (const unsigned char *src, const unsigned char *line_end, int *keptlen)
+{
+	switch (*src) {
+	case '<':
+		*keptlen = 4;
+		return ((const unsigned char *) "<!--");
+	case '-':
+		*keptlen = 3;
+		return ((const unsigned char *) "-->");
+	case '#':
+		*keptlen = line_end - src;
+		return (src);
+	}
+
+	/* markers of inline scripts, hiding those from old browsers and XHTML parsers */
+	if (js_is_str_present (src, line_end, "<![CDATA[", 9)) {
+		*keptlen = 11;
+		return ((const unsigned char *) "//<![CDATA[");
+	} else if (js_is_str_present (src, line_end, "-->", 3)) {
+		*keptlen = 5;
+		return ((const unsigned char *) "//-->");
+	} else if (js_is_str_present (src, line_end, "]]>", 3)) {
+		*keptlen = 5;
+		return ((const unsigned char *) "//]]>");
+	}
+	return (NULL);
+}
+
+/* returns: JS_PREV_* for the name */
+static int js_name_flags (const unsigned char *name, int namelen)
+{
+	static const char	*restricted [] = {"return", "throw", "break", "continue", "yield", "debugger", NULL};
+	static const char	*control [] = {"if", "for", "with", NULL};
+	/* keywords which are always followed by an expression or statement */
+	static const char	*leading [] = {"typeof", "instanceof", "in", "new", "delete", "void", "case", "do", "else", "extends", "try", "finally", NULL};
+	int	i;
+
+	/* keywords are lowercase, shorter than 11 chars */
+	if ((namelen > 10) || (*name < 'a') || (*name > 'z'))
+		return (JS_PREV_EXPR | JS_PREV_DIVISION);
+
+	for (i = 0; restricted [i] != NULL; i++) {
+		if ((strlen (restricted [i]) == namelen) && (! memcmp (name, restricted [i], namelen)))
+			return (JS_PREV_RESTRICTED);
+	}
+	for (i = 0; control [i] != NULL; i++) {
+		if ((strlen (control [i]) == namelen) && (! memcmp (name, control [i], namelen)))
+			return (JS_PREV_CONTROL);
+	}
+	for (i = 0; leading [i] != NULL; i++) {
+		if ((strlen (leading [i]) == namelen) && (! memcmp (name, leading [i], namelen)))
+			return (0);
+	}
+	if ((namelen == 5) && (! memcmp (name, "while", 5)))
+		return (JS_PREV_WHILE);
+	if ((namelen == 5) && (! memcmp (name, "async", 5)))
+		return (JS_PREV_RESTRICTED | JS_PREV_DIVISION);
+	return (JS_PREV_EXPR | JS_PREV_DIVISION);
+}
+
+/* (called when there's a line break between the last token outputted and the next one)
+ * returns: !=0 if the line break must be kept */
+static int js_newline_required (int prev, int type, const unsigned char *tok, const unsigned char *tok_end)
+{
+	if (type == JS_TOK_COMMENT)
+		return (1);
+	if (prev & JS_PREV_RESTRICTED)
+		return ((*tok != ';') && (*tok != '}'));
+	if (! (prev & JS_PREV_EXPR))
+		return (0);
+
+	/* those never begin a statement */
+	if ((type == JS_TOK_PUNCT) && (strchr (")]},;:", *tok) != NULL))
+		return (0);
+	/* may or may not be a continuation of the expression */
+	if (prev & JS_PREV_NOCONT)
+		return (1);
+	if ((type == JS_TOK_PUNCT) && (tok_end - tok == 1) && (strchr (".=<>+-*/%&|^?", *tok) != NULL))
+		return (0);
+	return (1);
+}
+
+/* (called when there are spaces or comments between the last token outputted and the next one)
+ * returns: !=0 if a space must be kept */
+static int js_space_required (unsigned char prev_char, int prev, int type, const unsigned char *tok, const unsigned char *tok_end)
 {
-	int	concatenable = 0;
-	
-	switch (*given_char) {
-	case '=':
+	if ((js_cc [*tok] & JS_CC_WORD) && (prev_char != '<'))
+		return ((js_cc [prev_char] & JS_CC_WORD) || (prev & JS_PREV_REGEX));
+
+	switch (prev_char) {
 	case '+':
 	case '-':
-	case '*':
+		/* "+ +", "- -", "-- >" */
+		return ((*tok == prev_char) || ((prev_char == '-') && (*tok == '>')));
 	case '/':
-	case '(':
-	case ')':
-	case '>':
+		/* would become a comment */
+		return ((*tok == '/') || (*tok == '*'));
 	case '<':
-	case ';':
-	case ':':
-	case ',':
-	case '[':
-	case ']':
-	case '{':
-	case '}':
-	case '"':
-		concatenable = 1;
+		/* "<!--" begins a comment, "</script" and "<script" are special to HTML */
+		return ((*tok == '!') || (*tok == '/') || ((type == JS_TOK_NAME) && css_name_begins (tok, tok_end - tok, "script")));
 	}
+	/* "1 .toString()" */
+	return ((prev & JS_PREV_NUMBER) && (*tok == '.'));
+}
 
-	return (concatenable);
+/* returns: ==0 ok, !=0 nested too deep */
+static int js_push (js_state *state, int kind)
+{
+	if (state->depth >= JS_MAX_NEST)
+		return (1);
+	state->nest [state->depth++] = kind;
+	return (0);
 }
 
-/* compress javascript code (may contain "<!--" and "-->" tags) */
-/* returns the size of data dumped into dst */
-int compress_javascript_chunk (const unsigned char *src, int srclen, unsigned char *dst)
+/* state: optimizer state, all zeros before the first call
+ * src: source javascript code (may contain "<!--" and "-->" tags)
+ * dst: destination of compressed code (must not overlap src)
+ * srclen: size of src code
+ * dst_history: chars already outputted just before dst (0 if none)
+ * stop_margin: if != 0, more code is yet to come: stops before a token reaching
+ * 	the last stop_margin chars of src (which will be processed in a later call)
+ * srcused: if != NULL, returns the chars of src processed
+ * returns: chars outputted into dst */
+int compress_javascript_text (js_state *state, const unsigned char *src, int srclen, unsigned char *dst, int dst_history, int stop_margin, int *srcused)
 {
 	const unsigned char	*rpos = src;
-	unsigned char		*wpos = dst;
-	int		count;
-	int		dstlen = 0;
-	unsigned char	previous_char = '\0';
-	unsigned char	previous_char2 = '\0'; /* 1 char before previous_char */
-	unsigned char	close_quote_char;
-	int		break_loop;
-
-	count = srclen;
-	while (count) {
-		if (*rpos == '\n') {
-		       	/* we cannot convert all '\n' to spaces unless we fully parse the "if", contexts etc
-			 * whoever designed javascript made it to allow commands not finishing with ';' to be legal,
-			 * when those are finished with '\n' */
-			
-			if (! ((*(rpos + 1) == '-') && (count >= 4))) {
-				if (previous_char == ' ') {	/* no use for space followed by '\n', remove that */
-					wpos--;
-					dstlen--;
-					previous_char = previous_char2;
-					previous_char2 = '\0';
+	const unsigned char	*end = src + srclen;
+	const unsigned char	*tok, *tok_end, *next;
+	const unsigned char	*out;
+	unsigned char	*wpos = dst;
+	int	outlen;
+	int	complete;
+	int	space, newline, mid_line;
+	int	type, flags;
+	int	subst;
+
+	if (! js_cc_ready)
+		js_cc_init ();
+
+	while ((rpos < end) && (! state->passthrough)) {
+		/* spaces and comments before the next token */
+		complete = 1;
+		space = newline = 0;
+		mid_line = state->mid_line;
+		type = JS_TOK_NAME;
+		next = NULL;
+		tok = rpos;
+		while (tok < end) {
+			if ((*tok == '\n') || (*tok == '\r')) {
+				newline = 1;
+				mid_line = 0;
+				tok++;
+			} else if (js_cc [*tok] & JS_CC_BLANK) {
+				space = 1;
+				tok++;
+			} else if ((*tok == '/') && (tok + 1 < end) && (tok [1] == '*')) {
+				if ((tok + 2 < end) && ((tok [2] == '!') || (tok [2] == '@'))) {
+					type = JS_TOK_COMMENT;
+					break;
 				}
-				if ((previous_char != '\0') && (previous_char != '\n') && (previous_char != ';') && (previous_char != ':') && (previous_char != '{') && (previous_char != '}')) {
-					*(wpos++) = '\n';
-					dstlen++;
+				if ((next = css_skip_comment (tok, end)) == NULL) {
+					complete = 0;
+					next = end;
 				}
-				rpos++;
-				count--;
-			} else {
-				if (! WHICH_STRNCMP (rpos, "\n-->", 4)) {
-					/* we have a "\n-->" we must write exactly that */
-					strncpy_overlapping (rpos, wpos, 4);
-					rpos += 4;
-					wpos += 4;
-					count -= 4;
-					dstlen += 4;					
-				} else {
-					/* false alarm, process as a normal '\n' */
-					if (previous_char == ' ') {	/* no use for space followed by '\n', remove that */
-						wpos--;
-						dstlen--;
-						previous_char = previous_char2;
-						previous_char2 = '\0';
-					}
-					if ((previous_char != '\0') && (previous_char != '\n') && (previous_char != ';') && (previous_char != ':') && (previous_char != '{') && (previous_char != '}')) {
-						*(wpos++) = '\n';
-						dstlen++;
-					}
-					rpos++;
-					count--;				
+				if ((memchr (tok, '\n', next - tok) != NULL) || (memchr (tok, '\r', next - tok) != NULL)) {
+					newline = 1;
+					mid_line = 0;
 				}
+				space = 1;
+				tok = next;
+			} else if (((*tok == '/') && (tok + 1 < end) && (tok [1] == '/')) || \
+				((*tok == '<') && (end - tok >= 4) && (! memcmp (tok, "<!--", 4))) || \
+				((*tok == '-') && (! mid_line) && (end - tok >= 3) && (! memcmp (tok, "-->", 3))) || \
+				((*tok == '#') && (state->prev_char == '\0') && (tok == rpos) && (tok + 1 < end) && (tok [1] == '!'))) {
+				/* single-line comment (HTML-like ones are valid javascript too) */
+				next = js_skip_line (tok, end);
+				if (next >= end)
+					complete = 0;
+				if (js_kept_comment (tok, next, &outlen) != NULL) {
+					type = JS_TOK_LINE;
+					break;
+				}
+				space = 1;
+				tok = next;
+			} else {
+				break;
 			}
-		} else if ((*rpos == '{') || (*rpos == '}')) {
-			if ((previous_char == ' ') || (previous_char == '\n')) {
-				wpos--;
-				dstlen--;
-			}
-			dstlen++;
-			*(wpos++) = *(rpos++);
-			count--;
-		} else if (*rpos <= ' ') { /* space */
-			if ((previous_char != ' ') && (previous_char != '\n')) {
-				*(wpos++) = ' ';
-				dstlen++;
+		}
+		if (stop_margin && (! complete))
+			break;
+		if (tok >= end) {
+			if (! stop_margin)
+				rpos = end;
+			break;
+		}
+
+		/* the token */
+		out = tok;
+		flags = JS_PREV_EXPR | JS_PREV_DIVISION;
+		subst = 0;
+		if (type == JS_TOK_COMMENT) {
+			if ((tok_end = css_skip_comment (tok, end)) == NULL)
+				tok_end = end;
+			flags = state->prev & ~JS_PREV_NEWLINE;
+		} else if (type == JS_TOK_LINE) {
+			tok_end = next;
+			out = js_kept_comment (tok, next, &outlen);
+			flags = state->prev | JS_PREV_NEWLINE;
+		} else if (((js_cc [*tok] & JS_CC_WORD) && (! (js_cc [*tok] & JS_CC_DIGIT))) || ((*tok == '#') && (tok + 1 < end) && (js_cc [tok [1]] & JS_CC_WORD))) {
+			tok_end = js_skip_name (tok + 1, end);
+			/* property names are no keywords */
+			if (state->prev_char != '.')
+				flags = js_name_flags (tok, tok_end - tok);
+		} else if ((js_cc [*tok] & JS_CC_DIGIT) || ((*tok == '.') && (tok + 1 < end) && (js_cc [tok [1]] & JS_CC_DIGIT))) {
+			type = JS_TOK_NUMBER;
+			tok_end = js_skip_number (tok, end);
+			flags |= JS_PREV_NUMBER;
+		} else if ((*tok == '"') || (*tok == '\'')) {
+			type = JS_TOK_STRING;
+			tok_end = css_skip_string (tok, end);
+		} else if ((*tok == '`') || ((*tok == '}') && (state->depth > 0) && (state->nest [state->depth - 1] == JS_NEST_TEMPLATE))) {
+			type = (*tok == '`') ? JS_TOK_TEMPLATE : JS_TOK_TEMPLATE_CONT;
+			tok_end = js_skip_template (tok + 1, end, &subst);
+			if (subst)
+				flags = 0;
+		} else if ((*tok == '/') && (! (state->prev & JS_PREV_DIVISION)) && ((tok_end = js_skip_regex (tok, end)) != NULL)) {
+			type = JS_TOK_STRING;
+			flags |= JS_PREV_REGEX;
+		} else {
+			type = JS_TOK_PUNCT;
+			tok_end = tok + 1;
+			if (((*tok == '+') || (*tok == '-')) && (tok + 1 < end) && (tok [1] == *tok)) {
+				tok_end++;
+				flags |= JS_PREV_NOCONT;
+			} else if (*tok == '}') {
+				flags = JS_PREV_EXPR | JS_PREV_NOCONT;
+			} else if ((*tok != ')') && (*tok != ']')) {
+				flags = 0;
 			}
-			rpos++;
-			count--;
-		} else if (*rpos == '\\') { /* non-quoted escaped chars */
-			*(wpos++) = *(rpos++);
-			count--;
-			dstlen++;
-			if (count) {
-				/* FIXME: ***********************************
-				 * escaped spaces cannot be processed as normal spaces
-				 * replace that with an unused char then, at the end of all, turn those chars back to spaces
-				 * WHILE skipping quotes 
-				 * *************************************************** */
-				if (*rpos == ' ')
-					/* DIRTY HACK: we're replacing with \t in order to avoid it being suppressed by the optimizer
-					 * it will convert a char into another, but at least the javascript will not break while parsing
-					 * (in worst case JS code may break if it expects a space) */
-					*(wpos++) = '\t';
-				else
-					*(wpos++) = *(rpos++);
-				count--;
-				dstlen++;
+		}
+		if (type != JS_TOK_LINE)
+			outlen = tok_end - tok;
+
+		/* a token reaching (almost) the end of data may not be complete yet */
+		if (stop_margin && (end - tok_end <= stop_margin))
+			break;
+
+		/* parentheses, braces and templates */
+		if (type == JS_TOK_PUNCT) {
+			switch (*tok) {
+			case '(':
+				if (js_push (state, (state->prev & JS_PREV_CONTROL) ? JS_NEST_CONTROL : ((state->prev & JS_PREV_WHILE) ? JS_NEST_WHILE : JS_NEST_PAREN)))
+					state->passthrough = 1;
+				break;
+			case '{':
+				if (js_push (state, JS_NEST_BLOCK))
+					state->passthrough = 1;
+				break;
+			case ')':
+				if ((state->depth > 0) && (state->nest [state->depth - 1] <= JS_NEST_WHILE)) {
+					/* the statement after if (...) etc; or what may end a do-while */
+					if (state->nest [state->depth - 1] == JS_NEST_CONTROL)
+						flags = 0;
+					else if (state->nest [state->depth - 1] == JS_NEST_WHILE)
+						flags = JS_PREV_EXPR;
+					state->depth--;
+				}
+				break;
+			case '}':
+				while ((state->depth > 0) && (state->nest [state->depth - 1] != JS_NEST_TEMPLATE)) {
+					if (state->nest [--(state->depth)] == JS_NEST_BLOCK)
+						break;
+				}
+				break;
 			}
-		} else if (*rpos == '/') { /* perhaps "[double slash]" or "[slash]*" ? */
-			if (count >= 2) {
-				if (*(rpos + 1) == '(') {
-					/* escape sequences of /(xxx) */
-					/* FIXME: should i escape backslashes inside /(...) ?
-					 * this routine does NOT do that */
-					*(wpos++) = *(rpos++);
-					*(wpos++) = *(rpos++);
-					count -= 2;
-					dstlen += 2;
-					
-					while ((count) && (*rpos != ')')) {
-						*(wpos++) = *(rpos++);
-						count--;
-						dstlen++;
-					}
+		} else if ((type == JS_TOK_TEMPLATE) && subst) {
+			if (js_push (state, JS_NEST_TEMPLATE))
+				state->passthrough = 1;
+		} else if ((type == JS_TOK_TEMPLATE_CONT) && (! subst)) {
+			state->depth--;
+		}
+		if (state->passthrough)
+			break;
 
-					*(wpos++) = *(rpos++); /* remaining ')' */
-					count--;
-					dstlen++;
-				} else if (*(rpos + 1) == '*') {
-					/* skip comment */
-					rpos += 2;
-					count -= 2;
+		/* separation from the last token */
+		if (state->prev_char != '\0') {
+			if ((state->prev & JS_PREV_NEWLINE) || ((type == JS_TOK_LINE) && (*tok == '-')) || \
+				(newline && js_newline_required (state->prev, type, tok, tok_end)))
+				*(wpos++) = '\n';
+			else if ((space || newline) && js_space_required (state->prev_char, state->prev, type, tok, tok_end))
+				*(wpos++) = ' ';
+		}
 
-					while ((count >= 2) && ((*rpos != '*') || (*(rpos + 1) != '/'))) {
-						rpos++;
-						count--;
-					}
+		memcpy (wpos, out, outlen);
+		wpos += outlen;
+		state->prev = flags;
+		state->prev_char = (type == JS_TOK_COMMENT) ? '/' : out [outlen - 1];
+		state->mid_line = 1;
+		rpos = tok_end;
+	}
 
-					/* skip remaining trailing *[slash], if existant */
-					if (count) {
-						rpos++;
-						count--;
-					}
-					if (count) {
-						rpos++;
-						count--;
-					}
-				} else if (*(rpos + 1) == '/'){
-					int done_proc_comment = 0;
+	if (state->passthrough) {
+		memcpy (wpos, rpos, end - rpos);
+		wpos += end - rpos;
+		rpos = end;
+	}
 
-					if (previous_char == ' ') {	/* no use for space followed by comment, remove that */
-						wpos--;
-						dstlen--;
-						previous_char = previous_char2;
-						previous_char2 = '\0';
-					}
-					
-					if (count >= 11) {
-						if (is_str_present_in_ss_comment (rpos, count, "<![CDATA[", 9)) {
-							/* generate a comment containing only the //<![CDATA[ */
-							strncpy_overlapping ("//<![CDATA[\n", wpos, 12);
-							wpos += 12;
-							dstlen += 12;
-							done_proc_comment = 1;
-						}
-					}
-					if ((done_proc_comment == 0) && (count >= 5)) {
-						if (is_str_present_in_ss_comment (rpos, count, "-->", 3)) {
-							/* generate a comment containing only the HTML closing-comment tag */
-							strncpy_overlapping ("//-->", wpos, 5);
-							wpos += 5;
-							dstlen += 5;
-						} else if (is_str_present_in_ss_comment (rpos, count, "]]>", 3)) {
-							/* generate a comment containing only the //]]> */
-							strncpy_overlapping ("//]]>\n", wpos, 6);
-							wpos += 6;
-							dstlen += 6;
-						}
-					}
-					/* discard the rest of the comment */
-					while (count && (*rpos != '\n')) {
-						rpos++;
-						count--;
-					}						
-				} else { /* "/" followed by something else, write that */
-					*(wpos++) = *(rpos++);
-					dstlen++;
-					count--;
-				}
-			} else { /* "/" followed by something else, write that */
-				*(wpos++) = *(rpos++);
-				dstlen++;
-				count--;
-			}
-		} else if ((*rpos == '"') || (*rpos == '\'') || (*rpos == '[')) { /* quoted text, leave content unmodified */
-			if (previous_char == ' ') {	/* no need for a space preceding quoted text, remove that */
-				wpos--;
-				dstlen--;
-			}
+	if (srcused != NULL)
+		*srcused = rpos - src;
+	return (wpos - dst);
+}
 
-			switch (*rpos) {
-				case '"':
-				case '\'':
-					close_quote_char = *rpos;
-					break;
-				case '[':
-					close_quote_char = ']';
-					break;
-			}
-			*(wpos++) = *(rpos++);
-			dstlen++;
-			count--;
-			break_loop = 0;
-			while ((count) && (! break_loop)) {
-				if (*rpos == '\\') {	/* escape char preceded by '\' (avoids closing quote when "\"" appears) */
-					*(wpos++) = *(rpos++);
-					dstlen++;
-					count--;
-					if (count) {
-						*(wpos++) = *(rpos++);
-						dstlen++;
-						count--;
-					}
-				} else if (*rpos == close_quote_char) {
-					*(wpos++) = *(rpos++);
-					dstlen++;
-					count--;
-					break_loop = 1;
-				} else {
-					*(wpos++) = *(rpos++);
-					dstlen++;
-					count--;
-				}
-			}
-		} else { /* other char (a-z 0-9 etc) */
-			if (previous_char == ' ') {
-				if (javascript_concatenable (&previous_char2) || javascript_concatenable (rpos)) {
-					previous_char = previous_char2;
-					previous_char2 = '\0';
-					wpos--;
-					dstlen--;
-				}
-			}
-			*(wpos++) = *(rpos++);
-			dstlen++;
-			count--;
-		}	
+/* compress javascript code (may contain "<!--" and "-->" tags) */
+/* returns the size of data dumped into dst */
+int compress_javascript_chunk (const unsigned char *src, int srclen, unsigned char *dst)
+{
+	js_state	state;
+	unsigned char	*src_copy;
+	int	dstlen;
 
-		if (dstlen)
-			previous_char = *(wpos - 1);
-		else
-			previous_char = '\0';
-		if (dstlen >= 2)
-			previous_char2 = *(wpos - 2);
-		else
-			previous_char2 = '\0';
+	/* the source must be left intact while optimizing */
+	if ((src_copy = malloc (srclen)) == NULL) {
+		memmove (dst, src, srclen);
+		return (srclen);
 	}
+	memcpy (src_copy, src, srclen);
+
+	memset (&state, 0, sizeof (js_state));
+	dstlen = compress_javascript_text (&state, src_copy, srclen, dst, 0, 0, NULL);
+	free (src_copy);
 
 	return (dstlen);
 }
@@ -701,23 +1859,28 @@ int compress_html_text_chunk (const unsigned char *src, int srclen, unsigned cha
 	int		count;
 	int		dstlen = 0;
 	int		previous_space;
+	int		spanlen;
 
 	/* convert multiple spaces/tabs/LFs to just one space */
 	previous_space = 0;
 	count = srclen;
-	while (count--) {
+	while (count) {
 		if (*rpos <= ' ') {
 			if (! previous_space) {
 				*(wpos++) = ' ';
 				dstlen++;
 				previous_space = 1;
 			}
+			spanlen = scan_space_span (rpos, count, 1);
 		} else {
 			previous_space = 0;
-			*(wpos++) = *rpos;
-			dstlen++;
+			spanlen = scan_space_span (rpos, count, 0);
+			memmove (wpos, rpos, spanlen);
+			wpos += spanlen;
+			dstlen += spanlen;
 		}
-		rpos++;
+		rpos += spanlen;
+		count -= spanlen;
 	}
 
 	/* if string has only spaces/tabs/LFs, turn it into an empty string (only if !allow_empty_html_text) */
@@ -727,6 +1890,490 @@ int compress_html_text_chunk (const unsigned char *src, int srclen, unsigned cha
 	return (dstlen);
 }
 
+/* HTML5-aware optimizations (HOPT_OPTIONAL_TAGS, HOPT_UNQUOTE, HOPT_BOOLEAN_ATTRS,
+ * HOPT_DEFAULT_TYPES and HOPT_BLOCK_SPACES)
+ * the resulting document is parsed by HTML5 browsers into the same tree,
+ * except for the removed spaces and attribute values which have no effect */
+
+/* element (chunk) properties */
+#define HTML_EL_TAG		1
+#define HTML_EL_CLOSING		2	/* end tag (or "<!DOCTYPE ...>") */
+#define HTML_EL_BLOCK		4	/* spaces around it are not rendered */
+#define HTML_EL_SPACES		8	/* not a tag: text made of spaces only */
+#define HTML_EL_VOID		16	/* start tag of an element with no content ("<br>", "<meta>" etc) */
+
+/* elements which have no content (and no end tag) */
+#define HTML_VOID_ELEMENTS	"area base br col embed hr img input link meta source track wbr"
+
+/* elements which the spaces around are not rendered (block-level, table parts, metadata) */
+#define HTML_BLOCK_ELEMENTS	"address article aside base blockquote body caption col colgroup dd details dialog div dl dt " \
+	"fieldset figcaption figure footer form h1 h2 h3 h4 h5 h6 head header hgroup hr html legend li link main menu meta nav " \
+	"ol optgroup option p pre section summary table tbody td tfoot th thead title tr ul"
+
+/* elements which may be within "<p>" without affecting how its end tag is handled */
+#define HTML_INLINE_ELEMENTS	"a abbr b bdi bdo big br cite code data dfn em font i img input kbd label mark nobr q s samp script " \
+	"small span strike strong sub sup time tt u var wbr"
+
+/* end tags which may be omitted when immediately followed by one of the start tags in next_start,
+ * one of the end tags in next_end or (if eof != 0) the end of the document */
+static const struct {
+	const char	*name;
+	const char	*next_start;
+	const char	*next_end;
+	int		eof;
+} html_optional_end [] = {
+	{"li", "li", "ul ol menu", 0},
+	{"dt", "dt dd", "", 0},
+	{"dd", "dt dd", "dl", 0},
+	{"p", "address article aside blockquote details dialog div dl fieldset figcaption figure footer form " \
+		"h1 h2 h3 h4 h5 h6 header hgroup hr main menu nav ol p pre section table ul",
+		"address article aside blockquote details dialog div fieldset figcaption figure footer form " \
+		"header li main nav section td th dd", 0},
+	{"td", "td th", "tr", 0},
+	{"th", "td th", "tr", 0},
+	{"tr", "tr", "tbody thead tfoot table", 0},
+	{"option", "option optgroup", "select datalist optgroup", 0},
+	{"optgroup", "optgroup", "select", 0},
+	{"thead", "tbody tfoot", "", 0},
+	{"tbody", "tbody tfoot", "table", 0},
+	{"tfoot", "", "table", 0},
+	{"head", "body", "", 0},
+	{"body", "", "html", 1},
+	{"html", "", "", 1},
+	{NULL, NULL, NULL, 0}
+};
+
+/* attributes whose value does not matter (only their presence) */
+#define HTML_BOOLEAN_ATTRS	"allowfullscreen async autofocus autoplay checked controls default defer disabled formnovalidate " \
+	"hidden inert ismap itemscope loop multiple muted nomodule novalidate open playsinline readonly required reversed selected"
+
+/* type attribute values which are the default ones */
+#define HTML_DEFAULT_SCRIPT_TYPES	"text/javascript application/javascript application/x-javascript text/ecmascript application/ecmascript"
+#define HTML_DEFAULT_STYLE_TYPES	"text/css"
+
+/* tags bigger than that, or with more attributes, are not processed by optimize_html_attributes() */
+#define HTML_ATTR_MAX_TAG	2048
+#define HTML_ATTR_MAX		32
+
+/* returns: !=0 if name (namelen chars, non case-sensitive) is one of those in list (lowercase, separated by spaces) */
+static int html_name_in_list (const unsigned char *name, int namelen, const char *list)
+{
+	int	itemlen;
+	int	i;
+
+	while (*list != '\0') {
+		itemlen = strcspn (list, " ");
+		if (itemlen == namelen) {
+			for (i = 0; (i < namelen) && (lowercase_table [name [i]] == (unsigned char) list [i]); i++);
+			if (i == namelen)
+				return (1);
+		}
+		list += itemlen;
+		while (*list == ' ')
+			list++;
+	}
+	return (0);
+}
+
+/* returns: index into html_optional_end [] of the element, or <0 if its end tag may not be omitted */
+static int html_optional_end_index (const unsigned char *name, int namelen)
+{
+	int	i;
+
+	for (i = 0; html_optional_end [i].name != NULL; i++) {
+		if (css_name_is (name, namelen, html_optional_end [i].name))
+			return (i);
+	}
+	return (-1);
+}
+
+/* src: a tag ("<name ..." or "</name ...")
+ * name and namelen: return the element name
+ * returns: HTML_EL_* */
+static int html_tag_element (const unsigned char *src, int srclen, const unsigned char **name, int *namelen)
+{
+	int	el = HTML_EL_TAG;
+	int	pos = 1;
+
+	if ((pos < srclen) && (src [pos] == '/')) {
+		el |= HTML_EL_CLOSING;
+		pos++;
+	}
+	*name = src + pos;
+	while ((pos < srclen) && (src [pos] > ' ') && (src [pos] != '>') && (src [pos] != '/'))
+		pos++;
+	*namelen = (src + pos) - *name;
+
+	if (html_name_in_list (*name, *namelen, HTML_BLOCK_ELEMENTS))
+		el |= HTML_EL_BLOCK;
+	if ((! (el & HTML_EL_CLOSING)) && html_name_in_list (*name, *namelen, HTML_VOID_ELEMENTS))
+		el |= HTML_EL_VOID;
+	return (el);
+}
+
+/* returns: HTML_EL_* of the beginning of a chunk (as returned by get_chunk_info())
+ * name and namelen: return the element name, if a tag */
+static int html_chunk_element (const unsigned char *src, int srclen, enum chunk_type c_type, const unsigned char **name, int *namelen)
+{
+	*name = src;
+	*namelen = 0;
+
+	switch (c_type) {
+	case CT_HTML_TAG_OTHER:
+	case CT_JAVASCRIPT:
+	case CT_STYLE:
+	case CT_HTML_PRE_TEXT:
+	case CT_HTML_TEXTAREA:
+		/* composite chunks begin with their opening tag */
+		return (html_tag_element (src, srclen, name, namelen));
+	case CT_HTML_TEXT:
+		return ((scan_space_span (src, srclen, 1) == srclen) ? HTML_EL_SPACES : 0);
+	case CT_EXCLAM_TYPES:
+		/* "<!DOCTYPE ...>" */
+		return (HTML_EL_CLOSING | HTML_EL_BLOCK);
+	default:
+		return (0);
+	}
+}
+
+/* src: a "<!...>" chunk
+ * returns: !=0 if it's "<!DOCTYPE html>", which puts the browser in no-quirks mode */
+static int html_is_no_quirks_doctype (const unsigned char *src, int srclen)
+{
+	int	pos;
+
+	if (! css_name_begins (src, srclen, "<!doctype"))
+		return (0);
+	pos = 9 + scan_space_span (src + 9, srclen - 9, 1);
+	if (! css_name_begins (src + pos, srclen - pos, "html"))
+		return (0);
+	pos += 4;
+	pos += scan_space_span (src + pos, srclen - pos, 1);
+	return ((pos < srclen) && (src [pos] == '>'));
+}
+
+/* outputs the held end tag and spaces into dst, except the ones to be dropped
+ * returns: size of data dumped into dst */
+static int html_flush_pending (html_state *state, unsigned char *dst, int drop_tag, int drop_space)
+{
+	int	dstlen = 0;
+
+	if (! drop_tag) {
+		memcpy (dst, state->pending, state->pending_tag_len);
+		dstlen += state->pending_tag_len;
+	}
+	if (! drop_space) {
+		memcpy (dst + dstlen, state->pending + state->pending_tag_len, state->pending_space_len);
+		dstlen += state->pending_space_len;
+	}
+	state->pending_tag_len = 0;
+	state->pending_space_len = 0;
+
+	return (dstlen);
+}
+
+/* to be called at the end of the document, outputs what's still held
+ * (except what may be dropped at the end of the document)
+ * returns: size of data dumped into dst */
+static int html_finish_pending (html_state *state, unsigned char *dst, HOPT_FLAGS flags)
+{
+	int	drop_space, drop_tag;
+
+	drop_space = (state->pending_space_len != 0) && (flags & HOPT_BLOCK_SPACES);
+	drop_tag = (state->pending_tag_len != 0) && ((state->pending_space_len == 0) || drop_space) && html_optional_end [state->pending_tag].eof;
+
+	return (html_flush_pending (state, dst, drop_tag, drop_space));
+}
+
+/* returns: !=0 if the attribute value may be outputted unquoted */
+static int html_unquotable (const unsigned char *value, int valuelen)
+{
+	if (valuelen == 0)
+		return (0);
+	while (valuelen--) {
+		if ((*value <= ' ') || (strchr ("\"'=<>`", *value) != NULL))
+			return (0);
+		value++;
+	}
+	return (1);
+}
+
+/* returns: !=0 if both strings are the same (non case-sensitive) */
+static int html_same_name (const unsigned char *a, int alen, const unsigned char *b, int blen)
+{
+	if (alen != blen)
+		return (0);
+	while (alen--) {
+		if (lowercase_table [*(a++)] != lowercase_table [*(b++)])
+			return (0);
+	}
+	return (1);
+}
+
+/* optimizes the attributes of a start tag ("<name attr=... >"), according to
+ * HOPT_UNQUOTE, HOPT_BOOLEAN_ATTRS and HOPT_DEFAULT_TYPES
+ * the tag is modified in place, it's left as it is if it looks anyhow unusual
+ * returns: the new size of the tag */
+static int optimize_html_attributes (unsigned char *tag, int taglen, HOPT_FLAGS flags)
+{
+	struct {
+		const unsigned char	*name;
+		int	namelen;
+		const unsigned char	*value;	/* NULL if there's no value */
+		int	valuelen;
+		unsigned char	quote;	/* '\0' if unquoted */
+	} attr [HTML_ATTR_MAX];
+	unsigned char	out [HTML_ATTR_MAX_TAG + HTML_ATTR_MAX + 2];	/* a space may be added between attributes */
+	const unsigned char	*pos = tag + 1;
+	const unsigned char	*end = tag + taglen - 1;	/* the final '>' */
+	const unsigned char	*elname;
+	const char	*default_types = NULL;
+	int	elnamelen;
+	int	nattr = 0;
+	int	self_closing = 0;
+	int	type_attr = -1;	/* index of the type attribute, if dropped */
+	int	type_count = 0;
+	int	bare = 0;	/* !=0: the last thing outputted is an unquoted value (a '/' right after would be taken as part of it) */
+	int	outlen;
+	int	i;
+
+	if ((taglen < 3) || (taglen > HTML_ATTR_MAX_TAG) || (*tag != '<') || (*end != '>') || (lowercase_table [tag [1]] < 'a') || (lowercase_table [tag [1]] > 'z'))
+		return (taglen);
+
+	elname = pos;
+	while ((pos < end) && (*pos > ' ') && (*pos != '/'))
+		pos++;
+	elnamelen = pos - elname;
+
+	while (pos < end) {
+		if ((*pos <= ' ') || (*pos == '/')) {
+			if ((*pos == '/') && (pos + 1 == end))
+				self_closing = 1;
+			pos++;
+			continue;
+		}
+
+		/* attribute name */
+		if (nattr == HTML_ATTR_MAX)
+			return (taglen);
+		attr [nattr].name = pos;
+		while ((pos < end) && (*pos > ' ') && (*pos != '/') && (*pos != '=')) {
+			if ((*pos == '"') || (*pos == '\'') || (*pos == '<'))
+				return (taglen);
+			pos++;
+		}
+		attr [nattr].namelen = pos - attr [nattr].name;
+		if (attr [nattr].namelen == 0)
+			return (taglen);
+		attr [nattr].value = NULL;
+		attr [nattr].valuelen = 0;
+		attr [nattr].quote = '\0';
+		while ((pos < end) && (*pos <= ' '))
+			pos++;
+
+		/* attribute value, if any */
+		if ((pos < end) && (*pos == '=')) {
+			pos++;
+			while ((pos < end) && (*pos <= ' '))
+				pos++;
+			if (pos >= end)
+				return (taglen);
+			if ((*pos == '"') || (*pos == '\'')) {
+				attr [nattr].quote = *pos;
+				attr [nattr].value = ++pos;
+				if ((pos = memchr (pos, attr [nattr].quote, end - pos)) == NULL)
+					return (taglen);
+				attr [nattr].valuelen = pos - attr [nattr].value;
+				pos++;
+			} else {
+				attr [nattr].value = pos;
+				while ((pos < end) && (*pos > ' ')) {
+					if (strchr ("\"'=<`", *pos) != NULL)
+						return (taglen);
+					pos++;
+				}
+				attr [nattr].valuelen = pos - attr [nattr].value;
+			}
+		}
+
+		if (css_name_is (attr [nattr].name, attr [nattr].namelen, "type")) {
+			type_attr = nattr;
+			type_count++;
+		}
+		nattr++;
+	}
+
+	/* default type attribute, dropped only if it's the only one and does not come along with the old "language" */
+	if (flags & HOPT_DEFAULT_TYPES) {
+		if (css_name_is (elname, elnamelen, "script"))
+			default_types = HTML_DEFAULT_SCRIPT_TYPES;
+		else if (css_name_is (elname, elnamelen, "style") || css_name_is (elname, elnamelen, "link"))
+			default_types = HTML_DEFAULT_STYLE_TYPES;
+		for (i = 0; i < nattr; i++) {
+			if (css_name_is (attr [i].name, attr [i].namelen, "language"))
+				default_types = NULL;
+		}
+	}
+	if ((default_types == NULL) || (type_count != 1) || (attr [type_attr].value == NULL) || \
+		(! html_name_in_list (attr [type_attr].value, attr [type_attr].valuelen, default_types)))
+		type_attr = -1;
+
+	/* rebuilds the tag */
+	out [0] = '<';
+	memcpy (out + 1, elname, elnamelen);
+	outlen = 1 + elnamelen;
+	for (i = 0; i < nattr; i++) {
+		if (i == type_attr)
+			continue;
+		out [outlen++] = ' ';
+		memcpy (out + outlen, attr [i].name, attr [i].namelen);
+		outlen += attr [i].namelen;
+		bare = 0;
+
+		if (attr [i].value == NULL)
+			continue;
+		if ((flags & HOPT_BOOLEAN_ATTRS) && html_name_in_list (attr [i].name, attr [i].namelen, HTML_BOOLEAN_ATTRS) && \
+			((attr [i].valuelen == 0) || html_same_name (attr [i].value, attr [i].valuelen, attr [i].name, attr [i].namelen)))
+			continue;
+
+		out [outlen++] = '=';
+		if ((attr [i].quote != '\0') && (! ((flags & HOPT_UNQUOTE) && html_unquotable (attr [i].value, attr [i].valuelen)))) {
+			out [outlen++] = attr [i].quote;
+			memcpy (out + outlen, attr [i].value, attr [i].valuelen);
+			outlen += attr [i].valuelen;
+			out [outlen++] = attr [i].quote;
+		} else {
+			memcpy (out + outlen, attr [i].value, attr [i].valuelen);
+			outlen += attr [i].valuelen;
+			bare = 1;
+		}
+	}
+	if (self_closing) {
+		if (bare)
+			out [outlen++] = ' ';
+		out [outlen++] = '/';
+	}
+	out [outlen++] = '>';
+
+	if (outlen > taglen)
+		return (taglen);
+	memcpy (tag, out, outlen);
+	return (outlen);
+}
+
+/* HOPT_LAZY_LOAD: "<img>" and "<iframe>" beyond the first html_lazy_eager of a page
+ * are loaded by the browser only when about to be displayed */
+#define HTML_LAZY_ATTRS		" loading=\"lazy\" decoding=\"async\""
+#define HTML_LAZY_MAX_GROWTH	(sizeof (HTML_LAZY_ATTRS) - 1)	/* per tag, at most */
+
+static int	html_lazy_eager = 0;
+
+/* defines how many "<img>" and "<iframe>" of each page are left as they are by HOPT_LAZY_LOAD
+ * (the ones at the top, usually displayed right away) */
+void hopt_set_lazy_load (int eager)
+{
+	html_lazy_eager = eager;
+}
+
+/* returns: how much bigger than srclen the text may become when optimized with 'flags'
+ * (only HOPT_LAZY_LOAD makes it grow, by one attribute or two per "<img>" and "<iframe>") */
+int hopt_html_max_growth (const unsigned char *src, int srclen, HOPT_FLAGS flags)
+{
+	const unsigned char	*pos = src;
+	const unsigned char	*end = src + srclen;
+	int	growth = 0;
+
+	if (! (flags & HOPT_LAZY_LOAD))
+		return (0);
+
+	while ((pos = memchr (pos, '<', end - pos)) != NULL) {
+		pos++;
+		if (css_name_begins (pos, end - pos, "img") || css_name_begins (pos, end - pos, "iframe"))
+			growth += HTML_LAZY_MAX_GROWTH;
+	}
+	return (growth);
+}
+
+/* adds loading="lazy" (and, for images, decoding="async") to a "<img>" or "<iframe>" start tag,
+ * unless it's one of the first html_lazy_eager of the page or already has those attributes
+ * the tag must be followed by room for HTML_LAZY_MAX_GROWTH chars
+ * returns: the new size of the tag */
+static int html_lazy_load (unsigned char *tag, int taglen, HOPT_FLAGS flags, html_state *state)
+{
+	const unsigned char	*pos = tag + 1;
+	const unsigned char	*end = tag + taglen - 1;	/* the final '>' */
+	const unsigned char	*name;
+	unsigned char	*insert;
+	int	namelen;
+	int	is_img;
+	int	has_loading = 0, has_decoding = 0;
+	int	self_closing = 0;
+	int	quotes;
+	char	attrs [HTML_LAZY_MAX_GROWTH + 1];
+	int	attrslen;
+	int	skip;
+
+	if ((taglen < 5) || (*end != '>'))
+		return (taglen);
+	name = pos;
+	while ((pos < end) && (*pos > ' ') && (*pos != '/'))
+		pos++;
+	namelen = pos - name;
+	is_img = css_name_is (name, namelen, "img");
+	if ((! is_img) && (! css_name_is (name, namelen, "iframe")))
+		return (taglen);
+	if (state->lazy_seen++ < html_lazy_eager)
+		return (taglen);
+
+	/* existing attributes are respected */
+	while (pos < end) {
+		if ((*pos <= ' ') || (*pos == '/')) {
+			if ((*pos == '/') && (pos + 1 == end))
+				self_closing = 1;
+			pos++;
+			continue;
+		}
+		name = pos;
+		while ((pos < end) && (*pos > ' ') && (*pos != '/') && (*pos != '='))
+			pos++;
+		namelen = pos - name;
+		if (css_name_is (name, namelen, "loading"))
+			has_loading = 1;
+		else if (css_name_is (name, namelen, "decoding"))
+			has_decoding = 1;
+		while ((pos < end) && (*pos <= ' '))
+			pos++;
+		if ((pos < end) && (*pos == '=')) {
+			pos++;
+			while ((pos < end) && (*pos <= ' '))
+				pos++;
+			if ((pos < end) && ((*pos == '"') || (*pos == '\''))) {
+				/* not closed: something unusual, left alone */
+				if ((pos = memchr (pos + 1, *pos, end - pos - 1)) == NULL)
+					return (taglen);
+				pos++;
+			} else {
+				while ((pos < end) && (*pos > ' '))
+					pos++;
+			}
+		}
+	}
+	if (has_loading)
+		return (taglen);
+
+	/* an unquoted value right before "/>" would take the '/' */
+	quotes = (! (flags & HOPT_UNQUOTE)) || self_closing;
+	attrslen = sprintf (attrs, quotes ? " loading=\"lazy\"" : " loading=lazy");
+	if (is_img && (! has_decoding))
+		attrslen += sprintf (attrs + attrslen, quotes ? " decoding=\"async\"" : " decoding=async");
+
+	insert = tag + taglen - (self_closing ? 2 : 1);
+	skip = (*(insert - 1) == ' ');	/* the space before "/>" serves as a separator already */
+	memmove (insert + attrslen - skip, insert, (tag + taglen) - insert);
+	memcpy (insert, attrs + skip, attrslen - skip);
+	return (taglen + attrslen - skip);
+}
+
 /* END OF ### HTML OPTIMIZATION ROUTINES */
 
 
@@ -744,6 +2391,10 @@ int compare_tag (const unsigned char *src, const unsigned char *tag, int taglen)
 
 	if (*rpos == '\0')
 		return (1);
+
+	/* quick check, most tags differ already at the first char */
+	if (lowercase_table [*rpos] != lowercase_table [*tag])
+		return (1);
 	
 	if (WHICH_STRNCASECMP (rpos, tag, taglen) == 0) {
 		switch (*(rpos + taglen)) {
@@ -765,16 +2416,11 @@ int compare_tag (const unsigned char *src, const unsigned char *tag, int taglen)
  */
 int return_chars_until_chr (const unsigned char *src, const unsigned char breakpoint)
 {
-	const unsigned char	*rpos = src;
-	int	charslen = 0;
-
-	while (*rpos != '\0') {
-		charslen++;
-		if (*(rpos++) == breakpoint)
-			return (charslen);
-	}
+	const unsigned char	*rpos = scan_chr_or_nul (src, breakpoint);
 
-	return (charslen);
+	if (*rpos == '\0')
+		return (rpos - src);
+	return ((rpos - src) + 1);
 }
 
 /* src: points to first char in javascript itself (just after "<SCRIPT ...>")
@@ -787,16 +2433,13 @@ int return_chars_until_chr (const unsigned char *src, const unsigned char breakp
 int return_javascript_body_len (const unsigned char *src)
 {
 	const unsigned char	*rpos = src;
-	int	srclen;
+	const unsigned char	*next;
 	int	junklen = 0;
-	int	count;
 	unsigned char	close_quote_char;
 	int 	break_loop;
 
-	srclen = WHICH_STRLEN (src);
-	count = srclen;
-
-	while (count) {
+	/* no need to know the data size, '\0' (and nothing before that) marks its end */
+	while (*rpos != '\0') {
 		switch (*rpos) {
 		case '<':
 			if (*(rpos + 1) == '/') {
@@ -804,32 +2447,28 @@ int return_javascript_body_len (const unsigned char *src)
 					// "</SCRIPT"
 					return (junklen);
 				}
-			} else if (count >= 9) {
+			} else {
 				// "<![CDATA["
 				if (! WHICH_STRNCMP ("<![CDATA[", rpos, 9)) {
 					junklen += 9;
-					count -= 9;
 					rpos += 9;
 
-					while (count) {
+					while (*rpos != '\0') {
 						if (*rpos == ']') {
 							if (! WHICH_STRNCMP ("]]>", rpos, 3)) {
 								// "]]>" (closes CDATA)
 								junklen += 3;
-								count -= 3;
 								rpos += 3;
 								break;
 							}
 						}
 						junklen++;
-						count--;
 						rpos++;
 					}
 					break;
 				}
 			}
 			junklen++;
-			count--;
 			rpos++;
 
 			break;
@@ -851,36 +2490,31 @@ int return_javascript_body_len (const unsigned char *src)
 
 			/* skips first quoted_char */
 			junklen++;
-			count--;
 			rpos++;
 			
-			while ((count) && (! break_loop)) {
+			while ((*rpos != '\0') && (! break_loop)) {
 				if (*rpos == '\\') {
 					/* skip escaped chars (meant to avoid \" and \') */
 					junklen++;
-					count--;
 					rpos++;
 				} else if (*rpos == close_quote_char) {
 					break_loop = 1;
 				}
 
-				if (count) {
+				if (*rpos != '\0') {
 					junklen++;
-					count--;
 					rpos++;
 				}
 			} 
 			break;
 			
 		case '\\':
-			if (count > 1) {
+			if (*(rpos + 1) != '\0') {
 				junklen += 2;
 				rpos += 2;
-				count -= 2;
 			} else {
 				junklen++;
 				rpos++;
-				count--;
 			}
 			break;
 			
@@ -891,25 +2525,23 @@ int return_javascript_body_len (const unsigned char *src)
 				break_loop = 0;
 
 				junklen += 2;
-				count -= 2;
 				rpos += 2;
-				while ((count) && (! break_loop)) {
+				while ((*rpos != '\0') && (! break_loop)) {
 					if (*rpos == ')')
 						break_loop = 1;
 					junklen++;
-					count--;
 					rpos++;
 				}
 			} else {
 				junklen++;
-				count--;
 				rpos++;
 			}
 			break;
 		default:
-			junklen++;
-			count--;
-			rpos++;
+			/* skips all the chars which need no special handling at once */
+			next = scan_set_or_nul (rpos + 1, (const unsigned char *) "<\"'[\\/");
+			junklen += next - rpos;
+			rpos = next;
 		}
 	}
 
@@ -930,6 +2562,7 @@ int return_javascript_body_len (const unsigned char *src)
 int break_composite_chunk (const unsigned char *src, int srclen, const unsigned char *closing_tag, int closing_tag_len, int *opening_tag_size, int *content_size, int *closing_tag_size)
 {
 	const unsigned char	*rpos = src;
+	const unsigned char	*next;
 	int	content_at, closing_tag_at;
 	int	count = srclen;
 
@@ -945,11 +2578,11 @@ int break_composite_chunk (const unsigned char *src, int srclen, const unsigned
 	}
 
 	/* finds content position */
-	content_at = 0;
-	while ((count) && (*(src + content_at) != '>')) {
-		count--;
-		content_at++;
-	}
+	if ((next = memchr (src, '>', count)) != NULL)
+		content_at = next - src;
+	else
+		content_at = count;
+	count -= content_at;
 	if (*(src + content_at) == '>')
 		content_at++;
 	*opening_tag_size = content_at;
@@ -957,13 +2590,14 @@ int break_composite_chunk (const unsigned char *src, int srclen, const unsigned
 	/* finds closing tag position */
 	closing_tag_at = content_at;
 	while (count) {
-		if (*(src + closing_tag_at) == '<') {
-			if (! compare_tag (src + closing_tag_at + 1, closing_tag, closing_tag_len)) {
-				count = 0;
-			} else {
-				count--;
-				closing_tag_at++;
-			}
+		if ((next = memchr (src + closing_tag_at, '<', count)) == NULL) {
+			closing_tag_at += count;
+			break;
+		}
+		count -= next - (src + closing_tag_at);
+		closing_tag_at = next - src;
+		if (! compare_tag (src + closing_tag_at + 1, closing_tag, closing_tag_len)) {
+			count = 0;
 		} else {
 			count--;
 			closing_tag_at++;
@@ -994,6 +2628,7 @@ int break_composite_chunk (const unsigned char *src, int srclen, const unsigned
 int return_junky_chunk_len (const unsigned char *src, const unsigned char *closing_tag, int closing_tag_len)
 {
 	const unsigned char	*rpos = src;
+	const unsigned char	*next;
 	int	junklen = 0;
 	int	otagsize;
 	int	bodysize;
@@ -1008,17 +2643,18 @@ int return_junky_chunk_len (const unsigned char *src, const unsigned char *closi
 		ctagsize = return_chars_until_chr (rpos, '>');
 		junklen += (otagsize + bodysize + ctagsize);
 	} else {	
-		while (*rpos != '\0') {
-			if (*rpos == '<') {
-				if (*(rpos + 1) == '/') {
-					if (compare_tag (rpos + 2, closing_tag, closing_tag_len) == 0) {
-						return (junklen + 2 + return_chars_until_chr (rpos + 2, '>'));
-					}
+		while (*(next = scan_chr_or_nul (rpos, '<')) != '\0') {
+			junklen += next - rpos;
+			rpos = next;
+			if (*(rpos + 1) == '/') {
+				if (compare_tag (rpos + 2, closing_tag, closing_tag_len) == 0) {
+					return (junklen + 2 + return_chars_until_chr (rpos + 2, '>'));
 				}
 			}
 			junklen++;
 			rpos++;
 		}
+		junklen += next - rpos;
 	}
 	return (junklen);
 }
@@ -1028,18 +2664,20 @@ int return_junky_chunk_len (const unsigned char *src, const unsigned char *closi
 int return_comment_chunk_len (const unsigned char *src)
 {
 	const unsigned char	*rpos = src + 4;
+	const unsigned char	*next;
 	int	charslen = 4;
 
-	while (*rpos != '\0') {
-		if (*rpos == '-') {
-			if (*(rpos + 1) == '-') {
-				if (*(rpos + 2) == '>')
-					return (charslen + 3);
-			}
+	while (*(next = scan_chr_or_nul (rpos, '-')) != '\0') {
+		charslen += next - rpos;
+		rpos = next;
+		if (*(rpos + 1) == '-') {
+			if (*(rpos + 2) == '>')
+				return (charslen + 3);
 		}
 		charslen++;
 		rpos++;
 	}
+	charslen += next - rpos;
 
 	return (charslen);
 }
@@ -1049,18 +2687,20 @@ int return_comment_chunk_len (const unsigned char *src)
 int return_cdata_len (const unsigned char *src)
 {
 	const unsigned char	*rpos = src + 9;
+	const unsigned char	*next;
 	int	charslen = 9;
 
-	while (*rpos != '\0') {
-		if (*rpos == ']') {
-			if (*(rpos + 1) == ']') {
-				if (*(rpos + 2) == '>')
-					return (charslen + 3);
-			}
+	while (*(next = scan_chr_or_nul (rpos, ']')) != '\0') {
+		charslen += next - rpos;
+		rpos = next;
+		if (*(rpos + 1) == ']') {
+			if (*(rpos + 2) == '>')
+				return (charslen + 3);
 		}
 		charslen++;
 		rpos++;
 	}
+	charslen += next - rpos;
 
 	return (charslen);
 }
@@ -1143,41 +2783,64 @@ int get_chunk_info (const unsigned char *src, chunk_info *info)
 
 /* END OF ### BASE HTML PARSER ### */
 
-/* converts CRLF and CR to that standard and closes dst with '\0' 
- * it also replaces '\0' in the middle of the text with spaces
- * return: size of resulting text (may be <= srclen because of CR suppression, for example) */
-/* *dst may be the same pointer as *src, but the buffer must be at least srclen+1 */
-int fix_linebreaks (const unsigned char *src, int srclen, unsigned char *dst)
+/* same as fix_linebreaks(), except the state is kept between calls
+ * (so the text may be processed in parts), and dst is not closed with '\0'
+ * prevchar and prevchar_was_cr_or_lf: init with '\0' and 0, respectively */
+int fix_linebreaks_part (const unsigned char *src, int srclen, unsigned char *dst, unsigned char *prevchar, int *prevchar_was_cr_or_lf)
 {
 	const unsigned char	*rpos = src;
 	unsigned char		*wpos = dst;
-	unsigned char		prevchar = '\0';
 	unsigned char		curchar;
-	int	prevchar_was_cr_or_lf = 0;
 	int	curchar_is_cr_or_lf;
 	int	count = srclen;
 	int	dstlen = 0;
+	int	spanlen;
+
+	while (count) {
+		/* chars other than CR, LF and '\0' are copied unmodified, the whole run at once */
+		if ((spanlen = scan_2chr_span (rpos, count, '\r', '\n')) != 0) {
+			memmove (wpos, rpos, spanlen);
+			rpos += spanlen;
+			wpos += spanlen;
+			dstlen += spanlen;
+			count -= spanlen;
+			*prevchar_was_cr_or_lf = 0;
+			*prevchar = *(rpos - 1);
+			continue;
+		}
 
-	while (count--) {
 		curchar = *(rpos++);
+		count--;
 		curchar_is_cr_or_lf = 0;
 		if ((curchar == '\n') || (curchar == '\r')) {
 			curchar_is_cr_or_lf = 1;
-			if ((!prevchar_was_cr_or_lf) || ((prevchar_was_cr_or_lf) && (prevchar == curchar))) {
+			if ((!*prevchar_was_cr_or_lf) || ((*prevchar_was_cr_or_lf) && (*prevchar == curchar))) {
 				*(wpos++) = '\n';
 				dstlen++;
 			}
-		} else if (curchar != '\0') {
-			*(wpos++) = curchar;
-			dstlen++;
 		} else {
 			*(wpos++) = ' ';
 			dstlen++;
 		}
-		prevchar_was_cr_or_lf = curchar_is_cr_or_lf;
-		prevchar = curchar;
+		*prevchar_was_cr_or_lf = curchar_is_cr_or_lf;
+		*prevchar = curchar;
 	}
-	*wpos = '\0';
+
+	return (dstlen);
+}
+
+/* converts CRLF and CR to that standard and closes dst with '\0' 
+ * it also replaces '\0' in the middle of the text with spaces
+ * return: size of resulting text (may be <= srclen because of CR suppression, for example) */
+/* *dst may be the same pointer as *src, but the buffer must be at least srclen+1 */
+int fix_linebreaks (const unsigned char *src, int srclen, unsigned char *dst)
+{
+	unsigned char	prevchar = '\0';
+	int	prevchar_was_cr_or_lf = 0;
+	int	dstlen;
+
+	dstlen = fix_linebreaks_part (src, srclen, dst, &prevchar, &prevchar_was_cr_or_lf);
+	*(dst + dstlen) = '\0';
 
 	return (dstlen);
 }
@@ -1192,8 +2855,26 @@ int hopt_pack_javascript (const unsigned char *src, int srclen, unsigned char *d
 	return (compress_javascript_chunk (src, srclen, dst));
 }
 
+/* optimizes a tag, according to HOPT_HTMLTAGS and the attribute-related flags
+ * returns: size of data dumped into dst */
+static int pack_html_tag (const unsigned char *src, int srclen, unsigned char *dst, HOPT_FLAGS flags)
+{
+	int	dstlen;
+
+	if (flags & HOPT_HTMLTAGS) {
+		dstlen = compress_html_tag (src, srclen, dst);
+	} else {
+		strncpy_overlapping (src, dst, srclen);
+		dstlen = srclen;
+	}
+	if (flags & (HOPT_UNQUOTE | HOPT_BOOLEAN_ATTRS | HOPT_DEFAULT_TYPES))
+		dstlen = optimize_html_attributes (dst, dstlen, flags);
+
+	return (dstlen);
+}
+
 /* optimize chunks which are composed of opening_tag + content + closing_tag (javascript, style, pre text etc) */
-int pack_composite_chunk (const unsigned char *src, int srclen, unsigned char *dst, HOPT_FLAGS which_content, HOPT_FLAGS pack_htmltags)
+int pack_composite_chunk (const unsigned char *src, int srclen, unsigned char *dst, HOPT_FLAGS which_content, HOPT_FLAGS flags)
 {
 	int	(*comp_call) (const unsigned char *, int, unsigned char *) = NULL;
 	const unsigned char	*closing_tag = NULL;
@@ -1233,12 +2914,7 @@ int pack_composite_chunk (const unsigned char *src, int srclen, unsigned char *d
 
 	if (composite_situation == 0) {
 		/* opening tag "<blabla ..." */
-		if (pack_htmltags) {
-			wsize1 = compress_html_tag (src, rsize1, dst);
-		} else {
-			strncpy_overlapping (src, dst, rsize1);
-			wsize1 = rsize1;
-		}
+		wsize1 = pack_html_tag (src, rsize1, dst, flags);
 
 		/* the content itself (javascript, CSS, etc.. including "<!--" and "-->" if existant) */
 		if (comp_call != NULL) {
@@ -1250,12 +2926,7 @@ int pack_composite_chunk (const unsigned char *src, int srclen, unsigned char *d
 		}
 	
 		/* closing tag "</blabla>" */
-		if (pack_htmltags) {
-			wsize3 = compress_html_tag (src + rsize1 + rsize2, rsize3, dst + wsize1 + wsize2);
-		} else {
-			strncpy_overlapping (src + rsize1 + rsize2, dst + wsize1 + wsize2, rsize3);
-			wsize3 = rsize3;
-		}
+		wsize3 = pack_html_tag (src + rsize1 + rsize2, rsize3, dst + wsize1 + wsize2, flags);
 
 		dstlen = wsize1 + wsize2 + wsize3;
 	} else {
@@ -1267,132 +2938,233 @@ int pack_composite_chunk (const unsigned char *src, int srclen, unsigned char *d
 	return (dstlen);	
 }
 	
-/* src = html text to be compressed (no need to be suffixed by '\0')
- * dst = destination buffer, may be the same as src. size must be at least src_size + 1. will be suffixed by '\0'.
- * srclen = html text size (not counting trailing '\0' if existant)
- * returns: size of optimized html text
- */
-int hopt_pack_html (const unsigned char *src, int srclen, unsigned char *dst, HOPT_FLAGS flags)
+/* optimizes the contents of a single chunk (as returned by get_chunk_info())
+ * state: html optimizer state (only allow_empty_html_text and lazy_seen are used here)
+ * returns: size of data dumped into dst */
+static int pack_html_chunk_content (const unsigned char *src, int srclen, unsigned char *dst, enum chunk_type c_type, HOPT_FLAGS flags, html_state *state)
 {
-	const unsigned char	*rpos;
-	unsigned char		*wpos;
-	chunk_info	info;
-	int		rc_size, wc_size;
-	int		w_total_size = 0;
-	int		allow_empty_html_text = 0; /* does not allow more than 1 empty text-chunk after another */
-
-	srclen = fix_linebreaks (src, srclen, dst);
-
-	/* since src is a constant array of chars, and we need to pre-modify the data in order to work with that,
-	 * we'll use dst buffer as src and dst simultaneously (the routines tolerate this), thus avoiding the need
-	 * to malloc a third buffer */
+	int	dstlen = 0;
 
-	*(dst + srclen) = '\0'; /* trailing zero needed, the optimization routines may rely on this if the JS/HTML meets EOF prematurely */
-	
-	src = dst; /* 'linebreak_fixed' text is now in dst, we work there from now on */
-	rpos = src;
-	wpos = dst;
-	
-	while ((rc_size = get_chunk_info (rpos, &info))) {
-		switch (info.c_type) {
-		case CT_COMMENT:
-			/* ommits comments, unless it's a "<!-- -->" which, interestingly,
-			 * was only found in the micros_ft website and, if removed, breaks
-			 * the formatting badly */
-			if (flags & HOPT_NOCOMMENTS) {
-				wc_size = 0;
-				if (rc_size == 8) {
-					if (! WHICH_STRNCMP ("<!-- -->", rpos, 8)) {
-						strncpy_overlapping (rpos, wpos, rc_size);
-						wc_size = 8;
-					}
+	switch (c_type) {
+	case CT_COMMENT:
+		/* ommits comments, unless it's a "<!-- -->" which, interestingly,
+		 * was only found in the micros_ft website and, if removed, breaks
+		 * the formatting badly */
+		if (flags & HOPT_NOCOMMENTS) {
+			dstlen = 0;
+			if (srclen == 8) {
+				if (! WHICH_STRNCMP ("<!-- -->", src, 8)) {
+					strncpy_overlapping (src, dst, srclen);
+					dstlen = 8;
 				}
-			} else {
-				strncpy_overlapping (rpos, wpos, rc_size);
-				wc_size = rc_size;
 			}
-			break;
+		} else {
+			strncpy_overlapping (src, dst, srclen);
+			dstlen = srclen;
+		}
+		break;
 #ifdef DEBUG
-			debug_dump_chunk_data (wpos, wc_size, "COMMENT");
+		debug_dump_chunk_data (dst, dstlen, "COMMENT");
 #endif
-		case CT_HTML_TEXT:
-			if (flags & HOPT_HTMLTEXT) {
-				wc_size = compress_html_text_chunk (rpos, rc_size, wpos, allow_empty_html_text);
-			} else {
-				strncpy_overlapping (rpos, wpos, rc_size);
-				wc_size = rc_size;
-			}
+	case CT_HTML_TEXT:
+		if (flags & HOPT_HTMLTEXT) {
+			dstlen = compress_html_text_chunk (src, srclen, dst, state->allow_empty_html_text);
+		} else {
+			strncpy_overlapping (src, dst, srclen);
+			dstlen = srclen;
+		}
 
-			if (wc_size > 0)
-				allow_empty_html_text = 1;
-			else
-				allow_empty_html_text = 0;
-			break;
+		if (dstlen > 0)
+			state->allow_empty_html_text = 1;
+		else
+			state->allow_empty_html_text = 0;
+		break;
 #ifdef DEBUG
-			debug_dump_chunk_data (wpos, wc_size, "HTML_TEXT");
+		debug_dump_chunk_data (dst, dstlen, "HTML_TEXT");
 #endif
-		case CT_HTML_TAG_OTHER:
-			if (flags & HOPT_HTMLTAGS) {
-				wc_size = compress_html_tag (rpos, rc_size, wpos);
-			} else {
-				strncpy_overlapping (rpos, wpos, rc_size);
-				wc_size = rc_size;
-			}
+	case CT_HTML_TAG_OTHER:
+		dstlen = pack_html_tag (src, srclen, dst, flags);
+		if (flags & HOPT_LAZY_LOAD)
+			dstlen = html_lazy_load (dst, dstlen, flags, state);
 #ifdef DEBUG
-			debug_dump_chunk_data (wpos, wc_size, "HTML_TAG_OTHER");
+		debug_dump_chunk_data (dst, dstlen, "HTML_TAG_OTHER");
 #endif
-			break;
-		case CT_JAVASCRIPT:
-			wc_size = pack_composite_chunk (rpos, rc_size, wpos, flags & HOPT_JAVASCRIPT, flags & HOPT_HTMLTAGS);
+		break;
+	case CT_JAVASCRIPT:
+		dstlen = pack_composite_chunk (src, srclen, dst, flags & HOPT_JAVASCRIPT, flags);
 #ifdef DEBUG
-			debug_dump_chunk_data (wpos, wc_size, "JAVASCRIPT");
+		debug_dump_chunk_data (dst, dstlen, "JAVASCRIPT");
 #endif
-			break;
-		case CT_STYLE:
-			wc_size = pack_composite_chunk (rpos, rc_size, wpos, flags & HOPT_CSS, flags & HOPT_HTMLTAGS);
+		break;
+	case CT_STYLE:
+		dstlen = pack_composite_chunk (src, srclen, dst, flags & HOPT_CSS, flags);
 #ifdef DEBUG
-			debug_dump_chunk_data (wpos, wc_size, "STYLE");
+		debug_dump_chunk_data (dst, dstlen, "STYLE");
 #endif
-			break;
-		case CT_HTML_PRE_TEXT:
-			wc_size = pack_composite_chunk (rpos, rc_size, wpos, flags & HOPT_PRE, flags & HOPT_HTMLTAGS);
+		break;
+	case CT_HTML_PRE_TEXT:
+		dstlen = pack_composite_chunk (src, srclen, dst, flags & HOPT_PRE, flags);
 #ifdef DEBUG
-			debug_dump_chunk_data (wpos, wc_size, "PRE_TEXT");
+		debug_dump_chunk_data (dst, dstlen, "PRE_TEXT");
 #endif	
-			break;
-		case CT_HTML_TEXTAREA:
-			wc_size = pack_composite_chunk (rpos, rc_size, wpos, flags & HOPT_TEXTAREA, flags & HOPT_HTMLTAGS);
+		break;
+	case CT_HTML_TEXTAREA:
+		dstlen = pack_composite_chunk (src, srclen, dst, flags & HOPT_TEXTAREA, flags);
 #ifdef DEBUG
-			debug_dump_chunk_data (wpos, wc_size, "TEXTAREA");
+		debug_dump_chunk_data (dst, dstlen, "TEXTAREA");
 #endif
-			break;
-		case CT_COMMENT_EXTENSION:
-		case CT_EXCLAM_TYPES:
-			/* TODO: these tags may be optimizable (a guess) by the HTML-tag routines, since i'm unsure right now let's not modify */
-			/* note: "<!DOCTYPE" is probably useless in practice (at least when WWW browsers are concerned)
-			 * and perhaps it can be simply supressed */
-
-			/* dumps the data, unmodified */
-			strncpy_overlapping (rpos, wpos, rc_size);
-			wc_size = rc_size;
+		break;
+	case CT_COMMENT_EXTENSION:
+	case CT_EXCLAM_TYPES:
+		/* TODO: these tags may be optimizable (a guess) by the HTML-tag routines, since i'm unsure right now let's not modify */
+		/* note: "<!DOCTYPE" is probably useless in practice (at least when WWW browsers are concerned)
+		 * and perhaps it can be simply supressed */
+
+		/* dumps the data, unmodified */
+		strncpy_overlapping (src, dst, srclen);
+		dstlen = srclen;
 #ifdef DEBUG
-			debug_dump_chunk_data (wpos, wc_size, "COMMENT/EXCLAM");
+		debug_dump_chunk_data (dst, dstlen, "COMMENT/EXCLAM");
 #endif
-			break;
-		case CT_CDATA:
-			/* dumps the data, unmodified */
-			strncpy_overlapping (rpos, wpos, rc_size);
-			wc_size = rc_size;
+		break;
+	case CT_CDATA:
+		/* dumps the data, unmodified */
+		strncpy_overlapping (src, dst, srclen);
+		dstlen = srclen;
 #ifdef DEBUG
-			debug_dump_chunk_data (wpos, wc_size, "CDATA");
+		debug_dump_chunk_data (dst, dstlen, "CDATA");
 #endif
-			break;
+		break;
+	}
+
+	return (dstlen);
+}
+
+/* optimizes a single chunk (as returned by get_chunk_info())
+ * with HOPT_OPTIONAL_TAGS or HOPT_BLOCK_SPACES, an end tag or spaces may be held (and later dropped)
+ * until what comes next is known, html_finish_pending() must be called at the end of the document
+ * state: html optimizer state, init with zeros
+ * returns: size of data dumped into dst (which may include what was held before) */
+int pack_html_chunk (const unsigned char *src, int srclen, unsigned char *dst, enum chunk_type c_type, HOPT_FLAGS flags, html_state *state)
+{
+	int	held = state->pending_tag_len + state->pending_space_len;
+	int	dstlen, keptlen = 0;
+	const unsigned char	*name;
+	int	namelen;
+	int	el;
+	int	drop_tag = 0, drop_space = 0;
+	int	end_tag = -1;	/* index into html_optional_end [] if the chunk is an end tag which may be omitted */
+	int	p_open = state->p_open;
+
+	if (! (flags & (HOPT_OPTIONAL_TAGS | HOPT_BLOCK_SPACES)))
+		return (pack_html_chunk_content (src, srclen, dst, c_type, flags, state));
+
+	/* the chunk is examined before being optimized, since (in-place) the optimized chunk may overwrite it */
+	el = html_chunk_element (src, srclen, c_type, &name, &namelen);
+	if ((c_type == CT_EXCLAM_TYPES) && html_is_no_quirks_doctype (src, srclen))
+		state->no_quirks = 1;
+	if (el & HTML_EL_TAG) {
+		if (held) {
+			/* spaces between a start tag and its end tag are kept ("<td> </td>" is not ":empty") */
+			drop_space = (state->pending_space_len != 0) && (flags & HOPT_BLOCK_SPACES) && (el & HTML_EL_BLOCK) && \
+				(! ((el & HTML_EL_CLOSING) && (! (state->prev_el & (HTML_EL_CLOSING | HTML_EL_VOID)))));
+			drop_tag = (state->pending_tag_len != 0) && ((state->pending_space_len == 0) || drop_space) && \
+				html_name_in_list (name, namelen, (el & HTML_EL_CLOSING) ? html_optional_end [state->pending_tag].next_end : html_optional_end [state->pending_tag].next_start);
+			/* in quirks mode, "<table>" would end up within the paragraph */
+			if (drop_tag && (! state->no_quirks) && (! (el & HTML_EL_CLOSING)) && css_name_is (name, namelen, "table"))
+				drop_tag = 0;
 		}
 
+		/* "</p>" without an open "<p>" is not a no-op, it creates an empty paragraph */
+		if ((c_type == CT_HTML_TAG_OTHER) && (el & HTML_EL_CLOSING) && (flags & HOPT_OPTIONAL_TAGS) && \
+			(state->p_open || (! css_name_is (name, namelen, "p"))))
+			end_tag = html_optional_end_index (name, namelen);
+
+		if ((! (el & HTML_EL_CLOSING)) && css_name_is (name, namelen, "p"))
+			p_open = 1;
+		else if (! html_name_in_list (name, namelen, HTML_INLINE_ELEMENTS))
+			p_open = 0;
+	}
+
+	/* the chunk is dumped after what's held, moved back later if something is dropped
+	 * (fine in-place too, since the held data was shorter than the chunks it came from) */
+	dstlen = pack_html_chunk_content (src, srclen, dst + held, c_type, flags, state);
+
+	/* spaces after a block element: held, they're dropped if another block element comes next */
+	if ((el & HTML_EL_SPACES) && (flags & HOPT_BLOCK_SPACES) && (state->prev_el & HTML_EL_BLOCK) && \
+		(state->pending_space_len == 0) && (held + dstlen <= HTML_PENDING_MAX)) {
+		memcpy (state->pending + held, dst + held, dstlen);
+		state->pending_space_len = dstlen;
+		return (0);
+	}
+
+	if (held) {
+		keptlen = html_flush_pending (state, dst, drop_tag, drop_space);
+		if (keptlen != held)
+			memmove (dst + keptlen, dst + held, dstlen);
+	}
+
+	/* an end tag which may be omitted: held until what comes next is known */
+	if ((end_tag >= 0) && (dstlen <= HTML_PENDING_MAX)) {
+		memcpy (state->pending, dst + keptlen, dstlen);
+		state->pending_tag = end_tag;
+		state->pending_tag_len = dstlen;
+		dstlen = 0;
+	}
+
+	/* composite chunks end with their closing tag */
+	if ((c_type == CT_JAVASCRIPT) || (c_type == CT_STYLE) || (c_type == CT_HTML_PRE_TEXT) || (c_type == CT_HTML_TEXTAREA))
+		el |= HTML_EL_CLOSING;
+	state->prev_el = (el & HTML_EL_SPACES) ? 0 : el;
+	state->p_open = p_open;
+
+	return (keptlen + dstlen);
+}
+
+/* src = html text to be compressed (no need to be suffixed by '\0')
+ * dst = destination buffer, may be the same as src. size must be at least src_size + 1 (plus hopt_html_max_growth(),
+ *       with HOPT_LAZY_LOAD). will be suffixed by '\0'.
+ * srclen = html text size (not counting trailing '\0' if existant)
+ * returns: size of optimized html text
+ */
+int hopt_pack_html (const unsigned char *src, int srclen, unsigned char *dst, HOPT_FLAGS flags)
+{
+	const unsigned char	*rpos;
+	unsigned char		*wpos;
+	chunk_info	info;
+	int		rc_size, wc_size;
+	int		w_total_size = 0;
+	html_state	state;
+	int		growth = hopt_html_max_growth (src, srclen, flags);
+
+	/* if the text may grow, it's moved ahead by that much first, so the output never overwrites what's not read yet */
+	if (growth) {
+		memmove (dst + growth, src, srclen);
+		src = dst + growth;
+	}
+	srclen = fix_linebreaks (src, srclen, dst + growth);
+
+	/* since src is a constant array of chars, and we need to pre-modify the data in order to work with that,
+	 * we'll use dst buffer as src and dst simultaneously (the routines tolerate this), thus avoiding the need
+	 * to malloc a third buffer */
+
+	*(dst + growth + srclen) = '\0'; /* trailing zero needed, the optimization routines may rely on this if the JS/HTML meets EOF prematurely */
+	
+	src = dst + growth; /* 'linebreak_fixed' text is now in dst, we work there from now on */
+	rpos = src;
+	wpos = dst;
+	memset (&state, 0, sizeof (html_state));
+	
+	while ((rc_size = get_chunk_info (rpos, &info))) {
+		wc_size = pack_html_chunk (rpos, rc_size, wpos, info.c_type, flags, &state);
+
 		rpos += rc_size;
 		wpos += wc_size;
 		w_total_size += wc_size;
 	}
+	wc_size = html_finish_pending (&state, wpos, flags);
+	wpos += wc_size;
+	w_total_size += wc_size;
 	
 	/* finished, close the text as it should be */
 	*wpos = '\0';
@@ -1401,6 +3173,311 @@ int hopt_pack_html (const unsigned char *src, int srclen, unsigned char *dst, HO
 }
 
 
+/* ### ALREADY-MINIFIED TEXT DETECTION ### */
+
+/* CSS/JS which is already minified is not worth optimizing again.
+ * the saving is estimated from a few slices spread over the text (spaces, line breaks
+ * and comments which would be removed), that costs little even for huge texts */
+#define HOPT_SAMPLE_SLICES	4
+#define HOPT_SAMPLE_SLICE_LEN	4096
+
+/* chars which need no spaces around (in both CSS and JS) */
+#define HOPT_SAMPLE_PUNCT	"{}()[];,:=<>+*!?&|~"
+
+/* returns: chars of the slice which would be removed by the optimization (estimate) */
+static int hopt_sample_removable (const unsigned char *src, int srclen, int content)
+{
+	const unsigned char	*pos = src;
+	const unsigned char	*end = src + srclen;
+	const unsigned char	*start;
+	const unsigned char	*found;
+	int	removable = 0;
+
+	while (pos < end) {
+		if (*pos <= ' ') {
+			/* spaces and line breaks: removed next to punctuation, otherwise one is kept */
+			start = pos;
+			while ((pos < end) && (*pos <= ' '))
+				pos++;
+			removable += (pos - start) - 1;
+			if ((start == src) || (pos == end) || (strchr (HOPT_SAMPLE_PUNCT, *(start - 1)) != NULL) || (strchr (HOPT_SAMPLE_PUNCT, *pos) != NULL))
+				removable++;
+		} else if ((*pos == '"') || (*pos == '\'')) {
+			/* strings are skipped, if ending within the line (the slice may begin in the middle of one) */
+			for (found = pos + 1; (found < end) && (*found != *pos) && (*found != '\n'); found++) {
+				if ((*found == '\\') && (found + 1 < end))
+					found++;
+			}
+			pos = ((found < end) && (*found == *pos)) ? found + 1 : pos + 1;
+		} else if ((*pos == '/') && (pos + 1 < end) && (*(pos + 1) == '*')) {
+			/* comments (in JS, except the ones beginning with '!', which are kept) */
+			start = pos;
+			for (pos += 2; (pos < end) && (! ((*(pos - 1) == '*') && (*pos == '/'))); pos++);
+			if (pos < end)
+				pos++;
+			if ((content != HOPT_STREAM_JS) || (start + 2 >= end) || (*(start + 2) != '!'))
+				removable += pos - start;
+		} else if ((content == HOPT_STREAM_JS) && (*pos == '/') && (pos + 1 < end) && (*(pos + 1) == '/') && \
+			((pos == src) || (*(pos - 1) != ':'))) {
+			/* single-line comment (not "http://...") */
+			start = pos;
+			while ((pos < end) && (*pos != '\n'))
+				pos++;
+			removable += pos - start;
+		} else {
+			pos++;
+		}
+	}
+
+	return (removable);
+}
+
+/* src: CSS or JS text (content: HOPT_STREAM_CSS or HOPT_STREAM_JS)
+ * threshold: minimum saving (in percent) for the optimization to be worth
+ * returns: !=0 if the optimization of the text is expected to save less than threshold (already minified) */
+int hopt_is_minified (const unsigned char *src, int srclen, int content, int threshold)
+{
+	long	removable = 0;
+	long	sampled = 0;
+	const unsigned char	*pos;
+	int	slice_len = HOPT_SAMPLE_SLICE_LEN;
+	int	slice;
+	int	slices = HOPT_SAMPLE_SLICES;
+
+	if (srclen <= 0)
+		return (0);
+
+	/* small text: all of it */
+	if (srclen <= HOPT_SAMPLE_SLICES * HOPT_SAMPLE_SLICE_LEN) {
+		slices = 1;
+		slice_len = srclen;
+	}
+
+	for (slice = 0; slice < slices; slice++) {
+		pos = src + ((slices > 1) ? (((long) (srclen - slice_len)) * slice / (slices - 1)) : 0);
+		removable += hopt_sample_removable (pos, slice_len, content);
+		sampled += slice_len;
+	}
+
+	return ((removable * 100) < (threshold * sampled));
+}
+
+/* END OF ### ALREADY-MINIFIED TEXT DETECTION ### */
+
+
+/* ### STREAMING (INCREMENTAL) OPTIMIZATION ### */
+
+/* chars which must be available past the end of an element (or chunk)
+ * before it's processed, since the optimizers peek a few chars ahead */
+#define HOPT_STREAM_LOOKAHEAD		16
+
+/* optimized CSS/JS chars held back (not returned yet),
+ * since the optimizer may backtrack over those when processing what comes next */
+#define HOPT_STREAM_HISTORY		8
+
+/* if the pending (unprocessed) data grows beyond that (huge unterminated comment, script etc),
+ * gives up optimizing and just passes the remaining data through */
+#define HOPT_STREAM_MAX_PENDING		(1024 * 1024)
+
+struct t_hopt_stream {
+	int		content;	/* HOPT_STREAM_* */
+	HOPT_FLAGS	flags;
+	int		passthrough;	/* !=0: no longer optimizing */
+
+	/* HTML only: line break normalization and html optimizer state */
+	unsigned char	lb_prevchar;
+	int		lb_prevchar_was_cr_or_lf;
+	html_state	html;
+
+	/* CSS only: style optimizer state */
+	css_state	css;
+
+	/* JS only: javascript optimizer state */
+	js_state	js;
+
+	/* received and not processed yet, '\0'-terminated */
+	unsigned char	*in;
+	int		in_len;
+	int		in_alloc;
+	int		in_rescan;	/* not processed again before in_len reaches that */
+
+	/* processed data, out_returned chars of it were returned by the previous call */
+	unsigned char	*out;
+	int		out_len;
+	int		out_alloc;
+	int		out_returned;
+};
+
+/* makes sure *buf holds at least 'needed' chars
+ * returns: ==0 ok, !=0 error (out of memory) */
+static int hopt_stream_reserve (unsigned char **buf, int *alloc, int needed)
+{
+	unsigned char	*newbuf;
+	int		newalloc;
+
+	if (needed <= *alloc)
+		return (0);
+
+	newalloc = *alloc ? *alloc : 4096;
+	while (newalloc < needed)
+		newalloc <<= 1;
+	if ((newbuf = realloc (*buf, newalloc)) == NULL)
+		return (1);
+	*buf = newbuf;
+	*alloc = newalloc;
+	return (0);
+}
+
+/* returns: ==0 ok, !=0 error (out of memory) */
+static int hopt_stream_process (t_hopt_stream *stream, int finishing)
+{
+	const unsigned char	*rpos = stream->in;
+	const unsigned char	*in_end = stream->in + stream->in_len;
+	chunk_info	info;
+	int		rc_size;
+	int		used;
+
+	if (stream->passthrough) {
+		used = stream->in_len;
+		if (hopt_stream_reserve (&(stream->out), &(stream->out_alloc), stream->out_len + used + HTML_PENDING_MAX))
+			return (1);
+		/* whatever the html optimizer held is outputted as it is */
+		stream->out_len += html_flush_pending (&(stream->html), stream->out + stream->out_len, 0, 0);
+		memcpy (stream->out + stream->out_len, stream->in, used);
+		stream->out_len += used;
+	} else if (stream->content == HOPT_STREAM_HTML) {
+		while ((rc_size = get_chunk_info (rpos, &info))) {
+			/* a chunk reaching (almost) the end of data may not be complete yet */
+			if ((! finishing) && (rpos + rc_size + HOPT_STREAM_LOOKAHEAD > in_end))
+				break;
+			if (hopt_stream_reserve (&(stream->out), &(stream->out_alloc), stream->out_len + (rc_size * 2) + HTML_PENDING_MAX + HTML_LAZY_MAX_GROWTH + 32))
+				return (1);
+			stream->out_len += pack_html_chunk (rpos, rc_size, stream->out + stream->out_len, info.c_type, stream->flags, &(stream->html));
+			rpos += rc_size;
+		}
+		used = rpos - stream->in;
+		if (finishing) {
+			if (hopt_stream_reserve (&(stream->out), &(stream->out_alloc), stream->out_len + HTML_PENDING_MAX))
+				return (1);
+			stream->out_len += html_finish_pending (&(stream->html), stream->out + stream->out_len, stream->flags);
+		}
+	} else {
+		if (hopt_stream_reserve (&(stream->out), &(stream->out_alloc), stream->out_len + (stream->in_len * 2) + 32))
+			return (1);
+		if (stream->content == HOPT_STREAM_CSS)
+			stream->out_len += compress_style_text (&(stream->css), stream->in, stream->in_len, stream->out + stream->out_len, stream->out_len, finishing ? 0 : HOPT_STREAM_LOOKAHEAD, &used);
+		else
+			stream->out_len += compress_javascript_text (&(stream->js), stream->in, stream->in_len, stream->out + stream->out_len, stream->out_len, finishing ? 0 : HOPT_STREAM_LOOKAHEAD, &used);
+	}
+
+	stream->in_len -= used;
+	memmove (stream->in, stream->in + used, stream->in_len + 1);
+
+	/* too much data held, the remaining will be passed-through unmodified */
+	if ((! stream->passthrough) && (stream->in_len > HOPT_STREAM_MAX_PENDING)) {
+		stream->passthrough = 1;
+		return (hopt_stream_process (stream, finishing));
+	}
+
+	/* what's left starts with an incomplete element (or chunk), which would be scanned
+	 * again from its start by every following call. waiting for the pending data to double
+	 * keeps the total work linear, regardless of how small the fed parts are. */
+	stream->in_rescan = stream->in_len * 2;
+	if (stream->in_rescan > HOPT_STREAM_MAX_PENDING + 1)
+		stream->in_rescan = HOPT_STREAM_MAX_PENDING + 1;
+
+	return (0);
+}
+
+/* returns: pointer to stream optimizer, or NULL if error */
+t_hopt_stream *hopt_stream_new (int content, HOPT_FLAGS flags)
+{
+	t_hopt_stream	*stream;
+
+	if ((stream = calloc (1, sizeof (t_hopt_stream))) == NULL)
+		return (NULL);
+	stream->content = content;
+	stream->flags = flags;
+	if (hopt_stream_reserve (&(stream->in), &(stream->in_alloc), 1)) {
+		free (stream);
+		return (NULL);
+	}
+	*(stream->in) = '\0';
+
+	return (stream);
+}
+
+/* src: next part of the text, of any size
+ * out and outlen: returns the optimized data available so far (may be none),
+ * 	the data pointed by 'out' is valid until the next call
+ * returns: ==0 ok, !=0 error (out of memory) */
+int hopt_stream_feed (t_hopt_stream *stream, const unsigned char *src, int srclen, const unsigned char **out, int *outlen)
+{
+	/* discard what was returned previously */
+	if (stream->out_returned > 0) {
+		stream->out_len -= stream->out_returned;
+		memmove (stream->out, stream->out + stream->out_returned, stream->out_len);
+		stream->out_returned = 0;
+	}
+
+	if (hopt_stream_reserve (&(stream->in), &(stream->in_alloc), stream->in_len + srclen + 1))
+		return (1);
+	if ((stream->content == HOPT_STREAM_HTML) && (! stream->passthrough))
+		stream->in_len += fix_linebreaks_part (src, srclen, stream->in + stream->in_len, &(stream->lb_prevchar), &(stream->lb_prevchar_was_cr_or_lf));
+	else {
+		memcpy (stream->in + stream->in_len, src, srclen);
+		stream->in_len += srclen;
+	}
+	*(stream->in + stream->in_len) = '\0';
+
+	if ((stream->passthrough || (stream->in_len >= stream->in_rescan)) && hopt_stream_process (stream, 0))
+		return (1);
+
+	if ((stream->content != HOPT_STREAM_HTML) && (! stream->passthrough)) {
+		if (stream->out_len > HOPT_STREAM_HISTORY)
+			stream->out_returned = stream->out_len - HOPT_STREAM_HISTORY;
+	} else {
+		stream->out_returned = stream->out_len;
+	}
+	*out = stream->out;
+	*outlen = stream->out_returned;
+
+	return (0);
+}
+
+/* processes all remaining data (end of text)
+ * out and outlen: same as in hopt_stream_feed()
+ * returns: ==0 ok, !=0 error (out of memory) */
+int hopt_stream_finish (t_hopt_stream *stream, const unsigned char **out, int *outlen)
+{
+	if (stream->out_returned > 0) {
+		stream->out_len -= stream->out_returned;
+		memmove (stream->out, stream->out + stream->out_returned, stream->out_len);
+	}
+
+	if (hopt_stream_process (stream, 1))
+		return (1);
+
+	stream->out_returned = stream->out_len;
+	*out = stream->out;
+	*outlen = stream->out_returned;
+
+	return (0);
+}
+
+void hopt_stream_free (t_hopt_stream *stream)
+{
+	if (stream == NULL)
+		return;
+	if (stream->in != NULL)
+		free (stream->in);
+	if (stream->out != NULL)
+		free (stream->out);
+	free (stream);
+}
+
+/* END OF ### STREAMING (INCREMENTAL) OPTIMIZATION ### */
+
 /* coming next: EOF */
 
 
@@ -37,11 +37,36 @@
 #define HOPT_NOCOMMENTS 1 << 4
 #define HOPT_PRE        1 << 5
 #define HOPT_TEXTAREA	1 << 6
+/* HTML5-aware optimizations, which must be explicitly requested (not included in HOPT_ALL) */
+#define HOPT_OPTIONAL_TAGS	1 << 16	/* omits optional end tags ("</li>", "</p>", "</td>" etc) */
+#define HOPT_UNQUOTE	1 << 17	/* unquotes attribute values wherever HTML5 allows */
+#define HOPT_BOOLEAN_ATTRS	1 << 18	/* checked="checked" -> checked */
+#define HOPT_DEFAULT_TYPES	1 << 19	/* removes type="text/javascript" and type="text/css" */
+#define HOPT_BLOCK_SPACES	1 << 20	/* removes spaces between block elements */
+#define HOPT_LAZY_LOAD	1 << 21	/* adds loading="lazy" to "<img>" and "<iframe>" (see hopt_set_lazy_load()), the text may grow */
 #define HOPT_ALL        0xffff
 
 int hopt_pack_css (const unsigned char *src, int srclen, unsigned char *dst);
 int hopt_pack_javascript (const unsigned char *src, int srclen, unsigned char *dst);
 int hopt_pack_html (const unsigned char *src, int srclen, unsigned char *dst, HOPT_FLAGS flags);
+int hopt_html_max_growth (const unsigned char *src, int srclen, HOPT_FLAGS flags);
+void hopt_set_lazy_load (int eager);
+
+/* streaming (incremental) optimization: the text may be fed in parts of any size,
+ * the output is the same as the one from the hopt_pack_* functions above */
+#define HOPT_STREAM_HTML	0
+#define HOPT_STREAM_CSS		1
+#define HOPT_STREAM_JS		2
+
+/* already-minified CSS/JS detection (content: HOPT_STREAM_CSS or HOPT_STREAM_JS) */
+int hopt_is_minified (const unsigned char *src, int srclen, int content, int threshold);
+
+typedef struct t_hopt_stream t_hopt_stream;
+
+t_hopt_stream *hopt_stream_new (int content, HOPT_FLAGS flags);
+int hopt_stream_feed (t_hopt_stream *stream, const unsigned char *src, int srclen, const unsigned char **out, int *outlen);
+int hopt_stream_finish (t_hopt_stream *stream, const unsigned char **out, int *outlen);
+void hopt_stream_free (t_hopt_stream *stream);
 
 
 #define HTMLOPT_H
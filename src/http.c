@@ -57,20 +57,29 @@
 #define SRC_HTTP_C
 
 #include "http.h"
+#include "coalesce.h"
 #include "image.h"
 #include "cfgfile.h"
 #include "htmlopt.h"
 #include "log.h"
 #include "text.h"
+#include "delta.h"
+#include "imginline.h"
+#include "cssinline.h"
+#include "imgdims.h"
 #include "preemptdns.h"
+#include "prefetch.h"
 #include "cdetect.h"
 #include "urltables.h"
+#include "simplelist.h"
 #include "embbin.h"
 #include "auth.h"
 #include "misc.h"
 #include "tosmarking.h"
 #include "globaldefs.h"
 #include "session.h"
+#include "negcache.h"
+#include "shdict.h"
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -90,6 +99,10 @@ ZP_DATASIZE_TYPE forward_content (http_headers *hdr, FILE *from, FILE *to);
 ZP_DATASIZE_TYPE read_content (http_headers *hdr, FILE *from, FILE *to, char ** inbuf, ZP_DATASIZE_TYPE *inlen);
 static void clean_hdr(char* ln);
 void replace_data_and_send (http_headers *serv_hdr);
+static void negcache_record_result (const ZP_DATASIZE_TYPE before_len, const ZP_DATASIZE_TYPE after_len);
+static int has_coding (const char *coding_list, const char *coding);
+static int client_accepts_encoding (const http_headers *chdr, const int content_encoding);
+static HOPT_FLAGS html_optimization_flags (const http_headers *client_hdr);
 
 // close( sockfd );
 void proxy_http (http_headers *client_hdr, FILE* sockrfp, FILE* sockwfp)
@@ -102,13 +115,18 @@ void proxy_http (http_headers *client_hdr, FILE* sockrfp, FILE* sockwfp)
 	int status = 0;
 	ZP_DATASIZE_TYPE original_size;
 	char new_user_agent [HEADER_REPLACEMENT_ENTRY_LEN];
+	char ziproxy_flags [HEADER_REPLACEMENT_ENTRY_LEN];
 	ZP_DATASIZE_TYPE streamed_len;	// used when load into memory failed and data was streamed
+	ZP_DATASIZE_TYPE process_len;	// size of data before optimization (after gunzipping, if that's the case)
+	FILE *out_stream;	// where the response is sent to (either the client or the spool)
+	FILE *spool;
 
 	is_sending_data = 0;
 
 	if (URLNoProcessing != NULL) {
 		if (ut_check_if_matches (urltable_noprocessing, client_hdr->host, client_hdr->path)) {
 			/* we won't touch this data, just tunnel it */
+			coalesce_leader_abort ();
 			add_header (client_hdr, "Connection: close");
 			debug_log_puts ("Headers sent to server:");
 			send_headers_to (sockwfp, client_hdr);
@@ -132,12 +150,31 @@ void proxy_http (http_headers *client_hdr, FILE* sockrfp, FILE* sockwfp)
 		}
 	}
 
+	// capabilities announced to the next Ziproxy (if any)
+	ziproxy_flags [0] = '\0';
 #ifdef JP2K
 	if (AnnounceJP2Capability)
-		replace_header_str (client_hdr, "X-Ziproxy-Flags", "X-Ziproxy-Flags: jp2");
+		strcpy (ziproxy_flags, "jp2");
+#endif
+#ifdef ZSTD
+	shdict_announce (ziproxy_flags, sizeof (ziproxy_flags));
+#endif
+	delta_announce (ziproxy_flags, sizeof (ziproxy_flags));
+	delta_prepare_request (client_hdr);
+	if (ziproxy_flags [0] != '\0') {
+		char flags_header [HEADER_REPLACEMENT_ENTRY_LEN + 32];
+
+		snprintf (flags_header, sizeof (flags_header), "X-Ziproxy-Flags: %s", ziproxy_flags);
+		replace_header_str (client_hdr, "X-Ziproxy-Flags", flags_header);
+	}
+	if (OverrideAcceptEncoding) {
+#ifdef BROTLI
+		if (DecompressIncomingBrotliData)
+			replace_header_str(client_hdr, "Accept-Encoding", "Accept-Encoding: gzip, br");
+		else
 #endif
-	if (OverrideAcceptEncoding)
 		replace_header_str(client_hdr, "Accept-Encoding", "Accept-Encoding: gzip");
+	}
 
 	if (RedefineUserAgent != NULL) {
 		snprintf (new_user_agent, HEADER_REPLACEMENT_ENTRY_LEN, "User-Agent: %s\n", RedefineUserAgent);
@@ -161,11 +198,32 @@ void proxy_http (http_headers *client_hdr, FILE* sockrfp, FILE* sockwfp)
 	debug_log_puts ("In Headers:");
 	serv_hdr = get_response_headers(sockrfp);
 
+#ifdef ZSTD
+	// the remote Ziproxy informs a shared dictionary we don't have, fetch it later
+	if (AnnounceSharedDictCapability && ((tempp = find_header (SHDICT_HEADER ":", serv_hdr)) != NULL)) {
+		shdict_remote_id (tempp);
+		remove_header_str (serv_hdr, SHDICT_HEADER ":");
+	}
+#endif
+
 	// set TOS accordingly if Content-Type matches
 	tosmarking_check_content_type (serv_hdr->content_type);
 
 	decide_what_to_do(client_hdr, serv_hdr);
 
+#ifdef ZSTD
+	// paired Ziproxy lacking our current shared dictionary, inform it
+	if (shdict_client_is_paired (client_hdr->x_ziproxy_flags) && (shdict_current_id () != 0) && (! shdict_client_has_current (client_hdr->x_ziproxy_flags))) {
+		char dict_header [64];
+
+		snprintf (dict_header, sizeof (dict_header), "%s: %u", SHDICT_HEADER, shdict_current_id ());
+		add_header (serv_hdr, dict_header);
+	}
+#endif
+
+	// if identical requests are waiting for this one, is this response sharable?
+	coalesce_leader_check_response (serv_hdr);
+
 	// replace data entirely if URL is listed in the table
 	if (URLReplaceData != NULL) {
 		if (ut_check_if_matches (urltable_replacedata, client_hdr->host, client_hdr->path)) {
@@ -188,9 +246,13 @@ void proxy_http (http_headers *client_hdr, FILE* sockrfp, FILE* sockwfp)
 	debug_log_printf ("Image = %d, Chunked = %d\n",
 		serv_hdr->type, (serv_hdr->where_chunked > 0));
 
-	debug_log_printf ("WillGZip = %d, Compress = %d, DoPreDecompress = %d\n",
+	debug_log_printf ("WillGZip = %d, WillBrotli = %d, WillZstd = %d, Compress = %d (Brotli = %d, Zstd = %d), DoPreDecompress = %d\n",
 		(client_hdr->flags & H_WILLGZIP) != 0, 
+		(client_hdr->flags & H_WILLBROTLI) != 0,
+		(client_hdr->flags & H_WILLZSTD) != 0,
 		(serv_hdr->flags & DO_COMPRESS) != 0,
+		(serv_hdr->flags & DO_COMPRESS_BROTLI) != 0,
+		(serv_hdr->flags & DO_COMPRESS_ZSTD) != 0,
 		(serv_hdr->flags & DO_PRE_DECOMPRESS) != 0);
 
 	//if no data requested only forward header and exit
@@ -218,12 +280,13 @@ void proxy_http (http_headers *client_hdr, FILE* sockrfp, FILE* sockwfp)
 		return;
 	}
 
-	// data is encoded (gzip/other) and cannot be decoded (either because is unsupported or user requested no decoding)
+	// data is encoded (gzip/brotli/other) and cannot be decoded (either because is unsupported or user requested no decoding)
 	// just stream that, unmodified
-	if  ( ((serv_hdr->content_encoding_flags & ~PROP_ENCODED_GZIP) != PROP_ENCODED_NONE) ||
-		( (serv_hdr->content_encoding_flags == PROP_ENCODED_GZIP) && (! (serv_hdr->flags & DO_PRE_DECOMPRESS)) ) ) {
+	// (DO_PRE_DECOMPRESS is only set when the encoding is a decodable one)
+	if  ( (serv_hdr->content_encoding_flags != PROP_ENCODED_NONE) && (! (serv_hdr->flags & DO_PRE_DECOMPRESS)) ) {
 
 		debug_log_puts ("Data is encoded and cannot be decoded");	
+		coalesce_leader_abort ();
 		is_sending_data = 1;
 		debug_log_puts ("Forwarding header and streaming data.");
 		add_header (serv_hdr, "Connection: close");
@@ -237,6 +300,51 @@ void proxy_http (http_headers *client_hdr, FILE* sockrfp, FILE* sockwfp)
 		return;
 	}
 
+	// stream-to-stream text optimization (HTML, CSS or JS), gzipping it too if requested, if enabled AND
+	// the data is either not encoded or gzip/deflate-encoded (decompressed while optimizing) AND (either one of the following):
+	// - file too big to be loaded into memory
+	// - text optimization (and gzip) is all that's requested
+	// 	(otherwise loading into memory is preferred, since other processing/encodings may be applied)
+	if (ProcessTextStreaming && \
+			( \
+			  (serv_hdr->content_encoding_flags == PROP_ENCODED_NONE) \
+			  || ( (serv_hdr->flags & DO_PRE_DECOMPRESS) && \
+				((serv_hdr->content_encoding_flags == PROP_ENCODED_GZIP) || (serv_hdr->content_encoding_flags == PROP_ENCODED_DEFLATE)) ) \
+			) && \
+			(serv_hdr->flags & (DO_OPTIMIZE_HTML | DO_OPTIMIZE_CSS | DO_OPTIMIZE_JS)) && \
+			( \
+			  (MaxSize && (serv_hdr->content_length > MaxSize)) \
+			  || ( (! ((serv_hdr->flags & META_CONTENT_MUSTREAD) & ~(DO_OPTIMIZE_HTML | DO_OPTIMIZE_CSS | DO_OPTIMIZE_JS | DO_COMPRESS | DO_PRE_DECOMPRESS))) \
+				&& (! (serv_hdr->flags & (DO_COMPRESS_BROTLI | DO_COMPRESS_ZSTD | DO_COMPRESS_ZDICT))) ) \
+			) \
+		) {
+		int ret;
+		int content;
+
+		if (serv_hdr->flags & DO_OPTIMIZE_HTML)
+			content = HOPT_STREAM_HTML;
+		else if (serv_hdr->flags & DO_OPTIMIZE_CSS)
+			content = HOPT_STREAM_CSS;
+		else
+			content = HOPT_STREAM_JS;
+
+		coalesce_leader_abort ();
+		is_sending_data = 1;
+		ret = do_optimize_stream_stream (serv_hdr, sockrfp, sess_wclient, content, html_optimization_flags (client_hdr), \
+			(serv_hdr->flags & DO_COMPRESS) && (client_hdr->flags & H_WILLGZIP), &inlen, &outlen, MaxUncompressedGzipRatio, MinUncompressedGzipStreamEval);
+		if (ret != 0) {
+			// TODO: add flags of 'error' to access log in this case
+			debug_log_printf ("Error while text-optimizing stream: %d\n", ret);
+		} else {
+			negcache_record_result (inlen, outlen);
+		}
+
+		access_log_def_inlen(inlen);
+		access_log_def_outlen(outlen);
+		access_log_dump_entry ();
+		return;
+	}
+
 	// stream-to-stream compression, if we're not requesting pre-decompression AND (either one of the following):
 	// - gzip is the only optimization requested
 	// - file too big, but gzipping requested - we can do gzip, so stream it
@@ -251,10 +359,13 @@ void proxy_http (http_headers *client_hdr, FILE* sockrfp, FILE* sockwfp)
 		) {
 		int ret;
 
+		coalesce_leader_abort ();
 		ret = do_compress_stream_stream (serv_hdr, sockrfp, sess_wclient, &inlen, &outlen);
 		if (ret != 0) {
 			// TODO: add flags of 'error' to access log in this case
 			debug_log_printf ("Error while gzip-streaming: %d\n", ret);
+		} else {
+			negcache_record_result (inlen, outlen);
 		}
 
 		access_log_def_inlen(inlen);
@@ -266,10 +377,12 @@ void proxy_http (http_headers *client_hdr, FILE* sockrfp, FILE* sockwfp)
 	// stream-to-stream decompression, if client does not support gzip AND (either one of the following):
 	// - gunzip is the only operation requested
 	// - file too big, but gunzipping requested and NO gzipping afterwards
+	// 	(or compression is requested, but client does not support the incoming encoding)
 	// 	we can do gunzip, so stream it (no other optimization/processing will be applied)
 	// - streaming file (can't know its size unless we download it) and requests gunzipping and NO gzipping
 	// 	(no other optimization/processing will be applied)
-	if (((serv_hdr->flags & DO_PRE_DECOMPRESS) && (! (serv_hdr->flags & DO_COMPRESS))) && \
+	// same applies to Brotli, deflate and compress-encoded data.
+	if (((serv_hdr->flags & DO_PRE_DECOMPRESS) && ((! (serv_hdr->flags & DO_COMPRESS)) || (! client_accepts_encoding (client_hdr, serv_hdr->content_encoding_flags)))) && \
 			( \
 			  ( (serv_hdr->flags & DO_PRE_DECOMPRESS) && (MaxSize && (serv_hdr->content_length > MaxSize)) ) \
 			  || ((serv_hdr->flags & META_CONTENT_MUSTREAD) == DO_PRE_DECOMPRESS) \
@@ -277,6 +390,7 @@ void proxy_http (http_headers *client_hdr, FILE* sockrfp, FILE* sockwfp)
 		) {
 		int ret;
 		
+		coalesce_leader_abort ();
 		ret = do_decompress_stream_stream (serv_hdr, sockrfp, sess_wclient, &inlen, &outlen, MaxUncompressedGzipRatio, MinUncompressedGzipStreamEval);
 		if (ret != 0) {
 			// TODO: add flags of 'error' to access log in this case
@@ -289,16 +403,49 @@ void proxy_http (http_headers *client_hdr, FILE* sockrfp, FILE* sockwfp)
 		return;
 	}
 
+	// gzipped data which would be streamed unmodified (below), because either:
+	// - the server advertises the data as > MaxSize,
+	// - there's nothing except DECOMPRESS->COMPRESS
+	// but the remote server may have compressed it poorly, so recompress it while streaming
+	// if that's worth (evaluated from the first data).
+	if (GzipReoptimize && (serv_hdr->content_encoding_flags == PROP_ENCODED_GZIP) && (client_hdr->flags & H_WILLGZIP) && \
+			((serv_hdr->flags & (DO_COMPRESS | DO_PRE_DECOMPRESS)) == (DO_COMPRESS | DO_PRE_DECOMPRESS)) && \
+			( \
+			  (MaxSize && (serv_hdr->content_length > MaxSize)) \
+			  || ( ! ((serv_hdr->flags & META_CONTENT_MUSTREAD) & ~(DO_COMPRESS | DO_PRE_DECOMPRESS)) ) \
+			) \
+		) {
+		int ret;
+
+		coalesce_leader_abort ();
+		is_sending_data = 1;
+		ret = do_reoptimize_stream_stream (serv_hdr, sockrfp, sess_wclient, &inlen, &outlen, MaxUncompressedGzipRatio, MinUncompressedGzipStreamEval);
+		if (ret != 0) {
+			// TODO: add flags of 'error' to access log in this case
+			debug_log_printf ("Error while gzip-reoptimizing: %d\n", ret);
+		} else {
+			negcache_record_result (inlen, outlen);
+		}
+
+		access_log_def_inlen(inlen);
+		access_log_def_outlen(outlen);
+		access_log_dump_entry ();
+		return;
+	}
+
 	// if either:
 	// - the server advertises the data as > MaxSize,
 	// - there's no process to be done to the data.
 	// - there's nothing except DECOMPRESS->COMPRESS (gzip, again) -- semi-useless (we could gain a few bytes, but adds latency)
+	// 	(unless the client does not support the incoming encoding, then it must be transcoded)
 	// don't even try to load into memory, stream that directly and reduce latency.
 	if ( \
 			(MaxSize && (serv_hdr->content_length > MaxSize)) \
 			|| ((serv_hdr->flags & META_CONTENT_MUSTREAD) == DO_NOTHING) \
-			|| ( ! ((serv_hdr->flags & META_CONTENT_MUSTREAD) & ~(DO_COMPRESS | DO_PRE_DECOMPRESS)) ) \
+			|| ( ( ! ((serv_hdr->flags & META_CONTENT_MUSTREAD) & ~(DO_COMPRESS | DO_PRE_DECOMPRESS)) ) \
+				&& client_accepts_encoding (client_hdr, serv_hdr->content_encoding_flags) ) \
 			) {
+		coalesce_leader_abort ();
 		is_sending_data = 1;
 		if ((serv_hdr->flags & META_CONTENT_MUSTREAD) == DO_NOTHING)
 			debug_log_puts ("Nothing to do - streaming original data");
@@ -382,14 +529,38 @@ void proxy_http (http_headers *client_hdr, FILE* sockrfp, FILE* sockwfp)
 
 	if (inlen != serv_hdr->content_length) debug_log_printf ("In Content-Length: %"ZP_DATASIZE_STR"\n", inlen);
 
-	/* unpacks data gzipped by remote server, in order to process it */
+	/* unpacks data gzipped (or Brotli/deflate/compress-encoded) by remote server, in order to process it */
 	if (serv_hdr->flags & DO_PRE_DECOMPRESS) {
 		char **inbuf_addr;
 		int new_inlen;
 
-		debug_log_puts ("Decompressing Gzip data...");
 		inbuf_addr = &inbuf;
-		new_inlen = replace_gzipped_with_gunzipped(inbuf_addr, inlen, MaxUncompressedGzipRatio);
+		switch (serv_hdr->content_encoding_flags) {
+		case PROP_ENCODED_DEFLATE:
+			debug_log_puts ("Decompressing deflate data...");
+			new_inlen = replace_deflated_with_inflated(inbuf_addr, inlen, MaxUncompressedGzipRatio);
+			break;
+		case PROP_ENCODED_COMPRESS:
+			debug_log_puts ("Decompressing compress (LZW) data...");
+			new_inlen = replace_compressed_with_uncompressed(inbuf_addr, inlen, MaxUncompressedGzipRatio);
+			break;
+#ifdef ZSTD
+		case PROP_ENCODED_ZDICT:
+			debug_log_puts ("Decompressing shared-dictionary Zstd data...");
+			new_inlen = replace_shdict_with_unshdict(inbuf_addr, inlen, MaxUncompressedGzipRatio);
+			break;
+#endif
+#ifdef BROTLI
+		case PROP_ENCODED_BROTLI:
+			debug_log_puts ("Decompressing Brotli data...");
+			new_inlen = replace_brotli_with_unbrotli(inbuf_addr, inlen, MaxUncompressedGzipRatio);
+			break;
+#endif
+		default:
+			debug_log_puts ("Decompressing Gzip data...");
+			new_inlen = replace_gzipped_with_gunzipped(inbuf_addr, inlen, MaxUncompressedGzipRatio);
+			break;
+		}
 		if (new_inlen >= 0) {
 			inlen = new_inlen;
 			inbuf = *inbuf_addr;
@@ -405,14 +576,14 @@ void proxy_http (http_headers *client_hdr, FILE* sockrfp, FILE* sockwfp)
 			serv_hdr->where_content_length = -1;
 			remove_header_str(serv_hdr, "Content-Length");
 
-			debug_log_printf ("Gzip body decompressed for further processing. Decompressed size: %"ZP_DATASIZE_STR"\n", inlen);
+			debug_log_printf ("Body decompressed for further processing. Decompressed size: %"ZP_DATASIZE_STR"\n", inlen);
 		} else {
 			switch (new_inlen * -1) {
 			case 100:
 				send_error( 500, "Internal Error", NULL, "Uncompressed gzipped data exceedes safety threshold." );
 				break;
 			case 120:
-				debug_log_puts ("Broken Gzip data. Forwarding unmodified data.");
+				debug_log_puts ("Broken Gzip/Brotli/deflate/compress data. Forwarding unmodified data.");
 				/* will not attempt to compress it again */
 				/* since the data is a blackbox, neither we can apply Preemptive DNS */
 				serv_hdr->flags &= ~META_CONTENT_MUSTREAD;
@@ -429,9 +600,26 @@ void proxy_http (http_headers *client_hdr, FILE* sockrfp, FILE* sockwfp)
 		debug_log_puts ("Data is gzipped but is not supposed to be uncompressed OR\n	Data is encoded in an unknown way.");
 	}
 
+	/* differences sent by the paired Ziproxy: rebuild the page before anything else */
+	if (AnnounceDeltaCapability) {
+		if (serv_hdr->content_encoding_flags != PROP_ENCODED_NONE) {
+			if (delta_is_encoded_response (serv_hdr))
+				send_error (502, "Bad Gateway", NULL, "Differences from the remote Ziproxy could not be decoded.");
+		} else if (delta_decode_response (client_hdr, serv_hdr, &inbuf, &inlen) == DELTA_ERROR) {
+			send_error (502, "Bad Gateway", NULL, "Differences from the remote Ziproxy could not be applied.");
+		}
+	}
+
 	//in case something fails later and forgets to do this:
 	outbuf = inbuf;
 	outlen = inlen;
+	process_len = inlen;
+
+	// if identical requests are waiting for this one, the response is spooled for them
+	if ((spool = coalesce_leader_spool ()) != NULL)
+		out_stream = spool;
+	else
+		out_stream = sess_wclient;
 
 	// (start) only if data is not encoded
 	// data may (still) be encoded in case gzip decompressing failed
@@ -440,21 +628,7 @@ void proxy_http (http_headers *client_hdr, FILE* sockrfp, FILE* sockwfp)
 	/* text/html optimizer */
 	/* FIXME: inbuf must be at least (inlen + 1) chars big in order to hold added '\0' from htmlopt */
 	if (serv_hdr->flags & DO_OPTIMIZE_HTML) {
-		HOPT_FLAGS hopt_flags = HOPT_NONE;
-		if (ProcessHTML_CSS)
-			hopt_flags |= HOPT_CSS;
-		if (ProcessHTML_JS)
-			hopt_flags |= HOPT_JAVASCRIPT;
-		if (ProcessHTML_tags)
-			hopt_flags |= HOPT_HTMLTAGS;
-		if (ProcessHTML_text)
-			hopt_flags |= HOPT_HTMLTEXT;
-		if (ProcessHTML_PRE)
-			hopt_flags |= HOPT_PRE;
-		if (ProcessHTML_TEXTAREA)
-			hopt_flags |= HOPT_TEXTAREA;
-		if (ProcessHTML_NoComments)
-			hopt_flags |= HOPT_NOCOMMENTS;
+		HOPT_FLAGS hopt_flags = html_optimization_flags (client_hdr);
 
 		/* we may find files claiming to be "text/html" while in fact they're not,
 		 * (typically CSS or JS)
@@ -462,8 +636,41 @@ void proxy_http (http_headers *client_hdr, FILE* sockrfp, FILE* sockwfp)
 		switch (detect_content_type (inbuf)) {
 		case CD_TEXT_HTML:
 			debug_log_puts ("HTMLopt -> HTML");
+			/* added attributes may make the page bigger */
+			if (hopt_flags & HOPT_LAZY_LOAD) {
+				int growth = hopt_html_max_growth ((unsigned char *) inbuf, inlen, hopt_flags);
+				char *grown;
+
+				if ((growth > 0) && ((grown = realloc (inbuf, inlen + growth + 1)) != NULL))
+					inbuf = outbuf = grown;
+				else if (growth > 0)
+					hopt_flags &= ~HOPT_LAZY_LOAD;
+			}
 			inlen = hopt_pack_html (inbuf, inlen, inbuf, hopt_flags);
 			outlen = inlen;
+
+			if (serv_hdr->flags & DO_INLINE_CSS) {
+				ZP_DATASIZE_TYPE packed_len = inlen;
+
+				if (cssinline_html (client_hdr, &inbuf, &inlen) > 0) {
+					process_len += inlen - packed_len;
+					outbuf = inbuf;
+					outlen = inlen;
+				}
+				debug_log_difftime ("InlineCSS");
+			}
+
+			if (serv_hdr->flags & DO_INLINE_IMAGES) {
+				ZP_DATASIZE_TYPE packed_len = inlen;
+
+				if (imginline_html (client_hdr, &inbuf, &inlen) > 0) {
+					/* the inlined images are not expected to shrink the page */
+					process_len += inlen - packed_len;
+					outbuf = inbuf;
+					outlen = inlen;
+				}
+				debug_log_difftime ("InlineImages");
+			}
 			break;
 		default:
 			debug_log_puts ("HTMLopt WARNING: Data claimed to be HTML, but it's not.");
@@ -474,23 +681,52 @@ void proxy_http (http_headers *client_hdr, FILE* sockrfp, FILE* sockwfp)
 	/* text/css optimizer */
 	/* FIXME: inbuf must be at least (inlen + 1) chars big in order to hold added '\0' from htmlopt */
 	if (serv_hdr->flags & DO_OPTIMIZE_CSS) {
-		debug_log_puts ("HTMLopt -> CSS");
-		inlen = hopt_pack_css (inbuf, inlen, inbuf);
-		outlen = inlen;
+		if (serv_hdr->flags & DO_INLINE_CSS) {
+			ZP_DATASIZE_TYPE orig_len = inlen;
+
+			if (cssinline_css (client_hdr, &inbuf, &inlen) > 0) {
+				process_len += inlen - orig_len;
+				outbuf = inbuf;
+				outlen = inlen;
+			}
+			debug_log_difftime ("InlineCSS");
+		}
+
+		if (MinifiedTextThreshold && hopt_is_minified ((unsigned char *) inbuf, inlen, HOPT_STREAM_CSS, MinifiedTextThreshold)) {
+			debug_log_puts ("HTMLopt -> CSS already minified, not optimized");
+			access_log_set_flags (LOG_AC_FLAG_MINIFIED_CSS);
+		} else {
+			debug_log_puts ("HTMLopt -> CSS");
+			inlen = hopt_pack_css (inbuf, inlen, inbuf);
+			outlen = inlen;
+		}
 	}
 
 	/* application/[x-]javascript optimizer */
 	/* FIXME: inbuf must be at least (inlen + 1) chars big in order to hold added '\0' from htmlopt */
 	if (serv_hdr->flags & DO_OPTIMIZE_JS) {
-		debug_log_puts ("HTMLopt -> JS");
-		inlen = hopt_pack_javascript (inbuf, inlen, inbuf);
-		outlen = inlen;
+		if (MinifiedTextThreshold && hopt_is_minified ((unsigned char *) inbuf, inlen, HOPT_STREAM_JS, MinifiedTextThreshold)) {
+			debug_log_puts ("HTMLopt -> JS already minified, not optimized");
+			access_log_set_flags (LOG_AC_FLAG_MINIFIED_JS);
+		} else {
+			debug_log_puts ("HTMLopt -> JS");
+			inlen = hopt_pack_javascript (inbuf, inlen, inbuf);
+			outlen = inlen;
+		}
 	}
 	
 	/* preemptive name resolution */
 	if (serv_hdr->flags & DO_PREEMPT_DNS)
 		preempt_dns_from_html (inbuf, inlen);
 
+	/* sizes the images are displayed at, for DO_RESIZE_PICTURE later */
+	if (serv_hdr->flags & DO_IMAGE_DIMS)
+		imgdims_from_html (client_hdr, inbuf, inlen);
+
+	/* resources the browser will request next, prefetched once this page is sent */
+	if (serv_hdr->flags & DO_PREFETCH)
+		prefetch_from_html (client_hdr, inbuf, inlen);
+
 	if (serv_hdr->flags & DO_RECOMPRESS_PICTURE) {
 		status = compress_image(serv_hdr, client_hdr, inbuf, inlen, &outbuf, &outlen);
 		if ((status & IMG_UNIQUE_RET_MASK) == IMG_RET_TOO_EXPANSIVE) {
@@ -501,14 +737,33 @@ void proxy_http (http_headers *client_hdr, FILE* sockrfp, FILE* sockwfp)
 		debug_log_printf ("  and returned %d.\n", status);
 	}
 
+#ifdef ZSTD
+	if ((serv_hdr->flags & DO_COMPRESS) && shdict_client_is_paired (client_hdr->x_ziproxy_flags) && ((serv_hdr->type == TEXT_HTML) || (serv_hdr->type == TEXT_CSS) || (serv_hdr->type == APPLICATION_JAVASCRIPT)) && \
+		coalesce_request_is_shareable (client_hdr) && coalesce_response_is_shareable (serv_hdr))	/* the dictionary is served to anyone */
+		shdict_add_sample (inbuf, inlen);
+#endif
+
+	/* paired Ziproxy: send only the differences from the version it holds, if worth */
+	if (DeltaEncodeHTML && (serv_hdr->flags & DO_DELTA)) {
+		delta_encode_response (client_hdr, serv_hdr, &inbuf, &inlen);
+		outbuf = inbuf;
+		outlen = inlen;
+	}
+
  	if(serv_hdr->flags & DO_COMPRESS){
-		do_compress_memory_stream (serv_hdr, inbuf, sess_wclient, inlen, &outlen);
+		do_compress_memory_stream (serv_hdr, inbuf, out_stream, inlen, &outlen);
+		negcache_record_result (process_len, outlen);
+		if (spool != NULL)
+			coalesce_leader_publish (spool, sess_wclient, original_size, outlen);
 
 		access_log_def_inlen(original_size);
 		access_log_def_outlen(outlen);
 		access_log_dump_entry ();
 		exit (0);
 	}
+
+	if (serv_hdr->flags & (DO_OPTIMIZE_HTML | DO_OPTIMIZE_CSS | DO_OPTIMIZE_JS | DO_RECOMPRESS_PICTURE))
+		negcache_record_result (process_len, outlen);
 	
 	} /* (end) only if data is not encoded */
 
@@ -526,7 +781,7 @@ void proxy_http (http_headers *client_hdr, FILE* sockrfp, FILE* sockwfp)
 	add_header (serv_hdr, "Connection: close");
 	add_header (serv_hdr, "Proxy-Connection: close");
 
-	send_headers_to (sess_wclient, serv_hdr);
+	send_headers_to (out_stream, serv_hdr);
 
 	//forward content
 	tempp = outbuf;
@@ -535,12 +790,12 @@ void proxy_http (http_headers *client_hdr, FILE* sockrfp, FILE* sockwfp)
 		int outcount = outlen;
 		
 		do{
-			i = fwrite(tempp, 1, outcount, sess_wclient);
+			i = fwrite(tempp, 1, outcount, out_stream);
 			outcount -= i;
 			tempp += i;
 		}while((i > 0) && outcount);
 		
-		fflush (sess_wclient);
+		fflush (out_stream);
 
 		if(outcount == 0) {
 			fsync(1);
@@ -550,12 +805,126 @@ void proxy_http (http_headers *client_hdr, FILE* sockrfp, FILE* sockwfp)
 			outcount);
 	}
 
+	if (spool != NULL)
+		coalesce_leader_publish (spool, sess_wclient, original_size, outlen);
+
 
 	access_log_def_inlen(original_size);
 	access_log_def_outlen(outlen);
 	access_log_dump_entry ();
 }
 
+/* feeds the negative cache with the result of processing the current object:
+ * if it did not shrink, we burned CPU for nothing and should not try it again */
+static void negcache_record_result (const ZP_DATASIZE_TYPE before_len, const ZP_DATASIZE_TYPE after_len)
+{
+	if (before_len <= 0)
+		return;
+
+	if (after_len >= before_len) {
+		debug_log_puts ("NegCache: Processing did not reduce data size.");
+		negcache_add ();
+		negcache_learn (1);
+	} else {
+		negcache_learn (0);
+	}
+}
+
+/* returns: HTML optimization flags, as configured */
+static HOPT_FLAGS html_optimization_flags (const http_headers *client_hdr)
+{
+	HOPT_FLAGS hopt_flags = HOPT_NONE;
+
+	if (ProcessHTML_CSS)
+		hopt_flags |= HOPT_CSS;
+	if (ProcessHTML_JS)
+		hopt_flags |= HOPT_JAVASCRIPT;
+	if (ProcessHTML_tags)
+		hopt_flags |= HOPT_HTMLTAGS;
+	if (ProcessHTML_text)
+		hopt_flags |= HOPT_HTMLTEXT;
+	if (ProcessHTML_PRE)
+		hopt_flags |= HOPT_PRE;
+	if (ProcessHTML_TEXTAREA)
+		hopt_flags |= HOPT_TEXTAREA;
+	if (ProcessHTML_NoComments)
+		hopt_flags |= HOPT_NOCOMMENTS;
+	if (ProcessHTML_OptionalTags)
+		hopt_flags |= HOPT_OPTIONAL_TAGS;
+	if (ProcessHTML_UnquoteAttrs)
+		hopt_flags |= HOPT_UNQUOTE;
+	if (ProcessHTML_BooleanAttrs)
+		hopt_flags |= HOPT_BOOLEAN_ATTRS;
+	if (ProcessHTML_DefaultTypes)
+		hopt_flags |= HOPT_DEFAULT_TYPES;
+	if (ProcessHTML_BlockSpaces)
+		hopt_flags |= HOPT_BLOCK_SPACES;
+	if (LazyLoad && ((LazyLoadExList == NULL) || (! slist_check_if_matches (LazyLoadExList, client_hdr->host)))) {
+		hopt_flags |= HOPT_LAZY_LOAD;
+		hopt_set_lazy_load (LazyLoadEager);
+	}
+
+	return (hopt_flags);
+}
+
+/* checks whether a comma-separated list of content-codings (as in Accept-Encoding)
+ * contains 'coding' (case insensitive). entries with "q=0" are considered absent.
+ * returns: !=0 if present */
+static int has_coding (const char *coding_list, const char *coding)
+{
+	const char *pos = coding_list;
+	const char *params;
+	int coding_len = strlen (coding);
+
+	while (*pos != '\0') {
+		while ((*pos == ' ') || (*pos == '\t') || (*pos == ','))
+			pos++;
+
+		if (strncasecmp (pos, coding, coding_len) == 0) {
+			params = pos + coding_len;
+			while ((*params == ' ') || (*params == '\t'))
+				params++;
+
+			switch (*params) {
+			case '\0':
+			case '\r':
+			case '\n':
+			case ',':
+				return (1);
+			case ';':
+				params++;
+				while ((*params == ' ') || (*params == '\t'))
+					params++;
+				if (((*params == 'q') || (*params == 'Q')) && (*(params + 1) == '=') && (atof (params + 2) == 0.0))
+					return (0);
+				return (1);
+			}
+		}
+
+		/* next entry */
+		while ((*pos != '\0') && (*pos != ','))
+			pos++;
+	}
+
+	return (0);
+}
+
+/* whether the (real, user's) client is able to receive data
+ * encoded as 'content_encoding' (PROP_ENCODED_*) */
+static int client_accepts_encoding (const http_headers *chdr, const int content_encoding)
+{
+	switch (content_encoding) {
+	case PROP_ENCODED_NONE:
+		return (1);
+	case PROP_ENCODED_GZIP:
+		return ((chdr->flags & H_WILLGZIP) != 0);
+	case PROP_ENCODED_BROTLI:
+		return ((chdr->flags & H_WILLBROTLI) != 0);
+	}
+	/* (including PROP_ENCODED_ZDICT, only decodable by us) */
+	return (0);
+}
+
 /* replace content with empty one and send to the user */
 void replace_data_and_send (http_headers *serv_hdr)
 {
@@ -793,7 +1162,7 @@ http_headers *new_headers(void){
 
 	h->port = -1;
 
-	h->user_agent = h->content_encoding = h->method = h->url = h->path = h->host = h->proto = NULL;
+	h->user_agent = h->content_encoding = h->method = h->url = h->path = h->host = h->proto = h->x_ziproxy_flags = NULL;
 	
 	return h;
 }
@@ -1048,6 +1417,15 @@ void get_client_headers(http_headers * hdr){
 			}
 		}
 
+		if (strncasecmp (line, PREFETCH_HEADER ":", sizeof (PREFETCH_HEADER)) == 0) {
+			// made by our prefetcher, on behalf of an (already authenticated) client
+			if (prefetch_check_token (line + sizeof (PREFETCH_HEADER))) {
+				hdr->flags |= H_PREFETCH;
+				was_auth = 1;
+			}
+			continue;	// never forwarded
+		}
+
 		if (strncasecmp (line, "X-Ziproxy-Flags:", 16) == 0) {
 			char *provided_ziproxy_flags;
 			
@@ -1103,12 +1481,22 @@ void get_client_headers(http_headers * hdr){
 		if (strncasecmp(line, "Content-Length:", 15 ) == 0)
 			hdr->content_length = ZP_CONVERT_STR_TO_DATASIZE(&(line[15]));
 
-		//can accept gzip?
+		//can accept gzip (or brotli, zstd)?
 		else if (strncasecmp(line, "Accept-Encoding:", 16) == 0)
 		{
 			if (strstr (line + 16, "gzip") != NULL)
 				if (DoGzip)
 					hdr->flags |= H_WILLGZIP;
+#ifdef BROTLI
+			if (has_coding (line + 16, "br"))
+				if (DoBrotli)
+					hdr->flags |= H_WILLBROTLI;
+#endif
+#ifdef ZSTD
+			if (has_coding (line + 16, "zstd"))
+				if (DoZstd)
+					hdr->flags |= H_WILLZSTD;
+#endif
 			add_header(hdr, line);
 			continue;
 		}
@@ -1322,6 +1710,7 @@ ZP_DATASIZE_TYPE read_content (http_headers *hdr, FILE *from, FILE *to, char **
 		if ((MaxSize > 0) && (buf_used > MaxSize) && (stream_instead == 0)) {
 			/* we've just detected that the streaming data exceeded MaxSize, plan B now */
 			stream_instead = 1;
+			coalesce_leader_abort ();
 
 			/* dump headers.. */
 			add_header (hdr, "Connection: close");
@@ -1520,6 +1909,10 @@ int return_content_encoding(http_headers *shdr){
 			content_encoding |= PROP_ENCODED_DEFLATE;
 		if (strstr (shdr->content_encoding, "compress") != NULL)
 			content_encoding |= PROP_ENCODED_COMPRESS;
+		if (has_coding (shdr->content_encoding, "br"))
+			content_encoding |= PROP_ENCODED_BROTLI;
+		if (has_coding (shdr->content_encoding, SHDICT_CODING))
+			content_encoding |= PROP_ENCODED_ZDICT;
 
 		/* kludgy workaround for buggy sites which send character set information
 		   in the Content-Encoding field (which violates RFC 2616) */
@@ -1539,6 +1932,9 @@ void decide_what_to_do(http_headers *chdr, http_headers *shdr){
 
 	shdr->type = OTHER_CONTENT;
 	shdr->flags &= ~DO_COMPRESS;
+	shdr->flags &= ~DO_COMPRESS_BROTLI;
+	shdr->flags &= ~DO_COMPRESS_ZSTD;
+	shdr->flags &= ~DO_COMPRESS_ZDICT;
 	shdr->flags &= ~DO_PRE_DECOMPRESS;
 	
 	if(-1 == shdr->where_content_type) return; 
@@ -1547,6 +1943,14 @@ void decide_what_to_do(http_headers *chdr, http_headers *shdr){
 	if (ct_check_if_matches (lossless_compress_ct, shdr->content_type) != 0) {
 		if (DoGzip)
 			shdr->flags |= DO_COMPRESS;
+#ifdef BROTLI
+		if (DoBrotli)
+			shdr->flags |= DO_COMPRESS;
+#endif
+#ifdef ZSTD
+		if (DoZstd)
+			shdr->flags |= DO_COMPRESS;
+#endif
 	}
 
 	tempp = shdr->hdr[shdr->where_content_type] + 14;
@@ -1583,28 +1987,78 @@ void decide_what_to_do(http_headers *chdr, http_headers *shdr){
 	if ((ProcessHTML) && (shdr->type == TEXT_HTML))
 		shdr->flags |= DO_OPTIMIZE_HTML;
 
+	/* requires the whole page in memory, so streaming is not used then.
+	 * not with a Content-Security-Policy, its img-src may not allow data: URIs */
+	if ((InlineImages) && (shdr->flags & DO_OPTIMIZE_HTML) && (find_header ("Content-Security-Policy:", shdr) == NULL))
+		shdr->flags |= DO_INLINE_IMAGES;
+
 	if ((ProcessCSS) && (shdr->type == TEXT_CSS))
 		shdr->flags |= DO_OPTIMIZE_CSS;       
 
+	/* as with DO_INLINE_IMAGES (style-src may not allow inline styles) */
+	if ((InlineCSS) && ((shdr->flags & DO_OPTIMIZE_CSS) || ((shdr->flags & DO_OPTIMIZE_HTML) && (find_header ("Content-Security-Policy:", shdr) == NULL))))
+		shdr->flags |= DO_INLINE_CSS;
+
 	if ((ProcessJS) && (shdr->type == APPLICATION_JAVASCRIPT))
 		shdr->flags |= DO_OPTIMIZE_JS;
 
 	if ((PreemptNameRes) && (shdr->type == TEXT_HTML))
 			shdr->flags |= DO_PREEMPT_DNS;
 
+	/* as with DO_INLINE_IMAGES */
+	if ((ImageResize) && (shdr->type == TEXT_HTML))
+		shdr->flags |= DO_IMAGE_DIMS;
+
+	/* not for pages requested by the prefetcher itself */
+	if ((Prefetch) && (shdr->type == TEXT_HTML) && (! (chdr->flags & H_PREFETCH)))
+		shdr->flags |= DO_PREFETCH;
+
 	/* is the incoming data gzipped (and _only_ gzipped) ?
 	 * if so, should we decompress that before further processing? */
 	if (shdr->content_encoding_flags == PROP_ENCODED_GZIP) {
 		if (DecompressIncomingGzipData)
 			shdr->flags |= DO_PRE_DECOMPRESS;
 	}
+	/* same for deflate and compress (LZW), which share the gzip settings */
+	if ((shdr->content_encoding_flags == PROP_ENCODED_DEFLATE) || (shdr->content_encoding_flags == PROP_ENCODED_COMPRESS)) {
+		if (DecompressIncomingGzipData)
+			shdr->flags |= DO_PRE_DECOMPRESS;
+	}
+#ifdef ZSTD
+	/* shared-dictionary Zstandard is only sent by a paired Ziproxy, and never passed to browsers */
+	if (shdr->content_encoding_flags == PROP_ENCODED_ZDICT) {
+		if (AnnounceSharedDictCapability)
+			shdr->flags |= DO_PRE_DECOMPRESS;
+	}
+#endif
+#ifdef BROTLI
+	/* same for Brotli */
+	if (shdr->content_encoding_flags == PROP_ENCODED_BROTLI) {
+		if (DecompressIncomingBrotliData)
+			shdr->flags |= DO_PRE_DECOMPRESS;
+	}
+#endif
+
+	/* Brotli is preferred over gzip, if browser accepts it */
+	if ((shdr->flags & DO_COMPRESS) && (chdr->flags & H_WILLBROTLI))
+		shdr->flags |= DO_COMPRESS_BROTLI;
+	/* same for Zstandard (if both are accepted, Zstandard is used when streaming, Brotli otherwise) */
+	if ((shdr->flags & DO_COMPRESS) && (chdr->flags & H_WILLZSTD))
+		shdr->flags |= DO_COMPRESS_ZSTD;
+#ifdef ZSTD
+	/* a paired Ziproxy holding our shared dictionary gets text compressed with it instead */
+	if ((shdr->flags & DO_COMPRESS) && SharedDictCompress && \
+		((shdr->type == TEXT_HTML) || (shdr->type == TEXT_CSS) || (shdr->type == APPLICATION_JAVASCRIPT)) && \
+		shdict_client_has_current (chdr->x_ziproxy_flags))
+		shdr->flags |= DO_COMPRESS_ZDICT;
+#endif
 	
 	/* 
 	 * From this point, manage flags only to clear DO_* bits
 	 */
 
-	/* don't gzip if browser doesn't accept gzip */
-	if (! (chdr->flags & H_WILLGZIP))
+	/* don't compress if browser doesn't accept gzip (nor Brotli, Zstandard) */
+	if (! (chdr->flags & (H_WILLGZIP | H_WILLBROTLI | H_WILLZSTD)))
 		shdr->flags &= ~DO_COMPRESS;
 
 	/* Send partial-data requests, if there are no potential problems with data consistency.
@@ -1615,7 +2069,7 @@ void decide_what_to_do(http_headers *chdr, http_headers *shdr){
 			send_error (409, "Conflict", NULL, "Client has requested partial content for a dynamically-optimized Content-Type.");
 		} else {
 			debug_log_puts ("Content-Range provided (partial data). Disabling PreemptDNS.");
-			shdr->flags &= ~DO_PREEMPT_DNS;
+			shdr->flags &= ~(DO_PREEMPT_DNS | DO_IMAGE_DIMS | DO_PREFETCH);
 		}
 	}
 	
@@ -1630,7 +2084,62 @@ void decide_what_to_do(http_headers *chdr, http_headers *shdr){
 			shdr->flags &= ~META_CONTENT_MODIFICATION;
 		}
 	}
-	
+
+	/* Don't process objects already known (or expected) not to shrink.
+	 * DO_PRE_DECOMPRESS alone is not optimization, but required by clients without gzip support. */
+	if ((shdr->status == 200) && (shdr->flags & (META_CONTENT_MODIFICATION & ~DO_PRE_DECOMPRESS))) {
+		int negcache_ret;
+
+		negcache_ret = negcache_check (chdr->url, chdr->host, shdr->content_type, find_header ("ETag:", shdr), find_header ("Last-Modified:", shdr), shdr->content_length);
+		if (negcache_ret != NEGCACHE_MISS) {
+			if (negcache_ret == NEGCACHE_HIT_URL)
+				debug_log_puts ("NegCache: Object not worth processing (URL). Streaming it untouched.");
+			else
+				debug_log_puts ("NegCache: Object not worth processing (learned from host/content-type). Streaming it untouched.");
+			negcache_debug_stats ();
+
+			if ((shdr->flags & DO_PRE_DECOMPRESS) && (! client_accepts_encoding (chdr, shdr->content_encoding_flags)))
+				shdr->flags = (shdr->flags & ~(META_CONTENT_MODIFICATION | DO_PREEMPT_DNS | DO_IMAGE_DIMS | DO_PREFETCH)) | DO_PRE_DECOMPRESS;
+			else
+				shdr->flags &= ~(META_CONTENT_MODIFICATION | DO_PREEMPT_DNS | DO_IMAGE_DIMS | DO_PREFETCH);
+
+			access_log_set_flags (LOG_AC_FLAG_NEGCACHE_SKIP);
+		}
+	}
+
+	/* only images embedded in pages, not those opened by the user */
+	if ((ImageResize) && (shdr->flags & DO_RECOMPRESS_PICTURE) && imgdims_is_embedded (chdr))
+		shdr->flags |= DO_RESIZE_PICTURE;
+
+	/* far end: full pages to a paired Ziproxy may be replaced by differences.
+	 * those are stored and used as base for other users' requests, thus only shareable pages */
+	if (DeltaEncodeHTML && (shdr->type == TEXT_HTML) && delta_client_is_paired (chdr->x_ziproxy_flags) && \
+		(! shdr->has_content_range) && coalesce_request_is_shareable (chdr) && coalesce_response_is_shareable (shdr))
+		shdr->flags |= DO_DELTA;
+
+	/* near end: the page (or differences) must be decoded before anything else */
+	if (AnnounceDeltaCapability && (delta_is_encoded_response (shdr) || (find_header (DELTA_VERSION_HEADER ":", shdr) != NULL))) {
+		shdr->flags |= DO_DELTA;
+		switch (shdr->content_encoding_flags) {
+		case PROP_ENCODED_NONE:
+			break;
+		case PROP_ENCODED_GZIP:
+		case PROP_ENCODED_DEFLATE:
+		case PROP_ENCODED_COMPRESS:
+#ifdef ZSTD
+		case PROP_ENCODED_ZDICT:
+#endif
+#ifdef BROTLI
+		case PROP_ENCODED_BROTLI:
+#endif
+			shdr->flags |= DO_PRE_DECOMPRESS;
+			break;
+		default:
+			if (delta_is_encoded_response (shdr))
+				send_error (502, "Bad Gateway", NULL, "Differences from the remote Ziproxy are encoded in an unsupported way.");
+			break;
+		}
+	}
 }
 
 //Remove extra whitespace that may prevent correct parsing.
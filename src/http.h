@@ -95,10 +95,13 @@ typedef struct {
 } http_headers;
 
 #define H_WILLGZIP (1<<1)	// whether the (real, user's) client supports Gzip
+#define H_WILLBROTLI (1<<2)	// whether the (real, user's) client supports Brotli
 #define H_USE_SSL (1<<3)
 #define H_KEEPALIVE (1<<4)
 #define H_SIMPLE_RESPONSE (1<<5)
 #define H_TRANSP_PROXY_REQUEST (1<<6)
+#define H_WILLZSTD (1<<7)	// whether the (real, user's) client supports Zstandard
+#define H_PREFETCH (1<<8)	// request made by our own prefetcher (see prefetch.c)
 
 #define DO_NOTHING 0
 #define DO_COMPRESS (1<<10)
@@ -108,18 +111,29 @@ typedef struct {
 #define DO_OPTIMIZE_JS (1<<15)
 #define DO_PREEMPT_DNS (1<<16)
 #define DO_RECOMPRESS_PICTURE (1<<17)
+#define DO_COMPRESS_BROTLI (1<<18)	// DO_COMPRESS outputs Brotli instead of Gzip (not an operation by itself)
+#define DO_COMPRESS_ZSTD (1<<19)	// DO_COMPRESS outputs Zstandard instead of Gzip (not an operation by itself)
+#define DO_COMPRESS_ZDICT (1<<20)	// DO_COMPRESS outputs shared-dictionary Zstandard, for a paired Ziproxy (not an operation by itself)
+#define DO_DELTA (1<<21)	// far end: send differences to a paired Ziproxy; near end: rebuild the page from them
+#define DO_INLINE_IMAGES (1<<22)	// inline small images as data: URIs, along with DO_OPTIMIZE_HTML
+#define DO_INLINE_CSS (1<<23)	// inline small stylesheets and flatten @import, along with DO_OPTIMIZE_HTML or DO_OPTIMIZE_CSS
+#define DO_IMAGE_DIMS (1<<24)	// record the sizes the HTML page declares for its images
+#define DO_RESIZE_PICTURE (1<<25)	// DO_RECOMPRESS_PICTURE downscales to the declared size (not an operation by itself)
+#define DO_PREFETCH (1<<26)	// collect the resources the HTML page references, to be prefetched once it's sent
 
 // Includes all the flags commanding some sort of modification to the body
-#define META_CONTENT_MODIFICATION (DO_COMPRESS | DO_PRE_DECOMPRESS | DO_OPTIMIZE_HTML | DO_OPTIMIZE_CSS | DO_OPTIMIZE_JS | DO_RECOMPRESS_PICTURE)
+#define META_CONTENT_MODIFICATION (DO_COMPRESS | DO_PRE_DECOMPRESS | DO_OPTIMIZE_HTML | DO_OPTIMIZE_CSS | DO_OPTIMIZE_JS | DO_RECOMPRESS_PICTURE | DO_INLINE_IMAGES | DO_INLINE_CSS)
 
 // Includes all the flags commanding some operation requiring reading the body
-// Currently: (META_ALL_CONTENT_MODIFICATION | DO_PREEMPT_DNS)
-#define META_CONTENT_MUSTREAD (DO_COMPRESS | DO_PRE_DECOMPRESS | DO_OPTIMIZE_HTML | DO_OPTIMIZE_CSS | DO_OPTIMIZE_JS | DO_PREEMPT_DNS | DO_RECOMPRESS_PICTURE)
+// Currently: (META_ALL_CONTENT_MODIFICATION | DO_PREEMPT_DNS | DO_DELTA | DO_IMAGE_DIMS | DO_PREFETCH)
+#define META_CONTENT_MUSTREAD (DO_COMPRESS | DO_PRE_DECOMPRESS | DO_OPTIMIZE_HTML | DO_OPTIMIZE_CSS | DO_OPTIMIZE_JS | DO_PREEMPT_DNS | DO_RECOMPRESS_PICTURE | DO_DELTA | DO_INLINE_IMAGES | DO_INLINE_CSS | DO_IMAGE_DIMS | DO_PREFETCH)
 
 #define PROP_ENCODED_NONE 0
 #define PROP_ENCODED_GZIP (1<<0)
 #define PROP_ENCODED_DEFLATE (1<<1)
 #define PROP_ENCODED_COMPRESS (1<<2)
+#define PROP_ENCODED_BROTLI (1<<3)
+#define PROP_ENCODED_ZDICT (1<<4)	// shared-dictionary Zstandard (between paired Ziproxies)
 #define PROP_ENCODED_UNKNOWN (1<<10)
 
 EXTERN int is_sending_data;
@@ -57,6 +57,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <math.h>
+
+/* SSE2 is always present on x86_64 */
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include <gif_lib.h>
 
@@ -81,6 +87,7 @@
 #include "log.h"
 #include "cvtables.h"
 #include "globaldefs.h"
+#include "imgdims.h"
 
 /* 1GB roof for max_raw_size */
 #define MAX_RAW_SIZE_ROOF 0x3fffffffLL
@@ -93,12 +100,21 @@
 #define MIN_INSIZE_TO_JPEG 600
 #define MIN_INSIZE_TO_JP2K 800
 
+// resizing images to their display size
+#define RESAMPLE_BITS 14	/* fixed-point precision of weights */
+#define RESAMPLE_MAX_TAPS 1024	/* per output pixel, downscaling beyond ~170:1 is not done */
+#define RESAMPLE_MIN_GAIN 0.8	/* not worth resizing to more than that of the original dimensions */
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
 //Forwards. There are more utility functions, but they're used only once.
 static raw_bitmap *new_raw_bitmap();
 
 static int png2bitmap(char *inbuf, int insize, raw_bitmap **out, long long int max_raw_size);
 static int gif2bitmap(char *inbuf, int insize, raw_bitmap **out, long long int max_raw_size);
-static int jpg2bitmap(char *inbuf, int insize, raw_bitmap **out, long long int max_raw_size);
+static int jpg2bitmap(char *inbuf, int insize, raw_bitmap **out, long long int max_raw_size, int min_width, int min_height);
 
 static int bitmap2jpg(raw_bitmap  * bmp, int quality, char ** outb, int * outl);
 
@@ -110,6 +126,7 @@ static int depalettize(raw_bitmap * bmp);
 static int optimize_alpha_channel (raw_bitmap *bmp);
 static int optimize_palette (raw_bitmap *bmp);
 static int remove_alpha_channel (raw_bitmap *bmp);
+static int resize_to_display (raw_bitmap *bmp, int target_width, int target_height);
 
 #ifdef JP2K
 int calculate_jp2_rawsize (raw_bitmap *bmp, const t_color_space target_clrspc, const int *bitlenYA, const int *bitlenRGBA, const int*bitlenYUVA, const int *csamplingYA, const int *csamplingRGBA, const int *csamplingYUVA, int discard_alpha);
@@ -175,6 +192,7 @@ int compress_image (http_headers *serv_hdr, http_headers *client_hdr, char *inbu
 	int lossy_status, lossless_status;
 	const int *j2bitlenYA, *j2bitlenRGBA, *j2bitlenYUVA, *j2csamplingYA, *j2csamplingRGBA, *j2csamplingYUVA;
 	int source_is_lossless = 0;	/* !=0 if source is gif or png */
+	int target_width = 0, target_height = 0;	/* display size, 0 if unknown */
 
 	// "rate" below: JP2 rate, the native compression setting of JP2
 	// ziproxy tries to emulate JPEG's quality setting to JP2, and this
@@ -207,6 +225,13 @@ int compress_image (http_headers *serv_hdr, http_headers *client_hdr, char *inbu
 		max_raw_size = MAX_RAW_SIZE_ROOF;
 	}
 
+	/* size the image is displayed at, by pages which embed it */
+	if ((serv_hdr->flags & DO_RESIZE_PICTURE) && (imgdims_lookup (client_hdr->url, &target_width, &target_height) == 0)) {
+		target_width = (int) ceil (target_width * ImageResizeDPR);
+		target_height = (int) ceil (target_height * ImageResizeDPR);
+		debug_log_printf ("Image display size (times ImageResizeDPR) -- w: %d, h: %d (0: unknown)\n", target_width, target_height);
+	}
+
 	debug_log_puts ("Starting image decompression...");
 
 	switch (source_type) {
@@ -226,7 +251,7 @@ int compress_image (http_headers *serv_hdr, http_headers *client_hdr, char *inbu
 			break;
 		case IMG_JPEG:
 			if (insize >= MIN_INSIZE_JPEG)
-				st = jpg2bitmap (inbuf, insize, &bmp, max_raw_size);
+				st = jpg2bitmap (inbuf, insize, &bmp, max_raw_size, target_width * 2, target_height * 2);
 			else
 				st = IMG_RET_TOO_SMALL;
 			break;
@@ -262,6 +287,8 @@ int compress_image (http_headers *serv_hdr, http_headers *client_hdr, char *inbu
 
 	optimize_palette (bmp);
 	optimize_alpha_channel (bmp);
+	if ((target_width > 0) || (target_height > 0))
+		resize_to_display (bmp, target_width, target_height);
 
 	/*
 	 * STRATEGY DECISIONS
@@ -1140,7 +1167,9 @@ static void jpeg_emit_message (j_common_ptr cinfo, int msg_level)
 {
 }
 
-int jpg2bitmap(char *inbuf, int insize, raw_bitmap **out, long long int max_raw_size)
+/* min_width, min_height: if >0, the image may be downscaled while decompressing
+   (by 1/2, 1/4 or 1/8) as long as it remains at least that big */
+int jpg2bitmap(char *inbuf, int insize, raw_bitmap **out, long long int max_raw_size, int min_width, int min_height)
 {
 		
         struct jpeg_decompress_struct dinfo;
@@ -1176,6 +1205,20 @@ int jpg2bitmap(char *inbuf, int insize, raw_bitmap **out, long long int max_raw_
 	bmp = new_raw_bitmap();
 	*out = bmp;
 	jpeg_read_header(&dinfo, TRUE);
+
+	/* DCT scaling is nearly free, the rest of resizing is not */
+	if ((min_width > 0) || (min_height > 0)) {
+		int scale_denom;
+
+		for (scale_denom = 8; scale_denom > 1; scale_denom /= 2) {
+			if (((min_width == 0) || ((dinfo.image_width / scale_denom) >= min_width)) && \
+				((min_height == 0) || ((dinfo.image_height / scale_denom) >= min_height)))
+				break;
+		}
+		dinfo.scale_num = 1;
+		dinfo.scale_denom = scale_denom;
+	}
+
 	jpeg_start_decompress(&dinfo);
 	
 	imgsize=dinfo.output_width*dinfo.output_height*dinfo.output_components;
@@ -2322,3 +2365,232 @@ static int remove_alpha_channel (raw_bitmap *bmp)
 	return 0;
 }
 
+
+/* Lanczos3 kernel */
+static double lanczos3 (double x)
+{
+	if (x < 0.0)
+		x = -x;
+	if (x < 1e-8)
+		return 1.0;
+	if (x >= 3.0)
+		return 0.0;
+	return (3.0 * sin (M_PI * x) * sin (M_PI * x / 3.0)) / (M_PI * M_PI * x * x);
+}
+
+/* computes the source positions (start) and 14-bit fixed-point weights
+   of each of the 'out_len' output positions, when downscaling from 'in_len'.
+   weights: out_len * (*taps) entries, each group summing to (1 << RESAMPLE_BITS)
+   returns: ==0 ok, !=0 error (no memory) */
+static int resample_weights (int in_len, int out_len, int **start, short **weights, int *taps)
+{
+	double ratio = (double) in_len / (double) out_len;
+	double support = 3.0 * ratio;
+	double center, total;
+	double fweights [RESAMPLE_MAX_TAPS];
+	int o, i, first, last, sum, max_i;
+	short *curr_weights;
+
+	*taps = (int) ceil (support * 2.0) + 1;
+	if (*taps > RESAMPLE_MAX_TAPS)
+		return 1;
+	*start = malloc (sizeof (int) * out_len);
+	*weights = calloc (out_len * (*taps), sizeof (short));
+	if ((*start == NULL) || (*weights == NULL)) {
+		free (*start);
+		free (*weights);
+		return 1;
+	}
+
+	for (o = 0; o < out_len; o++) {
+		center = ((double) o + 0.5) * ratio;
+		first = (int) floor (center - support);
+		last = (int) ceil (center + support);
+		if (first < 0)
+			first = 0;
+		if (last > in_len)
+			last = in_len;
+		if (last - first > *taps)
+			last = first + *taps;
+
+		total = 0.0;
+		for (i = first; i < last; i++) {
+			fweights [i - first] = lanczos3 (((double) i + 0.5 - center) / ratio);
+			total += fweights [i - first];
+		}
+
+		/* normalized to 1.0, any rounding leftover goes to the heaviest tap */
+		curr_weights = *weights + (o * (*taps));
+		sum = 0;
+		max_i = 0;
+		for (i = 0; i < (last - first); i++) {
+			curr_weights [i] = (short) floor ((fweights [i] / total) * (1 << RESAMPLE_BITS) + 0.5);
+			sum += curr_weights [i];
+			if (curr_weights [i] > curr_weights [max_i])
+				max_i = i;
+		}
+		curr_weights [max_i] += (1 << RESAMPLE_BITS) - sum;
+		(*start) [o] = first;
+	}
+
+	return 0;
+}
+
+static inline unsigned char resample_clamp (int value)
+{
+	value = (value + (1 << (RESAMPLE_BITS - 1))) >> RESAMPLE_BITS;
+	if (value < 0)
+		return 0;
+	if (value > 255)
+		return 255;
+	return value;
+}
+
+/* vertical pass: each output row is a weighted sum of input rows,
+   'row_len' bytes (all components of all pixels) wide */
+static void resample_rows (const unsigned char *in, unsigned char *out, int row_len, int out_height, const int *start, const short *weights, int taps)
+{
+	const unsigned char *rows [RESAMPLE_MAX_TAPS];
+	const short *curr_weights;
+	int o, x, k;
+	int sum;
+
+	for (o = 0; o < out_height; o++) {
+		curr_weights = weights + (o * taps);
+		for (k = 0; k < taps; k++)
+			rows [k] = in + ((start [o] + ((curr_weights [k] != 0) ? k : 0)) * row_len);
+
+		x = 0;
+#if defined(__SSE2__)
+		/* 16 bytes at a time, two rows per multiply-add */
+		for (; x + 16 <= row_len; x += 16) {
+			__m128i zero = _mm_setzero_si128 ();
+			__m128i acc0 = zero, acc1 = zero, acc2 = zero, acc3 = zero;
+			__m128i ra, rb, lo, hi, w;
+
+			for (k = 0; k < taps; k += 2) {
+				ra = _mm_loadu_si128 ((const __m128i *) (rows [k] + x));
+				if (k + 1 < taps) {
+					rb = _mm_loadu_si128 ((const __m128i *) (rows [k + 1] + x));
+					w = _mm_set1_epi32 ((int) (((unsigned int) (unsigned short) curr_weights [k + 1] << 16) | (unsigned short) curr_weights [k]));
+				} else {
+					rb = zero;
+					w = _mm_set1_epi32 ((int) (unsigned short) curr_weights [k]);
+				}
+
+				lo = _mm_unpacklo_epi8 (ra, zero);
+				hi = _mm_unpacklo_epi8 (rb, zero);
+				acc0 = _mm_add_epi32 (acc0, _mm_madd_epi16 (_mm_unpacklo_epi16 (lo, hi), w));
+				acc1 = _mm_add_epi32 (acc1, _mm_madd_epi16 (_mm_unpackhi_epi16 (lo, hi), w));
+				lo = _mm_unpackhi_epi8 (ra, zero);
+				hi = _mm_unpackhi_epi8 (rb, zero);
+				acc2 = _mm_add_epi32 (acc2, _mm_madd_epi16 (_mm_unpacklo_epi16 (lo, hi), w));
+				acc3 = _mm_add_epi32 (acc3, _mm_madd_epi16 (_mm_unpackhi_epi16 (lo, hi), w));
+			}
+
+			w = _mm_set1_epi32 (1 << (RESAMPLE_BITS - 1));
+			acc0 = _mm_srai_epi32 (_mm_add_epi32 (acc0, w), RESAMPLE_BITS);
+			acc1 = _mm_srai_epi32 (_mm_add_epi32 (acc1, w), RESAMPLE_BITS);
+			acc2 = _mm_srai_epi32 (_mm_add_epi32 (acc2, w), RESAMPLE_BITS);
+			acc3 = _mm_srai_epi32 (_mm_add_epi32 (acc3, w), RESAMPLE_BITS);
+			_mm_storeu_si128 ((__m128i *) (out + x), _mm_packus_epi16 (_mm_packs_epi32 (acc0, acc1), _mm_packs_epi32 (acc2, acc3)));
+		}
+#endif
+		for (; x < row_len; x++) {
+			sum = 0;
+			for (k = 0; k < taps; k++)
+				sum += curr_weights [k] * rows [k][x];
+			out [x] = resample_clamp (sum);
+		}
+		out += row_len;
+	}
+}
+
+/* horizontal pass: each output pixel is a weighted sum of input pixels
+   in the same row, component by component */
+static void resample_columns (const unsigned char *in, unsigned char *out, int in_width, int out_width, int height, int bpp, const int *start, const short *weights, int taps)
+{
+	const unsigned char *in_pixel;
+	const short *curr_weights;
+	int y, o, c, k;
+	int sum;
+
+	for (y = 0; y < height; y++) {
+		for (o = 0; o < out_width; o++) {
+			curr_weights = weights + (o * taps);
+			for (c = 0; c < bpp; c++) {
+				in_pixel = in + (start [o] * bpp) + c;
+				sum = 0;
+				for (k = 0; (k < taps) && (start [o] + k < in_width); k++)
+					sum += curr_weights [k] * in_pixel [k * bpp];
+				*(out++) = resample_clamp (sum);
+			}
+		}
+		in += in_width * bpp;
+	}
+}
+
+/* downscales the image to fit the size it is displayed at.
+   target_width, target_height: the size in pixels, 0 if not known
+   (at least one of those must be known)
+   does not apply to palettized images nor images with alpha channel.
+   returns: ==0 resized, !=0 not resized */
+static int resize_to_display (raw_bitmap *bmp, int target_width, int target_height)
+{
+	double scale = 0.0;
+	int new_width, new_height;
+	int *start_v = NULL, *start_h = NULL;
+	short *weights_v = NULL, *weights_h = NULL;
+	int taps_v, taps_h;
+	unsigned char *vertical, *resized;
+	int ret = 1;
+
+	if ((bmp->raster != NULL) || (bmp->bitmap == NULL) || (bmp->bitmap_yuv != NULL))
+		return 1;
+	if ((bmp->bpp != 1) && (bmp->bpp != 3))
+		return 1;
+
+	/* the image must cover the box in both dimensions */
+	if (target_width > 0)
+		scale = (double) target_width / (double) bmp->width;
+	if ((target_height > 0) && (((double) target_height / (double) bmp->height) > scale))
+		scale = (double) target_height / (double) bmp->height;
+	if (scale > RESAMPLE_MIN_GAIN)
+		return 1;
+
+	new_width = (int) ceil (bmp->width * scale);
+	new_height = (int) ceil (bmp->height * scale);
+	if ((new_width < 1) || (new_height < 1))
+		return 1;
+
+	debug_log_printf ("Resizing image to its display size -- w: %d -> %d, h: %d -> %d\n", \
+		bmp->width, new_width, bmp->height, new_height);
+
+	if (resample_weights (bmp->height, new_height, &start_v, &weights_v, &taps_v) == 0) {
+		if (resample_weights (bmp->width, new_width, &start_h, &weights_h, &taps_h) == 0) {
+			vertical = malloc (bmp->width * bmp->bpp * new_height);
+			resized = malloc (new_width * bmp->bpp * new_height);
+			if ((vertical != NULL) && (resized != NULL)) {
+				resample_rows (bmp->bitmap, vertical, bmp->width * bmp->bpp, new_height, start_v, weights_v, taps_v);
+				resample_columns (vertical, resized, bmp->width, new_width, new_height, bmp->bpp, start_h, weights_h, taps_h);
+
+				free (bmp->bitmap);
+				bmp->bitmap = resized;
+				resized = NULL;
+				bmp->width = new_width;
+				bmp->height = new_height;
+				ret = 0;
+			}
+			free (vertical);
+			free (resized);
+			free (start_h);
+			free (weights_h);
+		}
+		free (start_v);
+		free (weights_v);
+	}
+
+	if (ret != 0)
+		debug_log_puts ("Unable to resize image.");
+	return ret;
+}
@@ -0,0 +1,493 @@
+/* imgdims.c
+ * Dimensions images are displayed at, as declared by HTML pages.
+ *
+ * Ziproxy - the HTTP acceleration proxy
+ * This code is under the following conditions:
+ *
+ * ---------------------------------------------------------------------
+ * Copyright (c)2005-2014 Daniel Mealha Cabrita
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111 USA
+ * ---------------------------------------------------------------------
+ */
+
+/*
+ * Pages often reference images far bigger than the box they're displayed in.
+ * When ImageResize is enabled, HTML pages optimized in memory are scanned for
+ * <img src="..." width="..." height="...">, and the largest size declared for
+ * each image URL is recorded here for ImageResizeTTL seconds. When that image
+ * is requested afterwards (as an embedded image, not as a navigation),
+ * compress_image() may downscale it to that size (times ImageResizeDPR).
+ *
+ * An image is left alone ("unbounded") if any page declares it with a
+ * relative (%) or no size at all, with srcset or with a width/height in its
+ * style, or references it otherwise (links, CSS url(...)), since the real
+ * display size is not known then.
+ *
+ * Each request is served by its own process, so the table lives in a shared
+ * anonymous mapping created by the daemon before forking (as in negcache.c).
+ * There's no locking: concurrent updates may, at worst, lose a declaration.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+
+#include "globaldefs.h"
+#include "imgdims.h"
+#include "subres.h"
+#include "log.h"
+#include "misc.h"
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+#define IMGDIMS_WAYS 8			/* entries probed per lookup */
+#define IMGDIMS_MAX_IMAGES 256		/* <img> per page, beyond that those are not recorded */
+#define IMGDIMS_MAX_OTHERS 1024		/* other references per page, beyond that those are not checked */
+#define IMGDIMS_MAX_DIM 65535		/* declared sizes beyond that are nonsense */
+
+typedef struct {
+	unsigned long long int key;	/* 0 == empty */
+	time_t expires;
+	int width;			/* 0 == not declared */
+	int height;
+	int unbounded;
+} t_imgdims_entry;
+
+typedef struct {
+	unsigned long long int key;
+	int width;
+	int height;
+	int unbounded;
+} t_imgdims_image;
+
+typedef struct {
+	const char *src;
+	int len;
+	char base [SUBRES_URL_LEN];
+	int has_base_element;
+	t_imgdims_image images [IMGDIMS_MAX_IMAGES];
+	int images_len;
+	unsigned long long int others [IMGDIMS_MAX_OTHERS];
+	int others_len;
+} t_imgdims_page;
+
+/* elements whose contents are not markup */
+static const char *imgdims_raw_elements [] = { "script", "textarea", "title", "xmp", "noscript", NULL };
+
+/* shared among all processes */
+static t_imgdims_entry *imgdims_entry = NULL;
+
+static int imgdims_entries;
+static int imgdims_ttl;
+
+static unsigned long long int imgdims_hash (const char *url)
+{
+	unsigned long long int hash;
+
+	hash = misc_hash_str (MISC_HASH_INIT, url);
+
+	/* 0 is reserved for 'empty' */
+	if (hash == 0)
+		hash = 1;
+	return (hash);
+}
+
+/* must be invoked by the daemon before forking, in order to share the table.
+ * if not invoked, nothing is recorded (and no image is resized).
+ * in_entries: max image URLs in the table
+ * in_ttl: seconds a declared size is remembered
+ * returns: 0 - ok, != 0 - unable to allocate shared memory (remains disabled) */
+int imgdims_init (const int in_entries, const int in_ttl)
+{
+	void *shared;
+
+	if (in_entries <= 0)
+		return (0);
+
+	if ((shared = mmap (NULL, sizeof (t_imgdims_entry) * in_entries, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+		return (1);
+
+	/* anonymous mappings are zero-filled, all entries start empty */
+	imgdims_entry = (t_imgdims_entry *) shared;
+	imgdims_entries = in_entries;
+	imgdims_ttl = in_ttl;
+
+	return (0);
+}
+
+/* merges the declared size of an image into the shared table */
+static void imgdims_record (const t_imgdims_image *image, const time_t now)
+{
+	t_imgdims_entry *curr_entry;
+	t_imgdims_entry *victim = NULL;
+	int i;
+
+	/* same key, otherwise the one to expire sooner (empty ones never expire later) */
+	for (i = 0; i < IMGDIMS_WAYS; i++) {
+		curr_entry = &imgdims_entry [(image->key + i) % imgdims_entries];
+		if (curr_entry->key == image->key) {
+			victim = curr_entry;
+			break;
+		}
+		if ((victim == NULL) || (victim->expires > curr_entry->expires))
+			victim = curr_entry;
+	}
+
+	if ((victim->key == image->key) && (victim->expires > now)) {
+		/* declared elsewhere too, the image must fit all of those */
+		if (victim->width < image->width)
+			victim->width = image->width;
+		if (victim->height < image->height)
+			victim->height = image->height;
+		victim->unbounded |= image->unbounded;
+	} else {
+		victim->width = image->width;
+		victim->height = image->height;
+		victim->unbounded = image->unbounded;
+	}
+	victim->expires = now + imgdims_ttl;
+	victim->key = image->key;
+}
+
+/* ### PAGE SCANNING ### */
+
+/* resolves the reference at src[start..end) against the page base.
+ * returns: hash of the absolute URL, or 0 if not resolvable */
+static unsigned long long int imgdims_ref_key (t_imgdims_page *page, int start, int end)
+{
+	char value [SUBRES_URL_LEN];
+	char url [SUBRES_URL_LEN];
+	int value_len = 0, pos;
+
+	while ((start < end) && isspace (page->src [start]))
+		start++;
+	while ((end > start) && isspace (page->src [end - 1]))
+		end--;
+	if (((end - start) >= SUBRES_URL_LEN) || (end == start))
+		return (0);
+	if (subres_match (page->src, end, start, "data:"))
+		return (0);
+
+	/* only &amp; is decoded, as in imginline.c */
+	for (pos = start; pos < end; pos++) {
+		if (subres_match (page->src, end, pos, "&amp;"))
+			pos += 4;
+		value [value_len++] = page->src [pos];
+	}
+	value [value_len] = '\0';
+
+	if (subres_resolve (page->base, value, url, sizeof (url)))
+		return (0);
+	return (imgdims_hash (url));
+}
+
+/* records a non-<img> reference at src[start..end) */
+static void imgdims_add_other (t_imgdims_page *page, int start, int end)
+{
+	unsigned long long int key;
+
+	if (page->others_len >= IMGDIMS_MAX_OTHERS)
+		return;
+	if ((key = imgdims_ref_key (page, start, end)) != 0)
+		page->others [page->others_len++] = key;
+}
+
+/* returns: the integer value of a width/height attribute at src[start..end),
+ *          0 if absent or not in pixels */
+static int imgdims_parse_dim (const char *src, int start, const int end)
+{
+	int value = 0;
+
+	while ((start < end) && isspace (src [start]))
+		start++;
+	while ((start < end) && isdigit (src [start])) {
+		if (value <= IMGDIMS_MAX_DIM)
+			value = (value * 10) + (src [start] - '0');
+		start++;
+	}
+	/* fractional part is irrelevant, a percentage is not a size */
+	while ((start < end) && ((src [start] == '.') || isdigit (src [start])))
+		start++;
+	if ((start < end) && (src [start] == '%'))
+		return (0);
+	if (value > IMGDIMS_MAX_DIM)
+		return (0);
+	return (value);
+}
+
+/* records the url(...) references in CSS at src[pos..end) */
+static void imgdims_scan_css (t_imgdims_page *page, int pos, const int end)
+{
+	const char *src = page->src;
+	int value_start, value_end;
+	char quote;
+
+	while ((pos = subres_find (src, end, pos, "url(")) < end) {
+		pos += 4;
+		while ((pos < end) && isspace (src [pos]))
+			pos++;
+		if ((pos < end) && ((src [pos] == '"') || (src [pos] == '\''))) {
+			quote = src [pos++];
+			value_start = pos;
+			while ((pos < end) && (src [pos] != quote))
+				pos++;
+		} else {
+			value_start = pos;
+			while ((pos < end) && (src [pos] != ')'))
+				pos++;
+		}
+		value_end = pos;
+		if (pos >= end)
+			return;
+		imgdims_add_other (page, value_start, value_end);
+	}
+}
+
+/* processes the tag at src[pos] ('<').
+ * returns: position after the tag (or after the element, for raw elements) */
+static int imgdims_scan_tag (t_imgdims_page *page, int pos)
+{
+	const char *src = page->src;
+	const int len = page->len;
+	t_imgdims_image *image = NULL;
+	int name_start, name_len;
+	int attr_start, attr_len;
+	int value_start, value_end;
+	int is_img, is_style, is_base, is_link;
+	int img_src_start = 0, img_src_end = 0;
+	int width = 0, height = 0, unbounded = 0;
+	char end_tag [16];
+	int i;
+
+	name_start = ++pos;
+	while ((pos < len) && (isalnum (src [pos]) || (src [pos] == '-') || (src [pos] == ':')))
+		pos++;
+	if ((name_len = pos - name_start) == 0)
+		return (pos);
+
+	is_img = (name_len == 3) && (strncasecmp (src + name_start, "img", 3) == 0);
+	is_style = (name_len == 5) && (strncasecmp (src + name_start, "style", 5) == 0);
+	is_base = (name_len == 4) && (strncasecmp (src + name_start, "base", 4) == 0);
+	is_link = ((name_len == 1) && (tolower (src [name_start]) == 'a')) || ((name_len == 4) && (strncasecmp (src + name_start, "link", 4) == 0));
+
+	/* attributes */
+	while (pos < len) {
+		while ((pos < len) && (isspace (src [pos]) || (src [pos] == '/')))
+			pos++;
+		if ((pos >= len) || (src [pos] == '>'))
+			break;
+
+		attr_start = pos;
+		while ((pos < len) && (! isspace (src [pos])) && (src [pos] != '=') && (src [pos] != '>') && (src [pos] != '/'))
+			pos++;
+		attr_len = pos - attr_start;
+		if (attr_len == 0)
+			pos++;	/* stray '=' */
+		while ((pos < len) && isspace (src [pos]))
+			pos++;
+
+		value_start = value_end = pos;
+		if ((pos < len) && (src [pos] == '=') && (attr_len > 0)) {
+			pos++;
+			while ((pos < len) && isspace (src [pos]))
+				pos++;
+			if ((pos < len) && ((src [pos] == '"') || (src [pos] == '\''))) {
+				char quote = src [pos++];
+
+				value_start = pos;
+				while ((pos < len) && (src [pos] != quote))
+					pos++;
+				value_end = pos;
+				if (pos < len)
+					pos++;
+			} else {
+				value_start = pos;
+				while ((pos < len) && (! isspace (src [pos])) && (src [pos] != '>'))
+					pos++;
+				value_end = pos;
+			}
+		}
+
+		if (is_img && (attr_len == 3) && (strncasecmp (src + attr_start, "src", 3) == 0)) {
+			img_src_start = value_start;
+			img_src_end = value_end;
+		} else if (is_img && (attr_len == 5) && (strncasecmp (src + attr_start, "width", 5) == 0)) {
+			width = imgdims_parse_dim (src, value_start, value_end);
+		} else if (is_img && (attr_len == 6) && (strncasecmp (src + attr_start, "height", 6) == 0)) {
+			height = imgdims_parse_dim (src, value_start, value_end);
+		} else if (is_img && (attr_len == 6) && (strncasecmp (src + attr_start, "srcset", 6) == 0)) {
+			unbounded = 1;
+		} else if ((attr_len == 5) && (strncasecmp (src + attr_start, "style", 5) == 0)) {
+			if (is_img && ((subres_find (src, value_end, value_start, "width") < value_end) || (subres_find (src, value_end, value_start, "height") < value_end)))
+				unbounded = 1;
+			imgdims_scan_css (page, value_start, value_end);
+		} else if (is_link && (attr_len == 4) && (strncasecmp (src + attr_start, "href", 4) == 0)) {
+			imgdims_add_other (page, value_start, value_end);
+		} else if (is_base && (attr_len == 4) && (strncasecmp (src + attr_start, "href", 4) == 0) && (! page->has_base_element)) {
+			char href [SUBRES_URL_LEN];
+			char base [SUBRES_URL_LEN];
+
+			/* only the first one counts, and only if resolvable */
+			page->has_base_element = 1;
+			if ((value_end - value_start < SUBRES_URL_LEN) && (memchr (src + value_start, '&', value_end - value_start) == NULL)) {
+				memcpy (href, src + value_start, value_end - value_start);
+				href [value_end - value_start] = '\0';
+				if (subres_resolve (page->base, href, base, sizeof (base)) == 0)
+					strcpy (page->base, base);
+			}
+		}
+	}
+	if (pos < len)
+		pos++;
+
+	if (is_img && (img_src_end > img_src_start)) {
+		unsigned long long int key = imgdims_ref_key (page, img_src_start, img_src_end);
+
+		if (key != 0) {
+			for (i = 0; i < page->images_len; i++) {
+				if (page->images [i].key == key) {
+					image = &(page->images [i]);
+					break;
+				}
+			}
+			if ((image == NULL) && (page->images_len < IMGDIMS_MAX_IMAGES)) {
+				image = &(page->images [page->images_len++]);
+				image->key = key;
+			}
+		}
+		if (image != NULL) {
+			if ((width == 0) && (height == 0))
+				unbounded = 1;
+			if (image->width < width)
+				image->width = width;
+			if (image->height < height)
+				image->height = height;
+			image->unbounded |= unbounded;
+		}
+	}
+
+	/* element contents */
+	if (is_style) {
+		int end = subres_find (src, len, pos, "</style");
+
+		imgdims_scan_css (page, pos, end);
+		return (end);
+	}
+	for (i = 0; imgdims_raw_elements [i] != NULL; i++) {
+		if ((name_len == strlen (imgdims_raw_elements [i])) && (strncasecmp (src + name_start, imgdims_raw_elements [i], name_len) == 0)) {
+			snprintf (end_tag, sizeof (end_tag), "</%s", imgdims_raw_elements [i]);
+			return (subres_find (src, len, pos, end_tag));
+		}
+	}
+	return (pos);
+}
+
+/* records the sizes the HTML page in src[0..len) declares for its images */
+void imgdims_from_html (const http_headers *chdr, const char *src, const int len)
+{
+	t_imgdims_page *page;
+	const char *found;
+	time_t now;
+	int pos = 0;
+	int i, j;
+
+	if ((imgdims_entry == NULL) || (chdr->url == NULL) || (strncmp (chdr->url, "http://", 7) != 0) || (strlen (chdr->url) >= SUBRES_URL_LEN))
+		return;
+	if ((page = calloc (1, sizeof (t_imgdims_page))) == NULL)
+		return;
+	page->src = src;
+	page->len = len;
+	strcpy (page->base, chdr->url);
+
+	while (pos < len) {
+		if ((found = memchr (src + pos, '<', len - pos)) == NULL)
+			break;
+		pos = found - src;
+
+		if (subres_match (src, len, pos, "<!--"))
+			pos = subres_find (src, len, pos + 4, "-->");
+		else
+			pos = imgdims_scan_tag (page, pos);
+	}
+
+	now = time (NULL);
+	for (i = 0; i < page->images_len; i++) {
+		for (j = 0; j < page->others_len; j++) {
+			if (page->others [j] == page->images [i].key) {
+				page->images [i].unbounded = 1;
+				break;
+			}
+		}
+		imgdims_record (&(page->images [i]), now);
+	}
+	debug_log_printf ("ImageResize: Sizes of %d images recorded.\n", page->images_len);
+
+	free (page);
+}
+
+/* retrieves the size an image is displayed at.
+ * width, height: largest declared size, 0 if not declared
+ * returns: 0 - ok, != 0 - unknown (or not to be resized) */
+int imgdims_lookup (const char *url, int *width, int *height)
+{
+	t_imgdims_entry *curr_entry;
+	unsigned long long int key;
+	time_t now;
+	int i;
+
+	if ((imgdims_entry == NULL) || (url == NULL))
+		return (1);
+
+	key = imgdims_hash (url);
+	now = time (NULL);
+	for (i = 0; i < IMGDIMS_WAYS; i++) {
+		curr_entry = &imgdims_entry [(key + i) % imgdims_entries];
+		if ((curr_entry->key == key) && (curr_entry->expires > now)) {
+			if (curr_entry->unbounded || ((curr_entry->width == 0) && (curr_entry->height == 0)))
+				return (1);
+			*width = curr_entry->width;
+			*height = curr_entry->height;
+			return (0);
+		}
+	}
+	return (1);
+}
+
+/* checks whether the request is for an image embedded in a page,
+ * as opposed to the user opening the image itself (which is not to be resized).
+ * returns: != 0 - embedded */
+int imgdims_is_embedded (const http_headers *chdr)
+{
+	const char *dest, *accept;
+
+	if ((dest = find_header ("Sec-Fetch-Dest:", chdr)) != NULL) {
+		while (isspace (*dest))
+			dest++;
+		return (strncasecmp (dest, "image", 5) == 0);
+	}
+	if ((accept = find_header ("Accept:", chdr)) != NULL)
+		return (strstr (accept, "text/html") == NULL);
+	return (1);
+}
+
@@ -0,0 +1,39 @@
+/* imgdims.h
+ * Dimensions images are displayed at, as declared by HTML pages.
+ *
+ * Ziproxy - the HTTP acceleration proxy
+ * This code is under the following conditions:
+ *
+ * ---------------------------------------------------------------------
+ * Copyright (c)2005-2014 Daniel Mealha Cabrita
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111 USA
+ * ---------------------------------------------------------------------
+ */
+
+// To stop multiple inclusions.
+#ifndef SRC_IMGDIMS_H
+#define SRC_IMGDIMS_H
+
+#include "globaldefs.h"
+#include "http.h"
+
+extern int imgdims_init (const int in_entries, const int in_ttl);
+extern void imgdims_from_html (const http_headers *chdr, const char *src, const int len);
+extern int imgdims_lookup (const char *url, int *width, int *height);
+extern int imgdims_is_embedded (const http_headers *chdr);
+
+#endif //SRC_IMGDIMS_H
+
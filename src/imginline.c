@@ -0,0 +1,533 @@
+/* imginline.c
+ * Inlining of small images referenced by HTML pages, as data: URIs.
+ *
+ * Ziproxy - the HTTP acceleration proxy
+ * This code is under the following conditions:
+ *
+ * ---------------------------------------------------------------------
+ * Copyright (c)2005-2014 Daniel Mealha Cabrita
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111 USA
+ * ---------------------------------------------------------------------
+ */
+
+/*
+ * Every small icon referenced by a page costs the client a separate
+ * request (and a round trip). When InlineImages is enabled, HTML pages
+ * optimized in memory are scanned for <img src="..."> and CSS url(...)
+ * references (in <style> blocks and style="..." attributes).
+ *
+ * - only images from the page's own site are considered, up to
+ *   InlineImagesMax distinct ones, fetched in parallel (see subres.c)
+ *   and each one aborted if bigger than InlineImagesMaxSize.
+ * - those are recompressed like any other image (ProcessJPG/PNG/GIF...),
+ *   and replace their references as data: URIs as long as the page
+ *   does not grow by more than InlineImagesPageBudget (counting each
+ *   reference to the same image).
+ *
+ * Anything else (errors, non-images, images too big) keeps its reference.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <ctype.h>
+
+#include "imginline.h"
+#include "subres.h"
+#include "image.h"
+#include "cfgfile.h"
+#include "log.h"
+#include "globaldefs.h"
+
+#define IMGINLINE_MAX_REFS	512	/* references beyond that are left untouched */
+
+/* elements whose contents are not markup (references there are not rewritten) */
+static const char *imginline_raw_elements [] = { "script", "textarea", "title", "xmp", "noscript", NULL };
+
+static const char imginline_base64_chars [] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+typedef struct {
+	t_subres fetch;			/* fetch.data: fetched (later, recompressed) image, or NULL */
+	int refs;			/* references to it in the page */
+	char *data_uri;			/* replacement, or NULL if not inlined */
+	int data_uri_len;
+} imginline_image;
+
+typedef struct {
+	int start, end;			/* the reference in the page */
+	int image;			/* index in images[] */
+	int add_quotes;			/* unquoted attribute value */
+} imginline_ref;
+
+typedef struct {
+	const char *src;
+	int len;
+	char base [SUBRES_URL_LEN];
+	int has_base_element;
+	const http_headers *chdr;
+	imginline_image images [IMGINLINE_MAX_IMAGES];
+	int images_len;
+	imginline_ref refs [IMGINLINE_MAX_REFS];
+	int refs_len;
+} imginline_page;
+
+/* ### PAGE SCANNING ### */
+
+/* records a reference to an image at src[start..end), if worth it */
+static void imginline_add_ref (imginline_page *page, int start, int end, const int decode_entities, const int add_quotes)
+{
+	char value [SUBRES_URL_LEN];
+	char url [SUBRES_URL_LEN];
+	imginline_ref *ref;
+	int value_len = 0, pos, i;
+
+	if (page->refs_len >= IMGINLINE_MAX_REFS)
+		return;
+
+	while ((start < end) && isspace (page->src [start]))
+		start++;
+	while ((end > start) && isspace (page->src [end - 1]))
+		end--;
+	if ((end - start) >= SUBRES_URL_LEN)
+		return;
+
+	/* only &amp; is expected there; CSS escapes are not handled either */
+	for (pos = start; pos < end; pos++) {
+		switch (page->src [pos]) {
+		case '&':
+			if (! decode_entities)
+				break;
+			if (! subres_match (page->src, end, pos, "&amp;"))
+				return;
+			value [value_len++] = '&';
+			pos += 4;
+			continue;
+		case '\\':
+		case '"':
+		case '\'':
+		case '<':
+		case '>':
+			return;
+		default:
+			if (isspace (page->src [pos]))
+				return;
+			break;
+		}
+		value [value_len++] = page->src [pos];
+	}
+	value [value_len] = '\0';
+
+	if (subres_resolve (page->base, value, url, sizeof (url)))
+		return;
+
+	/* already known? */
+	for (i = 0; i < page->images_len; i++) {
+		if (strcmp (page->images [i].fetch.url, url) == 0)
+			break;
+	}
+	if (i == page->images_len) {
+		if (page->images_len >= InlineImagesMax)
+			return;
+		if (subres_prepare (&(page->images [i].fetch), url, page->chdr, "image/*", InlineImagesMaxSize))
+			return;
+		page->images_len++;
+	}
+	page->images [i].refs++;
+
+	ref = &(page->refs [page->refs_len++]);
+	ref->start = start;
+	ref->end = end;
+	ref->image = i;
+	ref->add_quotes = add_quotes;
+}
+
+/* records the url(...) references in CSS at src[pos..end) */
+static void imginline_scan_css (imginline_page *page, int pos, const int end, const int decode_entities)
+{
+	const char *src = page->src;
+	int value_start, value_end;
+	char quote;
+
+	while ((pos = subres_find (src, end, pos, "url(")) < end) {
+		/* not part of some other identifier */
+		if ((pos > 0) && (isalnum (src [pos - 1]) || (src [pos - 1] == '-') || (src [pos - 1] == '_'))) {
+			pos += 4;
+			continue;
+		}
+		pos += 4;
+		while ((pos < end) && isspace (src [pos]))
+			pos++;
+		if ((pos < end) && ((src [pos] == '"') || (src [pos] == '\''))) {
+			quote = src [pos++];
+			value_start = pos;
+			while ((pos < end) && (src [pos] != quote))
+				pos++;
+			value_end = pos;
+		} else {
+			value_start = pos;
+			while ((pos < end) && (src [pos] != ')'))
+				pos++;
+			value_end = pos;
+		}
+		if (pos >= end)
+			return;
+		if (! subres_match (src, value_end, value_start, "data:"))
+			imginline_add_ref (page, value_start, value_end, decode_entities, 0);
+	}
+}
+
+/* processes the tag at src[pos] ('<').
+ * returns: position after the tag (or after the element, for raw elements) */
+static int imginline_scan_tag (imginline_page *page, int pos)
+{
+	const char *src = page->src;
+	const int len = page->len;
+	int name_start, name_len;
+	int attr_start, attr_len;
+	int value_start, value_end, has_value, is_quoted;
+	int is_img, is_style, is_base;
+	char end_tag [16];
+	int i;
+
+	name_start = ++pos;
+	while ((pos < len) && (isalnum (src [pos]) || (src [pos] == '-') || (src [pos] == ':')))
+		pos++;
+	if ((name_len = pos - name_start) == 0)
+		return (pos);
+
+	is_img = (name_len == 3) && (strncasecmp (src + name_start, "img", 3) == 0);
+	is_style = (name_len == 5) && (strncasecmp (src + name_start, "style", 5) == 0);
+	is_base = (name_len == 4) && (strncasecmp (src + name_start, "base", 4) == 0);
+
+	/* attributes */
+	while (pos < len) {
+		while ((pos < len) && (isspace (src [pos]) || (src [pos] == '/')))
+			pos++;
+		if ((pos >= len) || (src [pos] == '>'))
+			break;
+
+		attr_start = pos;
+		while ((pos < len) && (! isspace (src [pos])) && (src [pos] != '=') && (src [pos] != '>') && (src [pos] != '/'))
+			pos++;
+		attr_len = pos - attr_start;
+		if (attr_len == 0)
+			pos++;	/* stray '=' */
+		while ((pos < len) && isspace (src [pos]))
+			pos++;
+
+		has_value = is_quoted = 0;
+		value_start = value_end = pos;
+		if ((pos < len) && (src [pos] == '=') && (attr_len > 0)) {
+			pos++;
+			while ((pos < len) && isspace (src [pos]))
+				pos++;
+			if ((pos < len) && ((src [pos] == '"') || (src [pos] == '\''))) {
+				char quote = src [pos++];
+
+				value_start = pos;
+				while ((pos < len) && (src [pos] != quote))
+					pos++;
+				value_end = pos;
+				if (pos < len)
+					pos++;
+				is_quoted = 1;
+			} else {
+				value_start = pos;
+				while ((pos < len) && (! isspace (src [pos])) && (src [pos] != '>'))
+					pos++;
+				value_end = pos;
+			}
+			has_value = (value_end > value_start) && (value_end < len);
+		}
+		if (! has_value)
+			continue;
+
+		if (is_img && (attr_len == 3) && (strncasecmp (src + attr_start, "src", 3) == 0)) {
+			if (! subres_match (src, value_end, value_start, "data:"))
+				imginline_add_ref (page, value_start, value_end, 1, ! is_quoted);
+		} else if ((attr_len == 5) && (strncasecmp (src + attr_start, "style", 5) == 0)) {
+			imginline_scan_css (page, value_start, value_end, 1);
+		} else if (is_base && (attr_len == 4) && (strncasecmp (src + attr_start, "href", 4) == 0) && (! page->has_base_element)) {
+			char href [SUBRES_URL_LEN];
+			char base [SUBRES_URL_LEN];
+
+			/* only the first one counts, and only if resolvable */
+			page->has_base_element = 1;
+			if ((value_end - value_start < SUBRES_URL_LEN) && (memchr (src + value_start, '&', value_end - value_start) == NULL)) {
+				memcpy (href, src + value_start, value_end - value_start);
+				href [value_end - value_start] = '\0';
+				if (subres_resolve (page->base, href, base, sizeof (base)) == 0)
+					strcpy (page->base, base);
+			}
+		}
+	}
+	if (pos < len)
+		pos++;
+
+	/* element contents */
+	if (is_style) {
+		int end = subres_find (src, len, pos, "</style");
+
+		imginline_scan_css (page, pos, end, 0);
+		return (end);
+	}
+	for (i = 0; imginline_raw_elements [i] != NULL; i++) {
+		if ((name_len == strlen (imginline_raw_elements [i])) && (strncasecmp (src + name_start, imginline_raw_elements [i], name_len) == 0)) {
+			snprintf (end_tag, sizeof (end_tag), "</%s", imginline_raw_elements [i]);
+			return (subres_find (src, len, pos, end_tag));
+		}
+	}
+	return (pos);
+}
+
+/* records the image references in the page */
+static void imginline_scan (imginline_page *page)
+{
+	const char *src = page->src;
+	const char *found;
+	int pos = 0;
+
+	while ((pos < page->len) && (page->refs_len < IMGINLINE_MAX_REFS)) {
+		if ((found = memchr (src + pos, '<', page->len - pos)) == NULL)
+			break;
+		pos = found - src;
+
+		if (subres_match (src, page->len, pos, "<!--"))
+			pos = subres_find (src, page->len, pos + 4, "-->");
+		else
+			pos = imginline_scan_tag (page, pos);
+	}
+}
+
+/* ### INLINING ### */
+
+/* returns: MIME type of the image in 'data', or NULL if not a (known) image */
+static const char *imginline_mime_type (char *data, int data_len)
+{
+	switch (detect_type (data, data_len)) {
+	case IMG_PNG:
+		return ("image/png");
+	case IMG_GIF:
+		return ("image/gif");
+	case IMG_JPEG:
+		return ("image/jpeg");
+#ifdef JP2K
+	case IMG_JP2K:
+		return ("image/jp2");
+#endif
+	default:
+		return (NULL);
+	}
+}
+
+/* recompresses the fetched image, as configured for images in general */
+static void imginline_recompress (imginline_image *image, http_headers *chdr)
+{
+	http_headers img_hdr;
+	char *outbuf = image->fetch.data;
+	ZP_DATASIZE_TYPE outlen = image->fetch.data_len;
+
+	memset (&img_hdr, 0, sizeof (img_hdr));
+	img_hdr.where_content_type = img_hdr.where_content_length = img_hdr.where_chunked = -1;
+	img_hdr.where_content_encoding = img_hdr.where_etag = -1;
+	img_hdr.type = detect_type (image->fetch.data, image->fetch.data_len);
+
+	switch (img_hdr.type) {
+	case IMG_PNG:
+		if (! ProcessPNG)
+			return;
+		break;
+	case IMG_GIF:
+		if (! ProcessGIF)
+			return;
+		break;
+	case IMG_JPEG:
+		if (! ProcessJPG)
+			return;
+		break;
+#ifdef JP2K
+	case IMG_JP2K:
+		if (! ProcessJP2)
+			return;
+		break;
+#endif
+	default:
+		return;
+	}
+
+	compress_image (&img_hdr, chdr, image->fetch.data, image->fetch.data_len, &outbuf, &outlen);
+	if ((outbuf != image->fetch.data) && (outbuf != NULL)) {
+		if ((outlen > 0) && (outlen < image->fetch.data_len)) {
+			free (image->fetch.data);
+			image->fetch.data = outbuf;
+			image->fetch.data_len = outlen;
+		} else {
+			free (outbuf);
+		}
+	}
+}
+
+/* builds image->data_uri from image->fetch.data.
+ * returns: ==0 ok, !=0 not an image (or no memory) */
+static int imginline_make_data_uri (imginline_image *image)
+{
+	const unsigned char *in = (const unsigned char *) image->fetch.data;
+	const char *mime_type;
+	char *out;
+	int i, bits;
+
+	if ((mime_type = imginline_mime_type (image->fetch.data, image->fetch.data_len)) == NULL)
+		return (1);
+
+	image->data_uri_len = strlen ("data:") + strlen (mime_type) + strlen (";base64,") + ((image->fetch.data_len + 2) / 3) * 4;
+	if ((image->data_uri = malloc (image->data_uri_len + 1)) == NULL)
+		return (1);
+	out = image->data_uri + sprintf (image->data_uri, "data:%s;base64,", mime_type);
+
+	for (i = 0; i + 2 < image->fetch.data_len; i += 3) {
+		bits = (in [i] << 16) | (in [i + 1] << 8) | in [i + 2];
+		*(out++) = imginline_base64_chars [(bits >> 18) & 0x3f];
+		*(out++) = imginline_base64_chars [(bits >> 12) & 0x3f];
+		*(out++) = imginline_base64_chars [(bits >> 6) & 0x3f];
+		*(out++) = imginline_base64_chars [bits & 0x3f];
+	}
+	if (i < image->fetch.data_len) {
+		bits = in [i] << 16;
+		if (i + 1 < image->fetch.data_len)
+			bits |= in [i + 1] << 8;
+		*(out++) = imginline_base64_chars [(bits >> 18) & 0x3f];
+		*(out++) = imginline_base64_chars [(bits >> 12) & 0x3f];
+		*(out++) = (i + 1 < image->fetch.data_len) ? imginline_base64_chars [(bits >> 6) & 0x3f] : '=';
+		*(out++) = '=';
+	}
+	*out = '\0';
+	return (0);
+}
+
+/* inlines the small images referenced by the HTML page in *inoutbuf, as data: URIs.
+ * *inoutbuf may be replaced by a new (malloc()'ed) buffer, the old one is free()'d then.
+ * returns: number of references replaced */
+int imginline_html (http_headers *chdr, char **inoutbuf, ZP_DATASIZE_TYPE *inoutlen)
+{
+	imginline_page *page;
+	t_subres *fetches [IMGINLINE_MAX_IMAGES];
+	imginline_image *image;
+	imginline_ref *ref;
+	char *outbuf, *out;
+	ZP_DATASIZE_TYPE outlen;
+	int budget = InlineImagesPageBudget;
+	int inlined_refs = 0, inlined_images = 0;
+	int pos, cost, i;
+
+	if ((chdr->url == NULL) || (strncmp (chdr->url, "http://", 7) != 0) || (strlen (chdr->url) >= SUBRES_URL_LEN) || (*inoutlen > INT_MAX))
+		return (0);
+	/* img-src may not allow data: URIs */
+	if (subres_html_has_csp (*inoutbuf, *inoutlen)) {
+		debug_log_puts ("InlineImages: page has a Content-Security-Policy, not inlining.");
+		return (0);
+	}
+	if ((page = calloc (1, sizeof (imginline_page))) == NULL)
+		return (0);
+	page->src = *inoutbuf;
+	page->len = *inoutlen;
+	page->chdr = chdr;
+	strcpy (page->base, chdr->url);
+
+	imginline_scan (page);
+	if (page->images_len == 0) {
+		free (page);
+		return (0);
+	}
+
+	/* fetch them all in parallel */
+	for (i = 0; i < page->images_len; i++)
+		fetches [i] = &(page->images [i].fetch);
+	subres_fetch_all (fetches, page->images_len);
+	debug_log_difftime ("InlineImages: fetching");
+
+	/* recompress and encode them, in order of appearance, while within budget */
+	for (i = 0; i < page->images_len; i++) {
+		image = &(page->images [i]);
+		if (image->fetch.data == NULL) {
+			debug_log_printf ("InlineImages: %s not fetched (error, timeout or too big).\n", image->fetch.url);
+			continue;
+		}
+
+		imginline_recompress (image, chdr);
+		if ((image->fetch.data_len <= InlineImagesMaxSize) && (imginline_make_data_uri (image) == 0)) {
+			cost = image->data_uri_len * image->refs;
+			if (cost <= budget) {
+				budget -= cost;
+				inlined_images++;
+			} else {
+				debug_log_printf ("InlineImages: %s exceeds the page budget.\n", image->fetch.url);
+				free (image->data_uri);
+				image->data_uri = NULL;
+			}
+		}
+		free (image->fetch.data);
+		image->fetch.data = NULL;
+	}
+
+	/* rewrite the page */
+	outlen = page->len;
+	for (i = 0; i < page->refs_len; i++) {
+		ref = &(page->refs [i]);
+		if ((image = &(page->images [ref->image]))->data_uri != NULL)
+			outlen += image->data_uri_len + (ref->add_quotes ? 2 : 0) - (ref->end - ref->start);
+	}
+
+	if ((inlined_images > 0) && ((outbuf = malloc (outlen + 1)) != NULL)) {
+		out = outbuf;
+		pos = 0;
+		for (i = 0; i < page->refs_len; i++) {
+			ref = &(page->refs [i]);
+			if ((image = &(page->images [ref->image]))->data_uri == NULL)
+				continue;
+
+			memcpy (out, page->src + pos, ref->start - pos);
+			out += ref->start - pos;
+			if (ref->add_quotes)
+				*(out++) = '"';
+			memcpy (out, image->data_uri, image->data_uri_len);
+			out += image->data_uri_len;
+			if (ref->add_quotes)
+				*(out++) = '"';
+			pos = ref->end;
+			inlined_refs++;
+		}
+		memcpy (out, page->src + pos, page->len - pos);
+
+		free (*inoutbuf);
+		*inoutbuf = outbuf;
+		*inoutlen = outlen;
+	}
+	debug_log_printf ("InlineImages: %d of %d images inlined (%d references, %d bytes of data URIs).\n", \
+		inlined_images, page->images_len, inlined_refs, InlineImagesPageBudget - budget);
+
+	for (i = 0; i < page->images_len; i++) {
+		if (page->images [i].data_uri != NULL)
+			free (page->images [i].data_uri);
+	}
+	free (page);
+	return (inlined_refs);
+}
+
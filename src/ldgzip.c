@@ -0,0 +1,192 @@
+/* ldgzip.c
+ * gzip one-shot (whole buffer) routines, using libdeflate
+ *
+ * Ziproxy - the HTTP acceleration proxy
+ * This code is under the following conditions:
+ *
+ * ---------------------------------------------------------------------
+ * Copyright (c)2005-2014 Daniel Mealha Cabrita
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111 USA
+ * ---------------------------------------------------------------------
+ */
+
+/* libdeflate is much faster than zlib, but it only works with whole buffers.
+ * those are used for bodies already in memory, zlib is still used for streams. */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef LIBDEFLATE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <libdeflate.h>
+
+#include "ldgzip.h"
+#include "cfgfile.h"
+#include "log.h"
+#include "tosmarking.h"
+#include "globaldefs.h"
+
+#define BUFSIZE 16384
+
+/* deflate cannot expand data more than ~1032:1 */
+#define DEFLATE_MAX_RATIO 1032
+
+/* Compress inlen bytes from source to file dest (gzip format).
+   returns LDGZIP_OK on success, LDGZIP_MEM_ERROR if memory could not be
+   allocated for processing, or LDGZIP_ERRNO if there is an error
+   writing the file. */
+int ldgzip_memory_stream (const char *source, FILE *dest, int level, ZP_DATASIZE_TYPE inlen, ZP_DATASIZE_TYPE *outlen)
+{
+	struct libdeflate_compressor *compressor;
+	unsigned char *out;
+	size_t out_len;
+	size_t have, written;
+	size_t last_write_bytes;
+
+	*outlen = 0;
+
+	if ((compressor = libdeflate_alloc_compressor (level)) == NULL)
+		return (LDGZIP_MEM_ERROR);
+	out_len = libdeflate_gzip_compress_bound (compressor, inlen);
+	if ((out = malloc (out_len)) == NULL) {
+		libdeflate_free_compressor (compressor);
+		return (LDGZIP_MEM_ERROR);
+	}
+
+	out_len = libdeflate_gzip_compress (compressor, source, inlen, out, out_len);
+	libdeflate_free_compressor (compressor);
+	if (out_len == 0) {
+		free (out);
+		return (LDGZIP_MEM_ERROR);
+	}
+
+	/* send it in pieces, so TOS, access log and alarm are updated as usual */
+	for (written = 0; written < out_len; written += have) {
+		have = ((out_len - written) > BUFSIZE) ? BUFSIZE : (out_len - written);
+		tosmarking_add_check_bytecount (have);	/* update TOS if necessary */
+		if ((last_write_bytes = fwrite(out + written, 1, have, dest)) != have || ferror(dest)) {
+			*outlen += last_write_bytes;
+			free (out);
+			return (LDGZIP_ERRNO);
+		}
+		*outlen += last_write_bytes;
+
+		/* update access log stats */
+		access_log_def_outlen(*outlen);
+
+		// If we are sending a big file down a slow line, we
+		// need to reset the alarm once a while.
+		if (ConnTimeout)
+			alarm(ConnTimeout);
+	}
+
+	free (out);
+	return (LDGZIP_OK);
+}
+
+/* Decompress inlen bytes of gzip data from source into a newly-allocated *dest.
+ * The output buffer is sized from the gzip trailer (ISIZE), which is only
+ * a hint (it comes from the sender): it is capped by max_growth (or by an
+ * initial guess, without limit) and the buffer is grown (and the data
+ * decompressed again) only if the data really needs more.
+ * *dest is allocated with one extra byte, so htmlopt may add its '\0'.
+ * max_growth (in %) is the maximum allowable uncompressed size relative
+ * 	to inlen, if exceeded nothing is decompressed
+ * 	if max_growth==0 then there will be no limit (other than memory
+ * 	and the maximum ratio of deflate itself)
+ * returns: LDGZIP_OK (*dest and *outlen are defined) or an error
+ * 	(in this case, *dest is unchanged).
+ * 	LDGZIP_FALLBACK is returned for data which cannot be decompressed
+ * 	in one shot (multiple gzip members, data > 4GB, broken data),
+ * 	zlib should be used then. */
+int ldgunzip_memory_memory (const char *source, ZP_DATASIZE_TYPE inlen, char **dest, ZP_DATASIZE_TYPE *outlen, int max_growth)
+{
+	struct libdeflate_decompressor *decompressor;
+	const unsigned char *trailer;
+	ZP_DATASIZE_TYPE isize;
+	ZP_DATASIZE_TYPE max_outlen;
+	ZP_DATASIZE_TYPE buf_len;
+	size_t actual_in_len, actual_out_len;
+	char *buf, *new_buf;
+	enum libdeflate_result result;
+
+	/* gzip header (10) + empty deflate data (2) + trailer (8) */
+	if (inlen < 20)
+		return (LDGZIP_FALLBACK);
+
+	if (max_growth != 0)
+		max_outlen = (inlen * max_growth) / 100;
+	else
+		max_outlen = inlen * DEFLATE_MAX_RATIO;
+
+	/* uncompressed size (modulo 2^32), little endian.
+	 * the sender may lie, so it's only used as the initial buffer size */
+	trailer = (const unsigned char *) source + inlen - 4;
+	isize = (ZP_DATASIZE_TYPE) trailer [0] | ((ZP_DATASIZE_TYPE) trailer [1] << 8) | ((ZP_DATASIZE_TYPE) trailer [2] << 16) | ((ZP_DATASIZE_TYPE) trailer [3] << 24);
+	if (max_growth != 0)
+		buf_len = (isize > max_outlen) ? max_outlen : isize;
+	else
+		buf_len = (isize > ((inlen * 4) + BUFSIZE)) ? ((inlen * 4) + BUFSIZE) : isize;
+
+	if ((buf = malloc (buf_len + 1)) == NULL)
+		return (LDGZIP_MEM_ERROR);
+	if ((decompressor = libdeflate_alloc_decompressor ()) == NULL) {
+		free (buf);
+		return (LDGZIP_MEM_ERROR);
+	}
+
+	while ((result = libdeflate_gzip_decompress_ex (decompressor, source, inlen, buf, buf_len, &actual_in_len, &actual_out_len)) == LIBDEFLATE_INSUFFICIENT_SPACE) {
+		if (buf_len >= max_outlen) {
+			libdeflate_free_decompressor (decompressor);
+			free (buf);
+			/* without a ratio limit that's not valid deflate data, let zlib report it */
+			return ((max_growth != 0) ? LDGZIP_RATIO_EXCEEDED : LDGZIP_FALLBACK);
+		}
+
+		/* ISIZE was wrong, grow and try again */
+		buf_len = (buf_len < BUFSIZE) ? BUFSIZE : (buf_len * 2);
+		if (buf_len > max_outlen)
+			buf_len = max_outlen;
+		if ((new_buf = realloc (buf, buf_len + 1)) == NULL) {
+			libdeflate_free_decompressor (decompressor);
+			free (buf);
+			return (LDGZIP_MEM_ERROR);
+		}
+		buf = new_buf;
+	}
+	libdeflate_free_decompressor (decompressor);
+
+	/* anything not matching exactly (ex: more members after the first one) is left to zlib */
+	if ((result != LIBDEFLATE_SUCCESS) || (actual_in_len != inlen)) {
+		free (buf);
+		return (LDGZIP_FALLBACK);
+	}
+	if ((max_growth != 0) && (actual_out_len > max_outlen)) {
+		free (buf);
+		return (LDGZIP_RATIO_EXCEEDED);
+	}
+
+	*outlen = actual_out_len;
+	*dest = buf;
+	return (LDGZIP_OK);
+}
+
+#endif
+
@@ -79,6 +79,7 @@ static char *accesslog_username = NULL;
 static char *accesslog_method = NULL;
 static char *accesslog_url = NULL;
 static ZP_FLAGS accesslog_flags;
+static int accesslog_gzip_level = 0;	/* 0: not logged */
 ZP_DATASIZE_TYPE accesslog_inlen;
 ZP_DATASIZE_TYPE accesslog_outlen;
 
@@ -232,6 +233,7 @@ void access_log_reset (void)
 	accesslog_inlen = 0;
 	accesslog_outlen = 0;
 	accesslog_flags = LOG_AC_FLAG_NONE;
+	accesslog_gzip_level = 0;
 }
 
 static void access_log_redefine_str_var (const char *given_str, char **given_var)
@@ -278,6 +280,12 @@ void access_log_define_url (const char *url)
 	access_log_redefine_str_var (url, &accesslog_url);
 }
 
+/* gzip level chosen for this request (when adaptive), 0 if not applicable */
+void access_log_define_gzip_level (int gzip_level)
+{
+	accesslog_gzip_level = gzip_level;
+}
+
 /* al_flags will be OR'ed to the current accesslog_flags */
 void access_log_set_flags (ZP_FLAGS given_flags)
 {
@@ -338,6 +346,10 @@ void access_log_dump_entry (void)
 	if (accesslog_flags & LOG_AC_FLAG_URL_NOTPROC) strcat (flags_str, "N");
 	if (accesslog_flags & LOG_AC_FLAG_TOOBIG_NOMEM) strcat (flags_str, "W");
 	if (accesslog_flags & LOG_AC_FLAG_REPLACED_DATA) strcat (flags_str, "R");
+	if (accesslog_flags & LOG_AC_FLAG_NEGCACHE_SKIP) strcat (flags_str, "C");
+	if (accesslog_flags & LOG_AC_FLAG_COALESCED) strcat (flags_str, "F");
+	if (accesslog_flags & LOG_AC_FLAG_MINIFIED_JS) strcat (flags_str, "J");
+	if (accesslog_flags & LOG_AC_FLAG_MINIFIED_CSS) strcat (flags_str, "Y");
 	if (accesslog_flags & LOG_AC_FLAG_SIGSEGV) strcat (flags_str, "1");
 	if (accesslog_flags & LOG_AC_FLAG_SIGFPE) strcat (flags_str, "2");
 	if (accesslog_flags & LOG_AC_FLAG_SIGILL) strcat (flags_str, "3");
@@ -345,6 +357,8 @@ void access_log_dump_entry (void)
 	if (accesslog_flags & LOG_AC_FLAG_SIGSYS) strcat (flags_str, "5");
 	if (accesslog_flags & LOG_AC_FLAG_SIGTERM) strcat (flags_str, "X");
 	if (accesslog_flags & LOG_AC_SOFTWARE_BUG) strcat (flags_str, "*");
+	if (accesslog_gzip_level > 0)
+		sprintf (flags_str + strlen (flags_str), "g%d", accesslog_gzip_level);
 
 	client_source [255] = '\0';
 	snprintf (client_source, 255, "%s%s%s", has_username?accesslog_username:"", has_username?"@":"", has_client_addr?accesslog_client_addr:"?");
@@ -86,6 +86,10 @@ extern ZP_DATASIZE_TYPE accesslog_outlen;	/* PRIVATE */
 #define LOG_AC_FLAG_SIGBUS			1 << 24 /* 4 - SIGBUS received */
 #define LOG_AC_FLAG_SIGSYS			1 << 25 /* 5 - SIGSYS received */
 #define LOG_AC_FLAG_SIGTERM			1 << 26 /* X - SIGTERM received */
+#define LOG_AC_FLAG_NEGCACHE_SKIP		1 << 27 /* C - not processed, negative cache */
+#define LOG_AC_FLAG_COALESCED			1 << 28 /* F - result of identical concurrent request */
+#define LOG_AC_FLAG_MINIFIED_JS			1 << 29 /* J - JS not processed, already minified */
+#define LOG_AC_FLAG_MINIFIED_CSS		1 << 30 /* Y - CSS not processed, already minified */
 
 extern int debug_log_init (const char *debuglog_filename);
 extern int debug_log_printf (char *fmt, ...);
@@ -101,6 +105,7 @@ extern void access_log_define_client_adrr (const char *client_addr);
 extern void access_log_define_username (const char *username);
 extern void access_log_define_method (const char *method);
 extern void access_log_define_url (const char *url);
+extern void access_log_define_gzip_level (int gzip_level);
 extern void access_log_set_flags (ZP_FLAGS given_flags);
 extern void access_log_unset_flags (ZP_FLAGS given_flags);
 extern ZP_FLAGS access_log_get_flags (void);
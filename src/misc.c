@@ -72,3 +72,15 @@ void misc_convert_str_tolower (const char *in_str, char *out_str)
 	*out_pos = '\0';
 }
 
+/* FNV-1a 64bit hash of in_str, continuing from in_hash.
+   Use MISC_HASH_INIT as in_hash for a new hash.
+   Several strings may be hashed together by chaining calls. */
+unsigned long long int misc_hash_str (unsigned long long int in_hash, const char *in_str)
+{
+	while (*in_str != '\0') {
+		in_hash ^= (unsigned char) *(in_str++);
+		in_hash *= 1099511628211ULL;
+	}
+	return (in_hash);
+}
+
@@ -29,6 +29,10 @@
 
 extern void misc_cleanup_string (const char *in_str, char *out_str);
 extern void misc_convert_str_tolower (const char *in_str, char *out_str);
+extern unsigned long long int misc_hash_str (unsigned long long int in_hash, const char *in_str);
+
+/* initial value for misc_hash_str() */
+#define MISC_HASH_INIT 14695981039346656037ULL
 
 #endif
 
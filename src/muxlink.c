@@ -0,0 +1,959 @@
+/* muxlink.c
+ * Multiplexed link between two Ziproxies
+ *
+ * Ziproxy - the HTTP acceleration proxy
+ * This code is under the following conditions:
+ *
+ * ---------------------------------------------------------------------
+ * Copyright (c)2005-2014 Daniel Mealha Cabrita
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111 USA
+ * ---------------------------------------------------------------------
+ */
+
+/*
+ * When two Ziproxies are chained over an expensive link, every request
+ * would otherwise cost a new TCP connection over it (handshake, slow start).
+ * Instead, a dedicated process at each end keeps a few long-lived TCP
+ * connections (links) and carries every request/response over them as
+ * a stream of frames.
+ *
+ * - near end (MuxLinkConnections): the request processes connect to
+ *   a local port (127.0.0.1) instead of NextProxy. Each such connection
+ *   becomes a stream over the least busy link to NextProxy:MuxLinkNextPort.
+ * - far end (MuxLinkListenPort): accepts links and hands every new stream
+ *   to a request process, just like a regular client connection.
+ *
+ * Frame: type (1 byte), reserved (1), payload length (2), stream id (4),
+ * followed by the payload. Integers in network byte order.
+ * The HTTP headers of each stream (everything up to the first empty line,
+ * in each direction) are sent as HEADERS frames, compressed with a single
+ * zlib stream per link direction. Thus the headers repeated in every
+ * request (User-Agent, Cookie, etc) cost very little after the first time.
+ * The rest is sent as DATA frames, unmodified (the body is processed
+ * and compressed by the far Ziproxy, as usual).
+ *
+ * Flow control: each end may send up to MUXLINK_INITIAL_WINDOW bytes of
+ * a stream, plus what the other end allows with WINDOW frames as it
+ * delivers the data. A slow client does not stall the other streams.
+ *
+ * Priority: the local data is only read while the link has little data
+ * queued, and the higher-priority streams (HTML, CSS, JS) are read first.
+ * The priority is decided by the near end and sent with OPEN.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <zlib.h>
+
+#include "muxlink.h"
+#include "cfgfile.h"
+#include "log.h"
+#include "shdict.h"
+
+/* from netd.c */
+extern int proxy_handlereq (SOCKET sock_client, const char *client_addr, struct sockaddr_in *socket_host);
+
+#define MUXLINK_MAGIC		"ZPMUX1\n"
+#define MUXLINK_MAGIC_LEN	7
+#define MUXLINK_FRAME_HDR	8
+#define MUXLINK_MAX_PAYLOAD	16384
+#define MUXLINK_INITIAL_WINDOW	65536
+#define MUXLINK_MAX_LINKS	16	/* links accepted by the far end */
+#define MUXLINK_MAX_STREAMS	1024
+#define MUXLINK_HIGHWATER	(4 * MUXLINK_MAX_PAYLOAD)	/* queued in a link before reading more local data */
+#define MUXLINK_PRIORITIES	3	/* 0: highest */
+
+/* frame types */
+#define MUXF_OPEN	1	/* (near -> far) new stream, payload: priority (1 byte) */
+#define MUXF_HEADERS	2	/* compressed headers */
+#define MUXF_DATA	3
+#define MUXF_WINDOW	4	/* payload: window increment (4 bytes) */
+#define MUXF_CLOSE	5	/* no more data from this end */
+#define MUXF_RESET	6	/* stream aborted */
+
+#define LINK_DOWN	0
+#define LINK_CONNECTING	1
+#define LINK_UP		2
+
+typedef struct {
+	unsigned char *data;
+	size_t len;
+	size_t size;
+} t_muxbuf;
+
+typedef struct {
+	int fd;
+	int state;
+	int magic_ok;		/* (far end) MUXLINK_MAGIC received */
+	t_muxbuf in, out;
+	z_stream zsend, zrecv;
+	unsigned int next_id;
+	int streams;
+	time_t retry_at;	/* (near end) when to reconnect */
+	char peer_addr [INET_ADDRSTRLEN];
+} t_muxlink;
+
+typedef struct {
+	int fd;			/* local socket (request process), -1: entry not in use */
+	int link;		/* -1: (near end) waiting for a link */
+	unsigned int id;
+	int priority;
+	int opened;		/* OPEN sent/received */
+	int local_eof;		/* nothing more from fd (CLOSE sent) */
+	int remote_eof;		/* CLOSE received */
+	int shut_wr;		/* fd shut down for writing */
+	int hdr_match;		/* chars of "\r\n\r\n" matched so far (data sent) */
+	int hdr_done;		/* headers sent, the rest is DATA */
+	long send_window;
+	long recv_credit;	/* delivered, but not acknowledged with WINDOW yet */
+	t_muxbuf out;		/* to be written to fd */
+	time_t created;
+} t_muxstream;
+
+static int listen_fd = -1;	/* near end: local (request processes), far end: links */
+static int local_port = 0;
+static pid_t mux_pid = 0;
+static time_t last_spawn = 0;
+static struct in_addr *addr_low, *addr_high;
+
+static t_muxlink links [MUXLINK_MAX_LINKS];
+static t_muxstream streams [MUXLINK_MAX_STREAMS];
+static struct sockaddr_in *req_socket_host;
+static int request_procs = 0;	/* far end: request processes running, limited by MaxActiveUserConnections */
+
+static int is_near_end (void)
+{
+	return (MuxLinkConnections > 0);
+}
+
+static int muxbuf_append (t_muxbuf *buf, const void *data, size_t len)
+{
+	unsigned char *new_data;
+	size_t new_size;
+
+	if (buf->len + len > buf->size) {
+		new_size = (buf->size == 0) ? MUXLINK_MAX_PAYLOAD : buf->size;
+		while (new_size < buf->len + len)
+			new_size *= 2;
+		if ((new_data = realloc (buf->data, new_size)) == NULL)
+			return (1);
+		buf->data = new_data;
+		buf->size = new_size;
+	}
+	memcpy (buf->data + buf->len, data, len);
+	buf->len += len;
+	return (0);
+}
+
+static void muxbuf_consume (t_muxbuf *buf, size_t len)
+{
+	memmove (buf->data, buf->data + len, buf->len - len);
+	buf->len -= len;
+}
+
+static void muxbuf_free (t_muxbuf *buf)
+{
+	if (buf->data != NULL)
+		free (buf->data);
+	buf->data = NULL;
+	buf->len = buf->size = 0;
+}
+
+static void set_nonblock (int fd)
+{
+	fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK);
+}
+
+/* creates the listening socket.
+ * must be called by the daemon, before dropping privileges.
+ * returns: ==0 ok, !=0 error */
+int muxlink_init (struct in_addr *in_addr_low, struct in_addr *in_addr_high)
+{
+	struct sockaddr_in sock_addr;
+	socklen_t addr_len = sizeof (sock_addr);
+	int so_val = 1;
+
+	addr_low = in_addr_low;
+	addr_high = in_addr_high;
+
+	if ((MuxLinkConnections == 0) && (MuxLinkListenPort == 0))
+		return (0);
+
+	memset (&sock_addr, 0, sizeof (sock_addr));
+	sock_addr.sin_family = AF_INET;
+	if (is_near_end ()) {
+		/* any free port, local only */
+		sock_addr.sin_port = 0;
+		sock_addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+	} else {
+		sock_addr.sin_port = htons (MuxLinkListenPort);
+		sock_addr.sin_addr.s_addr = INADDR_ANY;
+		if ((Address != NULL) && (*Address != '\0'))
+			sock_addr.sin_addr.s_addr = inet_addr (Address);
+	}
+
+	if ((listen_fd = socket (AF_INET, SOCK_STREAM, 0)) < 0)
+		return (1);
+	setsockopt (listen_fd, SOL_SOCKET, SO_REUSEADDR, &so_val, sizeof (so_val));
+	if ((bind (listen_fd, (struct sockaddr *) &sock_addr, sizeof (sock_addr)) != 0) || (listen (listen_fd, SOMAXCONN) != 0)) {
+		close (listen_fd);
+		listen_fd = -1;
+		return (1);
+	}
+
+	if (is_near_end ()) {
+		getsockname (listen_fd, (struct sockaddr *) &sock_addr, &addr_len);
+		local_port = ntohs (sock_addr.sin_port);
+	}
+	return (0);
+}
+
+/* port (at 127.0.0.1) to be used instead of NextProxy:NextPort,
+ * or 0 if there's no multiplexed link */
+int muxlink_local_port (void)
+{
+	return (local_port);
+}
+
+/* request processes don't need the listening socket */
+void muxlink_child_cleanup (void)
+{
+	if (listen_fd >= 0)
+		close (listen_fd);
+}
+
+/* (daemon) whether 'pid' was the link process (which will be restarted) */
+int muxlink_reaped (pid_t pid)
+{
+	if ((pid <= 0) || (pid != mux_pid))
+		return (0);
+
+	error_log_puts (LOGMT_WARN, LOGSS_DAEMON, "Multiplexed link process terminated.");
+	mux_pid = 0;
+	return (1);
+}
+
+static void send_frame (t_muxlink *link, int type, unsigned int id, const unsigned char *payload, int len)
+{
+	unsigned char hdr [MUXLINK_FRAME_HDR];
+
+	hdr [0] = type;
+	hdr [1] = 0;
+	hdr [2] = (len >> 8) & 0xff;
+	hdr [3] = len & 0xff;
+	hdr [4] = (id >> 24) & 0xff;
+	hdr [5] = (id >> 16) & 0xff;
+	hdr [6] = (id >> 8) & 0xff;
+	hdr [7] = id & 0xff;
+	muxbuf_append (&(link->out), hdr, MUXLINK_FRAME_HDR);
+	if (len > 0)
+		muxbuf_append (&(link->out), payload, len);
+}
+
+static void send_window_update (t_muxlink *link, unsigned int id, unsigned long increment)
+{
+	unsigned char payload [4];
+
+	payload [0] = (increment >> 24) & 0xff;
+	payload [1] = (increment >> 16) & 0xff;
+	payload [2] = (increment >> 8) & 0xff;
+	payload [3] = increment & 0xff;
+	send_frame (link, MUXF_WINDOW, id, payload, 4);
+}
+
+/* sends headers, compressed with the link's (persistent) zlib stream */
+static void send_compressed_headers (t_muxlink *link, unsigned int id, unsigned char *data, int len)
+{
+	unsigned char out [MUXLINK_MAX_PAYLOAD];
+	int produced;
+
+	link->zsend.next_in = data;
+	link->zsend.avail_in = len;
+	do {
+		link->zsend.next_out = out;
+		link->zsend.avail_out = MUXLINK_MAX_PAYLOAD;
+		deflate (&(link->zsend), Z_SYNC_FLUSH);
+		if ((produced = MUXLINK_MAX_PAYLOAD - link->zsend.avail_out) > 0)
+			send_frame (link, MUXF_HEADERS, id, out, produced);
+	} while (link->zsend.avail_out == 0);
+}
+
+static t_muxstream *find_stream (int link_idx, unsigned int id)
+{
+	int i;
+
+	for (i = 0; i < MUXLINK_MAX_STREAMS; i++) {
+		if ((streams [i].fd >= 0) && (streams [i].link == link_idx) && (streams [i].id == id))
+			return (&streams [i]);
+	}
+	return (NULL);
+}
+
+static t_muxstream *new_stream (int fd)
+{
+	int i;
+
+	for (i = 0; i < MUXLINK_MAX_STREAMS; i++) {
+		if (streams [i].fd < 0) {
+			memset (&streams [i], 0, sizeof (t_muxstream));
+			streams [i].fd = fd;
+			streams [i].link = -1;
+			streams [i].priority = 1;
+			streams [i].send_window = MUXLINK_INITIAL_WINDOW;
+			streams [i].created = time (NULL);
+			return (&streams [i]);
+		}
+	}
+	return (NULL);
+}
+
+static void free_stream (t_muxstream *stream)
+{
+	close (stream->fd);
+	stream->fd = -1;
+	muxbuf_free (&(stream->out));
+	if (stream->link >= 0)
+		links [stream->link].streams--;
+}
+
+/* aborts the stream, informing the other end */
+static void reset_stream (t_muxstream *stream)
+{
+	if ((stream->link >= 0) && stream->opened)
+		send_frame (&links [stream->link], MUXF_RESET, stream->id, NULL, 0);
+	free_stream (stream);
+}
+
+static void check_stream_done (t_muxstream *stream)
+{
+	if ((stream->out.len == 0) && stream->remote_eof && (! stream->shut_wr)) {
+		shutdown (stream->fd, SHUT_WR);
+		stream->shut_wr = 1;
+	}
+	if (stream->local_eof && stream->shut_wr)
+		free_stream (stream);
+}
+
+static int link_setup (t_muxlink *link, int fd)
+{
+	int so_val = 1;
+
+	memset (link, 0, sizeof (t_muxlink));
+	link->fd = fd;
+	link->next_id = 1;
+	set_nonblock (fd);
+	setsockopt (fd, IPPROTO_TCP, TCP_NODELAY, &so_val, sizeof (so_val));
+	setsockopt (fd, SOL_SOCKET, SO_KEEPALIVE, &so_val, sizeof (so_val));
+
+	if (deflateInit (&(link->zsend), Z_BEST_COMPRESSION) != Z_OK)
+		return (1);
+	if (inflateInit (&(link->zrecv)) != Z_OK) {
+		deflateEnd (&(link->zsend));
+		return (1);
+	}
+	return (0);
+}
+
+static void link_fail (int link_idx)
+{
+	t_muxlink *link = &links [link_idx];
+	int i;
+
+	for (i = 0; i < MUXLINK_MAX_STREAMS; i++) {
+		if ((streams [i].fd >= 0) && (streams [i].link == link_idx))
+			free_stream (&streams [i]);
+	}
+
+	if (link->state != LINK_DOWN) {
+		deflateEnd (&(link->zsend));
+		inflateEnd (&(link->zrecv));
+	}
+	close (link->fd);
+	muxbuf_free (&(link->in));
+	muxbuf_free (&(link->out));
+	link->fd = -1;
+	link->state = LINK_DOWN;
+	link->streams = 0;
+	link->retry_at = time (NULL) + 1;
+}
+
+/* (near end) (re)connects link 'link_idx' to NextProxy:MuxLinkNextPort */
+static void link_connect (int link_idx)
+{
+	t_muxlink *link = &links [link_idx];
+	struct addrinfo hints, *ai;
+	char port_str [16];
+	int fd;
+
+	link->retry_at = time (NULL) + 1;
+
+	memset (&hints, 0, sizeof (hints));
+	hints.ai_family = PF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	snprintf (port_str, sizeof (port_str), "%d", MuxLinkNextPort);
+	if (getaddrinfo (NextProxy, port_str, &hints, &ai) != 0)
+		return;
+
+	if ((fd = socket (ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0) {
+		freeaddrinfo (ai);
+		return;
+	}
+	if (link_setup (link, fd) != 0) {
+		close (fd);
+		link->fd = -1;
+		freeaddrinfo (ai);
+		return;
+	}
+
+	link->state = LINK_CONNECTING;
+	link->magic_ok = 1;	/* the far end sends no magic */
+	if (connect (fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+		link->state = LINK_UP;
+	} else if (errno != EINPROGRESS) {
+		link_fail (link_idx);
+	}
+	freeaddrinfo (ai);
+
+	if (link->state != LINK_DOWN)
+		muxbuf_append (&(link->out), MUXLINK_MAGIC, MUXLINK_MAGIC_LEN);
+}
+
+/* (near end) priority according to the requested URL:
+ * 0 - pages, CSS and JS (required for rendering), 2 - images and media, 1 - other */
+static int classify_request (const unsigned char *data, int len)
+{
+	char url [1024];
+	char *ext, *end;
+	const unsigned char *pos;
+	int i = 0;
+
+	/* second token of the request line */
+	if ((pos = memchr (data, ' ', len)) == NULL)
+		return (1);
+	for (pos++; (pos < data + len) && (*pos != ' ') && (*pos != '\r') && (*pos != '\n') && (i < (int) sizeof (url) - 1); pos++)
+		url [i++] = *pos;
+	url [i] = '\0';
+
+	if ((end = strpbrk (url, "?#")) != NULL)
+		*end = '\0';
+	if ((ext = strrchr (url, '.')) == NULL || (strchr (ext, '/') != NULL))
+		return (0);	/* no extension, probably a page */
+	ext++;
+
+	if ((strcasecmp (ext, "html") == 0) || (strcasecmp (ext, "htm") == 0) || (strcasecmp (ext, "css") == 0) || (strcasecmp (ext, "js") == 0))
+		return (0);
+	if ((strcasecmp (ext, "jpg") == 0) || (strcasecmp (ext, "jpeg") == 0) || (strcasecmp (ext, "png") == 0) || (strcasecmp (ext, "gif") == 0) \
+		|| (strcasecmp (ext, "webp") == 0) || (strcasecmp (ext, "ico") == 0) || (strcasecmp (ext, "mp4") == 0) || (strcasecmp (ext, "webm") == 0) \
+		|| (strcasecmp (ext, "mp3") == 0))
+		return (2);
+	return (1);
+}
+
+/* reads local data from the stream and sends it through the link */
+static void stream_read (t_muxstream *stream)
+{
+	t_muxlink *link = &links [stream->link];
+	unsigned char buf [MUXLINK_MAX_PAYLOAD];
+	int to_read = MUXLINK_MAX_PAYLOAD;
+	int read_len, hdr_len, i;
+
+	if (stream->send_window < to_read)
+		to_read = stream->send_window;
+
+	read_len = read (stream->fd, buf, to_read);
+	if (read_len < 0) {
+		if ((errno != EAGAIN) && (errno != EINTR))
+			reset_stream (stream);
+		return;
+	}
+
+	if (! stream->opened) {
+		unsigned char priority;
+
+		/* (near end) first data, open the stream */
+		stream->priority = classify_request (buf, read_len);
+		priority = stream->priority;
+		send_frame (link, MUXF_OPEN, stream->id, &priority, 1);
+		if (MuxLinkWindow > MUXLINK_INITIAL_WINDOW)
+			send_window_update (link, stream->id, MuxLinkWindow - MUXLINK_INITIAL_WINDOW);
+		stream->opened = 1;
+	}
+
+	if (read_len == 0) {
+		stream->local_eof = 1;
+		send_frame (link, MUXF_CLOSE, stream->id, NULL, 0);
+		check_stream_done (stream);
+		return;
+	}
+	stream->send_window -= read_len;
+
+	/* headers (up to and including the empty line) go compressed */
+	hdr_len = 0;
+	if (! stream->hdr_done) {
+		for (i = 0; (i < read_len) && (! stream->hdr_done); i++) {
+			if (buf [i] == "\r\n\r\n" [stream->hdr_match])
+				stream->hdr_match++;
+			else
+				stream->hdr_match = (buf [i] == '\r') ? 1 : 0;
+			if (stream->hdr_match == 4)
+				stream->hdr_done = 1;
+		}
+		hdr_len = i;
+		send_compressed_headers (link, stream->id, buf, hdr_len);
+	}
+	if (read_len > hdr_len)
+		send_frame (link, MUXF_DATA, stream->id, buf + hdr_len, read_len - hdr_len);
+}
+
+/* writes pending data to the stream's local socket */
+static void stream_write (t_muxstream *stream)
+{
+	int written;
+
+	written = write (stream->fd, stream->out.data, stream->out.len);
+	if (written < 0) {
+		if ((errno != EAGAIN) && (errno != EINTR))
+			reset_stream (stream);
+		return;
+	}
+	muxbuf_consume (&(stream->out), written);
+
+	/* let the other end send more */
+	stream->recv_credit += written;
+	if ((! stream->remote_eof) && ((stream->recv_credit >= MuxLinkWindow / 4) || (stream->out.len == 0))) {
+		send_window_update (&links [stream->link], stream->id, stream->recv_credit);
+		stream->recv_credit = 0;
+	}
+
+	check_stream_done (stream);
+}
+
+/* (far end) a new stream, handled by a new request process */
+static void stream_open (int link_idx, unsigned int id, int priority)
+{
+	t_muxstream *stream;
+	int sv [2];
+	int i;
+
+	/* same limit as for the regular connections (those are not counted by the daemon) */
+	if ((MaxActiveUserConnections > 0) && (request_procs >= MaxActiveUserConnections)) {
+		error_log_printf (LOGMT_WARN, LOGSS_DAEMON, "Multiplexed link: MaxActiveUserConnections limit reached (%d). Stream refused.\n", MaxActiveUserConnections);
+		send_frame (&links [link_idx], MUXF_RESET, id, NULL, 0);
+		return;
+	}
+	if ((find_stream (link_idx, id) != NULL) || (socketpair (AF_UNIX, SOCK_STREAM, 0, sv) != 0)) {
+		send_frame (&links [link_idx], MUXF_RESET, id, NULL, 0);
+		return;
+	}
+	if ((stream = new_stream (sv [0])) == NULL) {
+		close (sv [0]);
+		close (sv [1]);
+		send_frame (&links [link_idx], MUXF_RESET, id, NULL, 0);
+		return;
+	}
+
+	switch (fork ()) {
+	case 0:
+		/* CHILD: a regular request process */
+		signal (SIGPIPE, SIG_DFL);
+		close (listen_fd);
+		for (i = 0; i < MUXLINK_MAX_LINKS; i++) {
+			if (links [i].fd >= 0)
+				close (links [i].fd);
+		}
+		for (i = 0; i < MUXLINK_MAX_STREAMS; i++) {
+			if (streams [i].fd >= 0)
+				close (streams [i].fd);
+		}
+		exit (proxy_handlereq (sv [1], links [link_idx].peer_addr, req_socket_host));
+	case -1:
+		error_log_puts (LOGMT_ERROR, LOGSS_DAEMON, "Multiplexed link: fork() failed.");
+		close (sv [1]);
+		stream->fd = -1;
+		close (sv [0]);
+		send_frame (&links [link_idx], MUXF_RESET, id, NULL, 0);
+		return;
+	default:
+		close (sv [1]);
+		request_procs++;
+	}
+
+	set_nonblock (stream->fd);
+	stream->link = link_idx;
+	stream->id = id;
+	stream->priority = (priority < MUXLINK_PRIORITIES) ? priority : MUXLINK_PRIORITIES - 1;
+	stream->opened = 1;
+	links [link_idx].streams++;
+	if (MuxLinkWindow > MUXLINK_INITIAL_WINDOW)
+		send_window_update (&links [link_idx], id, MuxLinkWindow - MUXLINK_INITIAL_WINDOW);
+}
+
+/* processes one frame received from the link.
+ * returns: ==0 ok, !=0 protocol error (link must be closed) */
+static int process_frame (int link_idx, int type, unsigned int id, unsigned char *payload, int len)
+{
+	t_muxlink *link = &links [link_idx];
+	t_muxstream *stream;
+	unsigned char out [MUXLINK_MAX_PAYLOAD];
+	int produced, ret;
+
+	stream = find_stream (link_idx, id);
+
+	switch (type) {
+	case MUXF_OPEN:
+		if (is_near_end () || (len < 1))
+			return (1);
+		stream_open (link_idx, id, payload [0]);
+		break;
+	case MUXF_HEADERS:
+		/* always inflated, the zlib stream is shared by all streams */
+		link->zrecv.next_in = payload;
+		link->zrecv.avail_in = len;
+		do {
+			link->zrecv.next_out = out;
+			link->zrecv.avail_out = MUXLINK_MAX_PAYLOAD;
+			ret = inflate (&(link->zrecv), Z_SYNC_FLUSH);
+			if ((ret != Z_OK) && (ret != Z_BUF_ERROR))
+				return (1);
+			produced = MUXLINK_MAX_PAYLOAD - link->zrecv.avail_out;
+			if ((stream != NULL) && (produced > 0))
+				muxbuf_append (&(stream->out), out, produced);
+		} while ((link->zrecv.avail_out == 0) || ((link->zrecv.avail_in > 0) && (produced > 0)));
+		break;
+	case MUXF_DATA:
+		if (stream != NULL)
+			muxbuf_append (&(stream->out), payload, len);
+		break;
+	case MUXF_WINDOW:
+		if (len < 4)
+			return (1);
+		if (stream != NULL)
+			stream->send_window += ((unsigned long) payload [0] << 24) | (payload [1] << 16) | (payload [2] << 8) | payload [3];
+		break;
+	case MUXF_CLOSE:
+		if (stream != NULL) {
+			stream->remote_eof = 1;
+			check_stream_done (stream);
+		}
+		break;
+	case MUXF_RESET:
+		if (stream != NULL)
+			free_stream (stream);
+		break;
+	default:
+		return (1);
+	}
+	return (0);
+}
+
+static void link_read (int link_idx)
+{
+	t_muxlink *link = &links [link_idx];
+	unsigned char buf [MUXLINK_MAX_PAYLOAD];
+	unsigned char *frame;
+	unsigned int id;
+	int read_len, len;
+	size_t pos = 0;
+
+	read_len = read (link->fd, buf, sizeof (buf));
+	if (read_len <= 0) {
+		if ((read_len < 0) && ((errno == EAGAIN) || (errno == EINTR)))
+			return;
+		link_fail (link_idx);
+		return;
+	}
+	muxbuf_append (&(link->in), buf, read_len);
+
+	if (! link->magic_ok) {
+		if (link->in.len < MUXLINK_MAGIC_LEN)
+			return;
+		if (memcmp (link->in.data, MUXLINK_MAGIC, MUXLINK_MAGIC_LEN) != 0) {
+			error_log_printf (LOGMT_WARN, LOGSS_DAEMON, "Multiplexed link: invalid connection from %s.\n", link->peer_addr);
+			link_fail (link_idx);
+			return;
+		}
+		link->magic_ok = 1;
+		pos = MUXLINK_MAGIC_LEN;
+	}
+
+	while (link->in.len - pos >= MUXLINK_FRAME_HDR) {
+		frame = link->in.data + pos;
+		len = (frame [2] << 8) | frame [3];
+		if (link->in.len - pos < (size_t) (MUXLINK_FRAME_HDR + len))
+			break;
+		id = ((unsigned int) frame [4] << 24) | (frame [5] << 16) | (frame [6] << 8) | frame [7];
+		if (process_frame (link_idx, frame [0], id, frame + MUXLINK_FRAME_HDR, len) != 0) {
+			error_log_printf (LOGMT_WARN, LOGSS_DAEMON, "Multiplexed link: protocol error (%s).\n", is_near_end () ? NextProxy : link->peer_addr);
+			link_fail (link_idx);
+			return;
+		}
+		pos += MUXLINK_FRAME_HDR + len;
+	}
+	muxbuf_consume (&(link->in), pos);
+}
+
+static void link_write (int link_idx)
+{
+	t_muxlink *link = &links [link_idx];
+	int written;
+
+	if (link->state == LINK_CONNECTING) {
+		int so_error = 0;
+		socklen_t so_len = sizeof (so_error);
+
+		if ((getsockopt (link->fd, SOL_SOCKET, SO_ERROR, &so_error, &so_len) != 0) || (so_error != 0)) {
+			link_fail (link_idx);
+			return;
+		}
+		link->state = LINK_UP;
+		debug_log_printf ("Multiplexed link #%d connected.\n", link_idx);
+	}
+
+	if (link->out.len == 0)
+		return;
+	written = write (link->fd, link->out.data, link->out.len);
+	if (written < 0) {
+		if ((errno != EAGAIN) && (errno != EINTR))
+			link_fail (link_idx);
+		return;
+	}
+	muxbuf_consume (&(link->out), written);
+}
+
+/* accepts a new connection on listen_fd:
+ * near end: a request process (new stream), far end: a new link */
+static void accept_connection (void)
+{
+	struct sockaddr_in peer;
+	socklen_t peer_len = sizeof (peer);
+	uint32_t peer_host;
+	int fd, i;
+
+	if ((fd = accept (listen_fd, (struct sockaddr *) &peer, &peer_len)) < 0)
+		return;
+
+	if (is_near_end ()) {
+		set_nonblock (fd);
+		if (new_stream (fd) == NULL)
+			close (fd);
+		return;
+	}
+
+	/* same restriction as the regular port (OnlyFrom) */
+	if (addr_low->s_addr) {
+		peer_host = ntohl (peer.sin_addr.s_addr);
+		if ((peer_host < ntohl (addr_low->s_addr)) || (peer_host > ntohl (addr_high->s_addr))) {
+			error_log_printf (LOGMT_WARN, LOGSS_DAEMON, "Multiplexed link from %s refused.\n", inet_ntoa (peer.sin_addr));
+			close (fd);
+			return;
+		}
+	}
+
+	for (i = 0; i < MUXLINK_MAX_LINKS; i++) {
+		if (links [i].fd < 0)
+			break;
+	}
+	if (i == MUXLINK_MAX_LINKS) {
+		error_log_printf (LOGMT_WARN, LOGSS_DAEMON, "Multiplexed link from %s refused (too many links).\n", inet_ntoa (peer.sin_addr));
+		close (fd);
+		return;
+	}
+	if (link_setup (&links [i], fd) != 0) {
+		close (fd);
+		links [i].fd = -1;
+		return;
+	}
+	links [i].state = LINK_UP;
+	inet_ntop (AF_INET, &(peer.sin_addr), links [i].peer_addr, sizeof (links [i].peer_addr));
+	debug_log_printf ("Multiplexed link from %s accepted.\n", links [i].peer_addr);
+}
+
+/* (near end) assigns the streams waiting for a link to the least busy one */
+static void assign_streams (void)
+{
+	time_t now = time (NULL);
+	int i, j, best;
+
+	for (i = 0; i < MUXLINK_MAX_STREAMS; i++) {
+		if ((streams [i].fd < 0) || (streams [i].link >= 0))
+			continue;
+
+		best = -1;
+		for (j = 0; j < MuxLinkConnections; j++) {
+			if ((links [j].state == LINK_UP) && ((best < 0) || (links [j].streams < links [best].streams)))
+				best = j;
+		}
+		if (best < 0) {
+			/* no link available for too long, give up (request process gets no response) */
+			if ((ConnTimeout > 0) && ((now - streams [i].created) > ConnTimeout))
+				free_stream (&streams [i]);
+			continue;
+		}
+
+		streams [i].link = best;
+		streams [i].id = links [best].next_id++;
+		links [best].streams++;
+	}
+}
+
+/* link process main loop, never returns */
+static void muxlink_run (void)
+{
+	static struct pollfd pfds [1 + MUXLINK_MAX_LINKS + MUXLINK_MAX_STREAMS];
+	static int pfd_stream [1 + MUXLINK_MAX_LINKS + MUXLINK_MAX_STREAMS];	/* <0: -(link+1), otherwise stream */
+	int nfds, i, j, p, idx;
+	time_t now;
+
+	for (i = 0; i < MUXLINK_MAX_LINKS; i++)
+		links [i].fd = -1;
+	for (i = 0; i < MUXLINK_MAX_STREAMS; i++)
+		streams [i].fd = -1;
+
+	while (1) {
+		now = time (NULL);
+
+		if (is_near_end ()) {
+			for (i = 0; i < MuxLinkConnections; i++) {
+				if ((links [i].state == LINK_DOWN) && (now >= links [i].retry_at))
+					link_connect (i);
+			}
+			assign_streams ();
+		}
+
+		/* what to watch */
+		nfds = 0;
+		pfds [nfds].fd = listen_fd;
+		pfds [nfds].events = POLLIN;
+		pfd_stream [nfds++] = 0;
+		for (i = 0; i < MUXLINK_MAX_LINKS; i++) {
+			if (links [i].fd < 0)
+				continue;
+			pfds [nfds].fd = links [i].fd;
+			pfds [nfds].events = (links [i].state == LINK_UP) ? POLLIN : 0;
+			if ((links [i].state == LINK_CONNECTING) || (links [i].out.len > 0))
+				pfds [nfds].events |= POLLOUT;
+			pfd_stream [nfds++] = -(i + 1);
+		}
+		for (i = 0; i < MUXLINK_MAX_STREAMS; i++) {
+			if ((streams [i].fd < 0) || (streams [i].link < 0))
+				continue;
+			pfds [nfds].fd = streams [i].fd;
+			pfds [nfds].events = 0;
+			if ((! streams [i].local_eof) && (streams [i].send_window > 0) && \
+				(links [streams [i].link].state == LINK_UP) && (links [streams [i].link].out.len < MUXLINK_HIGHWATER))
+				pfds [nfds].events |= POLLIN;
+			if (streams [i].out.len > 0)
+				pfds [nfds].events |= POLLOUT;
+			pfd_stream [nfds++] = i;
+		}
+
+		if (poll (pfds, nfds, 1000) > 0) {
+			if (pfds [0].revents & POLLIN)
+				accept_connection ();
+
+			/* links first, they may free streams */
+			for (j = 1; (j < nfds) && (pfd_stream [j] < 0); j++) {
+				idx = -(pfd_stream [j]) - 1;
+				if ((pfds [j].revents & (POLLOUT | POLLERR | POLLHUP)) && (links [idx].fd >= 0))
+					link_write (idx);
+				if ((pfds [j].revents & (POLLIN | POLLERR | POLLHUP)) && (links [idx].fd >= 0) && (links [idx].state == LINK_UP))
+					link_read (idx);
+			}
+
+			/* deliver pending data to the request processes */
+			for (; j < nfds; j++) {
+				idx = pfd_stream [j];
+				if ((pfds [j].revents & (POLLOUT | POLLERR | POLLHUP)) && (streams [idx].fd == pfds [j].fd) && (streams [idx].out.len > 0))
+					stream_write (&streams [idx]);
+			}
+
+			/* read local data, higher priority first, while the link is not congested */
+			for (p = 0; p < MUXLINK_PRIORITIES; p++) {
+				for (j = 1; j < nfds; j++) {
+					if ((idx = pfd_stream [j]) < 0)
+						continue;
+					if ((! (pfds [j].revents & (POLLIN | POLLERR | POLLHUP))) || (streams [idx].fd != pfds [j].fd) || (streams [idx].priority != p))
+						continue;
+					if ((streams [idx].link < 0) || (streams [idx].local_eof) || (links [streams [idx].link].out.len >= MUXLINK_HIGHWATER))
+						continue;
+					stream_read (&streams [idx]);
+				}
+			}
+		}
+
+		/* collect terminated request processes (far end) */
+		while (waitpid (-1, NULL, WNOHANG) > 0)
+			request_procs--;
+
+#ifdef ZSTD
+		/* new request processes inherit the shared dictionary from us */
+		shdict_refresh ();
+#endif
+	}
+}
+
+/* (daemon) starts the link process, if not running.
+ * socket_host is passed to the request processes (BindOutgoing) */
+void muxlink_check (SOCKET sock_listen, struct sockaddr_in *socket_host)
+{
+	pid_t pid;
+
+	if ((listen_fd < 0) || (mux_pid > 0))
+		return;
+
+	/* don't loop too fast if it keeps dying */
+	if (time (NULL) == last_spawn)
+		return;
+	last_spawn = time (NULL);
+
+	switch (pid = fork ()) {
+	case 0:
+		signal (SIGTERM, SIG_DFL);
+		signal (SIGPIPE, SIG_IGN);
+		close (sock_listen);
+		req_socket_host = socket_host;
+		muxlink_run ();
+		exit (0);
+	case -1:
+		error_log_puts (LOGMT_ERROR, LOGSS_DAEMON, "Unable to fork() the multiplexed link process.");
+		break;
+	default:
+		mux_pid = pid;
+		if (is_near_end ())
+			error_log_printf (LOGMT_INFO, LOGSS_DAEMON, "Multiplexed link process started (%d links to %s:%d).\n", MuxLinkConnections, NextProxy, MuxLinkNextPort);
+		else
+			error_log_printf (LOGMT_INFO, LOGSS_DAEMON, "Multiplexed link process started (port: %d).\n", MuxLinkListenPort);
+	}
+}
+
@@ -0,0 +1,42 @@
+/* muxlink.h
+ * Multiplexed link between two Ziproxies
+ *
+ * Ziproxy - the HTTP acceleration proxy
+ * This code is under the following conditions:
+ *
+ * ---------------------------------------------------------------------
+ * Copyright (c)2005-2014 Daniel Mealha Cabrita
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111 USA
+ * ---------------------------------------------------------------------
+ */
+
+//To stop multiple inclusions.
+#ifndef SRC_MUXLINK_H
+#define SRC_MUXLINK_H
+
+#include <sys/types.h>
+#include <netinet/in.h>
+
+#include "globaldefs.h"
+
+extern int muxlink_init (struct in_addr *in_addr_low, struct in_addr *in_addr_high);
+extern void muxlink_check (SOCKET sock_listen, struct sockaddr_in *socket_host);
+extern int muxlink_reaped (pid_t pid);
+extern void muxlink_child_cleanup (void);
+extern int muxlink_local_port (void);
+
+#endif //SRC_MUXLINK_H
+
@@ -0,0 +1,266 @@
+/* negcache.c
+ * Negative-result cache (objects not worth processing).
+ *
+ * Ziproxy - the HTTP acceleration proxy
+ * This code is under the following conditions:
+ *
+ * ---------------------------------------------------------------------
+ * Copyright (c)2005-2014 Daniel Mealha Cabrita
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111 USA
+ * ---------------------------------------------------------------------
+ */
+
+/*
+ * Objects which, once processed, turned out not to shrink (image too expansive,
+ * no viable target format, gzip output not smaller than input, etc) are
+ * recorded here, so the next request for the very same object is streamed
+ * untouched instead of burning CPU for nothing.
+ *
+ * Each request is served by its own process, so the tables live in a shared
+ * anonymous mapping created by the daemon before forking.
+ * There's no locking: concurrent updates may, at worst, cause an object to be
+ * processed once more (or skipped once more) than it should.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+
+#include "globaldefs.h"
+#include "negcache.h"
+#include "log.h"
+#include "misc.h"
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+#define NEGCACHE_WAYS 8			/* entries probed per lookup */
+#define NEGCACHE_LEARN_SLOTS 1024	/* host/content-type statistics slots */
+#define NEGCACHE_LEARN_PROBE 16		/* one in N learned skips is processed anyway, to keep stats current */
+#define NEGCACHE_LEARN_MAX_TRIED 4096	/* stats are halved when reaching this, so older results fade */
+
+typedef struct {
+	unsigned long long int key;	/* 0 == empty */
+	time_t expires;
+} t_negcache_entry;
+
+typedef struct {
+	unsigned long long int key;
+	unsigned int tried;
+	unsigned int failed;
+	unsigned int skipped;
+} t_negcache_stat;
+
+typedef struct {
+	unsigned long int hits_url;
+	unsigned long int hits_learned;
+	unsigned long int added;
+	t_negcache_stat stat [NEGCACHE_LEARN_SLOTS];
+} t_negcache_shared;
+
+/* shared among all processes */
+static t_negcache_shared *negcache = NULL;
+static t_negcache_entry *negcache_entry;
+
+static int negcache_entries;
+static int negcache_ttl;
+static int negcache_learn_samples;
+static int negcache_learn_ratio;
+
+/* object being served by this process */
+static unsigned long long int current_key = 0;	/* 0 == not cacheable */
+static t_negcache_stat *current_stat = NULL;	/* NULL == not learning */
+
+static unsigned long long int negcache_hash_pair (const char *str_a, const char *str_b)
+{
+	unsigned long long int hash;
+
+	hash = misc_hash_str (MISC_HASH_INIT, str_a);
+	hash = misc_hash_str (hash, "\n");
+	hash = misc_hash_str (hash, str_b);
+
+	/* 0 is reserved for 'empty' */
+	if (hash == 0)
+		hash = 1;
+	return (hash);
+}
+
+/* must be invoked by the daemon before forking, in order to share the tables.
+ * if not invoked, the negative cache remains disabled.
+ * in_entries: max URLs in the cache (0: disabled)
+ * in_ttl: seconds an URL stays in the cache
+ * in_learn_samples: min processed objects of a host/content-type before skipping those (0: disabled)
+ * in_learn_ratio: min percentage of failures (of a host/content-type) before skipping those
+ * returns: 0 - ok, != 0 - unable to allocate shared memory (remains disabled) */
+int negcache_init (const int in_entries, const int in_ttl, const int in_learn_samples, const int in_learn_ratio)
+{
+	size_t shared_size;
+	void *shared;
+
+	if ((in_entries <= 0) && (in_learn_samples <= 0))
+		return (0);
+
+	shared_size = sizeof (t_negcache_shared) + (sizeof (t_negcache_entry) * in_entries);
+	if ((shared = mmap (NULL, shared_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+		return (1);
+
+	/* anonymous mappings are zero-filled, all entries start empty */
+	negcache = (t_negcache_shared *) shared;
+	negcache_entry = (t_negcache_entry *) (negcache + 1);
+
+	negcache_entries = in_entries;
+	negcache_ttl = in_ttl;
+	negcache_learn_samples = in_learn_samples;
+	negcache_learn_ratio = in_learn_ratio;
+
+	return (0);
+}
+
+/* checks whether the object about to be served is known (or expected) not to be worth processing.
+ * this also defines the object to be referred by further negcache_add() and negcache_learn() calls.
+ * in_etag, in_last_modified: header values, NULL if not present
+ * in_content_length: -1 if unknown
+ * returns: NEGCACHE_MISS, NEGCACHE_HIT_URL or NEGCACHE_HIT_LEARNED */
+int negcache_check (const char *in_url, const char *in_host, const char *in_content_type, const char *in_etag, const char *in_last_modified, const ZP_DATASIZE_TYPE in_content_length)
+{
+	char content_length_str [32];
+	const char *validator = NULL;
+	t_negcache_entry *curr_entry;
+	t_negcache_stat *curr_stat;
+	unsigned long long int key;
+	time_t now;
+	int i;
+
+	current_key = 0;
+	current_stat = NULL;
+
+	if ((negcache == NULL) || (in_url == NULL))
+		return (NEGCACHE_MISS);
+
+	if (negcache_entries > 0) {
+		/* without something telling whether the object has changed,
+		 * we'd keep skipping an object which may be processable now */
+		if (in_etag != NULL) {
+			validator = in_etag;
+		} else if (in_last_modified != NULL) {
+			validator = in_last_modified;
+		} else if (in_content_length >= 0) {
+			snprintf (content_length_str, sizeof (content_length_str), "%"ZP_DATASIZE_STR, in_content_length);
+			validator = content_length_str;
+		}
+
+		if (validator != NULL) {
+			current_key = negcache_hash_pair (in_url, validator);
+			now = time (NULL);
+
+			for (i = 0; i < NEGCACHE_WAYS; i++) {
+				curr_entry = &negcache_entry [(current_key + i) % negcache_entries];
+				if ((curr_entry->key == current_key) && (curr_entry->expires > now)) {
+					negcache->hits_url++;
+					return (NEGCACHE_HIT_URL);
+				}
+			}
+		}
+	}
+
+	if ((negcache_learn_samples > 0) && (in_host != NULL) && (in_content_type != NULL)) {
+		key = negcache_hash_pair (in_host, in_content_type);
+		curr_stat = &(negcache->stat [key % NEGCACHE_LEARN_SLOTS]);
+
+		/* slot was empty or used by something else, start over */
+		if (curr_stat->key != key) {
+			curr_stat->key = key;
+			curr_stat->tried = 0;
+			curr_stat->failed = 0;
+			curr_stat->skipped = 0;
+		}
+		current_stat = curr_stat;
+
+		if ((curr_stat->tried >= negcache_learn_samples) && ((curr_stat->failed * 100) >= (curr_stat->tried * negcache_learn_ratio))) {
+			if ((++(curr_stat->skipped) % NEGCACHE_LEARN_PROBE) != 0) {
+				current_stat = NULL;
+				negcache->hits_learned++;
+				return (NEGCACHE_HIT_LEARNED);
+			}
+			debug_log_puts ("NegCache: Processing learned-negative object anyway, as a probe.");
+		}
+	}
+
+	return (NEGCACHE_MISS);
+}
+
+/* records the object (defined by the last negcache_check()) as not worth processing */
+void negcache_add (void)
+{
+	t_negcache_entry *curr_entry;
+	t_negcache_entry *victim = NULL;
+	time_t now;
+	int i;
+
+	if ((negcache == NULL) || (current_key == 0))
+		return;
+
+	now = time (NULL);
+
+	/* same key, otherwise empty/expired, otherwise the one to expire sooner */
+	for (i = 0; i < NEGCACHE_WAYS; i++) {
+		curr_entry = &negcache_entry [(current_key + i) % negcache_entries];
+		if (curr_entry->key == current_key) {
+			victim = curr_entry;
+			break;
+		}
+		if ((victim == NULL) || (victim->expires > curr_entry->expires))
+			victim = curr_entry;
+	}
+
+	victim->key = current_key;
+	victim->expires = now + negcache_ttl;
+	negcache->added++;
+
+	debug_log_puts ("NegCache: Object added to negative cache.");
+}
+
+/* updates the host/content-type stats with the processing result
+ * of the object (defined by the last negcache_check()).
+ * in_failed: != 0 processing was not worth it */
+void negcache_learn (const int in_failed)
+{
+	if (current_stat == NULL)
+		return;
+
+	if (current_stat->tried >= NEGCACHE_LEARN_MAX_TRIED) {
+		current_stat->tried /= 2;
+		current_stat->failed /= 2;
+	}
+	current_stat->tried++;
+	if (in_failed)
+		current_stat->failed++;
+
+	/* only once per object */
+	current_stat = NULL;
+}
+
+void negcache_debug_stats (void)
+{
+	if (negcache == NULL)
+		return;
+
+	debug_log_printf ("NegCache: Skipped so far: %lu (URL), %lu (learned). Added so far: %lu.\n", negcache->hits_url, negcache->hits_learned, negcache->added);
+}
+
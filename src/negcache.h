@@ -0,0 +1,44 @@
+/* negcache.h
+ * Negative-result cache (objects not worth processing).
+ *
+ * Ziproxy - the HTTP acceleration proxy
+ * This code is under the following conditions:
+ *
+ * ---------------------------------------------------------------------
+ * Copyright (c)2005-2014 Daniel Mealha Cabrita
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111 USA
+ * ---------------------------------------------------------------------
+ */
+
+// To stop multiple inclusions.
+#ifndef SRC_NEGCACHE_H
+#define SRC_NEGCACHE_H
+
+#include "globaldefs.h"
+
+/* negcache_check() return codes */
+#define NEGCACHE_MISS		0
+#define NEGCACHE_HIT_URL	1	/* this very object (URL+validator) was not worth processing */
+#define NEGCACHE_HIT_LEARNED	2	/* objects from this host/content-type are usually not worth processing */
+
+extern int negcache_init (const int in_entries, const int in_ttl, const int in_learn_samples, const int in_learn_ratio);
+extern int negcache_check (const char *in_url, const char *in_host, const char *in_content_type, const char *in_etag, const char *in_last_modified, const ZP_DATASIZE_TYPE in_content_length);
+extern void negcache_add (void);
+extern void negcache_learn (const int in_failed);
+extern void negcache_debug_stats (void);
+
+#endif //SRC_NEGCACHE_H
+
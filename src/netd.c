@@ -83,6 +83,14 @@
 #include "ziproxy.h"
 #include "txtfiletools.h"
 #include "session.h"
+#include "negcache.h"
+#include "imgdims.h"
+#include "coalesce.h"
+#include "zstdpipe.h"
+#include "shdict.h"
+#include "muxlink.h"
+#include "preemptdns.h"
+#include "prefetch.h"
 
 int	proxy_server ();
 int	proxy_handlereq (SOCKET sock_client, const char *client_addr, struct sockaddr_in *socket_host);
@@ -363,6 +371,7 @@ int proxy_server(struct in_addr *addr_low, struct in_addr *addr_high)
 	int which_BindOutgoing = 0;
 	struct sockaddr_in pre_socket_host;
 	struct sockaddr_in *socket_host = NULL;
+	pid_t pid;
 
 	if (BindOutgoing_entries != 0)
 		socket_host = &pre_socket_host;
@@ -396,6 +405,15 @@ int proxy_server(struct in_addr *addr_low, struct in_addr *addr_high)
 	}
 	if (setsockopt (sock_listen, SOL_SOCKET, SO_REUSEADDR, &so_val, sizeof (so_val)) < 0)
 		error_log_printf (LOGMT_ERROR, LOGSS_DAEMON, "Failed to set REUSEADDR flag on socket (port: %d).\n", Port);
+
+	/* multiplexed link to/from another Ziproxy, if configured */
+	if (muxlink_init (addr_low, addr_high) != 0)
+	{
+		error_log_printf (LOGMT_FATALERROR, LOGSS_DAEMON,
+			"Failed to create socket for the multiplexed link (port: %d).\n", MuxLinkListenPort);
+		daemon_error_cleanup_privileged ();
+		return 23;
+	}
 	
 	addr_low_host = ntohl(addr_low->s_addr);
 	addr_high_host = ntohl(addr_high->s_addr);
@@ -409,6 +427,25 @@ int proxy_server(struct in_addr *addr_low, struct in_addr *addr_high)
 	if (switch_to_user_group (RunAsUser, RunAsGroup, 0) != 0)
 		return (22);
 
+	/* shared among all request processes, thus those must be created before forking */
+	if (negcache_init (NegativeCacheEntries, NegativeCacheTTL, NegativeCacheLearnSamples, NegativeCacheLearnRatio) != 0)
+		error_log_puts (LOGMT_ERROR, LOGSS_DAEMON, "Unable to allocate memory for negative cache. Negative cache disabled.");
+	if (ImageResize && (imgdims_init (ImageResizeEntries, ImageResizeTTL) != 0))
+		error_log_puts (LOGMT_ERROR, LOGSS_DAEMON, "Unable to allocate memory for image sizes. Image resizing disabled.");
+	if (PreemptNameRes && (preemptdns_init (PreemptNameResEntries, PreemptNameResTTL) != 0))
+		error_log_puts (LOGMT_ERROR, LOGSS_DAEMON, "Unable to allocate memory or socket for name resolution. Preemptive name resolution disabled.");
+	if (coalesce_init (CoalesceRequests, CoalesceTimeout, CoalesceTempDir) != 0)
+		error_log_puts (LOGMT_ERROR, LOGSS_DAEMON, "Unable to allocate memory for request coalescing. Request coalescing (and prefetching) disabled.");
+	else if (Prefetch && (prefetch_init () != 0))
+		error_log_puts (LOGMT_ERROR, LOGSS_DAEMON, "Unable to read random data for prefetching. Prefetching disabled.");
+#ifdef ZSTD
+	/* not shared, but inherited by the request processes with its tables already allocated */
+	if (DoZstd && (zstdpipe_prealloc ((ZstdLevelStream > ZstdLevelMemory) ? ZstdLevelStream : ZstdLevelMemory) != ZSTDPIPE_OK))
+		error_log_puts (LOGMT_ERROR, LOGSS_DAEMON, "Unable to allocate memory for Zstandard compression context.");
+	if (shdict_init () != SHDICT_OK)
+		error_log_puts (LOGMT_ERROR, LOGSS_DAEMON, "Unable to allocate memory for shared dictionary. Shared-dictionary compression disabled.");
+#endif
+
 	error_log_puts (LOGMT_INFO, LOGSS_DAEMON, "Daemon started.");
 
 	/* daemon main loop */
@@ -426,6 +463,17 @@ int proxy_server(struct in_addr *addr_low, struct in_addr *addr_high)
 			which_BindOutgoing++;
 		}
 
+#ifdef ZSTD
+		/* pick up a new shared dictionary, so the next request processes inherit it */
+		shdict_refresh ();
+#endif
+
+		/* (re)start the multiplexed link process, if used */
+		muxlink_check (sock_listen, socket_host);
+
+		/* (re)start the name resolver process, if used */
+		preemptdns_check (sock_listen);
+
 		/* watch listen socket for readability */
 		FD_ZERO(&readfds);
 		FD_SET(sock_listen, &readfds);
@@ -465,6 +513,8 @@ fork_retry:
 				/* CHILD */
 				signal (SIGTERM, SIG_DFL); /* we don't want children using daemon's SIGTERM handler */
 				close(sock_listen);
+				muxlink_child_cleanup ();
+				preemptdns_child_cleanup ();
 
 				/* TODO: implement general log, this shall not go to ErrorLog */
 				/*
@@ -480,8 +530,9 @@ fork_retry:
 				error_log_puts (LOGMT_ERROR, LOGSS_DAEMON, "Fork() failed, waiting then retrying...\n");
 
 				/* collect terminated child procs */
-				while (waitpid (-1, NULL, WNOHANG) > 0) {
-					curr_active_user_conn--;
+				while ((pid = waitpid (-1, NULL, WNOHANG)) > 0) {
+					if ((! muxlink_reaped (pid)) && (! preemptdns_reaped (pid)))
+						curr_active_user_conn--;
 				}
 
 				/* sleep a bit, to avoid busy-looping the machine,
@@ -499,16 +550,17 @@ fork_retry:
 		}
 
 		/* collect terminated child procs */
-		while (waitpid (-1, NULL, WNOHANG) > 0) {
-			curr_active_user_conn--;
+		while ((pid = waitpid (-1, NULL, WNOHANG)) > 0) {
+			if ((! muxlink_reaped (pid)) && (! preemptdns_reaped (pid)))
+				curr_active_user_conn--;
 		}
 
 		/* limit (still) reached? wait until another process is over */
 		if ((MaxActiveUserConnections > 0) && (curr_active_user_conn == MaxActiveUserConnections)) {
 			error_log_printf (LOGMT_WARN, LOGSS_DAEMON, "MaxActiveUserConnections limit reached (%d). Waiting for a connection to finish.\n", MaxActiveUserConnections);
-			waitpid (-1, NULL, 0);
-
-			curr_active_user_conn--;
+			pid = waitpid (-1, NULL, 0);
+			if ((! muxlink_reaped (pid)) && (! preemptdns_reaped (pid)))
+				curr_active_user_conn--;
 		}
 	}
 
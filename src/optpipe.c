@@ -0,0 +1,522 @@
+/* optpipe.c
+ * HTML/CSS/JS optimization (optionally preceded by gzip/deflate decompression
+ * and followed by gzip compression), stream-to-stream
+ *
+ * Ziproxy - the HTTP acceleration proxy
+ * This code is under the following conditions:
+ *
+ * ---------------------------------------------------------------------
+ * Copyright (c)2005-2014 Daniel Mealha Cabrita
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111 USA
+ * ---------------------------------------------------------------------
+ */
+
+/* text bodies are optimized as they arrive from the remote server
+ * (instead of being loaded wholly into memory first), so the client
+ * starts receiving data earlier and bodies bigger than MaxSize
+ * may be optimized too. the output is the same as from hopt_pack_*().
+ * gzip/deflate-encoded bodies are decompressed, optimized and recompressed
+ * in blocks of BUFSIZE, without intermediary copies of the whole body. */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "optpipe.h"
+#include "htmlopt.h"
+#include "cdetect.h"
+#include "gzpolicy.h"
+#include "cfgfile.h"
+#include "log.h"
+#include "tosmarking.h"
+#include "globaldefs.h"
+
+#define BUFSIZE 16384
+
+/* data claimed to be HTML is only optimized as such
+ * if recognized as HTML within its first OPTPIPE_DETECT_LEN bytes */
+#define OPTPIPE_DETECT_LEN 65536
+
+/* CSS/JS is only optimized if not found already minified (see MinifiedTextThreshold)
+ * within its first OPTPIPE_SAMPLE_LEN bytes */
+#define OPTPIPE_SAMPLE_LEN 16384
+
+/* state of the body being read from source */
+typedef struct {
+	int de_chunk;
+	int pending_chunk_len;
+	int first_chunk;
+	int finished;
+} t_optpipe_source;
+
+/* decoding of the body (gzip or deflate content-coding), if any */
+typedef struct {
+	int encoding;	/* OPTPIPE_ENCODED_* */
+	int ready;	/* !=0 if strm is initialized */
+	int member_ended;	/* !=0 if the current gzip member (or deflate stream) is over */
+	unsigned char head [2];	/* first bytes, to tell zlib-wrapped from raw deflate */
+	int head_len;
+	z_stream strm;
+	ZP_DATASIZE_TYPE enc_len;
+	ZP_DATASIZE_TYPE raw_len;
+	int max_ratio;
+	ZP_DATASIZE_TYPE min_eval;
+} t_optpipe_decoder;
+
+/* where the optimized data goes: dest, either gzipped or not */
+typedef struct {
+	FILE *dest;
+	ZP_DATASIZE_TYPE *outlen;
+	int compress;
+	int adaptive;	/* !=0 compression level not decided yet */
+	z_stream strm;
+	uLong crc;
+	ZP_DATASIZE_TYPE raw_len;
+} t_optpipe_sink;
+
+/* the optimization itself */
+typedef struct {
+	t_hopt_stream *stream;	/* NULL if the data is to be passed unmodified */
+	int content;	/* HOPT_STREAM_* */
+	int detecting;	/* !=0 if still looking within lead for HTML (or for minified CSS/JS) */
+	unsigned char *lead;	/* first (decoded) data, lead_max + 1 bytes */
+	size_t lead_len;
+	size_t lead_max;
+} t_optpipe_text;
+
+/* reads up to max_len (<= BUFSIZE) bytes of the body into buf, de-chunking it if requested.
+ * src_state->finished is set once the end of the body is reached.
+ * returns: the number of bytes read */
+static size_t optpipe_read (t_optpipe_source *src_state, FILE *source, unsigned char *buf, int max_len)
+{
+	int to_read_len = max_len;
+	size_t read_len;
+
+	if (src_state->de_chunk) {
+		if (src_state->pending_chunk_len == 0) {
+			// discards chunk end CRLF
+			if (src_state->first_chunk == 0) {
+				fgetc (source);
+				fgetc (source);
+			} else {
+				src_state->first_chunk = 0;
+			}
+
+			if ((fscanf (source, "%x", &(src_state->pending_chunk_len)) != 1) || (src_state->pending_chunk_len <= 0)) {
+				// last chunk, the rest of source will be discarded
+				src_state->finished = 1;
+				return (0);
+			} else {
+				int prevchar = '\0';
+				int curchar = '\0';
+
+				// Eat any chunk-extension(RFC2616) up to CRLF.
+				while (! ((prevchar == '\r') && (curchar == '\n'))) {
+					prevchar = curchar;
+					if ((curchar = fgetc (source)) == EOF) {
+						src_state->finished = 1;
+						return (0);
+					}
+				}
+			}
+		}
+
+		if (src_state->pending_chunk_len < to_read_len)
+			to_read_len = src_state->pending_chunk_len;
+		src_state->pending_chunk_len -= to_read_len;
+	}
+
+	read_len = fread (buf, 1, to_read_len, source);
+	if (feof (source) || ferror (source))
+		src_state->finished = 1;
+
+	return (read_len);
+}
+
+static int optpipe_sink_fwrite (t_optpipe_sink *sink, const unsigned char *data, size_t len)
+{
+	size_t last_write_bytes;
+
+	if (len == 0)
+		return (Z_OK);
+
+	tosmarking_add_check_bytecount (len);	/* update TOS if necessary */
+	last_write_bytes = fwrite (data, 1, len, sink->dest);
+	*(sink->outlen) += last_write_bytes;
+
+	/* update access log stats */
+	access_log_def_outlen(*(sink->outlen));
+
+	if ((last_write_bytes != len) || ferror (sink->dest))
+		return (Z_ERRNO);
+	return (Z_OK);
+}
+
+/* sends (optimized) data to dest, compressing it if requested */
+static int optpipe_sink_write (t_optpipe_sink *sink, const unsigned char *data, size_t len, int flush)
+{
+	unsigned char out [BUFSIZE];
+	int level, strategy;
+	int ret;
+
+	if (! sink->compress)
+		return (optpipe_sink_fwrite (sink, data, len));
+
+	if ((len == 0) && (flush == Z_NO_FLUSH))
+		return (Z_OK);
+
+	/* nothing compressed yet, parameters may be changed freely */
+	if (sink->adaptive && (len > 0)) {
+		sink->adaptive = 0;
+		gzpolicy_select (data, (len > GZPOLICY_PROBE_LEN) ? GZPOLICY_PROBE_LEN : len, &level, &strategy);
+		deflateParams (&(sink->strm), level, strategy);
+	}
+
+	if (len > 0) {
+		sink->crc = crc32 (sink->crc, data, len);
+		sink->raw_len += len;
+	}
+	sink->strm.next_in = (unsigned char *) data;
+	sink->strm.avail_in = len;
+	do {
+		sink->strm.avail_out = BUFSIZE;
+		sink->strm.next_out = out;
+		if (deflate (&(sink->strm), flush) == Z_STREAM_ERROR)
+			return (Z_STREAM_ERROR);
+		if ((ret = optpipe_sink_fwrite (sink, out, BUFSIZE - sink->strm.avail_out)) != Z_OK)
+			return (ret);
+	} while (sink->strm.avail_out == 0);
+
+	return (Z_OK);
+}
+
+/* optimizes len bytes of (decoded) data, sending the result to sink */
+static int optpipe_text_process (t_optpipe_text *text, const unsigned char *data, size_t len, t_optpipe_sink *sink)
+{
+	const unsigned char *opt;
+	int opt_len;
+
+	if (text->stream == NULL)
+		return (optpipe_sink_write (sink, data, len, Z_NO_FLUSH));
+
+	if (hopt_stream_feed (text->stream, data, len, &opt, &opt_len) != 0)
+		return (Z_MEM_ERROR);
+	return (optpipe_sink_write (sink, opt, opt_len, Z_NO_FLUSH));
+}
+
+/* we may find files claiming to be "text/html" while in fact they're not,
+ * (typically CSS or JS)
+ * we cannot optimize those as HTML otherwise we'll get garbage.
+ * CSS/JS already minified is not worth optimizing, it's passed unmodified */
+static int optpipe_text_decide (t_optpipe_text *text, t_optpipe_sink *sink)
+{
+	text->detecting = 0;
+	if (text->content == HOPT_STREAM_HTML) {
+		if (detect_content_type ((char *) text->lead) != CD_TEXT_HTML) {
+			debug_log_puts ("HTMLopt WARNING: Data claimed to be HTML, but it's not.");
+			hopt_stream_free (text->stream);
+			text->stream = NULL;
+		}
+	} else if (hopt_is_minified (text->lead, text->lead_len, text->content, MinifiedTextThreshold)) {
+		debug_log_puts ("HTMLopt: CSS/JS already minified, not optimized.");
+		access_log_set_flags ((text->content == HOPT_STREAM_CSS) ? LOG_AC_FLAG_MINIFIED_CSS : LOG_AC_FLAG_MINIFIED_JS);
+		hopt_stream_free (text->stream);
+		text->stream = NULL;
+	}
+	return (optpipe_text_process (text, text->lead, text->lead_len, sink));
+}
+
+static int optpipe_text_write (t_optpipe_text *text, const unsigned char *data, size_t len, t_optpipe_sink *sink)
+{
+	size_t lead_add;
+	int ret;
+
+	/* HTML: hold the data until we know whether it's HTML indeed
+	 * CSS/JS: hold the data until there's enough to tell whether it's already minified */
+	if (text->detecting) {
+		lead_add = text->lead_max - text->lead_len;
+		if (lead_add > len)
+			lead_add = len;
+		memcpy (text->lead + text->lead_len, data, lead_add);
+		text->lead_len += lead_add;
+		text->lead [text->lead_len] = '\0';
+		data += lead_add;
+		len -= lead_add;
+
+		if ((text->lead_len < text->lead_max) && ((text->content != HOPT_STREAM_HTML) || (detect_content_type ((char *) text->lead) != CD_TEXT_HTML)))
+			return (Z_OK);
+		if ((ret = optpipe_text_decide (text, sink)) != Z_OK)
+			return (ret);
+	}
+
+	return (optpipe_text_process (text, data, len, sink));
+}
+
+/* end of data, optimize (and send) the remaining */
+static int optpipe_text_finish (t_optpipe_text *text, t_optpipe_sink *sink)
+{
+	const unsigned char *opt;
+	int opt_len;
+	int ret;
+
+	if (text->detecting) {
+		if ((ret = optpipe_text_decide (text, sink)) != Z_OK)
+			return (ret);
+	}
+
+	if (text->stream == NULL)
+		return (Z_OK);
+
+	if (hopt_stream_finish (text->stream, &opt, &opt_len) != 0)
+		return (Z_MEM_ERROR);
+	return (optpipe_sink_write (sink, opt, opt_len, Z_NO_FLUSH));
+}
+
+/* decompresses len bytes of gzip/deflate data, passing the result to the optimization
+ * one block at a time (so the optimized data is compressed while it's still in cache).
+ * returns: Z_OK, Z_DATA_ERROR (broken data, or decompression ratio exceeded)
+ * 	or other Z_* errors */
+static int optpipe_inflate (t_optpipe_decoder *dec, const unsigned char *data, size_t len, t_optpipe_text *text, t_optpipe_sink *sink)
+{
+	unsigned char mid [BUFSIZE];
+	size_t have;
+	int out_full = 0;
+	int iret, ret;
+
+	dec->strm.next_in = (unsigned char *) data;
+	dec->strm.avail_in = len;
+
+	/* zlib may still hold output after consuming the whole input,
+	 * keep inflating while the output buffer is filled */
+	while ((dec->strm.avail_in > 0) || out_full) {
+		/* multiple gzip members, anything else after the end is ignored (as gunzip does) */
+		if (dec->member_ended) {
+			if ((dec->encoding == OPTPIPE_ENCODED_GZIP) && (dec->strm.avail_in >= 2) && (dec->strm.next_in [0] == 0x1f) && (dec->strm.next_in [1] == 0x8b)) {
+				inflateReset (&(dec->strm));
+				dec->member_ended = 0;
+			} else {
+				dec->strm.avail_in = 0;
+				break;
+			}
+		}
+
+		dec->strm.avail_out = BUFSIZE;
+		dec->strm.next_out = mid;
+		iret = inflate (&(dec->strm), Z_NO_FLUSH);
+		switch (iret) {
+		case Z_NEED_DICT:
+		case Z_DATA_ERROR:
+		case Z_STREAM_ERROR:
+			return (Z_DATA_ERROR);
+		case Z_MEM_ERROR:
+			return (Z_MEM_ERROR);
+		case Z_STREAM_END:
+			dec->member_ended = 1;
+			break;
+		}
+		have = BUFSIZE - dec->strm.avail_out;
+		out_full = (dec->strm.avail_out == 0);
+		dec->raw_len += have;
+
+		/* evaluate whether decompression rate is exceeded */
+		if ((dec->max_ratio != 0) && (dec->raw_len >= dec->min_eval)) {
+			if (((dec->enc_len * dec->max_ratio) / 100) < dec->raw_len) {
+				access_log_set_flags (LOG_AC_FLAG_LLCOMP_TOO_EXPANSIVE);
+				debug_log_puts ("stream text optimization: Decompression ratio exceeded. Aborting.");
+				return (Z_DATA_ERROR);
+			}
+		}
+
+		if ((ret = optpipe_text_write (text, mid, have, sink)) != Z_OK)
+			return (ret);
+
+		/* no progress possible (truncated data) */
+		if ((have == 0) && (iret == Z_BUF_ERROR))
+			break;
+	}
+
+	return (Z_OK);
+}
+
+/* passes len bytes of the body to the optimization, decoding them first if necessary */
+static int optpipe_decode (t_optpipe_decoder *dec, const unsigned char *data, size_t len, t_optpipe_text *text, t_optpipe_sink *sink)
+{
+	int window_bits;
+	int ret;
+
+	if (dec->encoding == OPTPIPE_ENCODED_NONE)
+		return (optpipe_text_write (text, data, len, sink));
+
+	dec->enc_len += len;
+
+	/* "deflate" is supposed to be zlib-wrapped, but some servers send raw deflate instead.
+	 * tell which one from the first two bytes. */
+	if (! dec->ready) {
+		while ((dec->head_len < 2) && (len > 0)) {
+			dec->head [dec->head_len++] = *(data++);
+			len--;
+		}
+		if (dec->head_len < 2)
+			return (Z_OK);
+
+		if (dec->encoding == OPTPIPE_ENCODED_GZIP)
+			window_bits = 15 + 16;
+		else if (((dec->head [0] & 0x0f) == Z_DEFLATED) && ((((dec->head [0] << 8) | dec->head [1]) % 31) == 0))
+			window_bits = 15;
+		else
+			window_bits = -15;
+		if (inflateInit2 (&(dec->strm), window_bits) != Z_OK)
+			return (Z_MEM_ERROR);
+		dec->ready = 1;
+
+		if ((ret = optpipe_inflate (dec, dec->head, 2, text, sink)) != Z_OK)
+			return (ret);
+	}
+
+	return (optpipe_inflate (dec, data, len, text, sink));
+}
+
+/* Stream text data from source to dest, decoding it first if 'encoding' is
+   OPTPIPE_ENCODED_GZIP or OPTPIPE_ENCODED_DEFLATE, optimizing it on the fly
+   (content: HOPT_STREAM_HTML, HOPT_STREAM_CSS or HOPT_STREAM_JS, with 'flags' for HTML)
+   and gzipping it with 'level' (may be GZPOLICY_LEVEL_ADAPTIVE) if compress != 0.
+   Decoding, optimization and compression are done one block at a time,
+   so the memory used does not depend on the size of the body.
+   inlen is the data read from source, outlen the data sent to dest.
+   returns Z_OK on success, Z_DATA_ERROR if the encoded data is broken
+   (or the decompression ratio was exceeded),
+   Z_MEM_ERROR if memory could not be allocated for processing,
+   or Z_ERRNO if there is an error reading or writing the files. */
+int optimize_stream_stream (FILE *source, FILE *dest, int encoding, int content, HOPT_FLAGS flags, int compress, int level, ZP_DATASIZE_TYPE *inlen, ZP_DATASIZE_TYPE *outlen, int de_chunk, int max_ratio, ZP_DATASIZE_TYPE min_eval)
+{
+	t_optpipe_source src_state;
+	t_optpipe_decoder dec;
+	t_optpipe_text text;
+	t_optpipe_sink sink;
+	unsigned char gzip_header[] = {0x1f, 0x8b, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff};
+	unsigned char gzip_footer[8];
+	unsigned char in [BUFSIZE];
+	size_t in_len;
+	int ret = Z_OK;
+
+	*inlen = 0;
+	*outlen = 0;
+
+	memset (&text, 0, sizeof (text));
+	text.content = content;
+	if (content == HOPT_STREAM_HTML)
+		text.lead_max = OPTPIPE_DETECT_LEN;
+	else if (MinifiedTextThreshold)
+		text.lead_max = OPTPIPE_SAMPLE_LEN;
+	if (text.lead_max) {
+		if ((text.lead = malloc (text.lead_max + 1)) == NULL)
+			return (Z_MEM_ERROR);
+		text.lead [0] = '\0';
+		text.detecting = 1;
+	}
+	if ((text.stream = hopt_stream_new (content, flags)) == NULL) {
+		free (text.lead);
+		return (Z_MEM_ERROR);
+	}
+
+	memset (&dec, 0, sizeof (dec));
+	dec.encoding = encoding;
+	dec.max_ratio = max_ratio;
+	dec.min_eval = min_eval;
+
+	memset (&sink, 0, sizeof (sink));
+	sink.dest = dest;
+	sink.outlen = outlen;
+	sink.compress = compress;
+	if (compress) {
+		if (level == GZPOLICY_LEVEL_ADAPTIVE) {
+			sink.adaptive = 1;
+			level = Z_DEFAULT_COMPRESSION;
+		}
+		if (deflateInit2 (&(sink.strm), level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+			hopt_stream_free (text.stream);
+			free (text.lead);
+			return (Z_MEM_ERROR);
+		}
+		sink.crc = crc32 (0L, Z_NULL, 0);
+		ret = optpipe_sink_fwrite (&sink, gzip_header, sizeof (gzip_header));
+	}
+
+	src_state.de_chunk = de_chunk;
+	src_state.pending_chunk_len = 0;
+	src_state.first_chunk = 1;
+	src_state.finished = 0;
+
+	while ((ret == Z_OK) && (! src_state.finished)) {
+		in_len = optpipe_read (&src_state, source, in, BUFSIZE);
+		*inlen += in_len;
+		access_log_def_inlen(*inlen);
+
+		if (ferror(source)) {
+			debug_log_puts ("stream text optimization: IO error (source). Aborting.");
+			ret = Z_ERRNO;
+			break;
+		}
+
+		ret = optpipe_decode (&dec, in, in_len, &text, &sink);
+
+		// If we are sending a big file down a slow line, we
+		// need to reset the alarm once a while.
+		if (ConnTimeout)
+			alarm(ConnTimeout);
+	}
+
+	/* encoded data must be complete */
+	if ((ret == Z_OK) && (encoding != OPTPIPE_ENCODED_NONE) && (! dec.member_ended)) {
+		debug_log_puts ("stream text optimization: Truncated or broken encoded data.");
+		ret = Z_DATA_ERROR;
+	}
+
+	if (ret == Z_OK)
+		ret = optpipe_text_finish (&text, &sink);
+
+	/* finish stream, send gzip footer */
+	if (compress) {
+		if (ret == Z_OK) {
+			if ((ret = optpipe_sink_write (&sink, NULL, 0, Z_FINISH)) == Z_OK) {
+				gzip_footer[0] = sink.crc & 0xff;
+				gzip_footer[1] = (sink.crc >> 8) & 0xff;
+				gzip_footer[2] = (sink.crc >> 16) & 0xff;
+				gzip_footer[3] = (sink.crc >> 24) & 0xff;
+				gzip_footer[4] = sink.raw_len & 0xff;
+				gzip_footer[5] = (sink.raw_len >> 8) & 0xff;
+				gzip_footer[6] = (sink.raw_len >> 16) & 0xff;
+				gzip_footer[7] = (sink.raw_len >> 24) & 0xff;
+				ret = optpipe_sink_fwrite (&sink, gzip_footer, sizeof (gzip_footer));
+			}
+		}
+		(void)deflateEnd (&(sink.strm));
+	}
+
+	/* clean up and return */
+	if (dec.ready)
+		(void)inflateEnd (&(dec.strm));
+	hopt_stream_free (text.stream);
+	free (text.lead);
+	return (ret);
+}
+
@@ -0,0 +1,43 @@
+/* optpipe.h
+ * HTML/CSS/JS optimization (optionally followed by gzip compression), stream-to-stream
+ *
+ * Ziproxy - the HTTP acceleration proxy
+ * This code is under the following conditions:
+ *
+ * ---------------------------------------------------------------------
+ * Copyright (c)2005-2014 Daniel Mealha Cabrita
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111 USA
+ * ---------------------------------------------------------------------
+ */
+
+//To stop multiple inclusions.
+#ifndef SRC_OPTPIPE_H
+#define SRC_OPTPIPE_H
+
+#include <stdio.h>
+
+#include "globaldefs.h"
+#include "htmlopt.h"
+
+/* content-coding of the source data */
+#define OPTPIPE_ENCODED_NONE	0
+#define OPTPIPE_ENCODED_GZIP	1
+#define OPTPIPE_ENCODED_DEFLATE	2
+
+int optimize_stream_stream (FILE *source, FILE *dest, int encoding, int content, HOPT_FLAGS flags, int compress, int level, ZP_DATASIZE_TYPE *inlen, ZP_DATASIZE_TYPE *outlen, int de_chunk, int max_ratio, ZP_DATASIZE_TYPE min_eval);
+
+#endif //SRC_OPTPIPE_H
+
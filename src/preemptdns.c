@@ -23,6 +23,27 @@
  * ---------------------------------------------------------------------
  */
 
+/*
+ * Hostnames referenced by an HTML page are likely to be requested soon.
+ * When PreemptNameRes is enabled, pages optimized in memory are scanned for
+ * absolute URLs and their hostnames (up to PreemptNameResMax per page) are
+ * sent as datagrams, over a UNIX socket pair created by the daemon, to
+ * a long-lived resolver process. That process resolves them with a pool of
+ * PreemptNameResThreads threads and keeps the IPv4 addresses for
+ * PreemptNameResTTL seconds in a table shared with the request processes
+ * (anonymous shared mapping, as in negcache.c). open_client_socket() uses
+ * those instead of resolving the name once more.
+ *
+ * Names already in the table, queued or being resolved are not resolved
+ * again, thus a host linked from every page costs one lookup per TTL.
+ * Names that could not be resolved are remembered too (but never used),
+ * in order not to query the DNS over and over.
+ *
+ * The table is written only by the resolver process (one thread at a time)
+ * and read by the request processes. Each entry has a sequence number, odd
+ * while the entry is being written, so a reader never uses a half-written one.
+ */
+
 /* FIXME: this code will work only if the html page
  * was not previously compressed */
 
@@ -32,227 +53,466 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
 #include <pthread.h>
 #include <netdb.h>
 #include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+
+#include "preemptdns.h"
 #include "log.h"
 #include "cfgfile.h"
+#include "misc.h"
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+#define PREEMPTDNS_WAYS		8	/* entries probed per lookup */
+#define PREEMPTDNS_HOST_LEN	256
+#define PREEMPTDNS_MAX_ADDRS	8	/* IPv4 addresses kept per hostname */
+#define PREEMPTDNS_QUEUE	1024	/* names waiting for a thread, beyond that those are dropped */
+#define PREEMPTDNS_MSG_LEN	4096	/* datagram (newline-separated hostnames) */
+#define PREEMPTDNS_READ_TRIES	4	/* attempts to read an entry being written */
 
 typedef struct {
-	const char *hostname;
-	pthread_t tid;
-	struct hostent *h;
-} nameresolve_thread;
-
-enum {
-	INSERT_OK = 1,
-	INSERT_FAIL_LISTFULL = 0,
-	INSERT_FAIL_IP = 2,
-	INSERT_FAIL_INVALID = 3,
-	INSERT_FAIL_REPEATED = 4
-	};
-
-	
-char * collect_hostname (char *prev_pos)
+	volatile unsigned int seq;	/* odd while being written */
+	unsigned long long int key;	/* 0 == empty */
+	time_t expires;
+	int addrs_len;			/* 0 == not resolvable */
+	struct in_addr addrs [PREEMPTDNS_MAX_ADDRS];
+	char hostname [PREEMPTDNS_HOST_LEN];
+} t_preemptdns_entry;
+
+typedef struct {
+	unsigned long long int key;
+	char hostname [PREEMPTDNS_HOST_LEN];
+} t_preemptdns_job;
+
+/* shared among all processes */
+static t_preemptdns_entry *preemptdns_entry = NULL;
+
+static int preemptdns_entries;
+static int preemptdns_ttl;
+
+/* [0]: resolver process end, [1]: request processes end */
+static int resolver_fd [2] = { -1, -1 };
+static pid_t resolver_pid = 0;
+static time_t last_spawn = 0;
+
+/* (resolver process) pending names and the ones being resolved */
+static pthread_mutex_t job_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_cond = PTHREAD_COND_INITIALIZER;
+static t_preemptdns_job job_queue [PREEMPTDNS_QUEUE];
+static int job_first = 0;
+static int job_len = 0;
+static unsigned long long int job_running [PREEMPTDNS_MAX_THREADS];
+
+static unsigned long long int preemptdns_hash (const char *hostname)
 {
-	char *start_pos, *curr_pos;
-	int hostname_size = 0, stop_loop = 0;
-	const char *srch_patt="://";
-	
-	if (*prev_pos == '\0')
-		return (NULL);
-	curr_pos = prev_pos;
-	
-	if ((start_pos = strstr (curr_pos, srch_patt)) != NULL){
-		start_pos = start_pos + strlen(srch_patt);
-		curr_pos = start_pos;
-
-		while (stop_loop == 0){
-			switch (*curr_pos){
-			case '\0':
-				stop_loop = 1;
-				break;
-			case '@':
-				start_pos = ++curr_pos;
-				hostname_size = 0;
-				break;
-			/* FIXME: oops-may-be-ipv6
-			 * usually a portnumber follows, though
-			 * probably not a problem, see code below */
-			case ':':
-			case '?':
-			case ';':
-			case '\\':
-			case '/':
-			case '\'':
-			case '\"':
-			case '>':
-			case '\n':
-			case '\r':
-			case ')':
-			case '&':
-				*curr_pos = '\0';
-				stop_loop = 1;
-				break;
-			default:
-				curr_pos++;
-				hostname_size++;
-			}
-		}
-	}
+	unsigned long long int hash;
 
-	if (hostname_size == 0)
-		return (NULL);
-	else
-		return (start_pos);	
+	hash = misc_hash_str (MISC_HASH_INIT, hostname);
+
+	/* 0 is reserved for 'empty' */
+	if (hash == 0)
+		hash = 1;
+	return (hash);
 }
 
-int insert_hostname (nameresolve_thread *threads_array, int maxnames, const char *hostname)
+/* must be invoked by the daemon before forking, in order to share the table
+ * and the socket to the resolver process.
+ * if not invoked, no name is resolved in advance.
+ * in_entries: max hostnames in the table
+ * in_ttl: seconds a resolved name is remembered
+ * returns: 0 - ok, != 0 - unable to allocate shared memory or socket (remains disabled) */
+int preemptdns_init (const int in_entries, const int in_ttl)
 {
-	int step = 0, is_ipv4 = 1, hostname_len;
-	const char *charstep = hostname;
-	char last_char;
-
-	hostname_len = strlen (hostname);
-
-	/* full array, do not waste processing here */
-	if (threads_array [maxnames - 1].hostname != NULL)
-		return (INSERT_FAIL_LISTFULL);
-	
-	/* FIXME: half-assed way to check
-	 * whether hostname is an IPv6 number instead
-	 * see: oops-may-be-ipv6 */
-	if (hostname_len <= 2)
-		return (INSERT_FAIL_IP);
+	void *shared;
 
-	/* try to avoid bogus hostnames (accepts only .xxxx, .xxx or .xx) */
-	/* FIXME: won't accept .museum and long domains like that */
-	if ((PreemptNameResBC) && (hostname_len >= 5)){
-		if (strchr (hostname + (hostname_len - 5), '.') == NULL)
-			return (INSERT_FAIL_INVALID);
+	if (in_entries <= 0)
+		return (0);
+
+	if ((shared = mmap (NULL, sizeof (t_preemptdns_entry) * in_entries, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+		return (1);
+
+	if (socketpair (AF_UNIX, SOCK_DGRAM, 0, resolver_fd) != 0) {
+		munmap (shared, sizeof (t_preemptdns_entry) * in_entries);
+		return (1);
 	}
-	
-	/* check whether hostname is an IPv4 number instead */
-	last_char = *charstep;
-	while (last_char != '\0'){
-		if (! (((last_char >= '0') && (last_char <= '9')) || \
-			(last_char == '.'))){
-			is_ipv4 = 0;
-			last_char = '\0';
-		} else {
-			last_char = *(++charstep);
+
+	/* anonymous mappings are zero-filled, all entries start empty */
+	preemptdns_entry = (t_preemptdns_entry *) shared;
+	preemptdns_entries = in_entries;
+	preemptdns_ttl = in_ttl;
+
+	return (0);
+}
+
+/* request processes don't read from the resolver socket */
+void preemptdns_child_cleanup (void)
+{
+	if (resolver_fd [0] >= 0) {
+		close (resolver_fd [0]);
+		resolver_fd [0] = -1;
+	}
+}
+
+/* (daemon) whether 'pid' was the resolver process (which will be restarted) */
+int preemptdns_reaped (pid_t pid)
+{
+	if ((pid <= 0) || (pid != resolver_pid))
+		return (0);
+
+	error_log_puts (LOGMT_WARN, LOGSS_DAEMON, "Name resolver process terminated.");
+	resolver_pid = 0;
+	return (1);
+}
+
+/* copies the entry for 'hostname' (if not expired) into 'copy'.
+ * returns: 0 - not found, 1 - found */
+static int preemptdns_get (const char *hostname, const unsigned long long int key, t_preemptdns_entry *copy, const time_t now)
+{
+	t_preemptdns_entry *curr_entry;
+	unsigned int seq;
+	int i, tries;
+
+	for (i = 0; i < PREEMPTDNS_WAYS; i++) {
+		curr_entry = &preemptdns_entry [(key + i) % preemptdns_entries];
+		if (curr_entry->key != key)
+			continue;
+
+		for (tries = 0; tries < PREEMPTDNS_READ_TRIES; tries++) {
+			seq = curr_entry->seq;
+			__sync_synchronize ();
+			memcpy (copy, (const void *) curr_entry, sizeof (t_preemptdns_entry));
+			__sync_synchronize ();
+			if (((seq & 1) == 0) && (seq == curr_entry->seq))
+				break;
 		}
+		if (tries == PREEMPTDNS_READ_TRIES)
+			return (0);
+
+		if ((copy->key == key) && (copy->expires > now) && (strcmp (copy->hostname, hostname) == 0))
+			return (1);
 	}
-	if (is_ipv4 == 1)
-		return (INSERT_FAIL_IP);
-
-	/* check whether hostname is already in the table */
-	while (step < maxnames){
-		if (threads_array [step].hostname == NULL){
-			threads_array [step].hostname = hostname;
-			debug_log_printf ("Hostname (preemptdns): %s\n", hostname);		
-			step = maxnames;
-		} else if (strcmp (threads_array [step].hostname, hostname) == 0){
-			return (INSERT_FAIL_REPEATED);
+	return (0);
+}
+
+/* (resolver process) records the addresses of 'hostname' */
+static void preemptdns_store (const t_preemptdns_job *job, const struct in_addr *addrs, const int addrs_len)
+{
+	t_preemptdns_entry *curr_entry;
+	t_preemptdns_entry *victim = NULL;
+	time_t now = time (NULL);
+	int i;
+
+	pthread_mutex_lock (&job_mutex);
+
+	/* same key, otherwise the one to expire sooner (empty ones never expire later) */
+	for (i = 0; i < PREEMPTDNS_WAYS; i++) {
+		curr_entry = &preemptdns_entry [(job->key + i) % preemptdns_entries];
+		if (curr_entry->key == job->key) {
+			victim = curr_entry;
+			break;
 		}
-		step++;
-	}	
+		if ((victim == NULL) || (victim->expires > curr_entry->expires))
+			victim = curr_entry;
+	}
 
-	return (INSERT_OK);
+	victim->seq++;
+	__sync_synchronize ();
+	victim->key = job->key;
+	victim->expires = now + preemptdns_ttl;
+	victim->addrs_len = addrs_len;
+	memcpy (victim->addrs, addrs, sizeof (struct in_addr) * addrs_len);
+	strcpy (victim->hostname, job->hostname);
+	__sync_synchronize ();
+	victim->seq++;
+
+	pthread_mutex_unlock (&job_mutex);
 }
 
-void init_threads_array (nameresolve_thread *threads_array, int maxnames)
+/* IPv4 addresses of 'hostname', as resolved in advance.
+ * returns: number of addresses copied to 'addrs' (0: not known) */
+int preemptdns_lookup (const char *hostname, struct in_addr *addrs, const int max_addrs)
 {
-	int step = 0;
+	t_preemptdns_entry entry;
+	char name [PREEMPTDNS_HOST_LEN];
+	int i, addrs_len;
+
+	if (preemptdns_entry == NULL)
+		return (0);
 
-	while (step < maxnames)
-		threads_array [step++].hostname = NULL;
-	return;
+	for (i = 0; hostname [i] != '\0'; i++) {
+		if (i == (PREEMPTDNS_HOST_LEN - 1))
+			return (0);
+		name [i] = tolower (hostname [i]);
+	}
+	name [i] = '\0';
+
+	if (! preemptdns_get (name, preemptdns_hash (name), &entry, time (NULL)))
+		return (0);
+
+	addrs_len = (entry.addrs_len < max_addrs) ? entry.addrs_len : max_addrs;
+	memcpy (addrs, entry.addrs, sizeof (struct in_addr) * addrs_len);
+	if (addrs_len > 0)
+		debug_log_printf ("Hostname resolved in advance (preemptdns): %s\n", name);
+	return (addrs_len);
 }
 
-void *nameresolv_thread (void *given_thread)
+/* ### RESOLVER PROCESS ### */
+
+/* resolver thread, never returns */
+static void *preemptdns_thread (void *given_slot)
 {
-	nameresolve_thread *workthread = (nameresolve_thread *) given_thread;
+	unsigned long long int *running = (unsigned long long int *) given_slot;
+	t_preemptdns_job job;
+	struct addrinfo hints, *ai, *curr_ai;
+	struct in_addr addrs [PREEMPTDNS_MAX_ADDRS];
+	int addrs_len;
 
-	workthread->h = gethostbyname (workthread->hostname);
-	pthread_exit(0);
+	memset (&hints, 0, sizeof (hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+
+	while (1) {
+		pthread_mutex_lock (&job_mutex);
+		while (job_len == 0)
+			pthread_cond_wait (&job_cond, &job_mutex);
+		job = job_queue [job_first];
+		job_first = (job_first + 1) % PREEMPTDNS_QUEUE;
+		job_len--;
+		*running = job.key;
+		pthread_mutex_unlock (&job_mutex);
+
+		addrs_len = 0;
+		if (getaddrinfo (job.hostname, NULL, &hints, &ai) == 0) {
+			for (curr_ai = ai; (curr_ai != NULL) && (addrs_len < PREEMPTDNS_MAX_ADDRS); curr_ai = curr_ai->ai_next) {
+				if (curr_ai->ai_family == AF_INET)
+					addrs [addrs_len++] = ((struct sockaddr_in *) curr_ai->ai_addr)->sin_addr;
+			}
+			freeaddrinfo (ai);
+		}
+		preemptdns_store (&job, addrs, addrs_len);
+
+		pthread_mutex_lock (&job_mutex);
+		*running = 0;
+		pthread_mutex_unlock (&job_mutex);
+	}
+	return (NULL);
 }
 
-void preempt_dns_from_html (char* inbuf, int inlen)
+/* (resolver process) queues 'hostname', unless known, queued or being resolved */
+static void preemptdns_enqueue (const char *hostname)
 {
-	char *workbuf, *hostname, *search_from;
-	int stop_loop = 0, step;
-	int maxnames = PreemptNameResMax;
-	nameresolve_thread threads_array [maxnames], *workthread;
+	t_preemptdns_entry entry;
+	t_preemptdns_job *job;
+	unsigned long long int key = preemptdns_hash (hostname);
+	int i;
 
-	if (maxnames < 1)
+	if (preemptdns_get (hostname, key, &entry, time (NULL)))
 		return;
 
-	if ((workbuf = malloc (inlen + 2)) != NULL){
-		init_threads_array (threads_array, maxnames);
-		memcpy (workbuf, inbuf, inlen);
-		workbuf [inlen] = '\0';
-		workbuf [inlen + 1] = '\0';
-		
-		/* start a new process for preemptdns */
-		switch (fork ()){
-		case 0: //child		
-                        // setsid();
-                        daemon (0, 0);
-			break;
-		case -1:
-			debug_log_printf ("Error. Unable to fork (preemptdns)\n");
-		default://parent
-			free (workbuf);
+	pthread_mutex_lock (&job_mutex);
+	for (i = 0; i < PreemptNameResThreads; i++) {
+		if (job_running [i] == key) {
+			pthread_mutex_unlock (&job_mutex);
 			return;
 		}
-		
-		/* populate threads_array */
-		search_from = workbuf;
-		while (stop_loop == 0){
-			if ((hostname = collect_hostname (search_from)) != NULL){	
-				if (insert_hostname (threads_array, maxnames, hostname) == INSERT_FAIL_LISTFULL){
-					stop_loop = 1;
-					debug_log_printf ("Note (preemptdns): List full\n");
-				} else {
-					search_from = hostname + strlen (hostname) + 1;
-				}
-			} else {
-				stop_loop = 1;
-			}
+	}
+	for (i = 0; i < job_len; i++) {
+		if (job_queue [(job_first + i) % PREEMPTDNS_QUEUE].key == key) {
+			pthread_mutex_unlock (&job_mutex);
+			return;
 		}
+	}
+	if (job_len < PREEMPTDNS_QUEUE) {
+		job = &job_queue [(job_first + job_len) % PREEMPTDNS_QUEUE];
+		job->key = key;
+		strcpy (job->hostname, hostname);
+		job_len++;
+		pthread_cond_signal (&job_cond);
+	}
+	pthread_mutex_unlock (&job_mutex);
+}
 
-		/* launch threads */
-		step = 0;
-		while (step < maxnames){
-			if (threads_array [step].hostname != NULL){
-				workthread = &threads_array [step];
-				pthread_create(&workthread->tid, NULL, nameresolv_thread, workthread);
-			} else {
-				step = maxnames;				
-			}
-			step++;
-		}	
-
-		/* wait for threads to finish */
-		step = 0;
-		while (step < maxnames){
-			if (threads_array [step].hostname != NULL){
-				workthread = &threads_array [step];
-				pthread_join (workthread->tid, NULL);
-			} else {
-				step = maxnames;				
-			}
-			step++;
-		}	
+/* resolver process main loop, never returns */
+static void preemptdns_run (void)
+{
+	char msg [PREEMPTDNS_MSG_LEN + 1];
+	char *hostname, *next;
+	pthread_t tid;
+	ssize_t msg_len;
+	int i;
 
-		free (workbuf);
-	} else {
-		debug_log_printf ("Unable to alloc work buffer (preemptdns)\n");
+	for (i = 0; i < PreemptNameResThreads; i++) {
+		if (pthread_create (&tid, NULL, preemptdns_thread, &job_running [i]) != 0)
+			break;
 	}
+	if (i == 0)
+		exit (1);
 
-	/* if it reached this point, it's the child process for sure
-	 * end of game for it */
-	exit (0);
+	while (1) {
+		if ((msg_len = recv (resolver_fd [0], msg, PREEMPTDNS_MSG_LEN, 0)) < 0) {
+			if (errno == EINTR)
+				continue;
+			exit (1);
+		}
+		msg [msg_len] = '\0';
+
+		for (hostname = msg; *hostname != '\0'; hostname = next) {
+			if ((next = strchr (hostname, '\n')) == NULL)
+				break;
+			*(next++) = '\0';
+			if (strlen (hostname) < PREEMPTDNS_HOST_LEN)
+				preemptdns_enqueue (hostname);
+		}
+	}
 }
 
+/* (daemon) starts the resolver process, if not running */
+void preemptdns_check (SOCKET sock_listen)
+{
+	pid_t pid;
+
+	if ((preemptdns_entry == NULL) || (resolver_pid > 0))
+		return;
+
+	/* don't loop too fast if it keeps dying */
+	if (time (NULL) == last_spawn)
+		return;
+	last_spawn = time (NULL);
+
+	switch (pid = fork ()) {
+	case 0:
+		signal (SIGTERM, SIG_DFL);
+		close (sock_listen);
+		close (resolver_fd [1]);
+		preemptdns_run ();
+		exit (0);
+	case -1:
+		error_log_puts (LOGMT_ERROR, LOGSS_DAEMON, "Unable to fork() the name resolver process.");
+		break;
+	default:
+		resolver_pid = pid;
+		error_log_printf (LOGMT_INFO, LOGSS_DAEMON, "Name resolver process started (%d threads).\n", PreemptNameResThreads);
+	}
+}
+
+/* ### PAGE SCANNING ### */
+
+static int is_hostname_char (const char c)
+{
+	return (isalnum ((unsigned char) c) || (c == '-') || (c == '.') || (c == '_'));
+}
+
+/* whether the name is worth resolving */
+static int preemptdns_valid_name (const char *hostname, const int hostname_len)
+{
+	int i, is_ipv4 = 1;
+
+	if ((hostname_len <= 2) || (hostname_len >= PREEMPTDNS_HOST_LEN))
+		return (0);
+
+	/* a local name is not resolved the same way by everyone,
+	 * and a trailing dot is unusual enough to be bogus */
+	if ((strchr (hostname, '.') == NULL) || (hostname [hostname_len - 1] == '.'))
+		return (0);
+
+	/* try to avoid bogus hostnames (accepts only .xxxx, .xxx or .xx) */
+	/* FIXME: won't accept .museum and long domains like that */
+	if ((PreemptNameResBC) && (hostname_len >= 5)) {
+		if (strchr (hostname + (hostname_len - 5), '.') == NULL)
+			return (0);
+	}
+
+	/* an IPv4 number needs no resolution */
+	for (i = 0; i < hostname_len; i++) {
+		if (! (isdigit ((unsigned char) hostname [i]) || (hostname [i] == '.'))) {
+			is_ipv4 = 0;
+			break;
+		}
+	}
+	return (! is_ipv4);
+}
+
+/* scans the page for absolute URLs ("scheme://[user@]host..." or,
+ * within scripts, "scheme:\/\/host...") and sends their hostnames
+ * to the resolver process. Does not modify the page. */
+void preempt_dns_from_html (const char *inbuf, int inlen)
+{
+	t_preemptdns_entry entry;
+	unsigned long long int page_keys [PreemptNameResMax > 0 ? PreemptNameResMax : 1];
+	unsigned long long int key;
+	char hostname [PREEMPTDNS_HOST_LEN];
+	char msg [PREEMPTDNS_MSG_LEN];
+	const char *colon;
+	time_t now = time (NULL);
+	int pos = 0, start, hostname_len, msg_len = 0, names = 0;
+	int i;
+
+	if ((preemptdns_entry == NULL) || (resolver_fd [1] < 0) || (PreemptNameResMax < 1))
+		return;
+
+	while ((names < PreemptNameResMax) && (pos < inlen) && ((colon = memchr (inbuf + pos, ':', inlen - pos)) != NULL)) {
+		pos = colon - inbuf + 1;
+		if ((pos + 2 <= inlen) && (inbuf [pos] == '/') && (inbuf [pos + 1] == '/'))
+			pos += 2;
+		else if ((pos + 4 <= inlen) && (memcmp (inbuf + pos, "\\/\\/", 4) == 0))
+			pos += 4;
+		else
+			continue;
+
+		/* skip user[:password]@ */
+		start = pos;
+		while ((pos < inlen) && (is_hostname_char (inbuf [pos]) || (inbuf [pos] == ':')))
+			pos++;
+		if ((pos < inlen) && (inbuf [pos] == '@'))
+			start = ++pos;
+		else
+			pos = start;
+
+		while ((pos < inlen) && is_hostname_char (inbuf [pos]) && ((pos - start) < PREEMPTDNS_HOST_LEN))
+			pos++;
+		hostname_len = pos - start;
+		if ((hostname_len >= PREEMPTDNS_HOST_LEN) || ((pos < inlen) && (inbuf [pos] == '@')))
+			continue;
+		for (i = 0; i < hostname_len; i++)
+			hostname [i] = tolower ((unsigned char) inbuf [start + i]);
+		hostname [hostname_len] = '\0';
+		if (! preemptdns_valid_name (hostname, hostname_len))
+			continue;
+
+		/* once per page, and only if not known already */
+		key = preemptdns_hash (hostname);
+		for (i = 0; (i < names) && (page_keys [i] != key); i++);	/* 1-line loop */
+		if (i < names)
+			continue;
+		page_keys [names++] = key;
+		if (preemptdns_get (hostname, key, &entry, now))
+			continue;
+
+		debug_log_printf ("Hostname (preemptdns): %s\n", hostname);
+		if (msg_len + hostname_len + 1 > PREEMPTDNS_MSG_LEN) {
+			send (resolver_fd [1], msg, msg_len, MSG_DONTWAIT);
+			msg_len = 0;
+		}
+		memcpy (msg + msg_len, hostname, hostname_len);
+		msg_len += hostname_len;
+		msg [msg_len++] = '\n';
+	}
+
+	if (names == PreemptNameResMax)
+		debug_log_printf ("Note (preemptdns): List full\n");
+
+	/* the resolver being too busy (full socket buffer) is not a reason to delay the page */
+	if (msg_len > 0)
+		send (resolver_fd [1], msg, msg_len, MSG_DONTWAIT);
+}
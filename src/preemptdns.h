@@ -23,21 +23,24 @@
  * ---------------------------------------------------------------------
  */
 
-
-//#include <stdio.h>
-//#include <time.h>
-//#include <sys/time.h>
-
-//If this is included in preemptdns.c, make declarations local.
-#ifdef SRC_PREEMPTDNS_C
-#define EXTERN
-#else
-#define EXTERN extern
-#endif
-
 //To stop multiple inclusions.
 #ifndef SRC_PREEMPTDNS_H
 #define SRC_PREEMPTDNS_H
-#endif
 
-EXTERN void preempt_dns_from_html (char* inbuf, int inlen);
+#include <sys/types.h>
+#include <netinet/in.h>
+
+#include "globaldefs.h"
+
+/* upper limit for PreemptNameResThreads (names resolved in parallel) */
+#define PREEMPTDNS_MAX_THREADS	64
+
+extern int preemptdns_init (const int in_entries, const int in_ttl);
+extern void preemptdns_check (SOCKET sock_listen);
+extern int preemptdns_reaped (pid_t pid);
+extern void preemptdns_child_cleanup (void);
+extern int preemptdns_lookup (const char *hostname, struct in_addr *addrs, const int max_addrs);
+extern void preempt_dns_from_html (const char *inbuf, int inlen);
+
+#endif //SRC_PREEMPTDNS_H
+
@@ -0,0 +1,483 @@
+/* prefetch.c
+ * Prefetching of the resources HTML pages are about to request.
+ *
+ * Ziproxy - the HTTP acceleration proxy
+ * This code is under the following conditions:
+ *
+ * ---------------------------------------------------------------------
+ * Copyright (c)2005-2014 Daniel Mealha Cabrita
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111 USA
+ * ---------------------------------------------------------------------
+ */
+
+/*
+ * Once an HTML page is processed, we know which stylesheets, scripts and
+ * images the browser is going to request next. When Prefetch is enabled,
+ * those are collected while the page is processed in memory (stylesheets
+ * first, then scripts, then images, in the order they appear, up to
+ * PrefetchMax) and, after the page is sent, requested from this very
+ * Ziproxy, up to PrefetchParallel at once and up to PrefetchBudget bytes
+ * per page.
+ *
+ * Each of those is a regular request: fetched, processed (images
+ * recompressed etc) and coalesced (see coalesce.c), except that its result
+ * is kept for PrefetchTTL seconds instead of being dropped at once (see
+ * coalesce_keep_result()). When the browser asks for it, while in progress
+ * or afterwards, it gets that result straight away.
+ *
+ * The requests carry the client's User-Agent, Accept-Encoding and
+ * X-Ziproxy-Flags (the result depends on those), no cookies, and
+ * PREFETCH_HEADER with a random token known only by the processes of this
+ * daemon. Only such requests have their results kept, and they're not
+ * subject to proxy authentication (the page request was authenticated).
+ * Images with srcset or loading="lazy" are not prefetched, since the browser
+ * may never request those (or request a different URL).
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "prefetch.h"
+#include "subres.h"
+#include "cfgfile.h"
+#include "session.h"
+#include "log.h"
+
+#define PREFETCH_TOKEN_LEN	16	/* random bytes, sent as hex */
+#define PREFETCH_TIMEOUT	30	/* seconds, for all the prefetching of a page */
+#define PREFETCH_BUFSIZE	16384
+
+/* prefetch order */
+#define PF_STYLESHEET	0
+#define PF_SCRIPT	1
+#define PF_IMAGE	2
+#define PF_KINDS	3
+
+static const char *prefetch_accept [PF_KINDS] = { "text/css,*/*;q=0.1", "*/*", "image/*" };
+
+/* elements whose contents are not markup */
+static const char *prefetch_raw_elements [] = { "script", "style", "textarea", "title", "xmp", "noscript", NULL };
+
+typedef struct {
+	char *url;
+	int kind;
+} t_prefetch_url;
+
+typedef struct {
+	const char *src;
+	int len;
+	char base [SUBRES_URL_LEN];
+	int has_base_element;
+	t_prefetch_url found [PF_KINDS][PREFETCH_MAX_URLS];
+	int found_len [PF_KINDS];
+} t_prefetch_page;
+
+/* inherited from the daemon, "" if prefetching is disabled */
+static char prefetch_token [(PREFETCH_TOKEN_LEN * 2) + 1] = "";
+
+/* (page request process) to be prefetched after the page is sent */
+static t_prefetch_url prefetch_urls [PREFETCH_MAX_URLS];
+static int prefetch_urls_len = 0;
+static char *prefetch_user_agent = NULL;
+static char *prefetch_accept_encoding = NULL;
+static char *prefetch_ziproxy_flags = NULL;
+static char *prefetch_referer = NULL;
+
+static void prefetch_deferred_work (void);
+
+/* must be invoked by the daemon before forking.
+ * if not invoked, nothing is prefetched.
+ * returns: 0 - ok, != 0 - unable to generate the token (remains disabled) */
+int prefetch_init (void)
+{
+	unsigned char random_bytes [PREFETCH_TOKEN_LEN];
+	int fd, i;
+
+	if ((fd = open ("/dev/urandom", O_RDONLY)) < 0)
+		return (1);
+	if (read (fd, random_bytes, PREFETCH_TOKEN_LEN) != PREFETCH_TOKEN_LEN) {
+		close (fd);
+		return (1);
+	}
+	close (fd);
+
+	for (i = 0; i < PREFETCH_TOKEN_LEN; i++)
+		sprintf (prefetch_token + (i * 2), "%02x", random_bytes [i]);
+	return (0);
+}
+
+/* value: contents of PREFETCH_HEADER
+ * returns: != 0 if the request was made by our prefetcher */
+int prefetch_check_token (const char *value)
+{
+	if (prefetch_token [0] == '\0')
+		return (0);
+	while (isspace (*value))
+		value++;
+	return ((strncmp (value, prefetch_token, PREFETCH_TOKEN_LEN * 2) == 0) && \
+		((value [PREFETCH_TOKEN_LEN * 2] == '\0') || isspace (value [PREFETCH_TOKEN_LEN * 2])));
+}
+
+/* ### PAGE SCANNING ### */
+
+/* records the reference at src[start..end) as a resource of the given kind */
+static void prefetch_add (t_prefetch_page *page, int start, int end, const int kind)
+{
+	char value [SUBRES_URL_LEN];
+	char url [SUBRES_URL_LEN];
+	int value_len = 0, pos, i, j;
+
+	if (page->found_len [kind] >= PrefetchMax)
+		return;
+
+	while ((start < end) && isspace (page->src [start]))
+		start++;
+	while ((end > start) && isspace (page->src [end - 1]))
+		end--;
+	if (((end - start) >= SUBRES_URL_LEN) || (end == start))
+		return;
+
+	/* only &amp; is decoded, as in imginline.c */
+	for (pos = start; pos < end; pos++) {
+		if (subres_match (page->src, end, pos, "&amp;"))
+			pos += 4;
+		value [value_len++] = page->src [pos];
+	}
+	value [value_len] = '\0';
+
+	/* https is tunneled (CONNECT), only http goes through the optimizations */
+	if (subres_resolve (page->base, value, url, sizeof (url)) || (strncmp (url, "http://", 7) != 0))
+		return;
+	if ((pos = strcspn (url, "#")) > 0)
+		url [pos] = '\0';
+
+	for (i = 0; i < PF_KINDS; i++) {
+		for (j = 0; j < page->found_len [i]; j++) {
+			if (strcmp (page->found [i][j].url, url) == 0)
+				return;
+		}
+	}
+
+	if ((page->found [kind][page->found_len [kind]].url = strdup (url)) != NULL)
+		page->found [kind][page->found_len [kind]++].kind = kind;
+}
+
+/* returns: != 0 if the attribute value at src[start..end) has 'word' as one of its tokens */
+static int prefetch_has_token (const char *src, int start, const int end, const char *word)
+{
+	int word_len = strlen (word);
+
+	while ((start = subres_find (src, end, start, word)) < end) {
+		if (((start == 0) || ((! isalnum (src [start - 1])) && (src [start - 1] != '-'))) && \
+			((start + word_len == end) || ((! isalnum (src [start + word_len])) && (src [start + word_len] != '-'))))
+			return (1);
+		start += word_len;
+	}
+	return (0);
+}
+
+/* processes the tag at src[pos] ('<').
+ * returns: position after the tag (or after the element, for raw elements) */
+static int prefetch_scan_tag (t_prefetch_page *page, int pos)
+{
+	const char *src = page->src;
+	const int len = page->len;
+	int name_start, name_len;
+	int attr_start, attr_len;
+	int value_start, value_end;
+	int is_img, is_script, is_link, is_base;
+	int ref_start = 0, ref_end = 0;
+	int stylesheet = 0, alternate = 0, skip = 0;
+	char end_tag [16];
+	int i;
+
+	name_start = ++pos;
+	while ((pos < len) && (isalnum (src [pos]) || (src [pos] == '-') || (src [pos] == ':')))
+		pos++;
+	if ((name_len = pos - name_start) == 0)
+		return (pos);
+
+	is_img = (name_len == 3) && (strncasecmp (src + name_start, "img", 3) == 0);
+	is_script = (name_len == 6) && (strncasecmp (src + name_start, "script", 6) == 0);
+	is_link = (name_len == 4) && (strncasecmp (src + name_start, "link", 4) == 0);
+	is_base = (name_len == 4) && (strncasecmp (src + name_start, "base", 4) == 0);
+
+	/* attributes */
+	while (pos < len) {
+		while ((pos < len) && (isspace (src [pos]) || (src [pos] == '/')))
+			pos++;
+		if ((pos >= len) || (src [pos] == '>'))
+			break;
+
+		attr_start = pos;
+		while ((pos < len) && (! isspace (src [pos])) && (src [pos] != '=') && (src [pos] != '>') && (src [pos] != '/'))
+			pos++;
+		attr_len = pos - attr_start;
+		if (attr_len == 0)
+			pos++;	/* stray '=' */
+		while ((pos < len) && isspace (src [pos]))
+			pos++;
+
+		value_start = value_end = pos;
+		if ((pos < len) && (src [pos] == '=') && (attr_len > 0)) {
+			pos++;
+			while ((pos < len) && isspace (src [pos]))
+				pos++;
+			if ((pos < len) && ((src [pos] == '"') || (src [pos] == '\''))) {
+				char quote = src [pos++];
+
+				value_start = pos;
+				while ((pos < len) && (src [pos] != quote))
+					pos++;
+				value_end = pos;
+				if (pos < len)
+					pos++;
+			} else {
+				value_start = pos;
+				while ((pos < len) && (! isspace (src [pos])) && (src [pos] != '>'))
+					pos++;
+				value_end = pos;
+			}
+		}
+
+		if (((is_img || is_script) && (attr_len == 3) && (strncasecmp (src + attr_start, "src", 3) == 0)) || \
+			((is_link || is_base) && (attr_len == 4) && (strncasecmp (src + attr_start, "href", 4) == 0))) {
+			ref_start = value_start;
+			ref_end = value_end;
+		} else if (is_img && (attr_len == 6) && (strncasecmp (src + attr_start, "srcset", 6) == 0)) {
+			skip = 1;
+		} else if (is_img && (attr_len == 7) && (strncasecmp (src + attr_start, "loading", 7) == 0)) {
+			skip |= subres_match (src, value_end, value_start, "lazy");
+		} else if (is_script && (attr_len == 4) && (strncasecmp (src + attr_start, "type", 4) == 0)) {
+			/* templates etc, not fetched by the browser */
+			skip |= (value_end > value_start) && (! prefetch_has_token (src, value_start, value_end, "javascript")) && \
+				(! prefetch_has_token (src, value_start, value_end, "module"));
+		} else if (is_link && (attr_len == 3) && (strncasecmp (src + attr_start, "rel", 3) == 0)) {
+			stylesheet = prefetch_has_token (src, value_start, value_end, "stylesheet");
+			alternate = prefetch_has_token (src, value_start, value_end, "alternate");
+		}
+	}
+	if (pos < len)
+		pos++;
+
+	if ((ref_end > ref_start) && (! skip)) {
+		if (is_img)
+			prefetch_add (page, ref_start, ref_end, PF_IMAGE);
+		else if (is_script)
+			prefetch_add (page, ref_start, ref_end, PF_SCRIPT);
+		else if (is_link && stylesheet && (! alternate))
+			prefetch_add (page, ref_start, ref_end, PF_STYLESHEET);
+		else if (is_base && (! page->has_base_element)) {
+			char href [SUBRES_URL_LEN];
+			char base [SUBRES_URL_LEN];
+
+			/* only the first one counts, and only if resolvable */
+			page->has_base_element = 1;
+			if ((ref_end - ref_start < SUBRES_URL_LEN) && (memchr (src + ref_start, '&', ref_end - ref_start) == NULL)) {
+				memcpy (href, src + ref_start, ref_end - ref_start);
+				href [ref_end - ref_start] = '\0';
+				if (subres_resolve (page->base, href, base, sizeof (base)) == 0)
+					strcpy (page->base, base);
+			}
+		}
+	}
+
+	/* element contents */
+	for (i = 0; prefetch_raw_elements [i] != NULL; i++) {
+		if ((name_len == strlen (prefetch_raw_elements [i])) && (strncasecmp (src + name_start, prefetch_raw_elements [i], name_len) == 0)) {
+			snprintf (end_tag, sizeof (end_tag), "</%s", prefetch_raw_elements [i]);
+			return (subres_find (src, len, pos, end_tag));
+		}
+	}
+	return (pos);
+}
+
+/* collects the resources the HTML page in src[0..len) will make the browser request,
+ * to be prefetched once this process is done with the page */
+void prefetch_from_html (const http_headers *chdr, const char *src, const int len)
+{
+	t_prefetch_page *page;
+	const char *found;
+	int pos = 0;
+	int i, j;
+
+	if ((prefetch_token [0] == '\0') || (prefetch_urls_len > 0) || (chdr->url == NULL) || \
+		(strncmp (chdr->url, "http://", 7) != 0) || (strlen (chdr->url) >= SUBRES_URL_LEN))
+		return;
+	if ((page = calloc (1, sizeof (t_prefetch_page))) == NULL)
+		return;
+	page->src = src;
+	page->len = len;
+	strcpy (page->base, chdr->url);
+
+	while (pos < len) {
+		if ((found = memchr (src + pos, '<', len - pos)) == NULL)
+			break;
+		pos = found - src;
+
+		if (subres_match (src, len, pos, "<!--"))
+			pos = subres_find (src, len, pos + 4, "-->");
+		else
+			pos = prefetch_scan_tag (page, pos);
+	}
+
+	/* the ones blocking the page rendering first */
+	for (i = 0; i < PF_KINDS; i++) {
+		for (j = 0; j < page->found_len [i]; j++) {
+			if (prefetch_urls_len < PrefetchMax)
+				prefetch_urls [prefetch_urls_len++] = page->found [i][j];
+			else
+				free (page->found [i][j].url);
+		}
+	}
+	free (page);
+
+	debug_log_printf ("Prefetch: %d resources to be prefetched.\n", prefetch_urls_len);
+	if (prefetch_urls_len == 0)
+		return;
+
+	/* the result depends on those, as for the client */
+	if (chdr->user_agent != NULL)
+		prefetch_user_agent = strdup (chdr->user_agent);
+	if ((found = find_header ("Accept-Encoding:", chdr)) != NULL)
+		prefetch_accept_encoding = strdup (found);
+	if (chdr->x_ziproxy_flags != NULL)
+		prefetch_ziproxy_flags = strdup (chdr->x_ziproxy_flags);
+	prefetch_referer = strdup (chdr->url);
+
+	atexit (prefetch_deferred_work);
+}
+
+/* ### PREFETCHING ### */
+
+/* requests 'res' from this Ziproxy.
+ * returns: socket to read the response from, or <0 if error */
+static int prefetch_request (const t_prefetch_url *res)
+{
+	struct sockaddr_in sock_addr;
+	char request [SUBRES_URL_LEN * 3 + 1024];
+	char host [SUBRES_HOST_LEN];
+	int request_len, host_len;
+	int sockfd;
+
+	/* authority of the URL (host[:port]) */
+	host_len = strcspn (res->url + 7, "/?#");
+	if (host_len >= SUBRES_HOST_LEN)
+		return (-1);
+	memcpy (host, res->url + 7, host_len);
+	host [host_len] = '\0';
+
+	request_len = snprintf (request, sizeof (request), "GET %s HTTP/1.0\r\nHost: %s\r\n%s%s%sAccept: %s\r\n%s%s%s%s%s%sReferer: %s\r\n%s: %s\r\nConnection: close\r\n\r\n", \
+		res->url, host, \
+		(prefetch_user_agent != NULL) ? "User-Agent:" : "", (prefetch_user_agent != NULL) ? prefetch_user_agent : "", (prefetch_user_agent != NULL) ? "\r\n" : "", \
+		prefetch_accept [res->kind], \
+		(prefetch_accept_encoding != NULL) ? "Accept-Encoding:" : "", (prefetch_accept_encoding != NULL) ? prefetch_accept_encoding : "", (prefetch_accept_encoding != NULL) ? "\r\n" : "", \
+		(prefetch_ziproxy_flags != NULL) ? "X-Ziproxy-Flags: " : "", (prefetch_ziproxy_flags != NULL) ? prefetch_ziproxy_flags : "", (prefetch_ziproxy_flags != NULL) ? "\r\n" : "", \
+		prefetch_referer, PREFETCH_HEADER, prefetch_token);
+	if (request_len >= sizeof (request))
+		return (-1);
+
+	memset (&sock_addr, 0, sizeof (sock_addr));
+	sock_addr.sin_family = AF_INET;
+	sock_addr.sin_port = htons (Port);
+	if ((Address != NULL) && (*Address != '\0'))
+		sock_addr.sin_addr.s_addr = inet_addr (Address);
+	else
+		sock_addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+
+	if ((sockfd = socket (AF_INET, SOCK_STREAM, 0)) < 0)
+		return (-1);
+	/* MSG_NOSIGNAL: a closed connection must not raise SIGPIPE in the whole process */
+	if ((connect (sockfd, (struct sockaddr *) &sock_addr, sizeof (sock_addr)) != 0) || \
+		(send (sockfd, request, request_len, MSG_NOSIGNAL) != request_len)) {
+		close (sockfd);
+		return (-1);
+	}
+	fcntl (sockfd, F_SETFL, fcntl (sockfd, F_GETFL) | O_NONBLOCK);
+
+	debug_log_printf ("Prefetch: %s\n", res->url);
+	return (sockfd);
+}
+
+/* invoked when the page request process ends:
+ * requests the collected resources, discarding the responses
+ * (what matters is those being processed and kept for the browser) */
+static void prefetch_deferred_work (void)
+{
+	struct pollfd pfds [PREFETCH_MAX_URLS];
+	char buf [PREFETCH_BUFSIZE];
+	time_t deadline;
+	long received = 0;
+	int next = 0, active = 0;
+	int i, read_len;
+
+	if (prefetch_urls_len == 0)
+		return;
+
+	/* the response is complete, don't make the client wait for us */
+	if (sess_wclient != NULL) {
+		fflush (sess_wclient);
+		shutdown (fileno (sess_wclient), SHUT_RDWR);
+	}
+	alarm (PREFETCH_TIMEOUT + 1);
+	deadline = time (NULL) + PREFETCH_TIMEOUT;
+
+	while (time (NULL) < deadline) {
+		/* up to PrefetchParallel at once, until the budget is exhausted */
+		while ((next < prefetch_urls_len) && (active < PrefetchParallel) && (received < PrefetchBudget)) {
+			if ((pfds [active].fd = prefetch_request (&prefetch_urls [next++])) >= 0) {
+				pfds [active].events = POLLIN;
+				active++;
+			}
+		}
+		if (active == 0)
+			break;
+
+		if (poll (pfds, active, 1000) <= 0)
+			continue;
+		for (i = 0; i < active; i++) {
+			if (! (pfds [i].revents & (POLLIN | POLLERR | POLLHUP)))
+				continue;
+			if ((read_len = read (pfds [i].fd, buf, PREFETCH_BUFSIZE)) > 0) {
+				received += read_len;
+			} else if ((read_len == 0) || (errno != EAGAIN)) {
+				close (pfds [i].fd);
+				pfds [i--] = pfds [--active];
+			}
+		}
+	}
+
+	for (i = 0; i < active; i++)
+		close (pfds [i].fd);
+	debug_log_printf ("Prefetch: %d of %d resources requested, %ld bytes received.\n", next, prefetch_urls_len, received);
+	prefetch_urls_len = 0;
+}
@@ -0,0 +1,44 @@
+/* prefetch.h
+ * Prefetching of the resources HTML pages are about to request.
+ *
+ * Ziproxy - the HTTP acceleration proxy
+ * This code is under the following conditions:
+ *
+ * ---------------------------------------------------------------------
+ * Copyright (c)2005-2014 Daniel Mealha Cabrita
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111 USA
+ * ---------------------------------------------------------------------
+ */
+
+// To stop multiple inclusions.
+#ifndef SRC_PREFETCH_H
+#define SRC_PREFETCH_H
+
+#include "globaldefs.h"
+#include "http.h"
+
+/* header marking the requests made by the prefetcher (never forwarded) */
+#define PREFETCH_HEADER		"X-Ziproxy-Prefetch"
+
+/* upper limit for PrefetchMax (resources prefetched per page) */
+#define PREFETCH_MAX_URLS	64
+
+extern int prefetch_init (void);
+extern int prefetch_check_token (const char *value);
+extern void prefetch_from_html (const http_headers *chdr, const char *src, const int len);
+
+#endif //SRC_PREFETCH_H
+
@@ -0,0 +1,874 @@
+/* shdict.c
+ * Shared-dictionary (Zstandard) compression between paired Ziproxies
+ *
+ * Ziproxy - the HTTP acceleration proxy
+ * This code is under the following conditions:
+ *
+ * ---------------------------------------------------------------------
+ * Copyright (c)2005-2014 Daniel Mealha Cabrita
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111 USA
+ * ---------------------------------------------------------------------
+ */
+
+/*
+ * Ziproxies are often deployed in pairs: one near the clients, other at
+ * the far (fast) end of the narrow link. HTML, CSS and JS share a lot of
+ * boilerplate between pages and sites, and a dictionary trained from the
+ * recent traffic lets Zstandard compress even small objects much better.
+ *
+ * - far end (SharedDictCompress): samples the processed text bodies sent to
+ *   paired Ziproxies, trains a dictionary every SharedDictTrainInterval
+ *   seconds and compresses to SHDICT_CODING for paired Ziproxies holding
+ *   that very dictionary. It also serves the dictionary as
+ *   http://SHDICT_HOST/<id>.
+ * - near end (AnnounceSharedDictCapability): announces its dictionary id
+ *   with X-Ziproxy-Flags, fetches a new dictionary (through NextProxy)
+ *   when the far end informs a different one, and decodes SHDICT_CODING
+ *   like any other encoding (the browsers get gzip etc, as usual).
+ *
+ * Dictionaries are kept as SharedDictDir/<id>.dict, SharedDictDir/current
+ * holds the id in use. The id is the one embedded in the dictionary by the
+ * trainer, which is also written in every frame.
+ *
+ * The daemon loads the current dictionary (shdict_refresh()) and the request
+ * processes inherit it ready for use. Training and fetching are done by a
+ * request process after its response is sent, in order not to delay it.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef ZSTD
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <zstd.h>
+#include <zdict.h>
+
+#include "shdict.h"
+#include "cfgfile.h"
+#include "session.h"
+#include "log.h"
+#include "tosmarking.h"
+#include "globaldefs.h"
+
+#define BUFSIZE 16384
+
+#define SHDICT_SAMPLE_MIN	256	/* smaller bodies are not worth sampling */
+#define SHDICT_SAMPLE_MAX	16384	/* only the beginning of bigger bodies is sampled */
+#define SHDICT_MAX_FILE		(1048576 + 4096)	/* biggest dictionary accepted (SharedDictSize + headers) */
+#define SHDICT_FETCH_TIMEOUT	60	/* a fetch older than that is considered failed */
+#define SHDICT_PATH_LEN		1024
+
+typedef struct {
+	pthread_mutex_t lock;
+	unsigned int current_id;	/* dictionary to be used (0: none) */
+	time_t last_train;		/* (far end) when the current dictionary was trained */
+	int training;			/* (far end) a process is training a new dictionary */
+	unsigned int fetching_id;	/* (near end) dictionary being fetched (0: none) */
+	time_t fetch_start;
+	int samples;			/* (far end) samples collected so far */
+	size_t pool_used;
+	/* followed by: size_t sample_len [SharedDictTrainSamples]
+	 *              char pool [SharedDictTrainSamples * SHDICT_SAMPLE_MAX] */
+} t_shdict_shared;
+
+static t_shdict_shared *shared = NULL;
+static size_t *sample_len;
+static char *pool;
+
+/* dictionary loaded by this process */
+static unsigned int loaded_id = 0;
+static ZSTD_CDict *cdict = NULL;
+static ZSTD_DDict *ddict = NULL;
+static ZSTD_CCtx *cctx = NULL;
+static ZSTD_DCtx *dctx = NULL;
+
+/* work to be done after the response is sent */
+static int train_pending = 0;
+static unsigned int fetch_pending = 0;
+static int deferred_registered = 0;
+
+/* state of the body being read from source */
+typedef struct {
+	int de_chunk;
+	int pending_chunk_len;
+	int first_chunk;
+	int finished;
+} t_shdict_source;
+
+static void shdict_deferred_work (void);
+
+static void shdict_source_init (t_shdict_source *src_state, int de_chunk)
+{
+	src_state->de_chunk = de_chunk;
+	src_state->pending_chunk_len = 0;
+	src_state->first_chunk = 1;
+	src_state->finished = 0;
+}
+
+/* reads up to BUFSIZE bytes of the body into buf, de-chunking it if requested.
+ * src_state->finished is set once the end of the body is reached.
+ * returns: the number of bytes read */
+static size_t shdict_read (t_shdict_source *src_state, FILE *source, unsigned char *buf)
+{
+	int to_read_len = BUFSIZE;
+	size_t read_len;
+
+	if (src_state->de_chunk) {
+		if (src_state->pending_chunk_len == 0) {
+			// discards chunk end CRLF
+			if (src_state->first_chunk == 0) {
+				fgetc (source);
+				fgetc (source);
+			} else {
+				src_state->first_chunk = 0;
+			}
+
+			if ((fscanf (source, "%x", &(src_state->pending_chunk_len)) != 1) || (src_state->pending_chunk_len <= 0)) {
+				// last chunk, the rest of source will be discarded
+				src_state->finished = 1;
+				return (0);
+			} else {
+				int prevchar = '\0';
+				int curchar = '\0';
+
+				// Eat any chunk-extension(RFC2616) up to CRLF.
+				while (! ((prevchar == '\r') && (curchar == '\n'))) {
+					prevchar = curchar;
+					if ((curchar = fgetc (source)) == EOF) {
+						src_state->finished = 1;
+						return (0);
+					}
+				}
+			}
+		}
+
+		if (src_state->pending_chunk_len > BUFSIZE)
+			to_read_len = BUFSIZE;
+		else
+			to_read_len = src_state->pending_chunk_len;
+		src_state->pending_chunk_len -= to_read_len;
+	}
+
+	read_len = fread (buf, 1, to_read_len, source);
+	if (feof (source) || ferror (source))
+		src_state->finished = 1;
+
+	return (read_len);
+}
+
+static void shdict_dict_path (char *path, unsigned int id)
+{
+	snprintf (path, SHDICT_PATH_LEN, "%s/%u.dict", SharedDictDir, id);
+}
+
+/* reads a whole file into a newly-allocated buffer.
+ * returns: the buffer (*len defined) or NULL if error */
+static char *shdict_read_file (const char *path, size_t max_len, size_t *len)
+{
+	FILE *file;
+	char *buf;
+
+	if ((file = fopen (path, "rb")) == NULL)
+		return (NULL);
+	if ((buf = malloc (max_len)) == NULL) {
+		fclose (file);
+		return (NULL);
+	}
+	*len = fread (buf, 1, max_len, file);
+	fclose (file);
+	return (buf);
+}
+
+/* writes data as path, atomically (other processes never see a partial file).
+ * returns: ==0 ok, !=0 error */
+static int shdict_write_file (const char *path, const char *data, size_t len)
+{
+	char tmp_path [SHDICT_PATH_LEN + 32];
+	FILE *file;
+
+	snprintf (tmp_path, sizeof (tmp_path), "%s.%d.tmp", path, (int) getpid ());
+	if ((file = fopen (tmp_path, "wb")) == NULL)
+		return (1);
+	if ((fwrite (data, 1, len, file) != len) | (fclose (file) != 0)) {
+		unlink (tmp_path);
+		return (1);
+	}
+	if (rename (tmp_path, path) != 0) {
+		unlink (tmp_path);
+		return (1);
+	}
+	return (0);
+}
+
+/* stores a new dictionary and makes it the current one.
+ * the previous one is removed (the processes using it already have it loaded).
+ * returns: ==0 ok, !=0 error */
+static int shdict_store (unsigned int id, const char *dict, size_t dict_len)
+{
+	char path [SHDICT_PATH_LEN];
+	char id_str [16];
+	unsigned int previous_id = shared->current_id;
+
+	shdict_dict_path (path, id);
+	if (shdict_write_file (path, dict, dict_len) != 0)
+		return (1);
+
+	snprintf (id_str, sizeof (id_str), "%u\n", id);
+	snprintf (path, sizeof (path), "%s/current", SharedDictDir);
+	if (shdict_write_file (path, id_str, strlen (id_str)) != 0)
+		return (1);
+
+	if ((previous_id != 0) && (previous_id != id)) {
+		shdict_dict_path (path, previous_id);
+		unlink (path);
+	}
+	return (0);
+}
+
+/* loads the dictionary 'id' from SharedDictDir, replacing the one in use.
+ * returns: ==0 ok, !=0 error (the previous dictionary is kept) */
+static int shdict_load (unsigned int id)
+{
+	char path [SHDICT_PATH_LEN];
+	char *dict;
+	size_t dict_len;
+
+	shdict_dict_path (path, id);
+	if ((dict = shdict_read_file (path, SHDICT_MAX_FILE, &dict_len)) == NULL)
+		return (1);
+	if (ZDICT_getDictID (dict, dict_len) != id) {
+		free (dict);
+		return (1);
+	}
+
+	if (SharedDictCompress) {
+		ZSTD_CDict *new_cdict;
+
+		if ((new_cdict = ZSTD_createCDict (dict, dict_len, ZstdLevelMemory)) == NULL) {
+			free (dict);
+			return (1);
+		}
+		if (cdict != NULL)
+			ZSTD_freeCDict (cdict);
+		cdict = new_cdict;
+	} else {
+		ZSTD_DDict *new_ddict;
+
+		if ((new_ddict = ZSTD_createDDict (dict, dict_len)) == NULL) {
+			free (dict);
+			return (1);
+		}
+		if (ddict != NULL)
+			ZSTD_freeDDict (ddict);
+		ddict = new_ddict;
+	}
+
+	free (dict);
+	loaded_id = id;
+	return (0);
+}
+
+/* allocates the state shared among the request processes and loads the
+ * current dictionary (if any). Must be called by the daemon, before forking.
+ * returns: SHDICT_OK or SHDICT_MEM_ERROR */
+int shdict_init (void)
+{
+	pthread_mutexattr_t lock_attr;
+	size_t shared_size;
+	char path [SHDICT_PATH_LEN];
+	FILE *file;
+	unsigned int id = 0;
+
+	if (! (SharedDictCompress || AnnounceSharedDictCapability))
+		return (SHDICT_OK);
+
+	/* the near end has no use for the samples */
+	shared_size = sizeof (t_shdict_shared);
+	if (SharedDictCompress)
+		shared_size += (SharedDictTrainSamples * sizeof (size_t)) + ((size_t) SharedDictTrainSamples * SHDICT_SAMPLE_MAX);
+
+	if ((shared = mmap (NULL, shared_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+		shared = NULL;
+		return (SHDICT_MEM_ERROR);
+	}
+	memset (shared, 0, sizeof (t_shdict_shared));
+	sample_len = (size_t *) (shared + 1);
+	pool = (char *) (sample_len + SharedDictTrainSamples);
+
+	pthread_mutexattr_init (&lock_attr);
+	if (pthread_mutexattr_setpshared (&lock_attr, PTHREAD_PROCESS_SHARED) != 0) {
+		pthread_mutexattr_destroy (&lock_attr);
+		munmap (shared, shared_size);
+		shared = NULL;
+		return (SHDICT_MEM_ERROR);
+	}
+	pthread_mutex_init (&(shared->lock), &lock_attr);
+	pthread_mutexattr_destroy (&lock_attr);
+
+	/* dictionary from the previous run, if any */
+	snprintf (path, sizeof (path), "%s/current", SharedDictDir);
+	if ((file = fopen (path, "r")) != NULL) {
+		if (fscanf (file, "%u", &id) != 1)
+			id = 0;
+		fclose (file);
+	}
+	if ((id != 0) && (shdict_load (id) == 0)) {
+		shared->current_id = id;
+		/* do not retrain right away */
+		shared->last_train = time (NULL);
+		error_log_printf (LOGMT_INFO, LOGSS_DAEMON, "Shared dictionary %u loaded.\n", id);
+	}
+
+	return (SHDICT_OK);
+}
+
+/* loads the current dictionary, if it was replaced by some request process.
+ * invoked periodically by the daemon, so new request processes inherit it. */
+void shdict_refresh (void)
+{
+	unsigned int id;
+
+	if (shared == NULL)
+		return;
+
+	id = shared->current_id;
+	if ((id != 0) && (id != loaded_id)) {
+		if (shdict_load (id) == 0)
+			error_log_printf (LOGMT_INFO, LOGSS_DAEMON, "Shared dictionary %u loaded.\n", id);
+	}
+}
+
+/* id of the dictionary loaded in this process (0: none) */
+unsigned int shdict_current_id (void)
+{
+	return (loaded_id);
+}
+
+/* whether the request comes from a Ziproxy announcing shared-dictionary capability */
+int shdict_client_is_paired (const char *x_ziproxy_flags)
+{
+	if ((shared == NULL) || (x_ziproxy_flags == NULL))
+		return (0);
+	return (strstr (x_ziproxy_flags, SHDICT_FLAG) != NULL);
+}
+
+/* whether the requesting Ziproxy holds the very dictionary loaded here */
+int shdict_client_has_current (const char *x_ziproxy_flags)
+{
+	const char *id_str;
+
+	if ((! shdict_client_is_paired (x_ziproxy_flags)) || (loaded_id == 0) || (cdict == NULL))
+		return (0);
+	if ((id_str = strstr (x_ziproxy_flags, SHDICT_FLAG "=")) == NULL)
+		return (0);
+	return (strtoul (id_str + strlen (SHDICT_FLAG "="), NULL, 10) == loaded_id);
+}
+
+/* (near end) appends the shared-dictionary capability to the X-Ziproxy-Flags value */
+void shdict_announce (char *flags, int flags_size)
+{
+	int len = strlen (flags);
+
+	if ((shared == NULL) || (! AnnounceSharedDictCapability))
+		return;
+
+	if (loaded_id != 0)
+		snprintf (flags + len, flags_size - len, "%s%s=%u", (len > 0) ? ", " : "", SHDICT_FLAG, loaded_id);
+	else
+		snprintf (flags + len, flags_size - len, "%s%s", (len > 0) ? ", " : "", SHDICT_FLAG);
+}
+
+static void shdict_register_deferred (void)
+{
+	if (! deferred_registered) {
+		atexit (shdict_deferred_work);
+		deferred_registered = 1;
+	}
+}
+
+/* (near end) the remote Ziproxy informed its current dictionary,
+ * fetch it (after this response) if we don't have it yet */
+void shdict_remote_id (const char *header_value)
+{
+	unsigned int id;
+	time_t now;
+
+	if ((shared == NULL) || (! AnnounceSharedDictCapability) || (NextProxy == NULL) || (header_value == NULL))
+		return;
+	if (((id = strtoul (header_value, NULL, 10)) == 0) || (id == loaded_id))
+		return;
+
+	now = time (NULL);
+	pthread_mutex_lock (&(shared->lock));
+	/* already fetched (daemon will load it soon) or being fetched by another process? */
+	if ((shared->current_id == id) || ((shared->fetching_id != 0) && ((now - shared->fetch_start) < SHDICT_FETCH_TIMEOUT))) {
+		pthread_mutex_unlock (&(shared->lock));
+		return;
+	}
+	shared->fetching_id = id;
+	shared->fetch_start = now;
+	pthread_mutex_unlock (&(shared->lock));
+
+	debug_log_printf ("Shared dictionary %u announced by remote Ziproxy, will be fetched.\n", id);
+	fetch_pending = id;
+	shdict_register_deferred ();
+}
+
+/* (far end) collects a text body sent to a paired Ziproxy, for training
+ * the next dictionary. The process providing the last sample trains it. */
+void shdict_add_sample (const char *data, ZP_DATASIZE_TYPE len)
+{
+	time_t now;
+
+	if ((shared == NULL) || (! SharedDictCompress) || (len < SHDICT_SAMPLE_MIN))
+		return;
+	if (len > SHDICT_SAMPLE_MAX)
+		len = SHDICT_SAMPLE_MAX;
+
+	now = time (NULL);
+	pthread_mutex_lock (&(shared->lock));
+	if (shared->training || (shared->samples >= SharedDictTrainSamples) || \
+		((shared->current_id != 0) && ((now - shared->last_train) < SharedDictTrainInterval))) {
+		pthread_mutex_unlock (&(shared->lock));
+		return;
+	}
+
+	memcpy (pool + shared->pool_used, data, len);
+	sample_len [shared->samples++] = len;
+	shared->pool_used += len;
+
+	if (shared->samples == SharedDictTrainSamples) {
+		shared->training = 1;
+		train_pending = 1;
+	}
+	pthread_mutex_unlock (&(shared->lock));
+
+	if (train_pending) {
+		debug_log_puts ("Shared dictionary: enough samples collected, will train a new dictionary.");
+		shdict_register_deferred ();
+	}
+}
+
+/* trains a new dictionary from the collected samples.
+ * the samples are not modified meanwhile, since shared->training is set */
+static void shdict_train (void)
+{
+	char *dict;
+	size_t dict_len;
+	unsigned int id = 0;
+
+	if ((dict = malloc (SharedDictSize)) != NULL) {
+		dict_len = ZDICT_trainFromBuffer (dict, SharedDictSize, pool, sample_len, shared->samples);
+		if (ZDICT_isError (dict_len)) {
+			error_log_printf (LOGMT_WARN, LOGSS_UNSPECIFIED, "Shared dictionary training failed: %s\n", ZDICT_getErrorName (dict_len));
+		} else if ((id = ZDICT_getDictID (dict, dict_len)) != 0) {
+			if (shdict_store (id, dict, dict_len) != 0) {
+				error_log_printf (LOGMT_ERROR, LOGSS_UNSPECIFIED, "Unable to store shared dictionary in %s.\n", SharedDictDir);
+				id = 0;
+			}
+		}
+		free (dict);
+	}
+
+	pthread_mutex_lock (&(shared->lock));
+	shared->samples = 0;
+	shared->pool_used = 0;
+	shared->training = 0;
+	if (id != 0) {
+		shared->current_id = id;
+		shared->last_train = time (NULL);
+	}
+	pthread_mutex_unlock (&(shared->lock));
+}
+
+/* connects to NextProxy.
+ * returns: socket, or <0 if error */
+static int shdict_connect (void)
+{
+	struct addrinfo hints, *ai, *ai2;
+	char port_str [16];
+	int sockfd = -1;
+
+	memset (&hints, 0, sizeof (hints));
+	hints.ai_family = PF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	snprintf (port_str, sizeof (port_str), "%d", NextPort);
+	if (getaddrinfo (NextProxy, port_str, &hints, &ai) != 0)
+		return (-1);
+
+	for (ai2 = ai; ai2 != NULL; ai2 = ai2->ai_next) {
+		if ((sockfd = socket (ai2->ai_family, ai2->ai_socktype, ai2->ai_protocol)) < 0)
+			continue;
+		if (connect (sockfd, ai2->ai_addr, ai2->ai_addrlen) == 0)
+			break;
+		close (sockfd);
+		sockfd = -1;
+	}
+	freeaddrinfo (ai);
+	return (sockfd);
+}
+
+/* fetches dictionary 'id' from the remote Ziproxy (through NextProxy) */
+static void shdict_fetch (unsigned int id)
+{
+	FILE *sockrfp, *sockwfp;
+	char line [1024];
+	char *dict = NULL;
+	size_t dict_len = 0;
+	int sockfd;
+	int status = 0;
+	int ok = 0;
+
+	if ((sockfd = shdict_connect ()) >= 0) {
+		sockrfp = fdopen (sockfd, "r");
+		sockwfp = fdopen (dup (sockfd), "w");
+		if ((sockrfp != NULL) && (sockwfp != NULL)) {
+			fprintf (sockwfp, "GET http://%s/%u HTTP/1.0\r\nHost: %s\r\nX-Ziproxy-Flags: %s\r\nConnection: close\r\n\r\n", SHDICT_HOST, id, SHDICT_HOST, SHDICT_FLAG);
+			fflush (sockwfp);
+
+			/* status line, then headers (discarded) */
+			if (fgets (line, sizeof (line), sockrfp) != NULL)
+				sscanf (line, "HTTP/%*d.%*d %d", &status);
+			while (fgets (line, sizeof (line), sockrfp) != NULL) {
+				if ((line [0] == '\r') || (line [0] == '\n'))
+					break;
+			}
+
+			if ((status == 200) && ((dict = malloc (SHDICT_MAX_FILE)) != NULL)) {
+				dict_len = fread (dict, 1, SHDICT_MAX_FILE, sockrfp);
+				if ((ZDICT_getDictID (dict, dict_len) == id) && (shdict_store (id, dict, dict_len) == 0))
+					ok = 1;
+				free (dict);
+			}
+		}
+		if (sockrfp != NULL)
+			fclose (sockrfp);
+		else
+			close (sockfd);
+		if (sockwfp != NULL)
+			fclose (sockwfp);
+	}
+
+	pthread_mutex_lock (&(shared->lock));
+	shared->fetching_id = 0;
+	if (ok)
+		shared->current_id = id;
+	pthread_mutex_unlock (&(shared->lock));
+
+	if (ok)
+		debug_log_printf ("Shared dictionary %u fetched.\n", id);
+	else
+		error_log_printf (LOGMT_WARN, LOGSS_UNSPECIFIED, "Unable to fetch shared dictionary %u from %s (HTTP status: %d).\n", id, NextProxy, status);
+}
+
+/* invoked when the request process ends */
+static void shdict_deferred_work (void)
+{
+	if (! (train_pending || fetch_pending))
+		return;
+
+	/* the response is complete, don't make the client wait for us */
+	if (sess_wclient != NULL) {
+		fflush (sess_wclient);
+		shutdown (fileno (sess_wclient), SHUT_RDWR);
+	}
+	if (ConnTimeout)
+		alarm (ConnTimeout);
+
+	if (train_pending) {
+		train_pending = 0;
+		shdict_train ();
+	}
+	if (fetch_pending) {
+		unsigned int id = fetch_pending;
+
+		fetch_pending = 0;
+		shdict_fetch (id);
+	}
+}
+
+/* (far end) serves http://SHDICT_HOST/<id> to the paired Ziproxy.
+ * returns: ==0 served, !=0 dictionary not available */
+int shdict_serve (const char *url, FILE *dest)
+{
+	char path [SHDICT_PATH_LEN];
+	const char *id_str;
+	char *dict;
+	size_t dict_len;
+	unsigned int id;
+
+	if ((shared == NULL) || (! SharedDictCompress) || ((id_str = strrchr (url, '/')) == NULL))
+		return (1);
+	if (((id = strtoul (id_str + 1, NULL, 10)) == 0) || (id != loaded_id))
+		return (1);
+
+	shdict_dict_path (path, id);
+	if ((dict = shdict_read_file (path, SHDICT_MAX_FILE, &dict_len)) == NULL)
+		return (1);
+
+	fprintf (dest, "HTTP/1.0 200 OK\r\nContent-Type: application/octet-stream\r\nContent-Length: %lu\r\nConnection: close\r\n\r\n", (unsigned long) dict_len);
+	tosmarking_add_check_bytecount (dict_len);	/* update TOS if necessary */
+	fwrite (dict, 1, dict_len, dest);
+	fflush (dest);
+	free (dict);
+
+	access_log_def_outlen (dict_len);
+	return (0);
+}
+
+/* Compress inlen bytes from source to file dest, using the current dictionary.
+   returns SHDICT_OK on success, SHDICT_MEM_ERROR if memory could not be
+   allocated for processing (or there's no dictionary) or SHDICT_ERRNO
+   if there is an error writing to dest. */
+int shdict_memory_stream (const char *source, FILE *dest, ZP_DATASIZE_TYPE inlen, ZP_DATASIZE_TYPE *outlen)
+{
+	unsigned char out [BUFSIZE];
+	ZSTD_inBuffer input;
+	ZSTD_outBuffer output;
+	size_t remaining;
+	size_t last_write_bytes;
+
+	*outlen = 0;
+
+	if (cdict == NULL)
+		return (SHDICT_MEM_ERROR);
+	if ((cctx == NULL) && ((cctx = ZSTD_createCCtx ()) == NULL))
+		return (SHDICT_MEM_ERROR);
+	ZSTD_CCtx_reset (cctx, ZSTD_reset_session_and_parameters);
+	ZSTD_CCtx_refCDict (cctx, cdict);
+	ZSTD_CCtx_setPledgedSrcSize (cctx, inlen);
+
+	input.src = source;
+	input.size = inlen;
+	input.pos = 0;
+
+	/* run the encoder until it's finished */
+	do {
+		output.dst = out;
+		output.size = BUFSIZE;
+		output.pos = 0;
+		remaining = ZSTD_compressStream2 (cctx, &output, &input, ZSTD_e_end);
+		if (ZSTD_isError (remaining))
+			return (SHDICT_MEM_ERROR);
+
+		tosmarking_add_check_bytecount (output.pos);	/* update TOS if necessary */
+		if ((last_write_bytes = fwrite (out, 1, output.pos, dest)) != output.pos || ferror (dest)) {
+			*outlen += last_write_bytes;
+			return (SHDICT_ERRNO);
+		}
+		*outlen += last_write_bytes;
+
+		/* update access log stats */
+		access_log_def_outlen(*outlen);
+
+		// If we are sending a big file down a slow line, we
+		// need to reset the alarm once a while.
+		if (ConnTimeout)
+			alarm(ConnTimeout);
+
+	} while (remaining != 0);
+
+	return (SHDICT_OK);
+}
+
+/* returns the decompression context, ready for a new frame using the current dictionary
+ * (or NULL if there's no dictionary or out of memory) */
+static ZSTD_DCtx *shdict_get_dctx (void)
+{
+	if (ddict == NULL)
+		return (NULL);
+	if ((dctx == NULL) && ((dctx = ZSTD_createDCtx ()) == NULL))
+		return (NULL);
+	ZSTD_DCtx_reset (dctx, ZSTD_reset_session_and_parameters);
+	ZSTD_DCtx_refDDict (dctx, ddict);
+	return (dctx);
+}
+
+/* Decompress from file source to file dest until stream ends or EOF.
+   returns SHDICT_OK on success, SHDICT_MEM_ERROR if memory could not be
+   allocated for processing, SHDICT_DATA_ERROR if the data is invalid,
+   incomplete or requires a dictionary we don't have, SHDICT_RATIO_EXCEEDED
+   if the decompression ratio is exceeded or SHDICT_ERRNO if there is an
+   error reading or writing the files. */
+int unshdict_stream_stream (FILE *source, FILE *dest, ZP_DATASIZE_TYPE *inlen, ZP_DATASIZE_TYPE *outlen, int de_chunk, int max_ratio, ZP_DATASIZE_TYPE min_eval)
+{
+	ZSTD_DCtx *dec;
+	t_shdict_source src_state;
+	unsigned char in [BUFSIZE];
+	unsigned char out [BUFSIZE];
+	ZSTD_inBuffer input;
+	ZSTD_outBuffer output;
+	size_t ret = 1;
+	size_t last_write_bytes;
+
+	*inlen = 0;
+	*outlen = 0;
+
+	if ((dec = shdict_get_dctx ()) == NULL)
+		return (ddict == NULL ? SHDICT_DATA_ERROR : SHDICT_MEM_ERROR);
+
+	shdict_source_init (&src_state, de_chunk);
+
+	/* decompress until the frame ends or end of file */
+	do {
+		input.src = in;
+		input.size = shdict_read (&src_state, source, in);
+		input.pos = 0;
+		*inlen += input.size;
+
+		/* update access log stats */
+		access_log_def_inlen(*inlen);
+
+		if (ferror(source)) {
+			debug_log_puts ("stream unshdict: IO error (source). Aborting.");
+			return (SHDICT_ERRNO);
+		}
+		if (input.size == 0)
+			break;
+
+		/* run the decoder until it consumes the input */
+		do {
+			output.dst = out;
+			output.size = BUFSIZE;
+			output.pos = 0;
+			ret = ZSTD_decompressStream (dec, &output, &input);
+			if (ZSTD_isError (ret))
+				return (SHDICT_DATA_ERROR);
+
+			tosmarking_add_check_bytecount (output.pos);	/* update TOS if necessary */
+			if ((last_write_bytes = fwrite (out, 1, output.pos, dest)) != output.pos || ferror (dest)) {
+				*outlen += last_write_bytes;
+				debug_log_puts ("stream unshdict: IO error (dest). Aborting.");
+				return (SHDICT_ERRNO);
+			}
+			*outlen += last_write_bytes;
+
+			/* update access log stats */
+			access_log_def_outlen(*outlen);
+
+			/* evaluate whether decompression rate is exceeded */
+			if ((max_ratio != 0) && (*outlen >= min_eval)) {
+				if (((*inlen * max_ratio) / 100) < *outlen) {
+					/* ratio is exceeded, abort decompression and streaming */
+					access_log_set_flags (LOG_AC_FLAG_LLCOMP_TOO_EXPANSIVE);
+					debug_log_puts ("stream unshdict: Decompression ratio exceeded. Aborting.");
+					return (SHDICT_RATIO_EXCEEDED);
+				}
+			}
+		} while ((input.pos < input.size) || (output.pos == output.size));
+
+		// If we are sending a big file down a slow line, we
+		// need to reset the alarm once a while.
+		if (ConnTimeout)
+			alarm(ConnTimeout);
+
+		/* done when the frame is complete */
+	} while ((ret != 0) && (! src_state.finished));
+
+	return (ret == 0 ? SHDICT_OK : SHDICT_DATA_ERROR);
+}
+
+/* Decompress inlen bytes from source into a newly-allocated *dest.
+ * *dest is allocated with one extra byte, so htmlopt may add its '\0'.
+ * max_growth (in %) is the maximum allowable uncompressed size relative
+ * 	to inlen, if exceeded the decompressor will stop
+ * 	if max_growth==0 then there will be no limit (other than memory)
+ * returns: SHDICT_OK (*dest and *outlen are defined) or an error
+ * 	(in this case, *dest is unchanged) */
+int unshdict_memory_memory (const char *source, ZP_DATASIZE_TYPE inlen, char **dest, ZP_DATASIZE_TYPE *outlen, int max_growth)
+{
+	ZSTD_DCtx *dec;
+	ZSTD_inBuffer input;
+	ZSTD_outBuffer output;
+	ZP_DATASIZE_TYPE max_outlen;
+	unsigned long long content_size;
+	size_t buf_len;
+	char *buf, *new_buf;
+	size_t ret;
+
+	if ((dec = shdict_get_dctx ()) == NULL)
+		return (ddict == NULL ? SHDICT_DATA_ERROR : SHDICT_MEM_ERROR);
+
+	max_outlen = (inlen * max_growth) / 100;
+
+	/* frames written by shdict_memory_stream() have the size, otherwise guess and grow as needed */
+	content_size = ZSTD_getFrameContentSize (source, inlen);
+	if (content_size == ZSTD_CONTENTSIZE_ERROR)
+		return (SHDICT_DATA_ERROR);
+	if (content_size != ZSTD_CONTENTSIZE_UNKNOWN) {
+		if ((max_growth != 0) && (content_size > max_outlen))
+			return (SHDICT_RATIO_EXCEEDED);
+		buf_len = content_size;
+	} else {
+		buf_len = (inlen * 4) + BUFSIZE;
+	}
+	/* the declared size may be 0 (or wrong), we must be able to grow it anyway */
+	if (buf_len == 0)
+		buf_len = BUFSIZE;
+	if ((buf = malloc (buf_len + 1)) == NULL)
+		return (SHDICT_MEM_ERROR);
+
+	input.src = source;
+	input.size = inlen;
+	input.pos = 0;
+	output.dst = buf;
+	output.size = buf_len;
+	output.pos = 0;
+
+	while ((ret = ZSTD_decompressStream (dec, &output, &input)) != 0) {
+		if (ZSTD_isError (ret) || ((input.pos == input.size) && (output.pos < output.size))) {
+			/* broken or truncated */
+			free (buf);
+			return (SHDICT_DATA_ERROR);
+		}
+		if ((max_growth != 0) && (output.pos > max_outlen)) {
+			free (buf);
+			return (SHDICT_RATIO_EXCEEDED);
+		}
+		if (output.pos == output.size) {
+			if ((new_buf = realloc (buf, (buf_len * 2) + 1)) == NULL) {
+				free (buf);
+				return (SHDICT_MEM_ERROR);
+			}
+			buf_len *= 2;
+			buf = new_buf;
+			output.dst = buf;
+			output.size = buf_len;
+		}
+	}
+	if ((max_growth != 0) && (output.pos > max_outlen)) {
+		free (buf);
+		return (SHDICT_RATIO_EXCEEDED);
+	}
+
+	*dest = buf;
+	*outlen = output.pos;
+	return (SHDICT_OK);
+}
+
+#endif
+
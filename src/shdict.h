@@ -0,0 +1,71 @@
+/* shdict.h
+ * Shared-dictionary (Zstandard) compression between paired Ziproxies
+ *
+ * Ziproxy - the HTTP acceleration proxy
+ * This code is under the following conditions:
+ *
+ * ---------------------------------------------------------------------
+ * Copyright (c)2005-2014 Daniel Mealha Cabrita
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111 USA
+ * ---------------------------------------------------------------------
+ */
+
+//To stop multiple inclusions.
+#ifndef SRC_SHDICT_H
+#define SRC_SHDICT_H
+
+#include <stdio.h>
+
+#include "globaldefs.h"
+
+/* content-coding used between paired Ziproxies only (never sent to other clients) */
+#define SHDICT_CODING		"x-ziproxy-zdict"
+
+/* X-Ziproxy-Flags token announcing the capability ("zdict" or "zdict=<dictionary id>") */
+#define SHDICT_FLAG		"zdict"
+
+/* response header from the remote Ziproxy, informing its current dictionary id */
+#define SHDICT_HEADER		"X-Ziproxy-Dict"
+
+/* pseudo-host used for fetching dictionaries through the proxy link
+ * (.invalid is reserved, it will never resolve to a real host) */
+#define SHDICT_HOST		"ziproxy-shdict.invalid"
+
+/* return codes */
+#define SHDICT_OK		0
+#define SHDICT_ERRNO		1	/* IO error (source or dest) */
+#define SHDICT_MEM_ERROR	2
+#define SHDICT_DATA_ERROR	3	/* broken data, or dictionary not available */
+#define SHDICT_RATIO_EXCEEDED	4	/* decompressed data exceeds the given max ratio */
+
+int shdict_init (void);
+void shdict_refresh (void);
+unsigned int shdict_current_id (void);
+
+int shdict_client_is_paired (const char *x_ziproxy_flags);
+int shdict_client_has_current (const char *x_ziproxy_flags);
+void shdict_announce (char *flags, int flags_size);
+void shdict_remote_id (const char *header_value);
+
+void shdict_add_sample (const char *data, ZP_DATASIZE_TYPE len);
+int shdict_serve (const char *url, FILE *dest);
+
+int shdict_memory_stream (const char *source, FILE *dest, ZP_DATASIZE_TYPE inlen, ZP_DATASIZE_TYPE *outlen);
+int unshdict_stream_stream (FILE *source, FILE *dest, ZP_DATASIZE_TYPE *inlen, ZP_DATASIZE_TYPE *outlen, int de_chunk, int max_ratio, ZP_DATASIZE_TYPE min_eval);
+int unshdict_memory_memory (const char *source, ZP_DATASIZE_TYPE inlen, char **dest, ZP_DATASIZE_TYPE *outlen, int max_growth);
+
+#endif //SRC_SHDICT_H
+
@@ -0,0 +1,442 @@
+/* subres.c
+ * Sub-resources of pages (images, stylesheets) fetched by Ziproxy itself.
+ *
+ * Ziproxy - the HTTP acceleration proxy
+ * This code is under the following conditions:
+ *
+ * ---------------------------------------------------------------------
+ * Copyright (c)2005-2014 Daniel Mealha Cabrita
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111 USA
+ * ---------------------------------------------------------------------
+ */
+
+/*
+ * Resources referenced by a page (images, stylesheets) may be fetched
+ * by Ziproxy itself, in order to be embedded into the page (see
+ * imginline.c and cssinline.c).
+ *
+ * Only resources from the page's own site are fetched (same host, or
+ * hosts under the same parent domain): once embedded, they become
+ * readable by the page's scripts, which must not gain access this way
+ * to content from elsewhere (other sites, or the proxy's own network).
+ * They are fetched in parallel (one thread each, as preemptdns does),
+ * through NextProxy if defined, without the user's cookies, each one
+ * aborted if bigger than its maximum size or slower than SUBRES_TIMEOUT.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "subres.h"
+#include "cfgfile.h"
+#include "muxlink.h"
+#include "globaldefs.h"
+
+/* ### URLS ### */
+
+/* returns: !=0 if 'host' is an IPv4 number */
+static int subres_is_ip (const char *host)
+{
+	return (strspn (host, "0123456789.") == strlen (host));
+}
+
+/* returns: !=0 if 'domain' may be a site by itself,
+ * not just a public suffix ("com", "co.uk", "com.br"...) */
+static int subres_is_site_domain (const char *domain)
+{
+	const char *dot;
+
+	if ((dot = strchr (domain, '.')) == NULL)
+		return (0);
+	if (strchr (dot + 1, '.') != NULL)
+		return (1);
+	return ((dot - domain) > 3);
+}
+
+/* returns: !=0 if both hosts belong to the same site:
+ * same host, or one's parent domain is the other (or the other's parent) */
+static int subres_same_site (const char *host_a, const char *host_b)
+{
+	const char *parent_a, *parent_b;
+
+	if (strcasecmp (host_a, host_b) == 0)
+		return (1);
+	if (subres_is_ip (host_a) || subres_is_ip (host_b))
+		return (0);
+
+	parent_a = strchr (host_a, '.');
+	parent_b = strchr (host_b, '.');
+	if ((parent_a == NULL) || (parent_b == NULL))
+		return (0);
+	parent_a++;
+	parent_b++;
+
+	if (strcasecmp (parent_a, parent_b) == 0)
+		return (subres_is_site_domain (parent_a));
+	if (strcasecmp (parent_a, host_b) == 0)
+		return (subres_is_site_domain (host_b));
+	if (strcasecmp (host_a, parent_b) == 0)
+		return (subres_is_site_domain (host_a));
+	return (0);
+}
+
+/* removes "." and ".." segments from 'path' (starting with '/', optionally followed by "?query") */
+static void subres_remove_dots (char *path)
+{
+	char *r = path, *w = path;
+	char *segment;
+	int segment_len;
+
+	while (*r == '/') {
+		segment = r + 1;
+		segment_len = strcspn (segment, "/?");
+		if ((segment_len == 1) && (segment [0] == '.')) {
+			r = segment + segment_len;
+			if (*r != '/')
+				*(w++) = '/';
+		} else if ((segment_len == 2) && (segment [0] == '.') && (segment [1] == '.')) {
+			while ((w > path) && (*(--w) != '/'));
+			r = segment + segment_len;
+			if (*r != '/')
+				*(w++) = '/';
+		} else {
+			memmove (w, r, segment_len + 1);
+			w += segment_len + 1;
+			r = segment + segment_len;
+		}
+	}
+	memmove (w, r, strlen (r) + 1);
+}
+
+/* resolves 'ref' against 'base' (an absolute http URL) into 'out'.
+ * returns: ==0 ok, !=0 not resolvable into an http URL */
+int subres_resolve (const char *base, const char *ref, char *out, int out_size)
+{
+	int authority_len, dir_len, scheme_len, out_len;
+	const char *path;
+
+	/* empty, or the page itself */
+	if ((*ref == '\0') || (*ref == '#'))
+		return (1);
+
+	/* absolute: only http is fetchable by us */
+	scheme_len = strspn (ref, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789+-.");
+	if ((scheme_len > 0) && (ref [scheme_len] == ':')) {
+		if ((scheme_len != 4) || (strncasecmp (ref, "http://", 7) != 0))
+			return (1);
+		out_len = snprintf (out, out_size, "http://%s", ref + 7);
+	} else {
+		authority_len = 7 + strcspn (base + 7, "/?#");
+		path = base + authority_len;
+
+		if ((ref [0] == '/') && (ref [1] == '/')) {
+			out_len = snprintf (out, out_size, "http:%s", ref);
+		} else if (ref [0] == '/') {
+			out_len = snprintf (out, out_size, "%.*s%s", authority_len, base, ref);
+		} else if (ref [0] == '?') {
+			out_len = snprintf (out, out_size, "%.*s%.*s%s", authority_len, base, (int) strcspn (path, "?#"), path, ref);
+		} else {
+			/* relative to the base's directory */
+			for (dir_len = strcspn (path, "?#"); (dir_len > 0) && (path [dir_len - 1] != '/'); dir_len--);
+			if (dir_len == 0)
+				out_len = snprintf (out, out_size, "%.*s/%s", authority_len, base, ref);
+			else
+				out_len = snprintf (out, out_size, "%.*s%.*s%s", authority_len, base, dir_len, path, ref);
+		}
+	}
+	if ((out_len < 0) || (out_len >= out_size))
+		return (1);
+
+	/* the fragment is not sent */
+	out [strcspn (out, "#")] = '\0';
+
+	if ((path = strchr (out + 7, '/')) != NULL)
+		subres_remove_dots ((char *) path);
+	return (0);
+}
+
+/* splits 'res->url' into host, port and path.
+ * returns: ==0 ok, !=0 invalid (or unsupported) URL */
+static int subres_split_url (t_subres *res)
+{
+	const char *authority = res->url + 7;
+	int host_len, authority_len;
+	char *port_end;
+	long port = 80;
+
+	authority_len = strcspn (authority, "/?");
+	host_len = strcspn (authority, ":/?");
+	if ((host_len == 0) || (host_len >= SUBRES_HOST_LEN) || (memchr (authority, '@', authority_len) != NULL) || (authority [0] == '['))
+		return (1);
+	if (host_len < authority_len) {
+		port = strtol (authority + host_len + 1, &port_end, 10);
+		if ((port_end != authority + authority_len) || (port < 1) || (port > 65535))
+			return (1);
+	}
+	memcpy (res->host, authority, host_len);
+	res->host [host_len] = '\0';
+	res->port = port;
+
+	/* through NextProxy the full URL is requested */
+	if (NextProxy != NULL)
+		res->path = res->url;
+	else if (authority [authority_len] == '/')
+		res->path = authority + authority_len;
+	else
+		res->path = "/";
+	return (0);
+}
+
+/* returns: ==0 if ziproxy is allowed to connect to 'port' */
+static int subres_check_port (const unsigned short int port)
+{
+	int i;
+
+	if (RestrictOutPortHTTP_len <= 0)
+		return (0);
+	for (i = 0; i < RestrictOutPortHTTP_len; i++) {
+		if (port == RestrictOutPortHTTP [i])
+			return (0);
+	}
+	return (1);
+}
+
+/* prepares 'res' for fetching 'url' (absolute), on behalf of the page requested in 'chdr'.
+ * returns: ==0 ok, !=0 not to be fetched (invalid, from another site, forbidden port) */
+int subres_prepare (t_subres *res, const char *url, const http_headers *chdr, const char *accept, int max_size)
+{
+	memset (res, 0, sizeof (t_subres));
+	if ((strncmp (url, "http://", 7) != 0) || (strlen (url) >= SUBRES_URL_LEN))
+		return (1);
+	strcpy (res->url, url);
+	if (subres_split_url (res) || (! subres_same_site (chdr->host, res->host)) || subres_check_port (res->port))
+		return (1);
+
+	res->user_agent = chdr->user_agent;
+	res->referer = chdr->url;
+	res->accept = accept;
+	res->max_size = max_size;
+	return (0);
+}
+
+/* ### FETCHING ### */
+
+/* connects to host:port (or NextProxy), with SUBRES_TIMEOUT applied.
+ * returns: socket, or <0 if error */
+static int subres_connect (const char *host, unsigned short int port)
+{
+	struct addrinfo hints, *ai, *ai2;
+	struct pollfd pfd;
+	struct timeval tv;
+	char port_str [16];
+	int sockfd = -1;
+	int flags, err;
+	socklen_t err_len;
+
+	if (NextProxy != NULL) {
+		host = NextProxy;
+		port = NextPort;
+
+		/* through the multiplexed link process, instead */
+		if (muxlink_local_port () != 0) {
+			host = "127.0.0.1";
+			port = muxlink_local_port ();
+		}
+	}
+
+	memset (&hints, 0, sizeof (hints));
+	hints.ai_family = PF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	snprintf (port_str, sizeof (port_str), "%hu", port);
+	if (getaddrinfo (host, port_str, &hints, &ai) != 0)
+		return (-1);
+
+	for (ai2 = ai; ai2 != NULL; ai2 = ai2->ai_next) {
+		if ((sockfd = socket (ai2->ai_family, ai2->ai_socktype, ai2->ai_protocol)) < 0)
+			continue;
+
+		flags = fcntl (sockfd, F_GETFL, 0);
+		fcntl (sockfd, F_SETFL, flags | O_NONBLOCK);
+		err = 0;
+		if (connect (sockfd, ai2->ai_addr, ai2->ai_addrlen) != 0) {
+			err = errno;
+			if (err == EINPROGRESS) {
+				pfd.fd = sockfd;
+				pfd.events = POLLOUT;
+				err_len = sizeof (err);
+				if ((poll (&pfd, 1, SUBRES_TIMEOUT * 1000) != 1) || (getsockopt (sockfd, SOL_SOCKET, SO_ERROR, &err, &err_len) != 0))
+					err = ETIMEDOUT;
+			}
+		}
+		if (err == 0) {
+			fcntl (sockfd, F_SETFL, flags);
+			break;
+		}
+		close (sockfd);
+		sockfd = -1;
+	}
+	freeaddrinfo (ai);
+
+	if (sockfd >= 0) {
+		tv.tv_sec = SUBRES_TIMEOUT;
+		tv.tv_usec = 0;
+		setsockopt (sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
+		setsockopt (sockfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof (tv));
+	}
+	return (sockfd);
+}
+
+/* fetches the resource, up to res->max_size bytes.
+ * on success, res->data/data_len are filled */
+static void *subres_fetch_thread (void *given_res)
+{
+	t_subres *res = (t_subres *) given_res;
+	char request [SUBRES_URL_LEN * 2 + 1024];
+	char line [1024];
+	char host_port [SUBRES_HOST_LEN + 8];
+	FILE *sockrfp;
+	char *data;
+	ZP_DATASIZE_TYPE content_length = -1;
+	int request_len, data_len;
+	int sockfd, status = 0, ok = 1;
+
+	if ((sockfd = subres_connect (res->host, res->port)) < 0)
+		pthread_exit (0);
+
+	if (res->port != 80)
+		snprintf (host_port, sizeof (host_port), "%s:%hu", res->host, res->port);
+	else
+		snprintf (host_port, sizeof (host_port), "%s", res->host);
+	request_len = snprintf (request, sizeof (request), "GET %s HTTP/1.0\r\nHost: %s\r\n%s%s%sReferer: %s\r\nAccept: %s\r\nConnection: close\r\n\r\n", \
+		res->path, host_port, \
+		(res->user_agent != NULL) ? "User-Agent: " : "", (res->user_agent != NULL) ? res->user_agent : "", (res->user_agent != NULL) ? "\r\n" : "", \
+		res->referer, res->accept);
+
+	/* MSG_NOSIGNAL: a closed connection must not raise SIGPIPE in the whole process */
+	if ((request_len >= sizeof (request)) || (send (sockfd, request, request_len, MSG_NOSIGNAL) != request_len) || ((sockrfp = fdopen (sockfd, "r")) == NULL)) {
+		close (sockfd);
+		pthread_exit (0);
+	}
+
+	/* status line, then headers */
+	if (fgets (line, sizeof (line), sockrfp) != NULL)
+		sscanf (line, "HTTP/%*d.%*d %d", &status);
+	while (fgets (line, sizeof (line), sockrfp) != NULL) {
+		if ((line [0] == '\r') || (line [0] == '\n'))
+			break;
+		if (strncasecmp (line, "Content-Length:", 15) == 0) {
+			content_length = strtoll (line + 15, NULL, 10);
+			if (content_length > res->max_size)
+				ok = 0;
+		} else if (strncasecmp (line, "Content-Type:", 13) == 0) {
+			sscanf (line + 13, " %63[^;\r\n]", res->content_type);
+		} else if (strncasecmp (line, "Cache-Control:", 14) == 0) {
+			if ((strstr (line, "no-store") != NULL) || (strstr (line, "private") != NULL))
+				res->no_store = 1;
+		} else if ((strncasecmp (line, "Content-Encoding:", 17) == 0) && (strstr (line, "identity") == NULL)) {
+			ok = 0;
+		} else if (strncasecmp (line, "Transfer-Encoding:", 18) == 0) {
+			ok = 0;
+		}
+	}
+
+	if ((status == 200) && ok && ((data = malloc (res->max_size + 1)) != NULL)) {
+		data_len = fread (data, 1, res->max_size + 1, sockrfp);
+		if ((data_len > 0) && (data_len <= res->max_size) && (! ferror (sockrfp)) && \
+			((content_length < 0) || (content_length == data_len))) {
+			res->data = data;
+			res->data_len = data_len;
+		} else {
+			free (data);
+		}
+	}
+	fclose (sockrfp);
+
+	pthread_exit (0);
+}
+
+/* fetches all the (prepared) resources in parallel, returning when all are done */
+void subres_fetch_all (t_subres **res, int res_len)
+{
+	int i;
+
+	for (i = 0; i < res_len; i++)
+		res [i]->launched = (pthread_create (&(res [i]->tid), NULL, subres_fetch_thread, res [i]) == 0);
+	for (i = 0; i < res_len; i++) {
+		if (res [i]->launched)
+			pthread_join (res [i]->tid, NULL);
+	}
+}
+
+/* ### TEXT SCANNING ### */
+
+/* returns: !=0 if 'word' (lowercase) is at src[pos] (case-insensitive) */
+int subres_match (const char *src, const int len, const int pos, const char *word)
+{
+	int word_len = strlen (word);
+
+	return ((pos + word_len <= len) && (strncasecmp (src + pos, word, word_len) == 0));
+}
+
+/* returns: position of 'word' (lowercase) in src[from..len) (case-insensitive), or len if not found */
+int subres_find (const char *src, const int len, int from, const char *word)
+{
+	const char first = word [0];
+	const char first_upper = toupper (word [0]);
+
+	for (; from < len; from++) {
+		if (((src [from] == first) || (src [from] == first_upper)) && subres_match (src, len, from, word))
+			return (from);
+	}
+	return (len);
+}
+
+/* returns: !=0 if the HTML page in src declares a Content-Security-Policy
+ * ("<meta http-equiv=Content-Security-Policy ...>"), which may forbid inlined data */
+int subres_html_has_csp (const char *src, const int len)
+{
+	int pos = 0;
+
+	while ((pos = subres_find (src, len, pos, "http-equiv")) < len) {
+		pos += 10;
+		while ((pos < len) && isspace ((unsigned char) src [pos]))
+			pos++;
+		if ((pos >= len) || (src [pos] != '='))
+			continue;
+		pos++;
+		while ((pos < len) && (isspace ((unsigned char) src [pos]) || (src [pos] == '"') || (src [pos] == '\'')))
+			pos++;
+		if (subres_match (src, len, pos, "content-security-policy"))
+			return (1);
+	}
+	return (0);
+}
+
@@ -0,0 +1,67 @@
+/* subres.h
+ * Sub-resources of pages (images, stylesheets) fetched by Ziproxy itself.
+ *
+ * Ziproxy - the HTTP acceleration proxy
+ * This code is under the following conditions:
+ *
+ * ---------------------------------------------------------------------
+ * Copyright (c)2005-2014 Daniel Mealha Cabrita
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111 USA
+ * ---------------------------------------------------------------------
+ */
+
+// To stop multiple inclusions.
+#ifndef SRC_SUBRES_H
+#define SRC_SUBRES_H
+
+#include <pthread.h>
+
+#include "globaldefs.h"
+#include "http.h"
+
+#define SUBRES_URL_LEN		2048
+#define SUBRES_HOST_LEN		256
+#define SUBRES_CT_LEN		64
+#define SUBRES_TIMEOUT		5	/* seconds, for connecting and for each read/write */
+
+typedef struct {
+	char url [SUBRES_URL_LEN];	/* absolute */
+	char host [SUBRES_HOST_LEN];
+	unsigned short int port;
+	const char *path;		/* within url */
+	const char *user_agent;
+	const char *referer;
+	const char *accept;
+	int max_size;
+	pthread_t tid;
+	int launched;
+
+	/* result */
+	char *data;			/* body (malloc()'ed, one extra byte), or NULL if not fetched */
+	int data_len;
+	char content_type [SUBRES_CT_LEN];
+	int no_store;			/* "Cache-Control: no-store" or "private" */
+} t_subres;
+
+extern int subres_resolve (const char *base, const char *ref, char *out, int out_size);
+extern int subres_prepare (t_subres *res, const char *url, const http_headers *chdr, const char *accept, int max_size);
+extern void subres_fetch_all (t_subres **res, int res_len);
+extern int subres_match (const char *src, const int len, const int pos, const char *word);
+extern int subres_find (const char *src, const int len, int from, const char *word);
+extern int subres_html_has_csp (const char *src, const int len);
+
+#endif //SRC_SUBRES_H
+
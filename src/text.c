@@ -66,6 +66,14 @@
 #include "image.h"
 #include "log.h"
 #include "gzpipe.h"
+#include "gzpolicy.h"
+#include "ldgzip.h"
+#include "gzreopt.h"
+#include "brpipe.h"
+#include "zstdpipe.h"
+#include "dcpipe.h"
+#include "shdict.h"
+#include "optpipe.h"
 
 #define CHUNKSIZE 4050
 #define GUNZIP_BUFF 16384
@@ -75,8 +83,9 @@ ZP_DATASIZE_TYPE gunzip (char* inbuf, ZP_DATASIZE_TYPE inlen, char** outbuf, ZP_
 enum {ONormal,OChunked, OStream, OGzipStream};
 
 //TODO correct return value, print status into logs
-/* zlib compress streaming from 'from' to 'to' */
-/* returns: --> result of gzip_stream_stream() */
+/* zlib (or Zstandard/Brotli, if DO_COMPRESS_ZSTD/DO_COMPRESS_BROTLI) compress streaming from 'from' to 'to' */
+/* Zstandard is preferred here, since it's cheaper (streaming is about latency) */
+/* returns: --> result of gzip_stream_stream(), zstd_stream_stream() or brotli_stream_stream() */
 /* inlen and outlen will be written with the uncompressed and compressed sizes respectively */
 int do_compress_stream_stream (http_headers *hdr, FILE *from, FILE *to, ZP_DATASIZE_TYPE *inlen, ZP_DATASIZE_TYPE *outlen){
 	int status;
@@ -92,6 +101,44 @@ int do_compress_stream_stream (http_headers *hdr, FILE *from, FILE *to, ZP_DATAS
 	hdr->where_content_length = -1;
 	remove_header_str(hdr, "Content-Length");
 
+#ifdef ZSTD
+	if (hdr->flags & DO_COMPRESS_ZSTD) {
+		add_header(hdr, "Content-Encoding: zstd");
+		add_header(hdr, "Connection: close");
+		add_header(hdr, "Proxy-Connection: close");
+
+		debug_log_puts ("Zstd stream-to-stream. Out Headers:");
+		send_headers_to(to, hdr);
+		fflush(to);
+
+		status = zstd_stream_stream(from, to, ZstdLevelStream, ZstdStreamFlushInterval, inlen, outlen, de_chunk);
+		fflush(to);
+
+		debug_log_difftime ("Compression+streaming");
+
+		return (status);
+	}
+#endif
+
+#ifdef BROTLI
+	if (hdr->flags & DO_COMPRESS_BROTLI) {
+		add_header(hdr, "Content-Encoding: br");
+		add_header(hdr, "Connection: close");
+		add_header(hdr, "Proxy-Connection: close");
+
+		debug_log_puts ("Brotli stream-to-stream. Out Headers:");
+		send_headers_to(to, hdr);
+		fflush(to);
+
+		status = brotli_stream_stream(from, to, BrotliQualityStream, inlen, outlen, de_chunk);
+		fflush(to);
+
+		debug_log_difftime ("Compression+streaming");
+
+		return (status);
+	}
+#endif
+
 	add_header(hdr, "Content-Encoding: gzip");
 	add_header(hdr, "Connection: close");
 	add_header(hdr, "Proxy-Connection: close");
@@ -100,7 +147,8 @@ int do_compress_stream_stream (http_headers *hdr, FILE *from, FILE *to, ZP_DATAS
 	send_headers_to(to, hdr);
 	fflush(to);
 	
-	status = gzip_stream_stream(from, to, Z_BEST_COMPRESSION, inlen, outlen, de_chunk);
+	gzpolicy_set_response (hdr->content_type, hdr->content_length);
+	status = gzip_stream_stream(from, to, GzipAdaptiveLevel ? GZPOLICY_LEVEL_ADAPTIVE : GzipLevel, inlen, outlen, de_chunk);
 	fflush(to);
 
 	debug_log_difftime ("Compression+streaming");
@@ -108,11 +156,58 @@ int do_compress_stream_stream (http_headers *hdr, FILE *from, FILE *to, ZP_DATAS
 	return (status);
 }
 
+/* optimizes HTML/CSS/JS data while streaming, gzipping it too if compress != 0
+ * (content: HOPT_STREAM_*, hopt_flags: HTML optimization flags) */
+/* returns: --> result of optimize_stream_stream() */
+/* inlen and outlen will be written with the original and optimized (+compressed) sizes respectively */
+int do_optimize_stream_stream (http_headers *hdr, FILE *from, FILE *to, int content, HOPT_FLAGS hopt_flags, int compress, ZP_DATASIZE_TYPE *inlen, ZP_DATASIZE_TYPE *outlen, int max_ratio, ZP_DATASIZE_TYPE min_eval){
+	int status;
+	int de_chunk = 0;
+	int encoding = OPTPIPE_ENCODED_NONE;
+
+	/* if http body is chunked, de-chunk it while optimizing */
+	if (hdr->where_chunked > 0) {
+		remove_header(hdr, hdr->where_chunked);
+		de_chunk = 1;
+	}
+
+	/* gzipped/deflated data is decompressed while optimizing, modify headers accordingly */
+	if (hdr->content_encoding_flags != PROP_ENCODED_NONE) {
+		encoding = (hdr->content_encoding_flags == PROP_ENCODED_DEFLATE) ? OPTPIPE_ENCODED_DEFLATE : OPTPIPE_ENCODED_GZIP;
+		hdr->content_encoding_flags = PROP_ENCODED_NONE;
+		hdr->content_encoding = NULL;
+		hdr->where_content_encoding = -1;
+		remove_header_str(hdr, "Content-Encoding");
+	}
+	
+	/* previous content-length is invalid, discard it */
+	hdr->where_content_length = -1;
+	remove_header_str(hdr, "Content-Length");
+
+	if (compress)
+		add_header(hdr, "Content-Encoding: gzip");
+	add_header(hdr, "Connection: close");
+	add_header(hdr, "Proxy-Connection: close");
+
+	debug_log_puts ("Text optimization stream-to-stream. Out Headers:");
+	send_headers_to(to, hdr);
+	fflush(to);
+
+	gzpolicy_set_response (hdr->content_type, hdr->content_length);
+	status = optimize_stream_stream(from, to, encoding, content, hopt_flags, compress, GzipAdaptiveLevel ? GZPOLICY_LEVEL_ADAPTIVE : GzipLevel, inlen, outlen, de_chunk, max_ratio, min_eval);
+	fflush(to);
+
+	debug_log_difftime ("Optimization+streaming");
+
+	return (status);
+}
+
 //TODO correct return value, print status into logs
 /* similar to do_compress_stream_stream() but decompress instead */
 int do_decompress_stream_stream (http_headers *hdr, FILE *from, FILE *to, ZP_DATASIZE_TYPE *inlen, ZP_DATASIZE_TYPE *outlen, int max_ratio, ZP_DATASIZE_TYPE min_eval){
 	int status;
 	int de_chunk = 0;
+	int content_encoding = hdr->content_encoding_flags;
 
 	/* if http body is chunked, de-chunk it while decompressing */
 	if (hdr->where_chunked > 0) {
@@ -133,6 +228,55 @@ int do_decompress_stream_stream (http_headers *hdr, FILE *from, FILE *to, ZP_DAT
 	add_header(hdr, "Connection: close");
 	add_header(hdr, "Proxy-Connection: close");
 	
+	if ((content_encoding == PROP_ENCODED_DEFLATE) || (content_encoding == PROP_ENCODED_COMPRESS)) {
+		if (content_encoding == PROP_ENCODED_DEFLATE) {
+			debug_log_puts ("Inflate stream-to-stream. Out Headers:");
+			send_headers_to(to, hdr);
+			fflush(to);
+			status = undeflate_stream_stream(from, to, inlen, outlen, de_chunk, max_ratio, min_eval);
+		} else {
+			debug_log_puts ("Uncompress (LZW) stream-to-stream. Out Headers:");
+			send_headers_to(to, hdr);
+			fflush(to);
+			status = unlzw_stream_stream(from, to, inlen, outlen, de_chunk, max_ratio, min_eval);
+		}
+		fflush(to);
+
+		debug_log_difftime ("Decompression+streaming");
+
+		return (status);
+	}
+
+#ifdef ZSTD
+	if (content_encoding == PROP_ENCODED_ZDICT) {
+		debug_log_puts ("Shared-dictionary Zstd decompression stream-to-stream. Out Headers:");
+		send_headers_to(to, hdr);
+		fflush(to);
+
+		status = unshdict_stream_stream(from, to, inlen, outlen, de_chunk, max_ratio, min_eval);
+		fflush(to);
+
+		debug_log_difftime ("Decompression+streaming");
+
+		return (status);
+	}
+#endif
+
+#ifdef BROTLI
+	if (content_encoding == PROP_ENCODED_BROTLI) {
+		debug_log_puts ("Unbrotli stream-to-stream. Out Headers:");
+		send_headers_to(to, hdr);
+		fflush(to);
+
+		status = unbrotli_stream_stream(from, to, inlen, outlen, de_chunk, max_ratio, min_eval);
+		fflush(to);
+
+		debug_log_difftime ("Decompression+streaming");
+
+		return (status);
+	}
+#endif
+
 	debug_log_puts ("Gunzip stream-to-stream. Out Headers:");
 	send_headers_to(to, hdr);
 	fflush(to);
@@ -145,6 +289,38 @@ int do_decompress_stream_stream (http_headers *hdr, FILE *from, FILE *to, ZP_DAT
 	return (status);
 }
 
+/* gzip to gzip streaming, recompressing the data if worth (see gzreopt_stream_stream()) */
+/* inlen and outlen will be written with the original and sent sizes respectively */
+int do_reoptimize_stream_stream (http_headers *hdr, FILE *from, FILE *to, ZP_DATASIZE_TYPE *inlen, ZP_DATASIZE_TYPE *outlen, int max_ratio, ZP_DATASIZE_TYPE min_eval){
+	int status;
+	int de_chunk = 0;
+
+	/* if http body is chunked, de-chunk it while processing */
+	if (hdr->where_chunked > 0) {
+		remove_header(hdr, hdr->where_chunked);
+		de_chunk = 1;
+	}
+
+	/* previous content-length is invalid, discard it */
+	hdr->where_content_length = -1;
+	remove_header_str(hdr, "Content-Length");
+
+	add_header(hdr, "Connection: close");
+	add_header(hdr, "Proxy-Connection: close");
+
+	debug_log_puts ("Gzip reoptimization stream-to-stream. Out Headers:");
+	send_headers_to(to, hdr);
+	fflush(to);
+
+	status = gzreopt_stream_stream(from, to, GzipLevel, GzipReoptimizeMinSaving, inlen, outlen, de_chunk, max_ratio, min_eval);
+	fflush(to);
+
+	debug_log_difftime ("Reoptimization+streaming");
+
+	return (status);
+}
+
+/* when both are accepted, Brotli is preferred over Zstandard here (better ratio, body already in memory) */
 int do_compress_memory_stream (http_headers *hdr, const char *from, FILE *to, const ZP_DATASIZE_TYPE inlen, ZP_DATASIZE_TYPE *outlen){
 	int status;
 	int de_chunk = 0;
@@ -155,6 +331,70 @@ int do_compress_memory_stream (http_headers *hdr, const char *from, FILE *to, co
 		de_chunk = 1;
 	}
 	
+#ifdef ZSTD
+	/* paired Ziproxy holding our dictionary, preferred over anything else */
+	if (hdr->flags & DO_COMPRESS_ZDICT) {
+		add_header(hdr, "Content-Encoding: " SHDICT_CODING);
+		add_header(hdr, "Connection: close");
+		add_header(hdr, "Proxy-Connection: close");
+
+		debug_log_puts ("Shared-dictionary Zstd memory-to-stream. Out Headers:");
+		remove_header(hdr, hdr->where_content_length);
+		hdr->where_content_length=-1;
+		send_headers_to(to, hdr);
+		fflush(to);
+
+		status = shdict_memory_stream(from, to, inlen, outlen);
+		fflush(to);
+
+		debug_log_difftime ("Compression+streaming");
+
+		return (status);
+	}
+#endif
+
+#ifdef BROTLI
+	if (hdr->flags & DO_COMPRESS_BROTLI) {
+		add_header(hdr, "Content-Encoding: br");
+		add_header(hdr, "Connection: close");
+		add_header(hdr, "Proxy-Connection: close");
+
+		debug_log_puts ("Brotli memory-to-stream. Out Headers:");
+		remove_header(hdr, hdr->where_content_length);
+		hdr->where_content_length=-1;
+		send_headers_to(to, hdr);
+		fflush(to);
+
+		status = brotli_memory_stream(from, to, BrotliQualityMemory, inlen, outlen);
+		fflush(to);
+
+		debug_log_difftime ("Compression+streaming");
+
+		return (status);
+	}
+#endif
+
+#ifdef ZSTD
+	if (hdr->flags & DO_COMPRESS_ZSTD) {
+		add_header(hdr, "Content-Encoding: zstd");
+		add_header(hdr, "Connection: close");
+		add_header(hdr, "Proxy-Connection: close");
+
+		debug_log_puts ("Zstd memory-to-stream. Out Headers:");
+		remove_header(hdr, hdr->where_content_length);
+		hdr->where_content_length=-1;
+		send_headers_to(to, hdr);
+		fflush(to);
+
+		status = zstd_memory_stream(from, to, ZstdLevelMemory, inlen, outlen);
+		fflush(to);
+
+		debug_log_difftime ("Compression+streaming");
+
+		return (status);
+	}
+#endif
+
 	add_header(hdr, "Content-Encoding: gzip");
 	add_header(hdr, "Connection: close");
 	add_header(hdr, "Proxy-Connection: close");
@@ -165,7 +405,8 @@ int do_compress_memory_stream (http_headers *hdr, const char *from, FILE *to, co
 	send_headers_to(to, hdr);
 	fflush(to);
 	
-	status = gzip_memory_stream(from, to, Z_BEST_COMPRESSION, inlen, outlen);
+	gzpolicy_set_response (hdr->content_type, inlen);
+	status = gzip_memory_stream(from, to, GzipAdaptiveLevel ? GZPOLICY_LEVEL_ADAPTIVE : GzipLevel, inlen, outlen);
 	fflush(to);
 
 	debug_log_difftime ("Compression+streaming");
@@ -246,6 +487,23 @@ ZP_DATASIZE_TYPE replace_gzipped_with_gunzipped (char **inoutbuf, ZP_DATASIZE_TY
 	ZP_DATASIZE_TYPE retcode;
 	char *temp_inoutbuf = *inoutbuf;
 
+#ifdef LIBDEFLATE
+	/* try the (faster) one-shot decompressor first */
+	switch (ldgunzip_memory_memory(*inoutbuf, inlen, &temp_inoutbuf, &outlen, max_growth)) {
+	case LDGZIP_OK:
+		free (*inoutbuf);
+		*inoutbuf = temp_inoutbuf;
+		return (outlen);
+	case LDGZIP_RATIO_EXCEEDED:
+		return (-100);
+	case LDGZIP_MEM_ERROR:
+		return (-20);
+	default:
+		/* not supported there, use zlib */
+		break;
+	}
+#endif
+
 	retcode = gunzip(*inoutbuf, inlen, &temp_inoutbuf, &outlen, max_growth);
 	if (retcode == 0) {
 		*inoutbuf = temp_inoutbuf;
@@ -255,3 +513,81 @@ ZP_DATASIZE_TYPE replace_gzipped_with_gunzipped (char **inoutbuf, ZP_DATASIZE_TY
 	}
 }
 
+/* converts a DCPIPE_* result to replace_gzipped_with_gunzipped()-like return values */
+static ZP_DATASIZE_TYPE replace_dcpipe_result (int dcpipe_ret, char **inoutbuf, char *outbuf, ZP_DATASIZE_TYPE outlen)
+{
+	switch (dcpipe_ret) {
+	case DCPIPE_OK:
+		free (*inoutbuf);
+		*inoutbuf = outbuf;
+		return (outlen);
+	case DCPIPE_RATIO_EXCEEDED:
+		return (-100);
+	case DCPIPE_DATA_ERROR:
+		return (-120);
+	default:
+		return (-20);
+	}
+}
+
+/* same as replace_gzipped_with_gunzipped(), but for "deflate" data (zlib-wrapped or raw) */
+ZP_DATASIZE_TYPE replace_deflated_with_inflated (char **inoutbuf, ZP_DATASIZE_TYPE inlen, int max_growth)
+{
+	ZP_DATASIZE_TYPE outlen = 0;
+	char *outbuf = NULL;
+
+	int ret;
+
+	ret = undeflate_memory_memory(*inoutbuf, inlen, &outbuf, &outlen, max_growth);
+	return (replace_dcpipe_result (ret, inoutbuf, outbuf, outlen));
+}
+
+/* same as replace_gzipped_with_gunzipped(), but for "compress" (LZW) data */
+ZP_DATASIZE_TYPE replace_compressed_with_uncompressed (char **inoutbuf, ZP_DATASIZE_TYPE inlen, int max_growth)
+{
+	ZP_DATASIZE_TYPE outlen = 0;
+	char *outbuf = NULL;
+
+	int ret;
+
+	ret = unlzw_memory_memory(*inoutbuf, inlen, &outbuf, &outlen, max_growth);
+	return (replace_dcpipe_result (ret, inoutbuf, outbuf, outlen));
+}
+
+#ifdef ZSTD
+/* same as replace_gzipped_with_gunzipped(), but for shared-dictionary Zstandard data
+ * (SHDICT_* return codes match DCPIPE_* ones) */
+ZP_DATASIZE_TYPE replace_shdict_with_unshdict (char **inoutbuf, ZP_DATASIZE_TYPE inlen, int max_growth)
+{
+	ZP_DATASIZE_TYPE outlen = 0;
+	char *outbuf = NULL;
+
+	int ret;
+
+	ret = unshdict_memory_memory(*inoutbuf, inlen, &outbuf, &outlen, max_growth);
+	return (replace_dcpipe_result (ret, inoutbuf, outbuf, outlen));
+}
+#endif
+
+#ifdef BROTLI
+/* same as replace_gzipped_with_gunzipped(), but for Brotli data */
+ZP_DATASIZE_TYPE replace_brotli_with_unbrotli (char **inoutbuf, ZP_DATASIZE_TYPE inlen, int max_growth)
+{
+	ZP_DATASIZE_TYPE outlen;
+	char *outbuf;
+
+	switch (unbrotli_memory_memory(*inoutbuf, inlen, &outbuf, &outlen, max_growth)) {
+	case BRPIPE_OK:
+		free (*inoutbuf);
+		*inoutbuf = outbuf;
+		return (outlen);
+	case BRPIPE_RATIO_EXCEEDED:
+		return (-100);
+	case BRPIPE_DATA_ERROR:
+		return (-120);
+	default:
+		return (-20);
+	}
+}
+#endif
+
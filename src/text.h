@@ -51,6 +51,7 @@
  */
 
 #include "http.h"
+#include "htmlopt.h"
 
 //To stop multiple inclusions.
 #ifndef SRC_TEXT_H
@@ -58,8 +59,18 @@
 
 extern int do_compress_stream_stream (http_headers *hdr, FILE *from, FILE *to, ZP_DATASIZE_TYPE *inlen, ZP_DATASIZE_TYPE *outlen);
 extern int do_decompress_stream_stream (http_headers *hdr, FILE *from, FILE *to, ZP_DATASIZE_TYPE *inlen, ZP_DATASIZE_TYPE *outlen, int max_ratio, ZP_DATASIZE_TYPE min_eval);
+extern int do_optimize_stream_stream (http_headers *hdr, FILE *from, FILE *to, int content, HOPT_FLAGS hopt_flags, int compress, ZP_DATASIZE_TYPE *inlen, ZP_DATASIZE_TYPE *outlen, int max_ratio, ZP_DATASIZE_TYPE min_eval);
+extern int do_reoptimize_stream_stream (http_headers *hdr, FILE *from, FILE *to, ZP_DATASIZE_TYPE *inlen, ZP_DATASIZE_TYPE *outlen, int max_ratio, ZP_DATASIZE_TYPE min_eval);
 extern int do_compress_memory_stream (http_headers *hdr, const char *from, FILE *to, const ZP_DATASIZE_TYPE inlen, ZP_DATASIZE_TYPE *outlen);
 extern ZP_DATASIZE_TYPE replace_gzipped_with_gunzipped (char **inoutbuf, ZP_DATASIZE_TYPE inlen, ZP_DATASIZE_TYPE max_growth);
+extern ZP_DATASIZE_TYPE replace_deflated_with_inflated (char **inoutbuf, ZP_DATASIZE_TYPE inlen, int max_growth);
+extern ZP_DATASIZE_TYPE replace_compressed_with_uncompressed (char **inoutbuf, ZP_DATASIZE_TYPE inlen, int max_growth);
+#ifdef ZSTD
+extern ZP_DATASIZE_TYPE replace_shdict_with_unshdict (char **inoutbuf, ZP_DATASIZE_TYPE inlen, int max_growth);
+#endif
+#ifdef BROTLI
+extern ZP_DATASIZE_TYPE replace_brotli_with_unbrotli (char **inoutbuf, ZP_DATASIZE_TYPE inlen, int max_growth);
+#endif
 enum {ONormal, OChunked, OStream, OGzipStream};
 
 #endif //SRC_TEXT_H
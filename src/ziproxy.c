@@ -76,6 +76,10 @@
 #include "log.h"
 #include "tosmarking.h"
 #include "session.h"
+#include "coalesce.h"
+#include "shdict.h"
+#include "muxlink.h"
+#include "preemptdns.h"
 
 static void sigcatch (int sig);
 
@@ -195,6 +199,26 @@ int ziproxy (const char *client_addr, struct sockaddr_in *socket_host, SOCKET so
 		}
 	}
 
+#ifdef ZSTD
+	/* shared dictionary requested by a paired Ziproxy, served by us */
+	if (SharedDictCompress && (hdrs->host != NULL) && (strcasecmp (hdrs->host, SHDICT_HOST) == 0)) {
+		if (shdict_serve (hdrs->url, sess_wclient) != 0)
+			send_error (404, "Not Found", NULL, "Shared dictionary not available.");
+		access_log_dump_entry ();
+		exit (0);
+	}
+#endif
+
+	/* if an identical request is already in progress, send its result instead of fetching it again */
+	if (! (hdrs->flags & H_USE_SSL)) {
+		if (coalesce_begin (hdrs) == COALESCE_SERVED)
+			exit (0);
+
+		/* prefetched on behalf of a page, the browser is expected to ask for it soon */
+		if (hdrs->flags & H_PREFETCH)
+			coalesce_keep_result (PrefetchTTL);
+	}
+
 	/* Open the client socket to the real web server. */
 	sockfd = open_client_socket (hdrs->host, hdrs->port, socket_host);
 
@@ -243,6 +267,8 @@ static int open_client_socket (char* hostname, unsigned short int Port, struct s
     int sa_len, sock_family, sock_type, sock_protocol;
     int sockfd;
     int sa_entries = 0;
+    struct in_addr preresolved[MAX_SA_ENTRIES];
+    int preresolved_len;
     
     memset( (void*) &sa, 0, sizeof(sa) );
 
@@ -255,8 +281,37 @@ static int open_client_socket (char* hostname, unsigned short int Port, struct s
 if (NextProxy != NULL) {
 	hostname = NextProxy;
 	Port = NextPort;
+
+	/* through the multiplexed link process, instead */
+	if (muxlink_local_port () != 0) {
+		hostname = "127.0.0.1";
+		Port = muxlink_local_port ();
+	}
 }
 
+/* already resolved by the name resolver process (PreemptNameRes) */
+if ((NextProxy == NULL) && ((preresolved_len = preemptdns_lookup (hostname, preresolved, MAX_SA_ENTRIES)) > 0)) {
+	struct sockaddr_in sa_preresolved;
+
+	sockfd = socket (AF_INET, SOCK_STREAM, 0);
+	if (sockfd < 0)
+		send_error (500, "Internal Error", NULL, "Couldn't create socket.");
+	if (socket_host != NULL)
+		bind (sockfd, (struct sockaddr *) socket_host, sizeof (*socket_host));
+
+	memset (&sa_preresolved, 0, sizeof (sa_preresolved));
+	sa_preresolved.sin_family = AF_INET;
+	sa_preresolved.sin_port = htons (Port);
+	while (preresolved_len--) {
+		sa_preresolved.sin_addr = preresolved [preresolved_len];
+		if (connect (sockfd, (struct sockaddr *) &sa_preresolved, sizeof (sa_preresolved)) >= 0)
+			return (sockfd);
+	}
+	close (sockfd);
+
+	/* the host may have moved meanwhile, resolve it as usual */
+	debug_log_printf ("PreemptNameRes: Unable to connect to the cached addresses of %s, resolving again.\n", hostname);
+}
 
 #ifdef USE_IPV6
     (void) memset( &hints, 0, sizeof(hints) );
@@ -0,0 +1,323 @@
+/* zstdpipe.c
+ * Zstandard pipe-pipe routines
+ *
+ * Ziproxy - the HTTP acceleration proxy
+ * This code is under the following conditions:
+ *
+ * ---------------------------------------------------------------------
+ * Copyright (c)2005-2014 Daniel Mealha Cabrita
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111 USA
+ * ---------------------------------------------------------------------
+ */
+
+/* those routines mirror the compression ones in gzpipe.c, but for Zstandard (RFC 8878).
+ * a single compression context is kept per process and reused for every body.
+ * the context allocates its tables on first compression, so the daemon calls
+ * zstdpipe_prealloc() before forking and the request processes inherit them. */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef ZSTD
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <zstd.h>
+
+#include "zstdpipe.h"
+#include "cfgfile.h"
+#include "log.h"
+#include "tosmarking.h"
+#include "globaldefs.h"
+
+#define BUFSIZE 16384
+
+/* state of the body being read from source */
+typedef struct {
+	int de_chunk;
+	int pending_chunk_len;
+	int first_chunk;
+	int finished;
+} t_zstdpipe_source;
+
+static ZSTD_CCtx *zstdpipe_cctx = NULL;
+
+/* allocates the (reusable) compression context.
+ * may be called beforehand, otherwise it's done on first use.
+ * returns: ZSTDPIPE_OK or ZSTDPIPE_MEM_ERROR */
+int zstdpipe_init (void)
+{
+	if (zstdpipe_cctx == NULL) {
+		if ((zstdpipe_cctx = ZSTD_createCCtx ()) == NULL)
+			return (ZSTDPIPE_MEM_ERROR);
+	}
+	return (ZSTDPIPE_OK);
+}
+
+/* returns the compression context, ready for a new frame (or NULL if out of memory) */
+static ZSTD_CCtx *zstdpipe_get_cctx (int level)
+{
+	if (zstdpipe_init () != ZSTDPIPE_OK)
+		return (NULL);
+
+	/* discards whatever was left from the previous frame (if aborted),
+	   but keeps the allocated tables */
+	ZSTD_CCtx_reset (zstdpipe_cctx, ZSTD_reset_session_and_parameters);
+	if (ZSTD_isError (ZSTD_CCtx_setParameter (zstdpipe_cctx, ZSTD_c_compressionLevel, level)))
+		return (NULL);
+	return (zstdpipe_cctx);
+}
+
+/* allocates the context along with its tables, by compressing a byte
+ * as a stream of unknown size (which needs the biggest tables for that level).
+ * returns: ZSTDPIPE_OK or ZSTDPIPE_MEM_ERROR */
+int zstdpipe_prealloc (int level)
+{
+	ZSTD_CCtx *cctx;
+	ZSTD_inBuffer input;
+	ZSTD_outBuffer output;
+	unsigned char out [BUFSIZE];
+	size_t remaining;
+
+	if ((cctx = zstdpipe_get_cctx (level)) == NULL)
+		return (ZSTDPIPE_MEM_ERROR);
+
+	input.src = "";
+	input.size = 1;
+	input.pos = 0;
+	output.dst = out;
+	output.size = BUFSIZE;
+	output.pos = 0;
+
+	/* not ending at once, otherwise the size would be known */
+	if (ZSTD_isError (ZSTD_compressStream2 (cctx, &output, &input, ZSTD_e_continue)))
+		return (ZSTDPIPE_MEM_ERROR);
+	do {
+		output.pos = 0;
+		remaining = ZSTD_compressStream2 (cctx, &output, &input, ZSTD_e_end);
+		if (ZSTD_isError (remaining))
+			return (ZSTDPIPE_MEM_ERROR);
+	} while (remaining != 0);
+
+	return (ZSTDPIPE_OK);
+}
+
+static void zstdpipe_source_init (t_zstdpipe_source *src_state, int de_chunk)
+{
+	src_state->de_chunk = de_chunk;
+	src_state->pending_chunk_len = 0;
+	src_state->first_chunk = 1;
+	src_state->finished = 0;
+}
+
+/* reads up to BUFSIZE bytes of the body into buf, de-chunking it if requested.
+ * src_state->finished is set once the end of the body is reached.
+ * returns: the number of bytes read */
+static size_t zstdpipe_read (t_zstdpipe_source *src_state, FILE *source, unsigned char *buf)
+{
+	int to_read_len = BUFSIZE;
+	size_t read_len;
+
+	if (src_state->de_chunk) {
+		if (src_state->pending_chunk_len == 0) {
+			// discards chunk end CRLF
+			if (src_state->first_chunk == 0) {
+				fgetc (source);
+				fgetc (source);
+			} else {
+				src_state->first_chunk = 0;
+			}
+
+			if ((fscanf (source, "%x", &(src_state->pending_chunk_len)) != 1) || (src_state->pending_chunk_len <= 0)) {
+				// last chunk, the rest of source will be discarded
+				src_state->finished = 1;
+				return (0);
+			} else {
+				int prevchar = '\0';
+				int curchar = '\0';
+
+				// Eat any chunk-extension(RFC2616) up to CRLF.
+				while (! ((prevchar == '\r') && (curchar == '\n'))) {
+					prevchar = curchar;
+					if ((curchar = fgetc (source)) == EOF) {
+						src_state->finished = 1;
+						return (0);
+					}
+				}
+			}
+		}
+
+		if (src_state->pending_chunk_len > BUFSIZE)
+			to_read_len = BUFSIZE;
+		else
+			to_read_len = src_state->pending_chunk_len;
+		src_state->pending_chunk_len -= to_read_len;
+	}
+
+	read_len = fread (buf, 1, to_read_len, source);
+	if (feof (source) || ferror (source))
+		src_state->finished = 1;
+
+	return (read_len);
+}
+
+/* Compress from file source to file dest until EOF on source
+   (or until the last chunk, if de_chunk).
+   Every flush_interval bytes of input the compressed data produced so far
+   is flushed to dest, so the client may start processing it
+   (if flush_interval == 0, flushing happens only at the end).
+   returns ZSTDPIPE_OK on success, ZSTDPIPE_MEM_ERROR if memory could not be
+   allocated for processing, or ZSTDPIPE_ERRNO if there is an error
+   reading or writing the files. */
+int zstd_stream_stream (FILE *source, FILE *dest, int level, int flush_interval, ZP_DATASIZE_TYPE *inlen, ZP_DATASIZE_TYPE *outlen, int de_chunk)
+{
+	ZSTD_CCtx *cctx;
+	ZSTD_EndDirective mode;
+	ZSTD_inBuffer input;
+	ZSTD_outBuffer output;
+	t_zstdpipe_source src_state;
+	unsigned char in [BUFSIZE];
+	unsigned char out [BUFSIZE];
+	ZP_DATASIZE_TYPE unflushed_len = 0;
+	size_t remaining;
+	size_t last_write_bytes;
+
+	*inlen = 0;
+	*outlen = 0;
+
+	if ((cctx = zstdpipe_get_cctx (level)) == NULL)
+		return (ZSTDPIPE_MEM_ERROR);
+
+	zstdpipe_source_init (&src_state, de_chunk);
+
+	/* compress until end of file */
+	do {
+		input.src = in;
+		input.size = zstdpipe_read (&src_state, source, in);
+		input.pos = 0;
+		*inlen += input.size;
+		unflushed_len += input.size;
+
+		/* update access log stats */
+		access_log_def_inlen(*inlen);
+
+		if (ferror(source)) {
+			debug_log_puts ("stream zstd: IO error (source). Aborting.");
+			return (ZSTDPIPE_ERRNO);
+		}
+
+		if (src_state.finished) {
+			mode = ZSTD_e_end;
+		} else if ((flush_interval > 0) && (unflushed_len >= flush_interval)) {
+			mode = ZSTD_e_flush;
+			unflushed_len = 0;
+		} else {
+			mode = ZSTD_e_continue;
+		}
+
+		/* run the compressor until all input is consumed
+		   (and, if flushing or finishing, until there's no pending output) */
+		do {
+			output.dst = out;
+			output.size = BUFSIZE;
+			output.pos = 0;
+			remaining = ZSTD_compressStream2 (cctx, &output, &input, mode);
+			if (ZSTD_isError (remaining)) {
+				debug_log_printf ("stream zstd: Compressor error (%s). Aborting.\n", ZSTD_getErrorName (remaining));
+				return (ZSTDPIPE_MEM_ERROR);
+			}
+			tosmarking_add_check_bytecount (output.pos);	/* update TOS if necessary */
+			if ((last_write_bytes = fwrite(out, 1, output.pos, dest)) != output.pos || ferror(dest)) {
+				*outlen += last_write_bytes;
+				debug_log_puts ("stream zstd: IO error (dest). Aborting.");
+				return (ZSTDPIPE_ERRNO);
+			}
+			*outlen += last_write_bytes;
+
+			/* update access log stats */
+			access_log_def_outlen(*outlen);
+
+		} while ((mode == ZSTD_e_continue) ? (input.pos != input.size) : (remaining != 0));
+
+		if (mode == ZSTD_e_flush)
+			fflush (dest);
+
+		// If we are sending a big file down a slow line, we
+		// need to reset the alarm once a while.
+		if (ConnTimeout)
+			alarm(ConnTimeout);
+
+		/* done when last data in file processed */
+	} while (mode != ZSTD_e_end);
+
+	return (ZSTDPIPE_OK);
+}
+
+/* Compress inlen bytes from source to file dest.
+   returns: same as zstd_stream_stream() */
+int zstd_memory_stream (const char *source, FILE *dest, int level, ZP_DATASIZE_TYPE inlen, ZP_DATASIZE_TYPE *outlen)
+{
+	ZSTD_CCtx *cctx;
+	ZSTD_inBuffer input;
+	ZSTD_outBuffer output;
+	unsigned char out [BUFSIZE];
+	size_t remaining;
+	size_t last_write_bytes;
+
+	*outlen = 0;
+
+	if ((cctx = zstdpipe_get_cctx (level)) == NULL)
+		return (ZSTDPIPE_MEM_ERROR);
+	/* whole data is known, the compressor tunes itself for it
+	   (and the size is recorded in the frame header) */
+	ZSTD_CCtx_setPledgedSrcSize (cctx, inlen);
+
+	input.src = source;
+	input.size = inlen;
+	input.pos = 0;
+
+	/* run the compressor until it's finished */
+	do {
+		output.dst = out;
+		output.size = BUFSIZE;
+		output.pos = 0;
+		remaining = ZSTD_compressStream2 (cctx, &output, &input, ZSTD_e_end);
+		if (ZSTD_isError (remaining))
+			return (ZSTDPIPE_MEM_ERROR);
+		tosmarking_add_check_bytecount (output.pos);	/* update TOS if necessary */
+		if ((last_write_bytes = fwrite(out, 1, output.pos, dest)) != output.pos || ferror(dest)) {
+			*outlen += last_write_bytes;
+			return (ZSTDPIPE_ERRNO);
+		}
+		*outlen += last_write_bytes;
+
+		/* update access log stats */
+		access_log_def_outlen(*outlen);
+
+		// If we are sending a big file down a slow line, we
+		// need to reset the alarm once a while.
+		if (ConnTimeout)
+			alarm(ConnTimeout);
+
+	} while (remaining != 0);
+
+	return (ZSTDPIPE_OK);
+}
+
+#endif
+
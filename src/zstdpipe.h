@@ -0,0 +1,45 @@
+/* zstdpipe.h
+ * Zstandard pipe-pipe routines
+ *
+ * Ziproxy - the HTTP acceleration proxy
+ * This code is under the following conditions:
+ *
+ * ---------------------------------------------------------------------
+ * Copyright (c)2005-2014 Daniel Mealha Cabrita
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111 USA
+ * ---------------------------------------------------------------------
+ */
+
+//To stop multiple inclusions.
+#ifndef SRC_ZSTDPIPE_H
+#define SRC_ZSTDPIPE_H
+
+#include <stdio.h>
+
+#include "globaldefs.h"
+
+/* return codes */
+#define ZSTDPIPE_OK		0
+#define ZSTDPIPE_ERRNO		1	/* IO error (source or dest) */
+#define ZSTDPIPE_MEM_ERROR	2
+
+int zstdpipe_init (void);
+int zstdpipe_prealloc (int level);
+int zstd_stream_stream (FILE *source, FILE *dest, int level, int flush_interval, ZP_DATASIZE_TYPE *inlen, ZP_DATASIZE_TYPE *outlen, int de_chunk);
+int zstd_memory_stream (const char *source, FILE *dest, int level, ZP_DATASIZE_TYPE inlen, ZP_DATASIZE_TYPE *outlen);
+
+#endif //SRC_ZSTDPIPE_H
+